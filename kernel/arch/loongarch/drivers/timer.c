@@ -5,6 +5,7 @@
 #include <trap/context.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <proc/timer.h>
 #include <time.h>
 
 extern int timer_intr_get();
@@ -29,16 +30,26 @@ static void account_time(struct proc* p) {
     }
 }
 
+// one shot, the counter counts down from a multiple of 4
+void timer_set_next_event(uint64 when) {
+    uint64 now = r_time();
+    uint64 delta = (when > now ? when - now : 0);
+    w_csr_tcfg(MAX(delta & ~3UL, 4) | CSR_TCFG_En);
+}
+
 void timer_isr() {
     // log("receive timer interrupt");
     w_csr_ticlr(CSR_TICLR_CLR);
 
-    tick_counter += 1;
+    // only a timer has expired, no tick to account
+    if (!timer_interrupt())
+        return;
     struct proc* p = myproc();
     if (p && p->state == RUNNING) {
         account_time(p);
     }
 
-    if (timer_intr_get())
+    // sleepers are woken even when preemption is off
+    if (sched_tick() && timer_intr_get())
         yield();
 }
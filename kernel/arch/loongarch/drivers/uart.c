@@ -3,6 +3,7 @@
 #include <irq/interrupt.h>
 #include <locking/spinlock.h>
 #include <proc/proc.h>
+#include <proc/wait.h>
 
 #define RHR 0       // receive holding register
 #define THR 0       // transmit holding register
@@ -137,19 +138,18 @@ uart_putc(int c)
 {
 	spinlock_acquire(&uart_tx_lock);
 
-	while(1) {
-		if(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE) {
-			// buffer is full.
-			// wait for uart_start() to open up space in the buffer.
-			sleep(&uart_tx_r);
-		} else {
-			uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-			uart_tx_w += 1;
-			uart_start();
-			spinlock_release(&uart_tx_lock);
-			return;
-		}
+	while(uart_buf_full()) {
+		// buffer is full.
+		// wait for uart_start() to open up space in the buffer,
+		// the condition is checked again after we are queued.
+		spinlock_release(&uart_tx_lock);
+		wait_event_chan(&uart_tx_r, !uart_buf_full());
+		spinlock_acquire(&uart_tx_lock);
 	}
+	uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
+	uart_tx_w += 1;
+	uart_start();
+	spinlock_release(&uart_tx_lock);
 }
 
 // polling version, disable intr while output
@@ -26,6 +26,11 @@ typedef pte_t *pagetable_t;
 #define PTE_NX  (1UL << 62)
 #define PTE_RPLV (1UL << 63)
 #define PTE_COW (1UL << 9)
+#define PTE_H   (1UL << 6)  // 目录项中表示大页，与末级页表项的 G 位重合
+// 软件位 10 与 H 位一起标记 L1 页表中的 2 MiB 大页，不会与带 G 位的末级页表项混淆
+#define PTE_MEGA (PTE_H | (1UL << 10))
+// 软件位 11，V 为 0 的末级页表项中标记已换出的页
+#define PTE_SWAP (1UL << 11)
 
 #define PTE_U PTE_PLV3
 #define PTE_S PTE_PLV0
@@ -38,12 +43,14 @@ typedef pte_t *pagetable_t;
 #define PAMASK  (0xFFFFFFFFFUL << PGSHIFT)
 #define PTE2PA(pte) (((uint64)(pte)) & PAMASK)
 #define PA2PTE(pa)  (pte_t)(((uint64)(pa)) & PAMASK)
-#define PTE_FLAGS(pte) ((pte) & 0xE0000000000001FFUL)
+#define PTE_FLAGS(pte) ((pte) & 0xE000000000000FFFUL)
 
 #define DIRWIDTH    9U
 #define PTBASE      12U
 #define DIRBASE(n) (PTBASE + n * DIRWIDTH)
 
+#define PX(i, va) (((va) >> (9 * i + 12)) & 0x1ff)
+
 
 
 /* IOCSR */
@@ -63,6 +70,18 @@ typedef pte_t *pagetable_t;
 #define EXT_IOImap_Core_Base 0x1c00 // EXT_IOI[n]的处理器核路由方式
 #define EXT_IOI_node_type_Base 0x14a0 // 16 个结点的映射向量类型n
 
+#define IOCSR_IPI_STATUS     0x1000 // 本核的处理器间中断状态，每一位是一个 action
+#define IOCSR_IPI_EN         0x1004 // 本核的处理器间中断使能
+#define IOCSR_IPI_CLEAR      0x100c // 写 1 清除对应的状态位
+#define IOCSR_MBUF0          0x1020 // 本核的 mailbox 0，固件从中读出从核的入口
+#define IOCSR_IPI_SEND       0x1040 // 向其他核发送处理器间中断
+#define IOCSR_MBUF_SEND      0x1048 // 写其他核的 mailbox，每次写 32 位
+
+#define IOCSR_SEND_BLOCKING  (1UL << 31)    // 等待写入完成
+#define IOCSR_SEND_CPU_SHIFT 16
+#define IOCSR_MBUF_SEND_BOX_SHIFT 2         // mailbox 中的 32 位为单位的偏移
+#define IOCSR_MBUF_SEND_BUF_SHIFT 32
+
 static inline uint32 __iocsrrd_w(uint64 iocsr) {
     uint32 val;
     asm volatile("iocsrrd.w %0, %1" : "=r"(val) : "r"(iocsr));
@@ -586,6 +605,15 @@ static inline void w_csr_cpuid(uint64 val) { csr_write(CSR_CPUID, val); }
     
 #define r_cpuid() r_csr_cpuid() 
 
+// stable counter, runs at CLOCK_FREQUNCY
+static inline uint64
+r_time()
+{
+    uint64 x;
+    asm volatile("rdtime.d %0, $zero" : "=r"(x));
+    return x;
+}
+
 static inline uint64 r_csr_prcfg1() { uint64 val; csr_read(CSR_PRCFG1, val); return val; }
 static inline void w_csr_prcfg1(uint64 val) { csr_write(CSR_PRCFG1, val); }
     
@@ -678,6 +706,35 @@ cpucfg(uint64 num)
     return val;
 }
 
+#define CPUCFG2_LSX     (1U << 6)
+#define CPUCFG2_LASX    (1U << 7)
+
+// 0: no vector unit, 1: LSX, 2: LASX
+// vector registers alias fp ones, which are never saved on trap or switch,
+// so EUEN stays off outside vec_begin/vec_end
+static inline int
+vec_probe()
+{
+    uint32 cfg = r_cpucfg(2);
+    if (cfg & CPUCFG2_LASX)
+        return 2;
+    return ((cfg & CPUCFG2_LSX) ? 1 : 0);
+}
+
+static inline uint64
+vec_begin()
+{
+    uint64 x = r_csr_euen();
+    w_csr_euen(x | CSR_EUEN_FPE | CSR_EUEN_SXE | CSR_EUEN_ASXE);
+    return x;
+}
+
+static inline void
+vec_end(uint64 old)
+{
+    w_csr_euen(old);
+}
+
 static inline void 
 intr_on() 
 {
@@ -710,11 +767,17 @@ intr_get()
     return (r_csr_crmd() & CSR_CRMD_IE) != 0;
 }
 
-static inline void 
-asid_init(int asid, int nbytes)
+// wait for an interrupt with interrupts on, defined in kernelvec.S
+// one arriving between enabling interrupts and idle returns to cpu_idle_insn,
+// kernel_trap then steps over the idle so the wakeup is not lost
+void cpu_idle();
+extern char cpu_idle_insn[];
+
+// ASIDBITS is read only, it tells how many asid bits the tlb compares
+static inline int
+asid_hw_bits()
 {
-    uint8 nbits = nbytes * 8;
-    w_csr_asid((asid & CSR_ASID_ASID) | ((nbits << 16) & CSR_ASIDBITS));
+    return (int) ((r_csr_asid() & CSR_ASIDBITS) >> 16);
 }
 
 static inline void
@@ -740,6 +803,13 @@ flush_tlb() {
     invtlb();
 }
 
+// invalidate all non-global entries of asid
+static inline void
+flush_tlb_asid(int asid)
+{
+    asm volatile( "invtlb 0x4, %0, $zero" : : "r"(asid));
+}
+
 static inline void 
 flush_tlb_one(int asid, uint64 vaddr)
 {
@@ -18,6 +18,7 @@
         ls7a_intc_init(); \
     } while(0)
 #define __irq_init_default() __irq_init(DEFAULT_HART)
+#define __irq_init_hart() iocsr_writel(IOCSR_IPI_EN, 0xffffffff)
 #define __irq_enable_default(irq) \
     do { \
         extioi_enable_irq(DEFAULT_HART, irq); \
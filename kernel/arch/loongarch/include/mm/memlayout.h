@@ -44,7 +44,7 @@
 #define MMAP_INIT_SIZE  0x40000000UL
 #define MMAP_EXPAND     0x40000000UL
 
-#define KSTACK(n)   (TRAMPOLINE - (2 * (n)) * PGSIZE)
+#define KSTACK(n)   (TRAMPOLINE - ((KSTACK_SIZE + PGSIZE) * (n)))
 
 /*
 info mtree
@@ -114,6 +114,7 @@ struct trapframe {
 #define SWI0 0
 
 #define TI_VEC (1UL << TI)
+#define IPI_VEC (1UL << IPI)
 #define HWI_VEC (0xff << HWI0)
 
 #define IntEcodeBase 64
@@ -7,6 +7,7 @@
 #include <debug.h>
 #include <arch.h>
 #include <syscall.h>
+#include <errno.h>
 
 extern char end[], trampoline[];
 extern void tlb_refill();
@@ -85,6 +86,9 @@ walk(pagetable_t pgtbl, uint64 va, int alloc)
             if (alloc == WALK_NOALLOC || (*pte = PA2PTE(alloc_pagetable())) == 0)
                 return 0;
         } 
+        // huge page in L1
+        else if (shift == 9 && PTE_IS_MEGA(*pte))
+            return pte;
         pgtbl = (pagetable_t) KERNEL_PA2VA(PTE2PA(*pte));
     } 
 
@@ -92,6 +96,20 @@ walk(pagetable_t pgtbl, uint64 va, int alloc)
 }
 
 
+pte_t*
+walk_megapage(pagetable_t pgtbl, uint64 va, int alloc)
+{
+    pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
+    pte_t* pte = pgtbl + PX(2, va);
+    if ((*pte & PAMASK) == 0) {
+        if (alloc == WALK_NOALLOC || (*pte = PA2PTE(alloc_pagetable())) == 0)
+            return 0;
+    }
+    pgtbl = (pagetable_t) KERNEL_PA2VA(PTE2PA(*pte));
+    return (pgtbl + PX(1, va));
+}
+
+
 // void
 // mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags)
 // {
@@ -124,11 +142,11 @@ walkaddr(pagetable_t pgtbl, uint64 va)
     pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
     pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
 
-    if ((*pte & PTE_V) == 0)
+    if (pte == NULL || (*pte & PTE_V) == 0)
         return 0;
 
     uint64 offset = va & (PGSIZE - 1);
-    uint64 pa = (uint64) PTE2PA(*pte) | offset;
+    uint64 pa = (uint64) PTE_PAGE_PA(*pte, va) | offset;
 
     return pa;
 }
@@ -140,12 +158,17 @@ pagetable_t
 uvmmake(uint64 trapframe)
 {
     pagetable_t upgtbl = alloc_pagetable();
+    if (upgtbl == NULL)
+        return NULL;
 
     // map TRAMPOLINE
     // mappages(upgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_PLV3 | PTE_MAT_CC | PTE_P);
 
     // map TRAPFRAME
-    mappages(upgtbl, TRAPFRAME, KERNEL_VA2PA(trapframe) , PGSIZE, PTE_PLV0 | PTE_RPLV | PTE_MAT_CC | PTE_P | PTE_W | PTE_NX | PTE_D);
+    if (mappages(upgtbl, TRAPFRAME, KERNEL_VA2PA(trapframe) , PGSIZE, PTE_PLV0 | PTE_RPLV | PTE_MAT_CC | PTE_P | PTE_W | PTE_NX | PTE_D) < 0) {
+        freewalk(upgtbl, 0);
+        return NULL;
+    }
 
     return upgtbl;
 }
@@ -158,7 +181,7 @@ uvminit(uint64 trapframe, const char* init_code, int sz)
     assert(init_code);
     assert(sz <= 16*PGSIZE);
     
-    void* userspace = kalloc(sz);
+    void* userspace = kalloc(PGROUNDUP(sz));
     memmove(userspace, init_code, sz);
     uint64 userspace_pa = KERNEL_VA2PA(userspace);
 
@@ -175,14 +198,21 @@ uvminit(uint64 trapframe, const char* init_code, int sz)
     return (pagetable_t) KERNEL_VA2PA(upgtbl);
 }
 
-void 
+int
 map_stack(pagetable_t pgtbl, uint64 stack_va) 
 {
     pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
     void* stack = kalloc(KSTACK_SIZE);
-    Assert(stack, "out of memory");
+    if (stack == NULL)
+        return -ENOMEM;
     // log("map stack va: %lx, pa %lx", stack_va, KERNEL_VA2PA(stack));
-    mappages(pgtbl, stack_va, KERNEL_VA2PA(stack), KSTACK_SIZE, PTE_PLV0 | PTE_MAT_CC | PTE_P | PTE_NX | PTE_W | PTE_RPLV | PTE_D);
+    if (mappages(pgtbl, stack_va, KERNEL_VA2PA(stack), KSTACK_SIZE, PTE_PLV0 | PTE_MAT_CC | PTE_P | PTE_NX | PTE_W | PTE_RPLV | PTE_D) < 0) {
+        kfree(stack);
+        return -ENOMEM;
+    }
+    // tlb is no longer flushed when switching address space
+    flush_tlb();
+    return 0;
 }
 
 uint64
@@ -196,54 +226,35 @@ phys_to_virt(uint64 pa) {
 }
 
 
-#define CHECK(cond, msg, ...) \
-    if (!(cond)) { \
-        Log(ANSI_FG_RED, msg, ## __VA_ARGS__); \
-        p->killed = 1; \
-        return; \
-    }
+uint64
+prot_to_pte(int prot)
+{
+    uint64 perm = PTE_U | PTE_MAT_CC | PTE_P;
+    perm |= ((prot & PROT_READ) ? 0 : PTE_NR);
+    perm |= ((prot & PROT_EXEC) ? 0 : PTE_NX);
+    perm |= ((prot & PROT_WRITE) ? PTE_W | PTE_D : 0);
+    return perm;
+}
+
 
 void 
-page_unmap_handler()
+page_fault_handler()
 {
     struct proc* p = myproc();
     uint64 badv = r_csr_badv();
-    uint64 va = PGROUNDDOWN(badv);
-
-    struct vm_area* vma = find_vma(p, va);
-    CHECK(vma, "vma not found, badv: %lx", badv);
-
     int ecode = r_ecode();
-    CHECK((ecode == PIS && (vma->prot & PROT_WRITE)) && (ecode == PIL && (vma->prot & PROT_READ)), "vma prot error");
-
-    char* mem = kalloc(PGSIZE);
-    CHECK(mem, "out of memory");
-    memset(mem, 0, PGSIZE);
-
-    if (vma->file) {
-        // file system help
-        // ilock(vma->file->ip);
-        // readi(vma->file->ip, 0, (uint64)page, 
-        //       vma->offset + (va - vma->start), PGSIZE);
-        // iunlock(vma->file->ip);
-    }
-
-    uint perm = PTE_U | PTE_MAT_CC | PTE_P;
-    perm |= ((vma->prot & PROT_READ) ? 0 : PTE_NR);
-    perm |= ((vma->prot & PROT_EXEC) ? 0 : PTE_NX);
-    perm |= ((vma->prot & PROT_WRITE) ? PTE_W | PTE_D : 0);
+    int write = (ecode == PIS || ecode == PME);
 
-    if (vma->flags & MAP_PRIVATE) {
-        perm &= ~PTE_W;
-        perm |= PTE_COW;
-    }
-    else if (vma->flags & MAP_SHARED) {
-        perm |= PTE_G;
-    }
+    int err = (p ? handle_mm_fault(p, badv, write) : -EFAULT);
+    if (err == 0)
+        return;
 
-    mappages(UPGTBL(p->pagetable), va, KERNEL_VA2PA(mem), PGSIZE, perm);
+    // kernel touches an illegal address
+    if ((r_csr_prmd() & CSR_PRMD_PPLV) == 0)
+        kernel_trap_error();
 
-    flush_tlb_one(p->pid, va);
+    Log(ANSI_FG_RED, "page fault at %lx, err %d", badv, err);
+    p->killed = 1;
 }
 
 void free_pgtbl(pagetable_t pgtbl, uint64 sz) {
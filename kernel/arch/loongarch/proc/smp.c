@@ -0,0 +1,46 @@
+#include <common.h>
+#include <arch.h>
+#include <debug.h>
+#include <proc/smp.h>
+
+#define IPI_ACTION_SMP      0       // the only action we use, the reasons are kept by smp.c
+
+extern char _start[];
+
+
+// a mailbox is written 32 bits at a time
+static void
+mail_send(int cpu, int box, uint64 data)
+{
+    uint64 val = IOCSR_SEND_BLOCKING | ((uint64) cpu << IOCSR_SEND_CPU_SHIFT);
+    iocsr_writeq(IOCSR_MBUF_SEND, val | ((uint64) (box * 2 + 1) << IOCSR_MBUF_SEND_BOX_SHIFT)
+                                      | (data & 0xffffffff00000000UL));
+    iocsr_writeq(IOCSR_MBUF_SEND, val | ((uint64) (box * 2) << IOCSR_MBUF_SEND_BOX_SHIFT)
+                                      | (data << IOCSR_MBUF_SEND_BUF_SHIFT));
+}
+
+
+void
+arch_send_ipi(int cpu)
+{
+    iocsr_writel(IOCSR_IPI_SEND, IOCSR_SEND_BLOCKING | (cpu << IOCSR_SEND_CPU_SHIFT) | IPI_ACTION_SMP);
+}
+
+
+// the firmware keeps other cores in idle until an ipi, then jumps to the address in mailbox 0
+int
+arch_cpu_start(int cpu)
+{
+    mail_send(cpu, 0, (uint64) _start);
+    arch_send_ipi(cpu);
+    return 0;
+}
+
+
+// clear the status before the reasons are read, an ipi sent after that sets it again
+void
+ipi_interrupt_handler()
+{
+    iocsr_writel(IOCSR_IPI_CLEAR, iocsr_readl(IOCSR_IPI_STATUS));
+    smp_ipi_handler();
+}
@@ -2,6 +2,7 @@
 #include <arch.h>
 #include <debug.h>
 #include <mm/mm.h>
+#include <mm/asid.h>
 #include <mm/memlayout.h>
 #include <trap/trap.h>
 #include <trap/context.h>
@@ -13,6 +14,7 @@
 extern char kernelvec[], uservec[], trampoline[], userret[];
 
 extern void timer_isr();
+extern void ipi_interrupt_handler();
 
 handler interrupt_handler_vector[NR_INTERRUPT] = {};
 handler exception_handler_vector[NR_EXCEPTION] = {};
@@ -66,11 +68,13 @@ trap_init()
 
     // register handler
     register_trap_handler(INTERRUPT, TI, timer_isr);
+    register_trap_handler(INTERRUPT, IPI, ipi_interrupt_handler);
     register_trap_handler(INTERRUPT, HWI0, irq_response);
 
-    register_trap_handler(EXCEPTION, PME, store_page_fault_handler);
-    register_trap_handler(EXCEPTION, PIL, page_unmap_handler);
-    register_trap_handler(EXCEPTION, PIS, page_unmap_handler);
+    register_trap_handler(EXCEPTION, PIL, page_fault_handler);
+    register_trap_handler(EXCEPTION, PIS, page_fault_handler);
+    register_trap_handler(EXCEPTION, PIF, page_fault_handler);
+    register_trap_handler(EXCEPTION, PME, page_fault_handler);
     register_trap_handler(EXCEPTION, SYS, syscall);
 }
 
@@ -78,8 +82,8 @@ void
 trap_init_hart()
 {
     // set all exception to the same handler
-    // enable timer and hardware interrupt
-    w_csr_ecfg(TI_VEC | HWI_VEC);
+    // enable timer, hardware and inter-processor interrupt
+    w_csr_ecfg(TI_VEC | HWI_VEC | IPI_VEC);
     w_csr_eentry((uint64)kernelvec);
 }
 
@@ -123,6 +127,10 @@ kernel_trap()
         kernel_trap_error();
     }
 
+    // the interrupt came before cpu_idle went idle, whatever it woke must be looked at first
+    if (era == (uint64) cpu_idle_insn)
+        era += 4;
+
     w_csr_era(era);
     w_csr_prmd(prmd);
 }
@@ -170,6 +178,11 @@ dive_to_user()
 
     uint64 trapframe = TRAPFRAME + ((uint64)p->trapframe - PGROUNDDOWN(p->trapframe));
     uint64 pgdl = (uint64) UPGTBL(p->pagetable);
+    // entries are tagged with asid, trampoline does not flush when pgdl changes
+    uint64 asid = asid_switch(p->pagetable);
+    if (asid == 0)
+        flush_tlb();
+    set_asid(asid);
     
     uint64 fn = TRAMPOLINE + (userret - trampoline);
     ((void (*)(uint64, uint64))fn)(trapframe, pgdl);
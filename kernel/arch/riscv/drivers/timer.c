@@ -8,6 +8,7 @@
 #include <irq/interrupt.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <proc/timer.h>
 #include <time.h>
 
 extern char timervec[];
@@ -30,26 +31,30 @@ void account_time(struct proc* p) {
 #ifdef BIOS_SBI
 #include <sbi/sbi.h>
 
-static inline void update_time() {
-    sbi_set_timer(r_time() + INTERVAL);
+// one shot, the SBI clears the pending interrupt as well
+void timer_set_next_event(uint64 when) {
+    sbi_set_timer(when);
 }
 
 void timer_interrupt_handler()
 {
     // log("receive timer interrupt");
-    update_time();
-    tick_counter += 1;
+    // only a timer has expired, no tick to account
+    if (!timer_interrupt())
+        return;
     struct proc* p = myproc();
-    if (p && p->state == RUNNING) {
+    if (p && p->state == RUNNING)
         account_time(p);
+
+    // preempt only when another proc is due, a lone proc keeps the CPU
+    if (sched_tick())
         yield();
-    }
 }
 
 void 
 timer_init() 
 {
-    update_time();
+    timer_set_next_event(r_time() + INTERVAL);
     w_sie(r_sie() | SIE_STIE);
 }
 
@@ -83,9 +88,12 @@ timer_interrupt_handler()
     // clear timer interrupt
     w_sip(r_sip() & ~(0x2));
 
-    struct proc* p = myproc();
-    if (p && p->state == RUNNING)
+    if (timer_interrupt() && sched_tick())
         yield();
 }
 
+// the machine mode handler rearms mtimecmp at a fixed interval, no tickless here
+void timer_set_next_event(uint64 when) {
+}
+
 #endif
\ No newline at end of file
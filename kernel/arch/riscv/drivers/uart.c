@@ -11,6 +11,7 @@
 #include <arch.h>
 #include <trap/context.h>
 #include <proc/proc.h>
+#include <proc/wait.h>
 #include <locking/spinlock.h>
 
 #define RHR 0       // receive holding register
@@ -49,6 +50,7 @@
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_r = 0;   // number of bytes read from buf and transmit
 uint64 uart_tx_w = 0;   // number of bytes written to buf
+static SPINLOCK_DEFINE(uart_tx_lock);   // protects uart_tx_buf, uart_tx_r and uart_tx_w
 
 static inline int uart_buf_empty() {
     return (uart_tx_r == uart_tx_w);
@@ -137,6 +139,7 @@ uart_putc_sync(int c)
 }
 
 // transmit all characters in uart_buf
+// caller must hold uart_tx_lock
 static void
 uart_start()
 {
@@ -160,17 +163,18 @@ uart_start()
 void
 uart_putc(int c)
 {
+    spinlock_acquire(&uart_tx_lock);
     // enable TX interrupt
     uart_write_reg(IER, IER_RX_EN | IER_TX_EN);
-    while (1) {
-        if (uart_buf_full()) {
-            sleep(&uart_tx_r);
-        } else {
-            uart_buf_write(c);
-            uart_start();
-            return;
-        }
+    while (uart_buf_full()) {
+        // uart_start wakes us from the TX interrupt once it has sent a byte
+        spinlock_release(&uart_tx_lock);
+        wait_event_chan(&uart_tx_r, !uart_buf_full());
+        spinlock_acquire(&uart_tx_lock);
     }
+    uart_buf_write(c);
+    uart_start();
+    spinlock_release(&uart_tx_lock);
 }
 
 
@@ -198,7 +202,9 @@ uart_isr()
         case IIR_RX_READY:
             break;
         case IIR_TX_EMPTY:
+            spinlock_acquire(&uart_tx_lock);
             uart_start();
+            spinlock_release(&uart_tx_lock);
             break;
         default:
             return -1;
@@ -195,13 +195,19 @@ static void virtio_handle_rxused(struct virtio_net *dev, uint32 idx)
 	 * don't necessarily know the offset into the packet structure which d2
 	 * will point at. */
 	struct packet *pkt = hdr->packet;
-	pkt->ll = rx_info->desc_virt[d2];
-	pkt->end = pkt->ll + (len - VIRTIO_NET_HDRLEN);
-	eth_recv(&dev->netdev.netif, pkt);
 
-	/* eth_recv takes ownership of pkt, we will put a new packet in there
-	 * and stick the descriptor back into the avail queue */
-	pkt = packet_alloc();
+	/* We run in interrupt context, so the replacement packet must not
+	 * reclaim or sleep. Without one the frame is dropped and its buffer
+	 * goes straight back to the device. */
+	struct packet *fresh = packet_alloc_gfp(GFP_ATOMIC | __GFP_NOWARN);
+	if (fresh != NULL) {
+		pkt->ll = rx_info->desc_virt[d2];
+		pkt->end = pkt->ll + (len - VIRTIO_NET_HDRLEN);
+		eth_recv(&dev->netdev.netif, pkt);
+		/* eth_recv takes ownership of pkt, we will put the new packet in
+		 * there and stick the descriptor back into the avail queue */
+		pkt = fresh;
+	}
 	hdr->packet = pkt;
 	rx->desc[d2].addr = virt_to_phys((uint64)&pkt->data);
 	rx_info->desc_virt[d2] = &pkt->data;
@@ -19,6 +19,8 @@
 #define PTE_D (1L << 7)
 #define PTE_AVL (7L << 9)
 #define PTE_COW (1L << 9)
+#define PTE_MEGA (1L << 8)   // RSW 位，标记 L1 页表中的 2 MiB 大页
+#define PTE_SWAP (1UL << 63) // V 为 0 的末级页表项中标记已换出的页，此时硬件忽略其余各位
 
 #define PTE_RW (PTE_V | PTE_W | PTE_R)
 #define PTE_RX (PTE_V | PTE_R | PTE_X)
@@ -92,6 +94,8 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_VS (3L << 9)   // Vector Status, read-only 0 without V extension
+#define SSTATUS_VS_INITIAL (1L << 9)
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -126,6 +130,7 @@ w_sip(uint64 x)
 {
   asm volatile("csrw sip, %0" : : "r"(x));
 }
+#define SIP_SSIP (1L << 1) // software, set by the SBI for an ipi
 
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9) // external
@@ -256,7 +261,11 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xFFFFL << SATP_ASID_SHIFT)
+
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -343,6 +352,31 @@ intr_off()
   w_sstatus(r_sstatus() & ~SSTATUS_SIE);
 }
 
+// vector unit exists if sstatus.VS can be turned on
+// vector state is never saved on trap or switch, so VS stays off outside vec_begin/vec_end
+static inline int
+vec_probe()
+{
+  w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+  int ok = ((r_sstatus() & SSTATUS_VS) != 0);
+  w_sstatus(r_sstatus() & ~SSTATUS_VS);
+  return ok;
+}
+
+static inline uint64
+vec_begin()
+{
+  uint64 x = r_sstatus();
+  w_sstatus(x | SSTATUS_VS_INITIAL);
+  return x;
+}
+
+static inline void
+vec_end(uint64 old)
+{
+  w_sstatus((r_sstatus() & ~SSTATUS_VS) | (old & SSTATUS_VS));
+}
+
 // are device interrupts enabled?
 static inline int
 intr_get()
@@ -351,6 +385,13 @@ intr_get()
   return ((x & SSTATUS_SIE) != 0 ? 1 : 0);
 }
 
+// wait for an interrupt with interrupts off, the pending one is taken after intr_on
+static inline void
+cpu_idle()
+{
+  asm volatile("wfi");
+}
+
 static inline uint64
 r_sp()
 {
@@ -403,6 +444,32 @@ flush_tlb_one(uint64 va) {
   asm volatile("sfence.vma %0" : : "r" (va) : "memory");
 }
 
+// flush non-global entries of asid, asid must not be 0
+static inline void
+flush_tlb_asid(uint64 asid) {
+  asm volatile("sfence.vma zero, %0" : : "r" (asid) : "memory");
+}
+
+static inline void
+flush_tlb_one_asid(uint64 asid, uint64 va) {
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid) : "memory");
+}
+
+// number of implemented asid bits, the unimplemented ones of satp.ASID read as 0
+static inline int
+asid_hw_bits()
+{
+  uint64 satp = r_satp();
+  w_satp(satp | SATP_ASID_MASK);
+  uint64 asid = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+  w_satp(satp);
+
+  int bits = 0;
+  for (; asid & 1; asid >>= 1)
+    bits++;
+  return bits;
+}
+
 #define read_reg(REG, res) asm volatile("mv %0, " #REG : "=r"(res))
 #define write_reg(REG, value) asm volatile("mv " #REG ", %0" : : "r"(value));
 
@@ -24,6 +24,11 @@
         __irq_init(DEFAULT_HART); \
         w_sie(r_sie() | SIE_SSIE | SIE_SEIE); \
     } while(0)
+#define __irq_init_hart() \
+    do { \
+        plic_init_hart(r_cpuid()); \
+        w_sie(r_sie() | SIE_SSIE | SIE_SEIE); \
+    } while(0)
 #define __irq_enable_default(irq) \
     plic_enable_irq(DEFAULT_HART, irq, DEFAULT_PRI)
 #define __irq_disable_default(irq) \
@@ -15,10 +15,14 @@ sbiret_t sbi_ecall(int ext_id, int func_id, uint64 arg0, uint64 arg1, uint64 arg
 #define SBI_EXT_LEGACY_CONSOLE 0x1
 #define SBI_EXT_TIME 0x54494D45
 #define SBI_EXT_CONSOLE 0x434F4E53
+#define SBI_EXT_IPI 0x735049
+#define SBI_EXT_HSM 0x48534D
 
 #define SBI_FUNC_CONSOLE_PUTCHAR 0
 #define SBI_FUNC_CONSOLE_GETCHAR 1
 #define SBI_FUNC_SET_TIMER 0
+#define SBI_FUNC_SEND_IPI 0
+#define SBI_FUNC_HART_START 0
 
 #define SBI_SUCCESS 0
 #define SBI_ERR_FAILED -1
@@ -45,4 +49,12 @@ sbiret_t sbi_ecall(int ext_id, int func_id, uint64 arg0, uint64 arg1, uint64 arg
 #define sbi_get_time() \
     sbi_ecall(SBI_EXT_TIME, SBI_FUNC_GET_TIME, 0, 0, 0, 0, 0, 0)
 
+// 向 hart_mask 中的 hart 发送 S 态软件中断，hart_mask 的第 i 位对应 hartid 为 hart_mask_base + i 的 hart
+#define sbi_send_ipi(hart_mask, hart_mask_base) \
+    sbi_ecall(SBI_EXT_IPI, SBI_FUNC_SEND_IPI, hart_mask, hart_mask_base, 0, 0, 0, 0)
+
+// 让处于 STOPPED 状态的 hart 以 S 态从物理地址 start_addr 开始执行，a0 为 hartid，a1 为 opaque，satp 为 0
+#define sbi_hart_start(hartid, start_addr, opaque) \
+    sbi_ecall(SBI_EXT_HSM, SBI_FUNC_HART_START, hartid, start_addr, opaque, 0, 0, 0)
+
 #endif // __SBI_H__
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include <debug.h>
 #include <arch.h>
 #include <syscall.h>
+#include <errno.h>
 
 extern char etext[];
 extern char end[];
@@ -52,28 +53,57 @@ kvminithart()
 }
 
 
+// map the kernel space with megapages where possible
+// these are not user pages, so no reference is taken on them
+static void
+kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags)
+{
+    uint64 end_va = PGROUNDUP(va + sz);
+    va = PGROUNDDOWN(va);
+    pa = PGROUNDDOWN(pa);
+
+    while (va < end_va) {
+        if (IS_MEGAPGALIGNED(va) && IS_MEGAPGALIGNED(pa) && end_va - va >= MEGAPGSIZE) {
+            pte_t* pmd = walk_megapage(kpgtbl, va, WALK_ALLOC);
+            Assert(pmd, "no memory for kernel pagetable");
+            if (*pmd == 0) {
+                *pmd = PA2PTE(pa) | flags | PTE_MEGA | PTE_V;
+                va += MEGAPGSIZE;
+                pa += MEGAPGSIZE;
+                continue;
+            }
+        }
+        pte_t* pte = walk(kpgtbl, va, WALK_ALLOC);
+        Assert(pte && !PTE_IS_MEGA(*pte), "kvmmap: bad pte at %lx", va);
+        *pte = PA2PTE(pa) | flags | PTE_V;
+        va += PGSIZE;
+        pa += PGSIZE;
+    }
+}
+
+
 pagetable_t
 kvmmake()
 {
     pagetable_t kpgtbl = alloc_pagetable();
 
     // uart0
-    mappages(kpgtbl, UART0, UART0, VIRT_UART0_SIZE, PTE_R | PTE_W);
+    kvmmap(kpgtbl, UART0, UART0, VIRT_UART0_SIZE, PTE_R | PTE_W);
 
     // virtio
-    mappages(kpgtbl, VIRTIO0, VIRTIO0, VIRTIO_MMIO_DEV_NUM*VIRT_VIRTIO_SIZE, PTE_R | PTE_W);
+    kvmmap(kpgtbl, VIRTIO0, VIRTIO0, VIRTIO_MMIO_DEV_NUM*VIRT_VIRTIO_SIZE, PTE_R | PTE_W);
 
     // CLINT
-    mappages(kpgtbl, CLINT, CLINT, VIRT_CLINT_SIZE, PTE_R | PTE_W);
+    kvmmap(kpgtbl, CLINT, CLINT, VIRT_CLINT_SIZE, PTE_R | PTE_W);
 
     // PLIC
-    mappages(kpgtbl, PLIC, PLIC, VIRT_PLIC_SIZE, PTE_R | PTE_W);
+    kvmmap(kpgtbl, PLIC, PLIC, VIRT_PLIC_SIZE, PTE_R | PTE_W);
 
     // kernel .text
-    mappages(kpgtbl, KERNELBASE, KERNELBASE, (uint64)etext - KERNELBASE, PTE_R | PTE_X);
+    kvmmap(kpgtbl, KERNELBASE, KERNELBASE, (uint64)etext - KERNELBASE, PTE_R | PTE_X);
 
     // kernel data and physical memory space
-    mappages(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP - (uint64)etext, PTE_R | PTE_W);
+    kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP - (uint64)etext, PTE_R | PTE_W);
 
     // map trampoline page
     mappages(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
@@ -102,6 +132,9 @@ walk(pagetable_t pgtbl, uint64 va, int alloc)
                 *pte |= PTE_V;
             else return 0;
         } 
+        // megapage leaf in L1
+        else if (shift == 9 && PTE_IS_MEGA(*pte))
+            return pte;
         pgtbl = (pagetable_t) PTE2PA(*pte);
     }
 
@@ -109,6 +142,20 @@ walk(pagetable_t pgtbl, uint64 va, int alloc)
 }
 
 
+pte_t*
+walk_megapage(pagetable_t pgtbl, uint64 va, int alloc)
+{
+    pte_t* pte = pgtbl + PX(2, va);
+    if ((*pte & PTE_V) == 0) {
+        if (alloc && (*pte = PA2PTE(alloc_pagetable())) != 0)
+            *pte |= PTE_V;
+        else return 0;
+    }
+    pgtbl = (pagetable_t) PTE2PA(*pte);
+    return (pgtbl + PX(1, va));
+}
+
+
 // void
 // mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags)
 // {
@@ -147,7 +194,7 @@ walkaddr(pagetable_t pgtbl, uint64 va)
         return 0;
 
     uint64 offset = va & (PGSIZE - 1);
-    uint64 pa = (uint64) PTE2PA(*pte) | offset;
+    uint64 pa = (uint64) PTE_PAGE_PA(*pte, va) | offset;
 
     return pa;
 }
@@ -159,12 +206,16 @@ pagetable_t
 uvmmake(uint64 trapframe)
 {
     pagetable_t upgtbl = alloc_pagetable();
+    if (upgtbl == NULL)
+        return NULL;
 
     // map TRAMPOLINE
-    mappages(upgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
-
-    // map TRAPFRAME
-    mappages(upgtbl, TRAPFRAME, trapframe, PGSIZE, PTE_R | PTE_W);
+    // map TRAPFRAME last, so that no reference is taken on failure
+    if (mappages(upgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X) < 0
+        || mappages(upgtbl, TRAPFRAME, trapframe, PGSIZE, PTE_R | PTE_W) < 0) {
+        freewalk(upgtbl, 0);
+        return NULL;
+    }
 
     return upgtbl;
 }
@@ -177,7 +228,7 @@ uvminit(uint64 trapframe, const char* init_code, int sz)
     assert(init_code);
     assert(sz <= 16*PGSIZE);
     
-    void* userspace = kalloc(sz);
+    void* userspace = kalloc(PGROUNDUP(sz));
     // memset(userspace, 0, sz);
     memmove(userspace, init_code, sz);
 
@@ -195,12 +246,19 @@ uvminit(uint64 trapframe, const char* init_code, int sz)
 }
 
 
-void 
+int
 map_stack(pagetable_t pgtbl, uint64 stack_va) 
 {
     void* stack = kalloc(KSTACK_SIZE);
-    Assert(stack, "out of memory");
-    mappages(pgtbl, stack_va, (uint64)stack, KSTACK_SIZE, PTE_R | PTE_W);
+    if (stack == NULL)
+        return -ENOMEM;
+    if (mappages(pgtbl, stack_va, (uint64)stack, KSTACK_SIZE, PTE_R | PTE_W) < 0) {
+        kfree(stack);
+        return -ENOMEM;
+    }
+    // kernel entries are no longer flushed on every trap
+    flush_tlb();
+    return 0;
 }
 
 uint64
@@ -214,55 +272,35 @@ phys_to_virt(uint64 pa) {
 }
 
 
-#define CHECK(cond, msg, ...) \
-    if (!(cond)) { \
-        Log(ANSI_FG_RED, msg, ## __VA_ARGS__); \
-        p->killed = 1; \
-        return; \
-    }
+uint64
+prot_to_pte(int prot)
+{
+    uint64 perm = PTE_U;
+    perm |= ((prot & PROT_READ) ? PTE_R : 0);
+    perm |= ((prot & PROT_EXEC) ? PTE_X : 0);
+    perm |= ((prot & PROT_WRITE) ? PTE_R | PTE_W : 0);
+    return perm;
+}
+
 
 void 
-page_unmap_handler()
+page_fault_handler()
 {
     struct proc* p = myproc();
     uint64 badv = r_stval();
-    uint64 va = PGROUNDDOWN(badv);
-
-    struct vm_area* vma = find_vma(p, va);
-    CHECK(vma, "vma not found");
-
     uint64 scause = r_scause();
-    CHECK((scause == STORE_AMO_ACCESS_FAULT && (vma->prot & PROT_WRITE)) && (scause == LOAD_ACCESS_FAULT && (vma->prot & PROT_READ)), "vma prot error");
-
-    char* mem = kalloc(PGSIZE);
-    CHECK(mem, "out of memory");
-    memset(mem, 0, PGSIZE);
-
-    if (vma->file) {
-        file_put(vma->file);
-        // file system help
-        // ilock(vma->file->ip);
-        // readi(vma->file->ip, 0, (uint64)page, 
-        //       vma->offset + (va - vma->start), PGSIZE);
-        // iunlock(vma->file->ip);
-    }
+    int write = (scause == STORE_AMO_PAGE_FAULT);
 
-    uint perm = PTE_U;
-    perm |= ((vma->prot & PROT_READ) ? PTE_R : 0);
-    perm |= ((vma->prot & PROT_EXEC) ? PTE_X : 0);
-    perm |= ((vma->prot & PROT_WRITE) ? PTE_W : 0);
-
-    if (vma->flags & MAP_PRIVATE) {
-        perm &= ~PTE_W;
-        perm |= PTE_COW;
-    }
-    else if (vma->flags & MAP_SHARED) {
-        perm |= PTE_G;
-    }
+    int err = (p ? handle_mm_fault(p, badv, write) : -EFAULT);
+    if (err == 0)
+        return;
 
-    mappages(UPGTBL(p->pagetable), va, (uint64)mem, PGSIZE, perm);
+    // kernel touches an illegal address
+    if (r_sstatus() & SSTATUS_SPP)
+        kernel_trap_error();
 
-    flush_tlb_one(va);
+    Log(ANSI_FG_RED, "page fault at %lx, err %d", badv, err);
+    p->killed = 1;
 }
 
 void free_pgtbl(pagetable_t pgtbl, struct vm_area* vma) {
@@ -0,0 +1,49 @@
+#include <common.h>
+#include <arch.h>
+#include <debug.h>
+#include <proc/smp.h>
+
+extern char _start[];
+
+#ifdef BIOS_SBI
+#include <sbi/sbi.h>
+
+// the kernel is mapped at its physical address, the hart enters _start with its hartid in a0
+int
+arch_cpu_start(int cpu)
+{
+    return (sbi_hart_start(cpu, (uint64) _start, 0).error == SBI_SUCCESS ? 0 : -1);
+}
+
+
+void
+arch_send_ipi(int cpu)
+{
+    sbi_send_ipi(1UL << cpu, 0);
+}
+
+
+// clear SSIP before the reasons are read, an ipi sent after that sets it again
+void
+ipi_interrupt_handler()
+{
+    w_sip(r_sip() & ~SIP_SSIP);
+    smp_ipi_handler();
+}
+
+#else
+
+// without the SBI other harts are parked in _start, SSIP carries the timer from machine mode
+int
+arch_cpu_start(int cpu)
+{
+    return -1;
+}
+
+
+void
+arch_send_ipi(int cpu)
+{
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <common.h>
 #include <mm/memlayout.h>
 #include <mm/mm.h>
+#include <mm/asid.h>
 #include <debug.h>
 #include <irq/interrupt.h>
 #include <arch.h>
@@ -11,6 +12,7 @@
 
 extern char kernelvec[], trampoline[], uservec[], userret[];
 void timer_interrupt_handler();
+void ipi_interrupt_handler();
 static void syscall_handler();
 
 typedef void (*handler)(void);
@@ -93,6 +95,7 @@ trap_init()
 
     #ifdef BIOS_SBI
     register_trap_handler(INTERRUPT, SUPERVISOR_TIMER_INTERRUPT, timer_interrupt_handler);
+    register_trap_handler(INTERRUPT, SUPERVISOR_SOFTWARE_INTERRUPT, ipi_interrupt_handler);
     #else
     register_trap_handler(INTERRUPT, SUPERVISOR_SOFTWARE_INTERRUPT, timer_interrupt_handler);
     register_trap_handler(EXCEPTION, ENVIRONMENT_CALL_FROM_S_MODE, s_mode_ecall_handler);
@@ -100,9 +103,9 @@ trap_init()
     register_trap_handler(EXCEPTION, ENVIRONMENT_CALL_FROM_U_MODE, syscall_handler);
     register_trap_handler(INTERRUPT, SUPERVISOR_EXTERNEL_INTERRUPT, irq_response);
 
-    register_trap_handler(EXCEPTION, STORE_AMO_PAGE_FAULT, store_page_fault_handler);
-    register_trap_handler(EXCEPTION, LOAD_ACCESS_FAULT, page_unmap_handler);
-    register_trap_handler(EXCEPTION, STORE_AMO_ACCESS_FAULT, page_unmap_handler);
+    register_trap_handler(EXCEPTION, INSTRUCTION_PAGE_FAULT, page_fault_handler);
+    register_trap_handler(EXCEPTION, LOAD_PAGE_FAULT, page_fault_handler);
+    register_trap_handler(EXCEPTION, STORE_AMO_PAGE_FAULT, page_fault_handler);
 }
 
 
@@ -174,7 +177,8 @@ dive_to_user()
     // p->trapframe->tp = p->tls;
     
     uint64 trapframe = TRAPFRAME + (uint64)p->trapframe - PGROUNDDOWN(p->trapframe);
-    uint64 satp = MAKE_SATP(UPGTBL(p->pagetable));
+    // asid 0 makes trampoline flush the whole tlb
+    uint64 satp = MAKE_SATP_ASID(UPGTBL(p->pagetable), asid_switch(p->pagetable));
 
     uint64 fn = TRAMPOLINE + (userret - trampoline);
     ((void (*)(uint64,uint64))fn)(trapframe, satp);
@@ -11,6 +11,7 @@
 #include <klib.h>
 #include <locking/spinlock.h>
 #include <mm/mm.h>
+#include <mm/meminfo.h>
 #include <init.h>
 
 static struct list_head devfs_list;
@@ -18,6 +19,7 @@ static spinlock_t devfs_list_lk;
 static uint32 cur_ino = 0;
 
 struct devfs_device stdin, stdout, stderr;
+static struct devfs_device meminfo;
 
 /**
  * Get a device by its name
@@ -121,6 +123,12 @@ int devfs_init(struct mountpoint *mp)
     stderr.file_type = FT_CHRDEV;
     stderr.name = stderr.tty.name;
     devfs_add_device(&stderr);
+
+    meminfo.file_type = FT_REG_FILE;
+    meminfo.name = "meminfo";
+    meminfo.info.show = meminfo_show;
+    meminfo.info.bufsize = MEMINFO_BUF_SIZE;
+    devfs_add_device(&meminfo);
     
     device_list_for_each_entry_locked(dev) {
         if(dev->type == DEVICE_TYPE_BLOCK) {
@@ -189,6 +197,10 @@ static off_t devfs_llseek(struct file *file, off_t offset, int whence)
     {
         return tty_llseek(&device->tty, offset, whence);
     }
+    else if (device->file_type == FT_REG_FILE)
+    {
+        return infofile_llseek(&device->info, file->fpos, offset, whence);
+    }
 
     error("Invalid device type");
     return -1;
@@ -220,6 +232,10 @@ static ssize_t devfs_read(struct file *file, char *buffer, size_t size, off_t *o
     {
         return tty_read(&device->tty, buffer, size, offset);
     }
+    else if (device->file_type == FT_REG_FILE)
+    {
+        return infofile_read(&device->info, buffer, size, offset);
+    }
 
     error("Invalid device type");
     return -1;
@@ -251,6 +267,11 @@ static ssize_t devfs_write(struct file *file, const char *buffer, size_t size, o
     {
         return tty_write(&device->tty, buffer, size, offset);
     }
+    else if (device->file_type == FT_REG_FILE)
+    {
+        error("info file is read only");
+        return -1;
+    }
 
     error("Invalid device type");
     return -1;
@@ -305,6 +326,8 @@ static int devfs_openat(struct file *file, path_t path, int flags, umode_t mode)
             file->f_inode->i_mode = mode & S_IFBLK;
         else if (device->file_type == FT_CHRDEV)
             file->f_inode->i_mode = mode & S_IFCHR;
+        else if (device->file_type == FT_REG_FILE)
+            file->f_inode->i_mode = mode & S_IFREG;
         else
         {
             error("Invalid data type.");
@@ -421,6 +444,26 @@ static int devfs_getattr(path_t path, struct stat *stat)
             stat->st_mtime = 0;
             stat->st_mtime_nsec = 0;
         }
+        else if (device->file_type == FT_REG_FILE)
+        {
+            // content is generated on read, size is unknown like files in procfs
+            stat->st_dev = 0;
+            stat->st_ino = device->ino;
+            stat->st_mode = S_IFREG;
+            stat->st_nlink = 1;
+            stat->st_uid = 0;
+            stat->st_gid = 0;
+            stat->st_rdev = 0;
+            stat->st_size = 0;
+            stat->st_blksize = 0;
+            stat->st_blocks = 0;
+            stat->st_atime = 0;
+            stat->st_atime_nsec = 0;
+            stat->st_ctime = 0;
+            stat->st_ctime_nsec = 0;
+            stat->st_mtime = 0;
+            stat->st_mtime_nsec = 0;
+        }
         else
         {
             error("Invalid data type.");
@@ -0,0 +1,74 @@
+#include <fs/devfs/devs/info.h>
+#include <fs/file.h>
+#include <fs/fcntl.h>
+#include <mm/mm.h>
+#include <klib.h>
+#include <debug.h>
+
+/**
+ * Generate the content of an info file into a new buffer
+ * @param info: The info file
+ * @param len: Pointer to store the length of the content
+ * @return The buffer to be freed by kfree, NULL if out of memory
+ */
+static char *infofile_generate(struct infofile *info, size_t *len)
+{
+    char *buf = kalloc(info->bufsize);
+
+    if (buf == NULL) {
+        error("no memory for info file");
+        return NULL;
+    }
+
+    *len = info->show(buf, info->bufsize);
+    return buf;
+}
+
+ssize_t infofile_read(struct infofile *info, char *buffer, size_t size, off_t *offset)
+{
+    size_t len, nr_read;
+    char *buf = infofile_generate(info, &len);
+
+    if (buf == NULL)
+        return -1;
+
+    nr_read = 0;
+    if (*offset >= 0 && *offset < len) {
+        nr_read = MIN(size, len - *offset);
+        memcpy(buffer, buf + *offset, nr_read);
+    }
+    kfree(buf);
+
+    *offset += nr_read;
+    return nr_read;
+}
+
+off_t infofile_llseek(struct infofile *info, off_t pos, off_t offset, int whence)
+{
+    size_t len;
+    char *buf;
+
+    switch (whence)
+    {
+    case SEEK_SET:
+        break;
+
+    case SEEK_CUR:
+        offset += pos;
+        break;
+
+    case SEEK_END:
+        buf = infofile_generate(info, &len);
+        if (buf == NULL)
+            return -1;
+        kfree(buf);
+        offset += len;
+        break;
+
+    default:
+        error("Invalid whence");
+        return -1;
+    }
+
+    return (offset < 0 ? -1 : offset);
+}
@@ -12,11 +12,74 @@
 
 #include <fs/ext4/lwext4/ext4.h>
 #include <fs/ext4/lwext4/ext4_fs.h>
+#include <fs/ext4/lwext4/ext4_inode.h>
 #include <fs/ext4/lwext4/ext4_errno.h>
+#include <fs/ext4/lwext4/ext4_bcache.h>
+
+#include <mm/reclaim.h>
+#include <mm/page_cache.h>
+#include <locking/sleeplock.h>
 
 #define MAX_EXT4_BLOCKDEV_NAME 64
 #define EXT4_BUF_SIZE 512
 
+/*
+ * lwext4 calls these around every operation on a mount point. One lock is
+ * shared by all ext4 mounts so the bcache shrinker can take it without
+ * knowing which mount it is about to touch.
+ */
+static SLEEPLOCK_DEFINE(ext4_fs_sleeplock);
+
+static void ext4_fs_lock(void)
+{
+	sleeplock_acquire(&ext4_fs_sleeplock);
+}
+
+static void ext4_fs_unlock(void)
+{
+	sleeplock_release(&ext4_fs_sleeplock);
+}
+
+static const struct ext4_lock ext4_fs_locks = {
+	.lock = ext4_fs_lock,
+	.unlock = ext4_fs_unlock,
+};
+
+/**
+ * Drop clean and unreferenced block cache buffers of all mounted ext4
+ * filesystems, called by reclaim_pages when memory is low. The caches are
+ * only touched when the filesystem lock is free: the allocation that asked
+ * for memory may come from inside lwext4 with the lock held.
+ * @param nr: Maximum number of buffers to drop
+ * @return Number of dropped buffers
+ */
+static uint64 ext4_bcache_shrink(uint64 nr)
+{
+	struct mountpoint *mp;
+	uint64 dropped = 0;
+
+	if (!sleeplock_trylock(&ext4_fs_sleeplock))
+		return 0;
+
+	mp_list_for_each_entry_locked(mp) {
+		struct ext4_fs_dev *fs_dev = (struct ext4_fs_dev *)mp->private;
+		if (mp->fs != &ext4_fs || fs_dev == NULL || fs_dev->ext4_blkdev.bc == NULL)
+			continue;
+		if (dropped >= nr)
+			break;
+		dropped += ext4_bcache_drop_clean(fs_dev->ext4_blkdev.bc, nr - dropped);
+	}
+
+	ext4_fs_unlock();
+	return dropped;
+}
+
+static struct shrinker ext4_shrinker = {
+	.name = "ext4_bcache",
+	.shrink = ext4_bcache_shrink,
+};
+static int ext4_shrinker_registered = 0;
+
 /**
  * Mount an ext4 filesystem
  * @param blkdev: Block device containing the filesystem
@@ -75,6 +138,8 @@ static int ext4_fs_mount(struct blkdev * blkdev, struct mountpoint *mp, const ch
 		return -1;
 	}
 
+	ext4_mount_setup_locks(mp->mountpoint, &ext4_fs_locks);
+
 	ret = ext4_cache_write_back(mp->mountpoint, true);
 	if (ret != EOK)
 	{
@@ -86,6 +151,11 @@ static int ext4_fs_mount(struct blkdev * blkdev, struct mountpoint *mp, const ch
 
 	mp->private = (void*)fs_dev;
 
+	if (!ext4_shrinker_registered) {
+		register_shrinker(&ext4_shrinker);
+		ext4_shrinker_registered = 1;
+	}
+
 	return 0;
 }
 
@@ -280,6 +350,10 @@ static int ext4_openat(struct file* file, path_t path, int flags, umode_t mode)
 			error_ext4("ext4_fopen2 error! ret: %d", ret);
 			return -1;
 		}
+
+		// page cache is indexed by inode number
+		file->f_inode->i_ino = ext4_file->inode;
+		file->f_inode->i_size = ext4_file->fsize;
 	}
 
 	if(flags & O_CREAT) {
@@ -354,7 +428,15 @@ static int ext4_link(path_t path, path_t hardlink_path) {
  * @return 0 on success, -1 on error
  */
 static int ext4_unlink(path_t path) {
+	uint32 ino;
+	struct ext4_inode inode;
+	int last;
+
+	// the inode number is reused once the last link is gone, its cached pages must go with it
+	last = (ext4_raw_inode_fill(path, &ino, &inode) == EOK && ext4_inode_get_links_cnt(&inode) <= 1);
 	int ret = ext4_fremove(path);
+	if (ret == EOK && last)
+		page_cache_invalidate(mountpoint_find(path), ino);
 	return ret;
 }
 
@@ -374,6 +456,8 @@ static int ext4_truncate(struct file* file, off_t length) {
 		return -1;
 	}
 
+	// mappings past the new end must not read the old data back
+	page_cache_truncate(file, length);
 	return 0;
 }
 
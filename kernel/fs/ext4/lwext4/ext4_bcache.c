@@ -319,6 +319,32 @@ bool ext4_bcache_is_full(struct ext4_bcache *bc)
 	return (bc->cnt <= bc->ref_blocks);
 }
 
+uint32 ext4_bcache_drop_clean(struct ext4_bcache *bc, uint32 nr)
+{
+	uint32 dropped = 0;
+	struct ext4_buf *buf, *tmp;
+
+	/* Someone is walking the LRU tree right now. */
+	if (bc->dont_shake)
+		return 0;
+
+	bc->dont_shake = true;
+	RB_FOREACH_SAFE(buf, ext4_buf_lru, &bc->lru_root, tmp) {
+		if (dropped >= nr)
+			break;
+
+		/* Dirty buffers must be written back first. */
+		if (ext4_bcache_test_flag(buf, BC_DIRTY))
+			continue;
+
+		ext4_bcache_drop_buf(bc, buf);
+		dropped++;
+	}
+	bc->dont_shake = false;
+
+	return dropped;
+}
+
 
 /**
  * @}
@@ -97,6 +97,9 @@ struct files_struct* fdt_dup(struct files_struct *fdt)
         if (fdt->fd[fd] != NULL) {
             new_fdt->fd[fd] = memdup(fdt->fd[fd], sizeof(struct file));
             new_fdt->fd[fd]->f_inode = memdup(new_fdt->fd[fd]->f_inode, sizeof(struct inode));
+            // the copy shares private data, let the file count it
+            if (new_fdt->fd[fd]->f_op && new_fdt->fd[fd]->f_op->dup)
+                new_fdt->fd[fd]->f_op->dup(new_fdt->fd[fd]);
         }
     }
 
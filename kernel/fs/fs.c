@@ -9,6 +9,7 @@
 #include <fs/devfs/devfs.h>
 #include <fs/kernel.h>
 #include <io/blk.h>
+#include <mm/page_cache.h>
 #include <proc/proc.h>
 #include <syscall.h>
 #include <debug.h>
@@ -331,13 +332,6 @@ SYSCALL_DEFINE3(read, ssize_t, int, fd, char *, buf, size_t, count)
 	if(count == 0)
 		return 0;
 
-	KCALLOC(char, kernel_buf, count);
-
-	if(kernel_buf == NULL) {
-		error("alloc kernel buffer error");
-		return -1;
-	}
-
 	if (fd < 0 || fd >= NR_OPEN)
 		return -1;
 
@@ -350,19 +344,28 @@ SYSCALL_DEFINE3(read, ssize_t, int, fd, char *, buf, size_t, count)
 		return -1;
 	}
 
+	KCALLOC(char, kernel_buf, count);
+
+	if(kernel_buf == NULL) {
+		error("alloc kernel buffer error");
+		return -1;
+	}
+
 	ori_fpos = file->fpos;
 	ret = call_interface(file->f_op, read, ssize_t, file, kernel_buf, count, &file->fpos);
 	if (ret < 0)
-		return -1;
+		goto out_free;
 
 	if (copy_to_user(buf, kernel_buf, ret) < 0) {
 		error("copy to userspace error");
-		kfree(kernel_buf);
-		return -1;
+		ret = -1;
+		goto out_free;
 	}
-	kfree(kernel_buf);
+	ret = file->fpos - ori_fpos;
 
-	return file->fpos - ori_fpos;
+out_free:
+	kfree(kernel_buf);
+	return (ret < 0 ? -1 : ret);
 }
 
 SYSCALL_DEFINE3(write, ssize_t, int, fd, const char *, buf, size_t, count)
@@ -375,13 +378,6 @@ SYSCALL_DEFINE3(write, ssize_t, int, fd, const char *, buf, size_t, count)
 	if(count == 0)
 		return 0;
 
-	KCALLOC(char, kernel_buf, count);
-
-	if(kernel_buf == NULL) {
-		error("alloc kernel buffer error");
-		return -1;
-	}
-
 	if (fd < 0 || fd >= NR_OPEN)
 		return -1;
 
@@ -394,24 +390,34 @@ SYSCALL_DEFINE3(write, ssize_t, int, fd, const char *, buf, size_t, count)
 		return -1;
 	}
 
+	KCALLOC(char, kernel_buf, count);
+
+	if(kernel_buf == NULL) {
+		error("alloc kernel buffer error");
+		return -1;
+	}
+
 	if(file->f_flags & O_APPEND) {
 		file->fpos = call_interface(file->f_op, llseek, off_t, file, 0, SEEK_END);
 	}
 
 	if (copy_from_user(kernel_buf, buf, count) < 0) {
 		error("copy from userspace error");
-		kfree(kernel_buf);
-		return -1;
+		ret = -1;
+		goto out_free;
 	}
 
 	ori_fpos = file->fpos;
 	ret = call_interface(file->f_op, write, ssize_t, file, kernel_buf, count, &file->fpos);
 	if (ret < 0)
-		return -1;
+		goto out_free;
+	ret = file->fpos - ori_fpos;
+	// mappings of the file see the new data
+	page_cache_write(file, ori_fpos, kernel_buf, ret);
 
+out_free:
 	kfree(kernel_buf);
-
-	return file->fpos - ori_fpos;
+	return (ret < 0 ? -1 : ret);
 }
 
 SYSCALL_DEFINE1(close, int, int, fd)
@@ -484,6 +490,35 @@ out:
 	return ret;
 }
 
+SYSCALL_DEFINE2(ftruncate, long, int, fd, off_t, length) {
+	struct file* file;
+	int ret;
+
+	if (fd < 0 || fd >= NR_OPEN)
+		return -1;
+
+	file = fd_get(myproc()->fdt, fd);
+	if (file == NULL)
+		return -1;
+
+	if ((file->f_flags & O_ACCMODE) == O_RDONLY) {
+		error("file is read only");
+		return -1;
+	}
+
+	ret = call_interface(file->f_op, truncate, int, file, length);
+	if (ret < 0) {
+		error("file truncate failed");
+		return -1;
+	}
+
+	// files in memory keep their size by themselves
+	if (file->f_inode)
+		file->f_inode->i_size = length;
+
+	return 0;
+}
+
 SYSCALL_DEFINE3(faccessat, long, int, dfd, const char*, filename, int, mode) {
 	int ret;
 	struct mountpoint *mount_p;
@@ -577,6 +612,9 @@ SYSCALL_DEFINE2(fstat, int, int, fd, struct stat *, buf)
 		return -1;
 
 	inode = file->f_inode;
+	// pipes and memfds have no inode to stat
+	if (inode == NULL || inode->i_mp == NULL)
+		return -1;
 
 	ret = call_interface(inode->i_mp->fs->fs_op, getattr, int, file->f_path, &stat);
 	if (ret < 0)
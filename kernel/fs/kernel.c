@@ -2,6 +2,7 @@
 #include <fs/fcntl.h>
 #include <fs/mountp.h>
 #include <mm/mm.h>
+#include <mm/page_cache.h>
 #include <debug.h>
 #include <lib/errno.h>
 
@@ -156,6 +157,8 @@ ssize_t kernel_write(struct file* file, const void* buf, size_t size) {
         return -1;
     }
 
+    // mappings of the file see the new data
+    page_cache_write(file, ori_fpos, buf, file->fpos - ori_fpos);
     return file->fpos - ori_fpos;
 }
 
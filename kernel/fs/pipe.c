@@ -95,6 +95,23 @@ static ssize_t pipe_write(struct file* file, const char * buffer, size_t size, o
 }
 
 
+/**
+ * Take one more reference of the pipe for a copied file.
+ * @param file: The copy of a pipe file made by fdt_dup.
+ * @return: 0 on success.
+ */
+static int pipe_dup(struct file *file) {
+	struct pipe* pipe = (struct pipe*)file->f_private;
+
+	assert(pipe != NULL);
+
+	spinlock_acquire(pipe->lock);
+	pipe->ref++;
+	spinlock_release(pipe->lock);
+
+	return 0;
+}
+
 /**
  * Close a pipe file.
  * @param file: The file structure containing the pipe.
@@ -115,5 +132,6 @@ static int pipe_close(struct file *file) {
 const struct file_operations pipe_fileops = {
 	.read = pipe_read,
 	.write = pipe_write,
-	.close = pipe_close
+	.close = pipe_close,
+	.dup = pipe_dup
 };
\ No newline at end of file
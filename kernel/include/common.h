@@ -2,7 +2,9 @@
 #define __COMMON_H__
 
 #define XLEN 64
-#define NCPU 1
+#ifndef NCPU
+#define NCPU 1  // the Makefile passes -DNCPU=$(SMP)
+#endif
 #define MEMORY_SIZE_SHIFT 27
 #define MEMORY_SIZE (1 << MEMORY_SIZE_SHIFT) // 128MB
 
@@ -17,6 +19,8 @@
 #define PATH_MAX 128
 #define MAX_ARG_STRLEN 128
 
+#define UINT64_MAX 0xFFFFFFFFFFFFFFFFUL
+
 #define PGROUNDUP(sz)  (((uint64)(sz)+PGOFFMASK) & PGMASK)
 #define PGROUNDDOWN(a) (((uint64)(a)) & PGMASK)
 #define IS_PGALIGNED(a) (!((uint64)(a) & PGOFFMASK))
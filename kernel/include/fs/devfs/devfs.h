@@ -3,6 +3,7 @@
 
 #include <fs/devfs/devs/tty.h>
 #include <fs/devfs/devs/block.h>
+#include <fs/devfs/devs/info.h>
 #include <tools/list.h>
 
 struct devfs_device {
@@ -11,6 +12,7 @@ struct devfs_device {
     union {
         struct disk disk;
         struct tty tty;
+        struct infofile info;   // FT_REG_FILE
         uint8 reserved;
     };
 
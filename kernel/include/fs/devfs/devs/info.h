@@ -0,0 +1,42 @@
+#ifndef __INFO_H__
+#define __INFO_H__
+
+#include <common.h>
+#include <fs/fs.h>
+
+/**
+ * A read-only text file whose content is generated on every access,
+ * used to expose kernel statistics such as /dev/meminfo
+ */
+struct infofile {
+    /**
+     * Generate the whole content of the file
+     * @param buf: The buffer to store the content
+     * @param size: The size of buf
+     * @return Length of the content
+     */
+    size_t (*show)(char *buf, size_t size);
+    size_t bufsize;
+};
+
+/**
+ * Read from an info file, the content is generated again on every read
+ * @param info: The info file
+ * @param buffer: The buffer to store the read data
+ * @param size: The number of bytes to read
+ * @param offset: Pointer to the current offset (will be updated after reading)
+ * @return Number of bytes read, or -1 if out of memory
+ */
+ssize_t infofile_read(struct infofile *info, char *buffer, size_t size, off_t *offset);
+
+/**
+ * Compute a new offset for an info file
+ * @param info: The info file
+ * @param pos: The current offset
+ * @param offset: The offset value
+ * @param whence: Reference position (SEEK_SET, SEEK_CUR, SEEK_END)
+ * @return The new offset, or -1 on error
+ */
+off_t infofile_llseek(struct infofile *info, off_t pos, off_t offset, int whence);
+
+#endif // __INFO_H__
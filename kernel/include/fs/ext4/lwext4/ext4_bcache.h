@@ -284,6 +284,13 @@ int ext4_bcache_free(struct ext4_bcache *bc, struct ext4_block *b);
  * @return  full status*/
 bool ext4_bcache_is_full(struct ext4_bcache *bc);
 
+/**@brief   Drop clean and unreferenced buffers, used to give memory back
+ *          when the system is running out of it.
+ * @param   bc block cache descriptor
+ * @param   nr maximum number of buffers to drop
+ * @return  number of dropped buffers*/
+uint32 ext4_bcache_drop_clean(struct ext4_bcache *bc, uint32 nr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,6 +38,7 @@ struct file_operations
 	int (*close)(struct file *);
 	int (*getdents64)(struct file *, struct dirent *, size_t);
 	int (*truncate)(struct file*, off_t length);
+	int (*dup)(struct file *);	// called on the copy made by fdt_dup, can be NULL
 };
 
 #define NR_OPEN 1024
@@ -7,6 +7,7 @@
 #include <locking/spinlock.h>
 #include <irq/interrupt.h>
 #include <io/device.h>
+#include <proc/wait.h>
 
 #define KERNEL_SECTOR_SIZE 512
 #define KERNEL_SECTOR_SHIFT 9
@@ -66,7 +67,8 @@ struct blkreq
     })
 
 #define blkreq_wakeup(req) wakeup(blkreq_wait_channel(req))
-#define blkreq_sleep(req) sleep(blkreq_wait_channel(req))
+#define blkreq_sleep(req) \
+    wait_event_chan(blkreq_wait_channel(req), (req)->status != BLKREQ_STATUS_INIT)
 
 struct blkdev_ops;
 
@@ -42,6 +42,12 @@ void irq_response(void);
  */
 void irq_init(void);
 
+/**
+ * Let this hart take inter-processor and external interrupts.
+ * Called once on every hart, external devices still only interrupt DEFAULT_HART.
+ */
+void irq_init_hart(void);
+
 /**
  * Push the current interrupt state off the stack.
  * This is used to disable interrupts temporarily.
@@ -18,6 +18,22 @@ void*           memmove(void *dst, const void *src, size_t n);
 void*           memcpy(void *dst, const void *src, size_t n);
 void*           memdup(const void *src, size_t n);
 
+/**
+ * 检测 CPU 的向量部件（RISC-V V 扩展，LoongArch LSX/LASX），有则让 mem* 的长拷贝使用向量指令
+ * 在 kinit 之前调用，之前的 mem* 使用按 8 字节展开的通用实现
+ */
+void            string_init();
+
+/**
+ * 将一页清零，page 按页对齐
+ */
+void            clear_page(void* page);
+
+/**
+ * 拷贝一页，dst 与 src 都按页对齐且不重叠
+ */
+void            copy_page(void* dst, const void* src);
+
 /**
  * append a suffix to name
  * @param name: name buffer, must be large enough
@@ -41,6 +57,29 @@ typedef int (*compar_fn_t)(const void*, const void*);
  */
 void qsort(void *base, size_t nmemb, size_t size, compar_fn_t compar);
 
+/* lib/lz4.c */
+#define LZ4_WRKMEM_SIZE (4096 * sizeof(uint16))
+/**
+ * 用 LZ4 块格式压缩，输入不超过 64 KiB
+ * @param src 输入
+ * @param n 输入长度
+ * @param dst 输出缓冲区
+ * @param cap 输出缓冲区大小
+ * @param wrkmem 哈希表，LZ4_WRKMEM_SIZE 字节
+ * @return 压缩后的长度，放不下 cap 字节时返回 0
+ */
+int lz4_compress(const void* src, int n, void* dst, int cap, void* wrkmem);
+
+/**
+ * 解压 LZ4 块，会检查输入是否越界
+ * @param src 压缩数据
+ * @param n 压缩数据长度
+ * @param dst 输出缓冲区
+ * @param cap 输出缓冲区大小
+ * @return 解压后的长度，数据损坏或放不下时返回 -1
+ */
+int lz4_decompress(const void* src, int n, void* dst, int cap);
+
 /* Calculation helper functions */
 #define MINFUNC_DEFINE(type) \
     static inline type min_##type(const type a, const type b) { \
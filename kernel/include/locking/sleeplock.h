@@ -0,0 +1,63 @@
+#ifndef __SLEEPLOCK_H__
+#define __SLEEPLOCK_H__
+
+#include <common.h>
+#include <locking/spinlock.h>
+
+struct proc;
+
+// a lock whose holder may sleep, waiters sleep on the lock's chan instead of spinning
+struct sleeplock {
+    uint32 locked;
+
+    // For debugging
+    char name[SPINLOCK_NAME_MAX_LEN];
+    struct proc *proc;  // which process holding this lock
+};
+
+typedef struct sleeplock sleeplock_t;
+
+
+/**
+ * Initialize a sleeplock structure
+ * @param lk: Sleeplock structure to initialize
+ * @param name: Descriptive name for debugging purposes
+ */
+void    sleeplock_init(struct sleeplock* lk, const char* name);
+
+/**
+ * Check if the current process holds a sleeplock
+ * @param lk: Sleeplock to check
+ * @return Non-zero if current process holds the lock, zero otherwise
+ */
+int     sleeplock_holding(struct sleeplock* lk);
+
+/**
+ * Acquire a sleeplock, sleeping until it is released
+ * @param lk: Sleeplock to acquire
+ * @note Must not be called with a spinlock held or from an interrupt handler
+ */
+void    sleeplock_acquire(struct sleeplock* lk);
+
+/**
+ * Acquire a sleeplock only if it is free, never sleeps
+ * @param lk: Sleeplock to acquire
+ * @return Non-zero if the lock was acquired, zero otherwise
+ */
+int     sleeplock_trylock(struct sleeplock* lk);
+
+/**
+ * Release a sleeplock and wake up its waiters
+ * @param lk: Sleeplock to release
+ * @note lk is not touched once it is unlocked, the next holder may free it
+ */
+void    sleeplock_release(struct sleeplock* lk);
+
+#define SLEEPLOCK_DEFINE(lockname) \
+    sleeplock_t lockname = { \
+        .locked = UNLOCKED, \
+        .name = #lockname, \
+        .proc = NULL \
+    }
+
+#endif // __SLEEPLOCK_H__
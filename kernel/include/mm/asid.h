@@ -0,0 +1,34 @@
+#ifndef __ASID_H__
+#define __ASID_H__
+
+#include <common.h>
+#include <mm/page.h>
+
+#define ASID_MAX_BITS 16    // 最多使用的 ASID 位数，RISC-V Sv39 为 16，LoongArch 为 10
+
+// 每个用户地址空间（upagetable）持有一个 ASID，CLONE_VM 的线程共享同一个
+// upagetable->asid 的低 asid_bits 位是硬件 ASID，高位是分配时的代数
+// ASID 用完后代数加一，所有 CPU 在下一次返回用户态前刷新整个 TLB，之后重新分配
+// 硬件 ASID 0 留给内核，也表示不使用 ASID，此时每次切换页表都要刷新整个 TLB
+
+/**
+ * 探测硬件 ASID 位数并初始化分配器，在 kvminithart 之后调用
+ */
+void        asid_init();
+
+/**
+ * 返回用户态前调用，取得 upgtbl 在当前代中的硬件 ASID
+ * 若 upgtbl 的 ASID 属于旧的代则重新分配；若本 CPU 有待处理的回滚则刷新整个 TLB
+ * @param upgtbl 即将运行的用户地址空间
+ * @return 应写入 satp / CSR.ASID 的硬件 ASID，不支持 ASID 时返回 0
+ */
+uint64      asid_switch(upagetable* upgtbl);
+
+/**
+ * 查询 upgtbl 在当前代中的硬件 ASID，用于按 ASID 刷新 TLB
+ * @param upgtbl 用户地址空间
+ * @return 硬件 ASID；没有有效的 ASID 时返回 -1，调用者应退回到不区分 ASID 的刷新
+ */
+int64       asid_of(upagetable* upgtbl);
+
+#endif // __ASID_H__
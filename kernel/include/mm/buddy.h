@@ -1,33 +1,65 @@
 #ifndef __BUDDY_H__
 #define __BUDDY_H__
 
+#include <common.h>
+#include <mm/page.h>
+#include <mm/gfp.h>
+#include <locking/spinlock.h>
+#include <tools/list.h>
+
 #define MAX_ORDER 11  // maximum order of buddy system
-#define BUDDY_MAGIC 0x42554459
+#define PCP_HIGH  64  // per-cpu list drains when it holds more pages than this
+#define PCP_BATCH 16  // number of pages moved per refill/drain
 
 #define BLOCK_SIZE(order) (PGSIZE << (order))
 #define BLOCK_NPAGES(order) (1 << (order))
-#define BUDDY_BLOCK(addr, order) (((uint64) (addr)) ^ (PGSIZE << (order)))
-#define BUDDY_LOW(addr, order) (((uint64) (addr)) & ~(((uint64) PGSIZE) << (order)))
-#define BUDDY_HIGH(addr, order) (((uint64) (addr)) | (PGSIZE << (order)))
+// pfn is the physical page number, blocks are aligned to their own size
+#define BUDDY_PFN(pfn, order) ((pfn) ^ (1UL << (order)))
+#define BUDDY_LOW_PFN(pfn, order) ((pfn) & ~(1UL << (order)))
 
 #define GET_PAGE_ORDER(addr, pages) (pages[((uint64)addr - (uint64)pages) >> PGSHIFT].order)
 #define SET_PAGE_ORDER(addr, pages, new_order) pages[((uint64)addr - (uint64)pages) >> PGSHIFT].order = new_order
 
-// the block's address must be page-aligned
-struct block {
-    uint64 magic;
-    int order;
-    struct block* prev;
-    struct block* next;
-};
-
+// free blocks are linked through struct page of their first page,
+// so the free memory itself is never touched by buddy system
 struct free_area {
-    struct block free_list;
+    struct list_head free_list;
     uint64 nr_free;     // number of free blocks in the area
 };
 
+// per-cpu cache of order-0 pages
+// hot pages are pushed and popped at the head, drain takes cold pages from the tail
+struct per_cpu_pages {
+    spinlock_t lock;    // taken by the owner cpu, and by buddy_drain_all from any cpu
+    struct list_head list;
+    int count;          // number of pages in list
+    int high;           // drain when count exceeds high
+    int batch;          // pages moved per refill/drain
+
+    uint64 alloc_hit;   // allocations served without touching zone
+    uint64 alloc_miss;  // allocations that had to refill list first
+    uint64 nr_refill;   // refill batches
+    uint64 nr_drain;    // drain batches
+};
+
 struct zone {
     struct free_area free_area[MAX_ORDER];
+    struct per_cpu_pages pcp[NCPU];
+    struct page* start_page;    // struct page of the first page in zone
+    uint64 nr_pages;            // number of pages in zone
+    uint64 nr_free_pages;       // free pages in free_area, pcp excluded
+    spinlock_t lock;            // protect free_area
+};
+
+// buddy system 的统计信息，由 buddy_get_stat 取得
+struct buddy_stat {
+    uint64 nr_pages;                // zone 中的总页数
+    uint64 nr_free[MAX_ORDER];      // 各个 order 的空闲块数
+    uint64 nr_pcp;                  // per-cpu 页缓存中的页数
+    uint64 pcp_hit;                 // 各个 CPU 的 alloc_hit 之和
+    uint64 pcp_miss;                // 各个 CPU 的 alloc_miss 之和
+    uint64 nr_shared;               // 引用计数大于 1 的页，即 COW 或页缓存共享的页
+    uint64 nr_shared_cache;         // 其中属于页缓存的页
 };
 
 
@@ -40,17 +72,51 @@ struct zone {
 void            buddy_init(uint64 start, uint64 end);
 
 /**
- * buddy system 的分配函数
+ * buddy system 的分配函数，等价于 buddy_alloc_gfp(sz, GFP_KERNEL)
  * @param sz 要分配的大小（字节）
- * @return buddy system 分配空间的指针
+ * @return buddy system 分配空间的指针，内存不足返回 NULL
  */
 void*           buddy_alloc(uint64 sz);
 
+/**
+ * 带分配标志的 buddy system 分配函数
+ * 分配失败时，按 gfp 决定是否回收内存、是否让出 CPU 后重试
+ * @param sz 要分配的大小（字节）
+ * @param gfp 分配标志，见 mm/gfp.h
+ * @return buddy system 分配空间的指针，内存不足返回 NULL
+ */
+void*           buddy_alloc_gfp(uint64 sz, gfp_t gfp);
+
 /**
  * buddy system 的释放函数
  * @param sz 要分配的 buddy 块以及其 order
  */
 void            buddy_free(void* addr, int order);
 
+/**
+ * 将当前 CPU 的 per-cpu 页缓存全部还给 buddy system
+ * @return 归还的页数
+ */
+int             buddy_drain_local();
+
+/**
+ * 将所有 CPU 的 per-cpu 页缓存全部还给 buddy system
+ * @return 归还的页数
+ */
+int             buddy_drain_all();
+
+/**
+ * 统计空闲页数，包括 per-cpu 页缓存中的页
+ * @return 空闲页数
+ */
+uint64          buddy_nr_free_pages();
+
+/**
+ * 取得 buddy system 的统计信息
+ * 共享页数通过扫描 zone 中所有的 struct page 得到，不加锁，只是一个近似值
+ * @param st 保存统计信息
+ */
+void            buddy_get_stat(struct buddy_stat* st);
+
 #endif // __BUDDY_H__
 
@@ -0,0 +1,17 @@
+#ifndef __GFP_H__
+#define __GFP_H__
+
+#include <common.h>
+
+typedef uint32 gfp_t;
+
+#define __GFP_RECLAIM   0x1     // 分配失败时可以调用回收钩子
+#define __GFP_WAIT      0x2     // 分配失败时可以让出 CPU，等待其他进程释放内存
+#define __GFP_NOWARN    0x4     // 分配失败时不打印警告，用于有退路的分配
+#define __GFP_ZERO      0x8     // 返回清零的内存，kalloc_gfp 分配单页时优先从预清零页池中取
+
+#define GFP_ATOMIC      0                               // 不回收、不睡眠，失败立即返回 NULL
+#define GFP_NOWAIT      (__GFP_RECLAIM)                 // 可以回收，但不睡眠
+#define GFP_KERNEL      (__GFP_RECLAIM | __GFP_WAIT)    // kalloc 等的默认标志
+
+#endif // __GFP_H__
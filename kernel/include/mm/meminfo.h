@@ -0,0 +1,17 @@
+#ifndef __MEMINFO_H__
+#define __MEMINFO_H__
+
+#include <common.h>
+
+#define MEMINFO_BUF_SIZE    (4 * PGSIZE)    // /dev/meminfo 一次生成的最大长度
+
+/**
+ * 生成 /dev/meminfo 的内容，格式见 docs/mm.md
+ * 每行为一个以空格分隔的记录，第一个字段是记录名，之后是数值；放不下的行会被整行丢弃
+ * @param buf 保存内容的缓冲区
+ * @param size 缓冲区的大小
+ * @return 内容的长度，不含末尾的 '\0'
+ */
+size_t      meminfo_show(char* buf, size_t size);
+
+#endif // __MEMINFO_H__
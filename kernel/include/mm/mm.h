@@ -3,10 +3,45 @@
 
 #include <klib.h>
 #include <arch.h>
+#include <mm/gfp.h>
 
 extern pagetable_t kernel_pagetable;
 
+// 允许写入的页表项权限，loongarch 只允许写入带有 dirty 位的页
+#ifdef __loongarch64
+#define PTE_WRITE (PTE_W | PTE_D)
+#else
+#define PTE_WRITE PTE_W
+#endif
+
+// L2 页表项覆盖的范围
+#define L2PGSIZE            (1UL << 30)
+
+// 解除映射时，超过该页数就不再逐页刷新 TLB
+#define TLB_FLUSH_ONE_MAX   32
+
+// 2 MiB 大页，即 L1 页表中的叶子页表项
+#define MEGAPGSHIFT         21
+#define MEGAPGSIZE          (1UL << MEGAPGSHIFT)
+#define MEGAPG_ORDER        (MEGAPGSHIFT - PGSHIFT)
+#define MEGAPG_NPAGES       (1 << MEGAPG_ORDER)
+#define MEGAPGROUNDDOWN(a)  (((uint64)(a)) & ~(MEGAPGSIZE - 1))
+#define IS_MEGAPGALIGNED(a) ((((uint64)(a)) & (MEGAPGSIZE - 1)) == 0)
+
+// 页表项是否映射一个大页，PTE_MEGA 由各架构定义
+#define PTE_IS_MEGA(pte)    ((((pte_t)(pte)) & PTE_MEGA) == PTE_MEGA)
+
+// 叶子页表项映射的、包含 va 的 4 KiB 页的物理地址，pte 可以是大页
+#define PTE_PAGE_PA(pte, va) \
+    (PTE2PA(pte) + (PTE_IS_MEGA(pte) ? (((uint64)(va)) & (MEGAPGSIZE - 1) & ~(PGSIZE - 1)) : 0))
+
+// 换出的页：V 为 0，带 PTE_SWAP，物理页号的位置存放 zram 槽位号，其余权限位保持不变
+#define PTE_IS_SWAP(pte)    ((((pte_t)(pte)) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+#define SWAP_PTE(slot, pte) (PA2PTE((uint64)(slot) << PGSHIFT) | (PTE_FLAGS(pte) & ~PTE_V) | PTE_SWAP)
+#define SWAP_PTE_SLOT(pte)  ((int) (PTE2PA(pte) >> PGSHIFT))
+
 struct vm_area;
+struct proc;
 
 /**
  * 内核分配器 slab, buddy system 初始化
@@ -22,12 +57,21 @@ void        kinit();
 
 /**
  * 内核分配器
- * 分配在物理上连续的，大小大于等于 sz 的空间
+ * 分配在物理上连续的，大小大于等于 sz 的空间，等价于 kalloc_gfp(sz, GFP_KERNEL)
  * @param sz 需要分配的空间大小（字节）
- * @return 内核分配空间的起始虚拟地址
+ * @return 内核分配空间的起始虚拟地址，内存不足返回 NULL
  */
 void*       kalloc(uint64 sz);
 
+/**
+ * 带分配标志的内核分配器
+ * 持有自旋锁或处于中断上下文时应使用 GFP_ATOMIC 或 GFP_NOWAIT
+ * @param sz 需要分配的空间大小（字节）
+ * @param gfp 分配标志，见 mm/gfp.h
+ * @return 内核分配空间的起始虚拟地址，内存不足返回 NULL
+ */
+void*       kalloc_gfp(uint64 sz, gfp_t gfp);
+
 /**
  * kalloc 的封装实现
  * 分配在物理上连续的，大小大于等于 nr*sz，且初始化全为 0 的空间
@@ -63,6 +107,7 @@ pagetable_t kvmmake();
 
 /**
  * 遍历页表，找到指定虚拟地址对应的页表项的地址
+ * va 位于大页中时返回 L1 页表中的大页表项，可以用 PTE_IS_MEGA 判断
  * @param pgtbl 要遍历的页表
  * @param va 要查找的虚拟地址
  * @param alloc 是否分配的标识符。在页表中没有找到 va 的 pte 时，若 alloc=1，walk 会自动完成分配， 若为 0, 则此时返回 NULL
@@ -70,6 +115,25 @@ pagetable_t kvmmake();
  */
 pte_t*      walk(pagetable_t pgtbl, uint64 va, int alloc);
 
+/**
+ * 找到 L1 页表中覆盖 va 所在 2 MiB 区域的页表项
+ * 该页表项为 0、大页表项，或者指向一个 L0 页表
+ * @param pgtbl 要遍历的页表
+ * @param va 要查找的虚拟地址
+ * @param alloc 为 1 时自动分配 L1 页表
+ * @return 页表项地址，L1 页表不存在且 alloc = 0 或者分配失败时返回 NULL
+ */
+pte_t*      walk_megapage(pagetable_t pgtbl, uint64 va, int alloc);
+
+/**
+ * 将覆盖 va 的大页拆分为 512 个 4 KiB 页，权限与引用计数保持不变
+ * va 不在大页中时什么也不做
+ * @param pgtbl 页表
+ * @param va 虚拟地址
+ * @return 成功返回 0，分配页表失败返回 -ENOMEM，此时大页保持原样
+ */
+int         split_megapage(pagetable_t pgtbl, uint64 va);
+
 /**
  * 在页表中映射虚拟空间与物理空间
  * @param pgtbl 完成映射的页表
@@ -77,8 +141,11 @@ pte_t*      walk(pagetable_t pgtbl, uint64 va, int alloc);
  * @param pa 与之对应的物理地址，要求与 va 有着相同的页内偏移量
  * @param sz 需要映射的空间的大小
  * @param flags 映射空间的权限
+ * flags 中带有 PTE_MEGA 时，在 va 与 pa 都按 2 MiB 对齐、剩余大小足够并且该区域尚无映射的地方使用大页，
+ * 其余部分仍用 4 KiB 页映射；大页中的每个 4 KiB 页各自持有一个引用
+ * @return 成功返回 0，分配页表失败返回 -ENOMEM，此时已映射的部分不会撤销
  */
-void        mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags);
+int         mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags);
 
 /**
  * @param pgtbl 页表
@@ -90,7 +157,7 @@ uint64      walkaddr(pagetable_t pgtbl, uint64 va);
 /**
  * 部分初始化用户页表，映射 trapframe。riscv 需要额外映射 TRAMPOLINE
  * @param trapframe trapframe 的内核态虚拟地址，可以在函数内转化为物理地址
- * @return 初始化后的用户页表
+ * @return 初始化后的用户页表，内存不足返回 NULL
  */
 pagetable_t uvmmake(uint64 trapframe);
 
@@ -102,20 +169,25 @@ pagetable_t uvmmake(uint64 trapframe);
 pagetable_t uvminit(uint64 trapframe, const char* init_code, int sz);
 
 /**
- * 拷贝用户空间代码，数据，栈和堆，用于 clone()
+ * 以写时复制的方式为子进程复制父进程的用户空间，用于 fork() 与不带 CLONE_VM 的 clone()
+ * 父子进程共享所有已经存在的页，私有的可写页在双方都改为只读并带上 PTE_COW，第一次写入时再复制
+ * 零页与 MAP_SHARED 的页缓存页保持原样共享
  * @param cpgtbl 子进程页表
  * @param ppgtbl 父进程页表
- * @param sz 用户空间代码，数据，栈和堆的顶部
+ * @return 成功返回 0，内存不足返回 -ENOMEM
  */
-void        uvmcopy(pagetable_t cpgtbl, pagetable_t ppgtbl, uint64 sz);
-void        uvmcopy_alloc(pagetable_t cpgtbl, pagetable_t ppgtbl, struct vm_area *vma_list);
+int         uvmcopy(pagetable_t cpgtbl, pagetable_t ppgtbl);
 
 /**
  * 给定栈区域的起始位置的虚拟地址，自动分配物理地址，然后在页表完成映射
  * @param pgtbl 页表
  * @param stack_va 栈底虚拟地址
+ * @return 成功返回 0，内存不足返回 -ENOMEM
  */
-void map_stack(pagetable_t pgtbl, uint64 stack_va);
+int  map_stack(pagetable_t pgtbl, uint64 stack_va);
+
+// copyin、copyout、copyinstr 在 mm/uaccess.c 中实现
+// 同一个 2 MiB 区域内只遍历一次页表，字符串按 8 字节查找 '\0'
 
 /**
  * 将内核空间的内存拷贝到用户空间
@@ -133,7 +205,7 @@ int         copyout(pagetable_t pgtbl, uint64 dstva, void* src, size_t len);
  * @param dst 内核空间的目的地值
  * @param srcva 用户空间的源地址
  * @param len 要拷贝的字节数
- * @return 实际拷贝的字节数。如果 dst == NULL，返回 -1
+ * @return 全部拷贝成功返回 0；中途遇到无法访问的地址时返回已经拷贝的字节数，一个字节也没有拷贝则返回 -1
  */
 int         copyin(pagetable_t pagetable, char* dst, uint64 srcva, size_t len);
 
@@ -163,12 +235,27 @@ uint64      phys_to_virt(uint64 pa);
 
 /**
  * mappages 的反向操作，解除从 va 开始 npages 页的映射，可以通过 do_free 决定是否释放物理页
+ * 只遍历范围内的页表，没有映射的页会被跳过，只有一部分在范围内的大页会先被拆分
+ * 变为空的 L0、L1 页表会被释放，TLB 在最后统一刷新
  * @param pagetable 页表
  * @param va 虚拟地址，要求页对齐
  * @param npages 从 va 开始解除映射的页的数量
  * @param do_free 如果为 1,则释放对应的物理页；为 0 则不释放
+ * @return 成功返回 0，拆分大页时内存不足返回 -ENOMEM，此时没有任何页被解除映射
+ */
+int         uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free);
+
+/**
+ * 把 [old, old + len) 的页表项移动到 new 开始的位置，物理页、交换页表项和 rmap 随之移动，不拷贝数据，用于 mremap
+ * old 与 new 模 2 MiB 同余时，完整落在范围内的大页整体移动，否则先拆分
+ * 所有的页表在移动之前分配好，失败时没有任何页表项被移动
+ * @param pagetable 页表
+ * @param old 原来的起始地址，要求页对齐
+ * @param new 新的起始地址，要求页对齐，[new, new + len) 中不能有映射，且不能与原来的范围重叠
+ * @param len 移动的长度，要求页对齐
+ * @return 成功返回 0，内存不足返回 -ENOMEM
  */
-void        uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free);
+int         uvmmove(pagetable_t pagetable, uint64 old, uint64 new, uint64 len);
 
 /**
  * 将页表从虚拟空间 0-sz 范围内的页解除映射，并且释放 TRAMPOLINE 与 trapframe 映射（如果有）
@@ -185,16 +272,31 @@ void free_pgtbl(pagetable_t pgtbl, struct vm_area *vma);
 void        freewalk(pagetable_t pgtbl, int level);
 
 /**
- * 将页表从虚拟空间 0-sz 范围内的页解除映射
+ * 解除页表中所有用户页的映射并释放物理页，然后释放页表自身
  * @param pgtbl 页表
- * @param sz 决定释放的空间范围
+ * @param sz 历史参数，不再决定释放的范围
  */
 void        uvmfree(pagetable_t pgtbl, uint64 sz);
 
 void        uvmfree_vma(pagetable_t pgtbl, struct vm_area* vma_list);
 
+// 用户地址空间的内存占用，单位为页
+struct mm_rss {
+    uint64 resident;        // 映射了物理页的页数，大页按 512 页计，不含零页
+    uint64 shared;          // 其中同时被其他映射引用的页
+    uint64 swapped;         // 被换出的页数
+};
+
+/**
+ * 遍历用户页表，统计用户地址空间的内存占用，不含 trapframe 与 trampoline
+ * 页表已经封装为 upagetable 时，调用者需持有它的 lock
+ * @param pgtbl 用户页表
+ * @param rss 保存统计结果
+ */
+void        uvm_get_rss(pagetable_t pgtbl, struct mm_rss* rss);
+
 /**
- * munmap 系统调用的实际实现
+ * munmap 系统调用的实际实现，调用者需持有当前进程 pagetable 的 lock
  * @param addr munmap 地址起始点
  * @param length munmap 范围大小
  * @return 成功返回 0，失败返回 -1
@@ -202,14 +304,41 @@ void        uvmfree_vma(pagetable_t pgtbl, struct vm_area* vma_list);
 int         do_munmap(void* addr, size_t length);
 
 /**
- * store page fault 的异常处理函数，辅助实现 COW 机制
+ * 缺页处理的通用部分，按需为堆与 mmap 区域分配页，并处理 COW
+ * 读缺页映射只读的零页，写缺页分配清零的新页；处理期间持有 p->pagetable 的 lock，调用者不能持有它
+ * @param p 发生缺页的进程
+ * @param va 缺页的虚拟地址
+ * @param write 是否为写操作引起的缺页
+ * @return 成功返回 0，地址非法返回 -EFAULT，内存不足返回 -ENOMEM
+ */
+int         handle_mm_fault(struct proc* p, uint64 va, int write);
+
+/**
+ * 刷新当前进程地址空间中 va 所在页的 TLB
+ * @param va 用户虚拟地址
+ */
+void        flush_user_tlb(uint64 va);
+
+/**
+ * 刷新当前进程地址空间中 [start, end) 范围的 TLB
+ * 不超过 TLB_FLUSH_ONE_MAX 页时逐页刷新，否则一次刷新整个地址空间
+ * @param start 起始地址
+ * @param end 结束地址（不含）
+ */
+void        flush_user_tlb_range(uint64 start, uint64 end);
+
+/**
+ * 缺页异常处理函数，由各个架构解析异常原因后调用 handle_mm_fault
+ * 用户态缺页失败会杀死进程，内核态缺页失败会 panic
  */
-void        store_page_fault_handler();
+void        page_fault_handler();
 
 /**
- * 缺页的异常处理函数，实现辅助实现 COW
+ * 将 mmap 的 PROT_* 权限转换为对应架构的页表项权限，不包含 PTE_V
+ * @param prot PROT_READ, PROT_WRITE, PROT_EXEC 的组合
+ * @return 页表项权限位
  */
-void        page_unmap_handler();
+uint64      prot_to_pte(int prot);
 
 static inline uint64 phys_page_number(uint64 pa) {
     return pa >> PGSHIFT;
@@ -3,34 +3,70 @@
 
 #include <common.h>
 #include <arch.h>
+#include <tools/list.h>
+#include <locking/sleeplock.h>
+#include <mm/memlayout.h>
 
-#pragma pack(push, 1)
+// page flags
+#define PG_BUDDY        0x1     // 该页是 free_area 中某个空闲块的首页
+#define PG_CACHE        0x2     // 该页属于文件页缓存，fork 时共享而不是复制
+#define PG_ANON         0x4     // 私有匿名页，挂在匿名页 LRU 上，rmap 记录了它的映射
+#define PG_SHMEM        0x8     // 该页属于共享内存对象，fork 时共享而不是复制，见 mm/shmem.h
+
+struct rmap_item;
+struct upagetable;
 
 struct page {
-    uint order : 4;
-    uint flag : 4;
+    struct list_head list;  // 空闲时挂在 free_area 或 per-cpu 链表上，匿名页挂在 LRU 上
+    uint8 order;            // 块的 order，只在块的首页有效
+    uint8 flag;
     uint8 cnt;
+    union {
+        struct rmap_item* rmap;     // 匿名页：映射它的页表项，见 mm/swap.h
+        struct {
+            uint16 first;           // zram 池页：开头的压缩对象占用的块数
+            uint16 last;            // zram 池页：末尾的压缩对象占用的块数
+        } zbud;
+        struct upagetable* upgtbl;  // 用户根页表页：封装它的 upagetable，由 upgtbl_init 设置
+    };
 };
 
-#pragma pack(pop)
-
 // 分配在 end 之后，管理所有物理页的 page 数组
 // 通过次知道分配器分配的大小，以及该页由多少映射
 extern struct page* pages;
 
 #define GET_PAGE(addr) (pages + (((uint64)addr - (uint64)pages) >> PGSHIFT))
+#define PAGE_ADDR(page) ((uint64)pages + ((uint64)((page) - pages) << PGSHIFT))
 #define PAGES_BASE ((struct page *) end)
 
-// 原子增加 pa 对应页的映射
+// 全局共享的零页，匿名映射的读缺页都映射到这里
+// 零页永远不会被释放，因此不参与引用计数
+extern char* zero_page;
+
+#define IS_ZERO_PAGE(addr) (KERNEL_PA2VA(PGROUNDDOWN(addr)) == (uint64) zero_page)
+
+// 分配并清零 zero_page，在 slab_init 之后调用
+void zero_page_init();
+
+// 原子增加 pa 对应页的映射，零页及范围外的地址返回 -1
 int page_ref_inc(uint64 pa);
-// 原子减少 pa 对应页的映射
+// 原子减少 pa 对应页的映射，零页及范围外的地址返回 -1
 int page_ref_dec(uint64 pa);
+// pa 对应页当前的引用数，零页及范围外的地址返回 -1
+int page_ref_count(uint64 pa);
 
 // pagetable 的封装
 // cnt 表示引用计数器，表示有多少进程共享此页表
-typedef struct {
+// asid 由 asid_switch 分配，共享页表的进程使用同一个 ASID，见 mm/asid.h
+// cpus 记录切换到过此页表的 cpu，它们的 TLB 中可能有此地址空间的项，刷新时需要通知
+// lock 保护页表项和 vma：缺页处理、改变映射的系统调用、execve 换页表、统计 RSS 以及释放页表时持有，
+// 持有期间可以睡眠；换出只 trylock 映射被换出页的地址空间，从去掉写权限一直持有到改写交换页表项
+typedef struct upagetable {
     pagetable_t pgtbl;
     volatile int cnt;
+    volatile uint64 asid;
+    volatile uint64 cpus;
+    sleeplock_t lock;
 } upagetable;
 
 
@@ -47,5 +83,14 @@ upagetable* upgtbl_clone(upagetable* upgtbl);
 int upgtbl_incr(upagetable* upgtbl);
 // 原子减少引用计数
 int upgtbl_decr(upagetable* upgtbl);
+// 释放一个引用，最后一个引用持有 lock 释放所有用户页和页表本身
+void upgtbl_put(upagetable* upgtbl);
+
+// 封装根页表 pgtbl 的 upagetable，还没有经过 upgtbl_init 的页表返回 NULL
+static inline upagetable*
+pgtbl_upgtbl(pagetable_t pgtbl)
+{
+    return GET_PAGE(KERNEL_PA2VA(pgtbl))->upgtbl;
+}
 
 #endif
\ No newline at end of file
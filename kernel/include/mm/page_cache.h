@@ -0,0 +1,111 @@
+#ifndef __PAGE_CACHE_H__
+#define __PAGE_CACHE_H__
+
+#include <common.h>
+#include <arch.h>
+#include <tools/list.h>
+
+#define PAGE_CACHE_HASH_SIZE    256
+#define WRITEBACK_BATCH         16      // 一次写回最多合并的连续页数
+
+struct file;
+struct mountpoint;
+
+// 文件页缓存，以 (挂载点, inode 号, 页号) 为键
+// 缓存本身持有页的一个引用，每个映射到该页的 pte 再各持有一个引用
+struct page_cache {
+    struct mountpoint* mp;
+    uint32 ino;
+    uint64 index;               // 页在文件中的序号，即 offset >> PGSHIFT
+    void* page;                 // 页的内核虚拟地址
+    uint8 dirty;                // 页内容比文件新，需要写回
+    struct list_head hash;      // 挂在哈希桶上
+    struct list_head lru;       // 挂在全局链表上，越靠后越久未使用
+};
+
+/**
+ * 初始化页缓存，并注册回收钩子
+ * 必须在 slab_init 之后调用
+ */
+void        page_cache_init();
+
+/**
+ * 文件是否可以通过页缓存映射，目前只支持 ext4 上的普通文件
+ * @param file 文件
+ * @return 可以返回 1，否则返回 0
+ */
+int         page_cache_mappable(struct file* file);
+
+/**
+ * 取得文件第 index 页的缓存页，没有缓存时从文件读入，超出文件末尾的部分填 0
+ * @param file 文件
+ * @param index 页在文件中的序号
+ * @return 页的内核虚拟地址，已经为调用者增加了一个引用，用完后调用 page_cache_put；内存不足或读取失败返回 NULL
+ */
+void*       page_cache_get(struct file* file, uint64 index);
+
+/**
+ * 释放 page_cache_get 为调用者增加的引用
+ * @param page page_cache_get 返回的页
+ */
+void        page_cache_put(void* page);
+
+/**
+ * 将文件第 index 页的缓存标记为脏页，页不在缓存中时什么也不做
+ * @param file 文件
+ * @param index 页在文件中的序号
+ */
+void        page_cache_set_dirty(struct file* file, uint64 index);
+
+/**
+ * 将文件 [start, end) 范围内的脏页写回文件，连续的脏页合并为一次写操作
+ * 只有除缓存外没有其他引用，或者唯一的其他引用来自 pgtbl 中 va 处的映射时，脏页才会变为干净的；
+ * 此时 pgtbl 中对应的可写映射会被改为只读，之后的写入会重新标记脏页
+ * @param file 文件
+ * @param start 起始页号
+ * @param end 结束页号（不含）
+ * @param pgtbl 调用者的用户页表，可以为 NULL
+ * @param va 第 start 页在 pgtbl 中映射的虚拟地址
+ * @return 成功返回写回的页数，写文件失败返回 -EIO
+ */
+int         page_cache_writeback(struct file* file, uint64 start, uint64 end, pagetable_t pgtbl, uint64 va);
+
+/**
+ * 文件 [off, off + len) 被写入 buf 的内容之后调用，把数据拷贝到已经缓存的页中，映射这些页的进程随即看到新数据
+ * 正在从文件读入的页会在插入缓存前重新读取；不能通过页缓存映射的文件什么也不做
+ * @param file 文件
+ * @param off 写入的起始偏移
+ * @param buf 写入的数据
+ * @param len 写入的字节数
+ */
+void        page_cache_write(struct file* file, off_t off, const void* buf, size_t len);
+
+/**
+ * 文件被截断为 length 之后调用，丢弃 length 之后的缓存页，最后一个不完整的页超出的部分清零
+ * 被丢弃的页不再写回，已经映射它们的进程在解除映射前仍然持有
+ * @param file 文件
+ * @param length 新的文件大小
+ */
+void        page_cache_truncate(struct file* file, off_t length);
+
+/**
+ * 丢弃 inode 的所有缓存页，inode 被删除、inode 号可能被重新使用时调用
+ * @param mp 挂载点
+ * @param ino inode 号
+ */
+void        page_cache_invalidate(struct mountpoint* mp, uint32 ino);
+
+/**
+ * 页缓存中的页数
+ * @param nr_dirty 不为 NULL 时保存其中脏页的数量
+ * @return 缓存的页数
+ */
+uint64      page_cache_nr_pages(uint64* nr_dirty);
+
+/**
+ * 释放所有干净且没有被映射的缓存页，用于内存回收
+ * @return 释放的页数
+ */
+uint64      page_cache_shrink();
+
+#endif // __PAGE_CACHE_H__
@@ -0,0 +1,37 @@
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include <common.h>
+#include <tools/list.h>
+
+#define RECLAIM_RETRIES 3   // 分配失败后最多回收重试的次数
+
+// 回收钩子，内存不足时由 reclaim_pages 依次调用
+struct shrinker {
+    const char* name;
+    uint64 (*shrink)(uint64 nr);    // 尝试释放 nr 个对象，返回实际释放的数量
+    struct list_head list;
+};
+
+/**
+ * 注册一个回收钩子
+ * @param s 要注册的回收钩子，生命周期需长于注册期间
+ */
+void        register_shrinker(struct shrinker* s);
+
+/**
+ * 注销一个回收钩子
+ * @param s 已注册的回收钩子
+ */
+void        unregister_shrinker(struct shrinker* s);
+
+/**
+ * 回收内存：先将 per-cpu 页缓存还给 buddy system，再依次调用各个回收钩子
+ * 回收过程中再次进入 reclaim_pages 会直接返回 0，在设备中断处理函数中调用也直接返回 0，
+ * 中断上下文的分配应使用 GFP_ATOMIC
+ * @param nr 希望回收的页数
+ * @return 实际回收的页数
+ */
+uint64      reclaim_pages(uint64 nr);
+
+#endif // __RECLAIM_H__
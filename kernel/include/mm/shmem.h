@@ -0,0 +1,59 @@
+#ifndef __SHMEM_H__
+#define __SHMEM_H__
+
+#include <common.h>
+#include <locking/spinlock.h>
+
+#define SHMEM_NAME_LEN      64
+
+struct file;
+
+// 共享内存对象，memfd_create 得到的文件和 MAP_SHARED | MAP_ANONYMOUS 的映射都由它提供页
+// 页只存在于内存中，不进入页缓存，也不会被换出
+// 对象本身持有每个页的一个引用，每个映射到该页的 pte 再各持有一个引用
+struct shmem {
+    spinlock_t lock;
+    int ref;                        // 指向它的 struct file 的数量
+    off_t size;                     // 文件大小，读写和映射的缺页不能超过它
+    uint64 nr_slots;                // pages 数组的长度
+    void** pages;                   // 第 i 页的内核虚拟地址，尚未写过的页为 NULL
+};
+
+/**
+ * 创建一个共享内存文件，以可读写方式打开
+ * @param path 文件的路径，只用于显示，memfd_create 为 /memfd:name
+ * @param size 初始大小
+ * @return 新的文件，引用计数为 0，与 file_init 相同；内存不足返回 NULL
+ */
+struct file*    shmem_file_create(const char* path, off_t size);
+
+/**
+ * 文件是否为共享内存文件
+ * @param file 文件
+ * @return 是返回 1，否则返回 0
+ */
+int             shmem_file(struct file* file);
+
+/**
+ * 取得共享内存文件第 index 页，没有时分配一个清零的页
+ * @param file 共享内存文件
+ * @param index 页号
+ * @return 页的内核虚拟地址，已经为调用者增加了一个引用，用完后调用 shmem_put_page；
+ *         超出文件大小或内存不足返回 NULL
+ */
+void*           shmem_get_page(struct file* file, uint64 index);
+
+/**
+ * 释放 shmem_get_page 为调用者增加的引用
+ * @param page shmem_get_page 返回的页
+ */
+void            shmem_put_page(void* page);
+
+/**
+ * 所有共享内存对象占用的页数
+ */
+uint64          shmem_nr_pages();
+
+extern const struct file_operations shmem_fileops;
+
+#endif // __SHMEM_H__
@@ -0,0 +1,142 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <common.h>
+#include <mm/gfp.h>
+#include <locking/spinlock.h>
+#include <tools/list.h>
+
+#define SLAB_NAME_MAX_LEN   24
+#define SLAB_MIN_ALIGN      8
+#define SLAB_MAX_ALIGN      64
+#define SLAB_MAX_FREE       2       // 每个 cache 最多保留的空闲 slab 数量
+
+#define KMALLOC_MIN_SHIFT   4
+#define KMALLOC_MAX_SHIFT   10
+#define KMALLOC_MIN_SIZE    (1 << KMALLOC_MIN_SHIFT)   // 16 bytes
+#define KMALLOC_MAX_SIZE    (1 << KMALLOC_MAX_SHIFT)   // 1024 bytes
+#define NR_KMALLOC_CACHES   (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// slab 占据一个页，头部存放元数据，其后为 object
+// 因此 slab 分配出去的地址一定不是页对齐的，kfree 以此区分 slab 与 buddy
+struct slab {
+    struct kmem_cache* cache;       // slab 所属的 cache
+    struct list_head list;          // 挂在 cache 的 partial/full/free 链表上
+    void* freelist;                 // 空闲 object 的单向链表
+    uint16 inuse;                   // 已分配的 object 数量
+    uint16 total;                   // object 总数
+};
+
+struct kmem_cache {
+    char name[SLAB_NAME_MAX_LEN];
+    uint32 obj_size;                // 对齐后的 object 大小
+    uint32 align;                   // object 的对齐要求
+    uint32 offset;                  // 第一个 object 在 slab 中的偏移
+    uint32 objs_per_slab;
+
+    struct list_head partial;       // 部分分配的 slab
+    struct list_head full;          // 全部分配的 slab
+    struct list_head free;          // 完全空闲的 slab
+
+    uint64 nr_slabs;                // slab 总数
+    uint64 nr_free_slabs;           // 空闲 slab 数
+    uint64 nr_active;               // 已分配出去的 object 数
+
+    spinlock_t lock;
+    struct list_head cache_entry;   // 挂在全局 cache 链表上
+};
+
+// 一个 cache 的统计信息，由 kmem_cache_get_stat 取得
+struct slab_stat {
+    char name[SLAB_NAME_MAX_LEN];
+    uint32 obj_size;
+    uint64 nr_active;               // 已分配出去的 object 数
+    uint64 nr_objs;                 // object 总数
+    uint64 nr_slabs;                // slab 数，即占用的页数
+};
+
+#define SLAB(addr) ((struct slab*) PGROUNDDOWN(addr))
+#define IS_SLAB_OBJ(addr) (!IS_PGALIGNED(addr))
+
+// 全局 cache 链表，用于统计与回收
+extern struct list_head slab_caches;
+
+/**
+ * 初始化 slab 分配器，建立 kmem_cache 自身的 cache 以及 kmalloc 的各个 size class
+ * 必须在 buddy_init 之后调用
+ */
+void                slab_init();
+
+/**
+ * 创建一个 object 大小固定的 cache
+ * @param name cache 的名字，用于调试与统计
+ * @param size object 的大小（字节）
+ * @param align object 的对齐要求，0 表示使用默认对齐
+ * @return 创建的 cache，若 size 过大或内存不足返回 NULL
+ */
+struct kmem_cache*  kmem_cache_create(const char* name, uint32 size, uint32 align);
+
+/**
+ * 销毁一个 cache，要求其所有 object 都已经释放
+ * @param cache 要销毁的 cache
+ */
+void                kmem_cache_destroy(struct kmem_cache* cache);
+
+/**
+ * 从 cache 中分配一个 object
+ * @param cache 目标 cache
+ * @return object 的地址，内存不足返回 NULL
+ */
+void*               kmem_cache_alloc(struct kmem_cache* cache);
+
+/**
+ * 带分配标志地从 cache 中分配一个 object，slab 不足时以 gfp 向 buddy system 申请新页
+ * @param cache 目标 cache
+ * @param gfp 分配标志，见 mm/gfp.h
+ * @return object 的地址，内存不足返回 NULL
+ */
+void*               kmem_cache_alloc_gfp(struct kmem_cache* cache, gfp_t gfp);
+
+/**
+ * 将 object 归还给 cache
+ * @param cache object 所属的 cache
+ * @param obj 由 kmem_cache_alloc 分配的 object
+ */
+void                kmem_cache_free(struct kmem_cache* cache, void* obj);
+
+/**
+ * 将 cache 中所有完全空闲的 slab 归还给 buddy system
+ * @param cache 目标 cache
+ * @return 释放的页数
+ */
+uint64              kmem_cache_shrink(struct kmem_cache* cache);
+
+/**
+ * 从 kmalloc 的 size class 中分配小块内存
+ * @param size 要分配的大小，不大于 KMALLOC_MAX_SIZE
+ * @param gfp 分配标志，见 mm/gfp.h
+ * @return 分配的内存地址，内存不足返回 NULL
+ */
+void*               kmalloc(uint64 size, gfp_t gfp);
+
+/**
+ * 取得各个 cache 的统计信息，按创建的顺序
+ * @param st 保存统计信息的数组
+ * @param max 数组的长度
+ * @return cache 的总数，可能大于 max，此时只填写了前 max 个
+ */
+int                 kmem_cache_get_stat(struct slab_stat* st, int max);
+
+/**
+ * 对所有 cache 调用 kmem_cache_shrink，用于内存回收
+ * @return 释放的页数
+ */
+uint64              kmem_cache_shrink_all();
+
+/**
+ * 释放 slab 分配的任意 object，所属 cache 由 slab 头部得到
+ * @param obj object 的地址
+ */
+void                slab_free(void* obj);
+
+#endif // __SLAB_H__
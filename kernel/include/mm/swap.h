@@ -0,0 +1,88 @@
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include <common.h>
+#include <arch.h>
+
+// 私有匿名页的换出与换入，换出的页压缩后存放在 zram 中（见 mm/zram.h）
+// 匿名页按映射的先后挂在 LRU 上，回收时按时钟算法扫描：
+// 自上次扫描以来被访问过（页表项的 A 位）的页移到队尾，获得第二次机会
+// 每个匿名页通过 rmap 记录映射它的页表项，换出时把这些页表项都改为交换页表项
+// 换出分三步：先 trylock 所有映射所在的地址空间并去掉写权限、刷新所有 cpu 的 TLB，再压缩，最后改为交换页表项，
+// 压缩失败时恢复写权限；地址空间的锁一直持有到最后一步，写入者在缺页处理中等待这把锁
+
+// 一个映射匿名页的页表项
+struct rmap_item {
+    pagetable_t pgtbl;          // 根页表的内核虚拟地址
+    uint64 va;
+    int wp;                     // 换出期间被去掉了写权限，恢复或写入交换页表项时加回
+    struct rmap_item* next;
+};
+
+struct swap_stat {
+    uint64 nr_anon;             // LRU 上的匿名页数
+    uint64 nr_swapout;          // 累计换出的页数
+    uint64 nr_swapin;           // 累计换入的页数
+    uint64 swapin_ns;           // 换入的累计耗时，从缺页到重新映射
+    uint64 swapin_ns_max;       // 单次换入的最长耗时
+};
+
+/**
+ * 初始化 rmap 缓存和 zram，并注册回收钩子，在 slab_init 之后调用
+ */
+void        swap_init();
+
+/**
+ * 页表 pgtbl 中的 va 新映射了私有匿名页 kva，调用前页表项已写好，引用数已增加
+ * 第一次映射时把页加入 LRU
+ * rmap 分配失败时不记录，此时页的引用数多于 rmap，不会被换出
+ * @param kva 页的内核虚拟地址
+ * @param pgtbl 根页表
+ * @param va 用户虚拟地址
+ */
+void        page_add_anon_rmap(uint64 kva, pagetable_t pgtbl, uint64 va);
+
+/**
+ * 在清除页表项、减少引用数之前调用，不是匿名页时什么也不做
+ * 最后一个映射移除后页离开 LRU
+ * @param kva 页的内核虚拟地址
+ * @param pgtbl 根页表
+ * @param va 用户虚拟地址
+ */
+void        page_remove_rmap(uint64 kva, pagetable_t pgtbl, uint64 va);
+
+/**
+ * 页表 pgtbl 中 kva 的映射从 old_va 移到了 new_va，用于 mremap，不分配内存
+ * 不是匿名页或者没有记录这个映射时什么也不做
+ * @param kva 页的内核虚拟地址
+ * @param pgtbl 根页表
+ * @param old_va 原来的用户虚拟地址
+ * @param new_va 新的用户虚拟地址
+ */
+void        page_move_anon_rmap(uint64 kva, pagetable_t pgtbl, uint64 old_va, uint64 new_va);
+
+/**
+ * 从 LRU 中换出最多 nr 个匿名页
+ * 只换出引用数等于 rmap 数、且所有映射所在的地址空间都能立即加锁的页，
+ * 要在分配内存期间保持某页不被换出，先增加它的引用数或者持有它所在地址空间的锁
+ * @param nr 希望换出的页数
+ * @return 实际释放的页数
+ */
+uint64      swap_out(uint64 nr);
+
+/**
+ * 换入交换页表项指向的页，处理缺页时调用
+ * @param pgtbl 根页表
+ * @param pte va 对应的交换页表项
+ * @param va 缺页地址
+ * @return 成功返回 0，内存不足返回 -ENOMEM，压缩数据损坏返回 -EIO
+ */
+int         do_swap_page(pagetable_t pgtbl, pte_t* pte, uint64 va);
+
+/**
+ * 读取换入换出的统计信息
+ * @param st 输出
+ */
+void        swap_get_stat(struct swap_stat* st);
+
+#endif // __SWAP_H__
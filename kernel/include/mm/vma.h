@@ -3,24 +3,42 @@
 
 #include <common.h>
 #include <fs/file.h>
+#include <fs/ext4/lwext4/misc/tree.h>
 
 struct proc;
 
+// madvise 设置的提示，存放在 vm_flags 中
+#define VMA_SEQ_READ        0x1     // 顺序访问，缺页时预先映射后面的文件页
+#define VMA_RAND_READ       0x2     // 随机访问，不做预读
+#define VMA_NOHUGEPAGE      0x4     // 不使用大页
+
+#define FILE_FAULT_AROUND   16      // VMA_SEQ_READ 的文件映射每次缺页最多预先映射的后续页数
+
+// vma 同时挂在按地址排序的双向链表和红黑树上
+// 链表用于顺序遍历和取得相邻的 vma，红黑树用于查找
 struct vm_area {
     uint64 start;
     uint64 end;
     int prot;
     int flags;
+    int vm_flags;                   // madvise 设置的提示，VMA_*
     struct file *file;
     off_t offset;
-    struct vm_area *next;
-    struct vm_area *prev;
+    struct vm_area *next;           // 地址更高的下一个 vma
+    struct vm_area *prev;           // 地址更低的上一个 vma
     int refcnt;
+
+    RB_ENTRY(vm_area) rb;           // 以 start 为键
+    uint64 gap;                     // 与上一个 vma 之间的空洞大小，即 start - prev->end
+    uint64 max_gap;                 // 子树中最大的 gap，用于快速查找空闲区间
 };
 
+RB_HEAD(vma_tree, vm_area);
+
 /**
  * 找到进程空间中可以用来分配 vma 的，满足 length 大小的空间
- * 如果没有则扩大 mmap 空间的范围
+ * 从 mmap_brk 向下查找，如果没有则扩大 mmap 空间的范围
+ * 利用子树的 max_gap 剪枝，复杂度为 O(log n)
  * @param p 进程结构体
  * @param length 需要 mmap 的大小
  * @return 返回可映射空间的起始地址
@@ -29,10 +47,68 @@ uint64 find_free_vma_range(struct proc *p, size_t length);
 
 /**
  * 寻找虚拟地址处于哪个 vma 范围内
+ * 先检查上一次命中的 vma（p->vma_cache），再在红黑树中查找
  * @param p 进程结构体
  * @param va 查找的虚拟地址
  * @return va 所在的 vma，若没有返回 NULLL
  */
 struct vm_area* find_vma(struct proc* p, uint64 va);
 
-#endif
\ No newline at end of file
+/**
+ * 寻找第一个结束地址大于 va 的 vma，即 va 所在的或者 va 之后的第一个 vma
+ * @param p 进程结构体
+ * @param va 查找的虚拟地址
+ * @return 找到的 vma，若没有返回 NULL
+ */
+struct vm_area* find_vma_after(struct proc* p, uint64 va);
+
+/**
+ * 将 vma 插入进程的地址空间
+ * @param p 进程结构体
+ * @param vma 待插入的 vma，不能与已有的 vma 重叠
+ * @return 成功返回 0，与已有的 vma 重叠返回 -EINVAL
+ */
+int vma_insert(struct proc* p, struct vm_area* vma);
+
+/**
+ * 将 vma 从进程的地址空间中摘下，不释放 vma 本身
+ * @param p 进程结构体
+ * @param vma 待移除的 vma
+ */
+void vma_remove(struct proc* p, struct vm_area* vma);
+
+/**
+ * 在原地修改 vma 的范围，新的范围不能与相邻的 vma 重叠
+ * @param p 进程结构体
+ * @param vma 待修改的 vma
+ * @param start 新的起始地址
+ * @param end 新的结束地址
+ */
+void vma_adjust(struct proc* p, struct vm_area* vma, uint64 start, uint64 end);
+
+/**
+ * 在 addr 处把 vma 拆成两个，低的部分仍是原来的 vma，高的部分是新分配的 vma
+ * 新的 vma 复制原来的属性，文件映射的 offset 随之调整
+ * @param p 进程结构体
+ * @param vma 待拆分的 vma
+ * @param addr 拆分的地址，要求页对齐且在 (vma->start, vma->end) 之内
+ * @return 高的部分的 vma，内存不足返回 NULL
+ */
+struct vm_area* vma_split(struct proc* p, struct vm_area* vma, uint64 addr);
+
+/**
+ * 复制父进程的 vma 链表到子进程，用于 fork()
+ * 失败时已经复制的部分留在 child 中，由调用者通过 free_vma_list 释放
+ * @param child 子进程
+ * @param parent 父进程
+ * @return 成功返回 0，内存不足返回 -ENOMEM
+ */
+int copy_vma_list(struct proc* child, struct proc* parent);
+
+/**
+ * 释放进程的整个 vma 链表，并释放 vma 对文件的引用
+ * @param p 进程结构体
+ */
+void free_vma_list(struct proc* p);
+
+#endif
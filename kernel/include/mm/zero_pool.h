@@ -0,0 +1,53 @@
+#ifndef __ZERO_POOL_H__
+#define __ZERO_POOL_H__
+
+#include <common.h>
+
+#define ZERO_POOL_HIGH      256     // 后台线程把池填到这么多页为止
+
+// 预清零页池的统计信息，由 zero_pool_get_stat 取得
+struct zero_pool_stat {
+    uint64 nr_pages;        // 池中的页数
+    uint64 nr_hit;          // 直接从池中取得清零页的次数
+    uint64 nr_miss;         // 池为空，需要同步清零的次数
+    uint64 nr_zeroed;       // 后台线程累计清零的页数
+};
+
+/**
+ * 初始化预清零页池并注册回收钩子，池中的页在内存不足时最先被还给 buddy system
+ * 在 kmem_init 中调用
+ */
+void        zero_pool_init();
+
+/**
+ * 创建后台清零线程 kzerod，在 proc_init 之后调用
+ * kzerod 平时处于睡眠状态，调度器在一轮中找不到可运行的进程时通过 zero_pool_idle 唤醒它；
+ * 它每清零一页就检查是否有其他进程可以运行，有则重新睡眠，因此只占用空闲的 CPU 时间
+ */
+void        zero_pool_thread_init();
+
+/**
+ * 由调度器在空闲时调用，池未满时唤醒 kzerod
+ */
+void        zero_pool_idle();
+
+/**
+ * 从池中取出一个已经清零的页，供 kalloc_gfp 处理 __GFP_ZERO 时使用
+ * @return 清零的页，池为空时返回 NULL
+ */
+void*       zero_pool_get();
+
+/**
+ * 从 buddy system 取得空闲页，清零后放入池中，不回收内存
+ * @param nr 最多放入的页数，池满时提前停止
+ * @return 实际放入的页数
+ */
+int         zero_pool_refill(int nr);
+
+/**
+ * 取得预清零页池的统计信息
+ * @param st 保存统计信息
+ */
+void        zero_pool_get_stat(struct zero_pool_stat* st);
+
+#endif // __ZERO_POOL_H__
@@ -0,0 +1,62 @@
+#ifndef __ZRAM_H__
+#define __ZRAM_H__
+
+#include <common.h>
+
+// 内存中的压缩交换区，换出的匿名页经 LZ4 压缩后存放在这里
+// 每个换出的页占用一个槽位，交换页表项中记录槽位号，fork 后可能有多个页表项指向同一个槽位
+// 压缩数据存放在池页中，每个池页按 64 字节分块，最多存放首尾两个对象（zbud）
+// 由同一个 8 字节值填满的页（如全零页）只记录这个值，不占用池空间
+
+#define ZRAM_NR_SLOTS       8192                // 槽位数，即最多可换出的页数
+#define ZRAM_MAX_CLEN       (PGSIZE * 3 / 4)    // 压缩后超过该长度的页不换出
+
+struct zram_stat {
+    uint64 nr_slots;        // 正在使用的槽位数，即当前换出的页数
+    uint64 nr_same_filled;  // 其中同值页的数量
+    uint64 compr_bytes;     // 其余页压缩后的总字节数
+    uint64 pool_pages;      // 压缩池占用的物理页数
+    uint64 nr_rejected;     // 因压缩率太低而拒绝换出的次数
+};
+
+/**
+ * 分配槽位表，在 slab_init 之后调用
+ */
+void        zram_init();
+
+/**
+ * 压缩并保存一页
+ * 不会触发内存回收，可以在回收过程中调用
+ * @param page 要保存的页，按页对齐
+ * @param nr_ref 槽位的初始引用数，即将指向它的交换页表项数
+ * @return 槽位号；槽位或池空间不足返回 -ENOMEM，压缩率太低返回 -E2BIG
+ */
+int         zram_store(const void* page, int nr_ref);
+
+/**
+ * 把槽位中的页解压到 page
+ * @param slot 槽位号
+ * @param page 目标页，按页对齐
+ * @return 成功返回 0，数据损坏返回 -EIO
+ */
+int         zram_load(int slot, void* page);
+
+/**
+ * 增加槽位的引用数，用于 fork 复制交换页表项
+ * @param slot 槽位号
+ */
+void        zram_dup(int slot);
+
+/**
+ * 减少槽位的引用数，没有引用时释放槽位和压缩数据
+ * @param slot 槽位号
+ */
+void        zram_free(int slot);
+
+/**
+ * 读取 zram 的统计信息
+ * @param st 输出
+ */
+void        zram_get_stat(struct zram_stat* st);
+
+#endif // __ZRAM_H__
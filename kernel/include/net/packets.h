@@ -11,6 +11,7 @@
 
 #include <common.h>
 #include <tools/list.h>
+#include <mm/gfp.h>
 
 /*
  * Ethernet Frame Header. A CRC-32 usually goes after the data.
@@ -174,6 +175,14 @@ struct packet {
  */
 struct packet *packet_alloc(void);
 
+/**
+ * Allocate a new packet with the given allocation flags, interrupt handlers
+ * must pass GFP_ATOMIC since they can neither reclaim nor sleep
+ * @param gfp: Allocation flags
+ * @return Pointer to allocated packet, NULL on failure
+ */
+struct packet *packet_alloc_gfp(gfp_t gfp);
+
 /**
  * Free a packet
  * @param pkt: Packet to free
@@ -14,6 +14,7 @@
 #include <net/packets.h>
 #include <io/net.h>
 #include <proc/proc.h>
+#include <proc/wait.h>
 #include <net/socket_type.h>
 #include <fs/file.h>
 
@@ -46,6 +47,7 @@ struct socket {
     struct sockops *ops;
 
 	struct list_head recvq;
+	struct wait_queue_head recv_wait; // receivers waiting for recvq, woken one per packet
     struct netdev *netdev; // Network device associated with this socket
 };
 
@@ -0,0 +1,54 @@
+#ifndef __KSTACK_H__
+#define __KSTACK_H__
+
+#include <common.h>
+
+#define KSTACK_NR_SLOTS     1024    // 内核栈虚拟地址槽位数，也是同时存在的进程数上限
+#define KSTACK_CACHE_MAX    32      // 最多缓存的空闲内核栈数，超出的在释放时直接解除映射
+
+struct proc;
+
+// 内核栈池的统计信息，由 kstack_get_stat 取得
+struct kstack_stat {
+    uint64 nr_active;       // 正在被进程使用的内核栈数
+    uint64 nr_cached;       // 缓存中仍保持映射的空闲内核栈数
+    uint64 nr_hit;          // 直接从缓存取得内核栈的次数
+    uint64 nr_miss;         // 需要重新分配并映射内核栈的次数
+};
+
+/**
+ * 初始化内核栈池并注册回收钩子，在 proc_init 中调用
+ * 槽位从 1 开始编号，0 表示没有内核栈；第 n 个槽位的栈映射在 KSTACK(n)
+ * 栈之间隔一个不映射的保护页，栈溢出会触发缺页而不是覆盖相邻的栈
+ */
+void        kstack_init();
+
+/**
+ * 为进程分配内核栈与 trapframe，优先复用缓存中最近释放的栈
+ * 设置 p->kstack、p->stack 和 p->trapframe，trapframe 已清零
+ * 池为 trapframe 持有一个引用，用户页表解除映射时不会释放它
+ * @param p 进程
+ * @return 成功返回 0，槽位用完或内存不足返回 -ENOMEM
+ */
+int         kstack_alloc(struct proc* p);
+
+/**
+ * 归还进程的内核栈与 trapframe，进程不能再在这个栈上运行
+ * 缓存未满且 trapframe 没有被其他页表映射时保留映射以备复用，否则立即释放
+ * @param p 进程，kstack_alloc 失败的进程也可以传入
+ */
+void        kstack_free(struct proc* p);
+
+/**
+ * 释放缓存中所有的内核栈
+ * @return 释放的页数
+ */
+uint64      kstack_shrink();
+
+/**
+ * 读取内核栈池的统计信息
+ * @param st 输出
+ */
+void        kstack_get_stat(struct kstack_stat* st);
+
+#endif // __KSTACK_H__
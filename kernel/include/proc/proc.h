@@ -5,10 +5,15 @@
 #include <trap/trap.h>
 #include <irq/interrupt.h>
 #include <mm/mm.h>
+#include <mm/vma.h>
+#include <elf.h>
+#include <proc/wait.h>
+#include <proc/timer.h>
 
 struct proc {
     int pid;                        // 进程 id
     int tgid;                       // 进程组 id
+    spinlock_t lock;                // 保护 state 的变化，唤醒者之间以及唤醒者与进程自己由它串行
     volatile int state;             // 进程的状态
 
     uint64 tls;                     // Thread Local Storage
@@ -18,7 +23,8 @@ struct proc {
 
     // pagetable_t pagetable;
     upagetable* pagetable;          // 用户态页表
-    uint64 stack;                   // 内核栈的虚拟地址，指向栈区域的顶部
+    int kstack;                     // 内核栈在内核栈池中的槽位，0 表示没有
+    uint64 stack;                   // 内核栈的虚拟地址，指向栈区域的底部
     struct trapframe* trapframe;    // trapframe 指针 
     struct context context;         // 进程的上下文
 
@@ -27,7 +33,17 @@ struct proc {
 
     int killed;                     // 进程是否被 kill 的标志
     void* chan;                     // 进程正在 sleep 的时间
-    long sleeping_due;              
+    struct timer sleep_timer;       // 定时睡眠到期时唤醒进程
+
+    // 调度
+    int nice;                       // nice 值，NICE_MIN 到 NICE_MAX，越小权重越大
+    int cpu;                        // 进程所属运行队列的 cpu
+    uint64 cpus_allowed;            // 允许运行的 cpu，第 i 位对应 cpuid 为 i 的 cpu，fork 时继承
+    int on_rq;                      // 是否在运行队列的红黑树中
+    volatile int on_cpu;            // 是否正在某个 cpu 上运行，回到 scheduler 之后才清除
+    uint64 vruntime;                // 按权重折算的运行时间，单位为 r_time() 的计数
+    uint64 exec_start;              // 最近一次开始计入 vruntime 的 r_time()
+    RB_ENTRY(proc) rq_node;         // 运行队列红黑树的节点
 
     int status;                     // exit() return status
 
@@ -38,11 +54,14 @@ struct proc {
     int waited;
 
     struct proc* parent;            // 父进程指针
+    struct wait_queue_head wait_child;  // 在 wait4 中等待子进程退出
 
     struct proc* next;              // 进程链表的双向值镇
     struct proc* prev;
 
-    struct vm_area* vma_list;       // vm_area 链表
+    struct vm_area* vma_list;       // vm_area 链表，按地址排序
+    struct vma_tree vma_tree;       // vm_area 红黑树
+    struct vm_area* vma_cache;      // 上一次 find_vma 命中的 vma
     uint64 mmap_base;               // mmap 基地址
     uint64 mmap_brk;                // mmap 范围的顶部
 
@@ -54,6 +73,9 @@ struct proc {
 
     uint64 utime;
     uint64 stime;
+
+    uint64 min_flt;                 // 缺页次数
+    uint64 maj_flt;                 // 其中需要从 zram 换入的次数
 };
 
 enum proc_state{ INIT, SLEEPING, RUNNABLE, RUNNING, ZOMBIE, NR_PROC_STATE };
@@ -61,17 +83,21 @@ enum proc_state{ INIT, SLEEPING, RUNNABLE, RUNNING, ZOMBIE, NR_PROC_STATE };
 // 存储所有进程的链表
 extern struct proc* proc_list;
 
+// 保护 proc_list 的遍历与修改，以及 parent 指针
+extern spinlock_t proc_list_lock;
+
 struct cpu { 
     struct context context;   // cpu 保存的上下文
     struct proc* proc;        // 当前 CPU 运行的进程
     int noff;                 // 中断嵌套计数
     int intena;               // irq_pushoff 前的中断使能标志
+    int nirq;                 // 正在处理的设备中断层数
 };
 
 // cpu 数组，通过 cpuid 获得自身的结构体
 extern struct cpu cpus[NCPU];
 
-#define CPUID(c) (int)(((uint64)((c) - cpus))/sizeof(struct cpu))
+#define CPUID(c) ((int)((c) - cpus))
 
 /**
  * 获取当前核的 cpu 结构体
@@ -97,7 +123,18 @@ myproc()
     return p;
 }
 
-#include <mm/vma.h>
+/**
+ * 当前核是否正在处理设备中断，中断处理函数中不能睡眠，也不能进入内存回收
+ * @return: 处于设备中断处理函数中返回 1，否则返回 0
+ */
+static inline int
+in_interrupt()
+{
+    irq_pushoff();
+    int n = mycpu()->nirq;
+    irq_popoff();
+    return n > 0;
+}
 
 /**
  * 初始化 init 进程，使之完成被调度的准备
@@ -107,11 +144,20 @@ void            proc_init();
 
 /**
  * 初始化 test 进程，调度后不可被抢占，用作内核态的代码的测试
+ * test 进程只在创建它的 cpu 上运行，它创建的内核线程同样如此
  */
 void            test_proc_init(uint64 test_func);
 
 /**
- * 获取系统分配的 pid
+ * 创建一个只在内核态运行的线程，没有用户页表，创建后即可被调度
+ * @param name 线程的名字
+ * @param fn 线程执行的函数，不应返回
+ * @return 线程的进程结构体，内存不足返回 NULL
+ */
+struct proc*    kthread_create(const char* name, void (*fn)());
+
+/**
+ * 获取系统分配的 pid，可以在多个 cpu 上同时调用
  * @return: 一个新的进程 id
  */
 int             alloc_pid();
@@ -125,12 +171,13 @@ struct proc*    alloc_proc();
 
 /**
  * 将进程设置为 SLEEPING 状态，让出 CPU，直到等待的事件完成调用 wakeup 后，恢复可被调用的状态
+ * 进程挂在 chan 的散列等待队列上；调用前检查的条件可能在 sleep 之前就被满足，需要可靠等待时使用 wait_event_chan
  * @param chan 正在等待的事件
  */
 void            sleep(void* chan);
 
 /**
- * 将所有正在等待指定事件的进程唤醒，使之可被重新调度
+ * 将所有正在等待指定事件的进程唤醒，使之可被重新调度，只查看 chan 所在的散列等待队列
  * @param chan 要唤醒的事件
  */
 void            wakeup(void* chan);
@@ -160,10 +207,26 @@ void            reparent(struct proc* p);
 void            freeproc(struct proc* p);
 
 /**
- * 释放进程的页表中所有已分配的内存，包括页表自身占有的内存
- * @param p 要释放的页表所对应的进程的结构体
+ * 替换进程的地址空间，并放弃对旧地址空间的引用
+ * 旧地址空间的最后一个引用放弃时，释放其中所有已分配的内存，包括页表自身占有的内存
+ * @param p 进程的结构体
+ * @param upgtbl 新的地址空间，传入 NULL 表示只释放旧的
+ */
+void            proc_set_pagetable(struct proc* p, upagetable* upgtbl);
+
+/**
+ * 为 execve 映射 ELF 文件的一个 PT_LOAD 段，权限由 p_flags 决定
+ * 整页的文件数据建立私有的文件 vma，缺页时从页缓存映射，只读的代码段在运行同一文件的进程间共享，可写的数据段写时复制；
+ * bss 建立匿名 vma。文件数据结束处所在的页（其后为 bss）以及与上一个段共享的页立即读入私有页，
+ * 文件不能映射或偏移与地址在页内不一致时，所有文件数据都这样读入
+ * @param pgtbl 新映像的用户页表
+ * @param file ELF 文件，文件 vma 会持有它的引用
+ * @param phdr 段的程序头
+ * @param base 加载基址，段映射在 base + p_vaddr
+ * @param vmas 新映像的 vma 链表，按地址从高到低排列，新的 vma 插入表头；段需要按地址升序加载
+ * @return 成功返回 0，内存不足返回 -ENOMEM，读取文件失败返回 -EIO，程序头不合法返回 -ENOEXEC
  */
-void            proc_free_pagetable(struct proc* p);
+int             load_elf_segment(pagetable_t pgtbl, struct file* file, Elf64_Phdr* phdr, uint64 base, struct vm_area** vmas);
 
 
 #define EXIT_IF(cond, msg, ...) \
@@ -1,6 +1,36 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+#include <common.h>
+#include <locking/spinlock.h>
+#include <fs/ext4/lwext4/misc/tree.h>
+
+#define NICE_MIN            (-20)
+#define NICE_MAX            19
+#define NICE_0_WEIGHT       1024    // nice 为 0 的进程的权重，vruntime 按 NICE_0_WEIGHT / weight 的比例增长
+
+#define PRIO_PROCESS        0       // setpriority/getpriority 的 which，目前只支持按进程设置
+
+struct proc;
+struct context;
+
+RB_HEAD(rq_tree, proc);
+
+// 每个 cpu 的运行队列，只包含可运行而没有在运行的进程，睡眠和僵尸进程不在其中
+struct rq {
+    spinlock_t lock;
+    struct rq_tree tree;            // 以 (vruntime, pid) 为键的红黑树，最左边的进程最先运行
+    uint64 nr_running;              // 树中的进程数
+    uint64 load;                    // 树中进程的权重之和
+    uint64 min_vruntime;            // 单调不减，新进程和被唤醒的进程以它为基准放入队列
+    uint64 nr_switches;             // 切换到进程的次数
+    uint64 nr_migrations;           // 从其他 cpu 迁入本队列的进程数
+    struct proc* curr;              // 正在本 cpu 上运行的进程，空闲时为 NULL
+    uint64 next_balance;            // 下一次周期性负载均衡的 r_time()，只由本 cpu 读写
+};
+
+extern struct rq runqueues[NCPU];
+
 /**
  * 切换内核态上下文，将目前的 ra, sp, 以及保存寄存器存入 old，将 nex 中的上下文加载出来
  * 在调用者的视角来看就像是调用了一个函数一样，实则已经完成了一次切换进程再切换回来的操作
@@ -9,10 +39,17 @@
  */
 void swtch(struct context *old, struct context* nex);
 
+/**
+ * 初始化每个 cpu 的运行队列，在创建第一个进程之前调用
+ */
+void sched_init();
+
 /**
  * 调度器，负责完成选择一个进程，并将其调度的过程
  * 每一个核都会在最开始的时候运行一个调度器，并且再死循环中不断重复这个过程
  * 这个“过程”被抽象为一个调度器进程
+ * 每次从本 cpu 运行队列中取出 vruntime 最小的进程运行，进程让出 CPU 后仍可运行的再放回队列
+ * 本 cpu 的队列为空时先从等待进程最多的 cpu 取走一半，仍然没有才进入空闲
  */
 void scheduler();
 
@@ -21,10 +58,55 @@ void scheduler();
  */
 void sched();
 
-/** 
+/**
  * 主动让出 CPU，调用 sched 返回 scheduler
+ * 当前进程放回队列时排在 vruntime 最小的进程之后，因此只要有其他可运行的进程就不会立即再次运行
  */
 void yield();
 
-#endif // __SCHED_H__
+/**
+ * 使进程变为可运行并放入运行队列，用于新创建的进程和被唤醒的进程
+ * 进程放入 cpus_allowed 中最短的队列，长度相同时留在原来的 cpu 上
+ * 新进程的 vruntime 取队列的 min_vruntime；睡眠过的进程最多获得 SCHED_WAKEUP_CREDIT 的补偿，不能借睡眠积累运行时间
+ * 已经可运行或正在运行的进程不受影响；定时睡眠的进程被提前唤醒时取消其 sleep_timer
+ * @param p 进程
+ */
+void sched_wakeup(struct proc* p);
+
+/**
+ * 由调度时钟调用，更新当前进程的 vruntime
+ * 每 SCHED_BALANCE_INTERVAL 做一次负载均衡：从最长的队列拉取进程，并唤醒空闲的 cpu 来取走本队列中等待的进程
+ * @return 当前进程的 vruntime 超过队列中最小的 vruntime 一个粒度以上，或者本 cpu 已不在它的 cpus_allowed 中时返回 1，调用者应当 yield
+ */
+int sched_tick();
+
+/**
+ * 让当前进程睡眠到 r_time() 达到 expires，调用时需关闭中断
+ * 由进程的 sleep_timer 唤醒，唤醒的精度不受调度时钟限制
+ * @param expires 唤醒的时刻，r_time() 的值；UINT64_MAX 表示不设定时器，只能由其他事件唤醒
+ */
+void sleep_until(uint64 expires);
+
+/**
+ * 设置进程的 nice 值，超出范围的值被截断到 [NICE_MIN, NICE_MAX]
+ * @param p 进程
+ * @param nice nice 值
+ */
+void sched_set_nice(struct proc* p, int nice);
 
+/**
+ * 设置进程可以运行的 cpu，队列中的进程立即移到允许的 cpu 上，
+ * 正在运行的进程在下一次调度时钟让出 CPU 时移动，睡眠的进程在被唤醒时移动
+ * 调用者需保证 p 不会被释放，例如持有 proc_list_lock；p 为当前进程时调用者应随后 yield
+ * @param p 进程
+ * @param mask 第 i 位对应 cpuid 为 i 的 cpu
+ * @return 成功返回 0，mask 中没有在线的 cpu 时返回 -EINVAL
+ */
+int sched_set_affinity(struct proc* p, uint64 mask);
+
+/**
+ * 本 cpu 运行队列中等待运行的进程数，不含正在运行的进程
+ */
+uint64 sched_nr_queued();
+
+#endif // __SCHED_H__
@@ -0,0 +1,69 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <common.h>
+
+#define IPI_RESCHED         (1 << 0)    // 有进程被放入目标 cpu 的运行队列，唤醒停在 cpu_idle 中的 cpu
+#define IPI_TLB             (1 << 1)    // 目标 cpu 需要刷新整个 TLB，见 flush_tlb_others
+
+#define SMP_BOOT_TIMEOUT    (CLOCK_FREQUNCY / 10)   // 等待一个从核上线的最长时间，单位为 r_time() 的计数
+
+// 已经进入 scheduler 的 cpu，第 i 位对应 cpuid 为 i 的 cpu
+extern volatile uint64 cpu_online_mask;
+
+static inline int
+cpu_online(int cpu)
+{
+    return (cpu_online_mask >> cpu) & 1;
+}
+
+/**
+ * 由主核在初始化完成后调用，启动其余 NCPU - 1 个核并等待它们上线
+ * 启动失败或超时未上线的核被跳过，之后不会再被使用
+ */
+void    smp_boot();
+
+/**
+ * 从核完成本核的页表、异常与中断设置之后调用，将本核标记为上线
+ */
+void    smp_online();
+
+/**
+ * 向另一个 cpu 发送处理器间中断
+ * @param cpu 目标 cpu
+ * @param reason IPI_RESCHED 或 IPI_TLB，同一原因在处理之前多次发送只会处理一次
+ */
+void    smp_send_ipi(int cpu, int reason);
+
+/**
+ * 处理器间中断的处理函数，由架构相关的中断处理在清除中断之后调用
+ */
+void    smp_ipi_handler();
+
+/**
+ * 让 mask 中除当前 cpu 以外的在线 cpu 刷新整个 TLB，等待它们全部完成后返回
+ * 等待时仍然处理发给本核的刷新请求，两个核互相刷新不会死锁；
+ * 但调用者不能持有其他 cpu 可能关中断等待的自旋锁
+ * @param mask 需要刷新的 cpu
+ */
+void    flush_tlb_others(uint64 mask);
+
+/**
+ * 刷新所有在线 cpu 的整个 TLB，用于内核页表以及多个地址空间的页表项被改变的情况
+ */
+void    flush_tlb_all();
+
+/**
+ * 启动一个从核，从核从 _start 开始执行，由架构实现
+ * @param cpu 要启动的 cpu
+ * @return 成功返回 0，不支持或固件拒绝返回负数
+ */
+int     arch_cpu_start(int cpu);
+
+/**
+ * 向 cpu 发出处理器间中断，由架构实现
+ * @param cpu 目标 cpu
+ */
+void    arch_send_ipi(int cpu);
+
+#endif // __SMP_H__
@@ -0,0 +1,105 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <common.h>
+#include <fs/ext4/lwext4/misc/tree.h>
+
+#define TIMER_IDLE_MAX      (10 * CLOCK_FREQUNCY)   // 空闲时最长多久不产生时钟中断，单位为 r_time() 的计数
+
+struct timer_base;
+
+// 到期时在时钟中断中调用 fn 的定时器，通常嵌在使用者的结构体中
+struct timer {
+    RB_ENTRY(timer) node;           // 所在 cpu 定时器红黑树的节点
+    uint64 expires;                 // 到期的 r_time()
+    void (*fn)(struct timer*);      // 到期时调用，此时定时器已不在队列中，可以再次加入
+    struct timer_base* base;        // 所在 cpu 的定时器队列，NULL 表示没有加入队列
+};
+
+// 定时器与时钟中断的统计信息，由 timer_get_stat 取得
+struct timer_stat {
+    uint64 nr_interrupts;           // 时钟中断次数
+    uint64 nr_ticks;                // 其中周期性的调度时钟数
+    uint64 nr_expired;              // 到期的定时器数
+    uint64 nr_idle;                 // 停止调度时钟进入空闲的次数
+};
+
+/**
+ * 初始化每个 cpu 的定时器队列，在 proc_init 中、第一个定时器之前调用
+ */
+void    timers_init();
+
+/**
+ * 从核上线时调用，从现在起开始本 cpu 的调度时钟
+ */
+void    timer_init_hart();
+
+/**
+ * 设置定时器到期时调用的函数，定时器不能在队列中
+ * @param t 定时器
+ * @param fn 到期时调用的函数
+ */
+void    timer_setup(struct timer* t, void (*fn)(struct timer*));
+
+/**
+ * 将定时器加入当前 cpu 的队列，已在队列中的先移出，比已设定的下一次时钟中断更早时重新设定硬件定时器
+ * @param t 定时器
+ * @param expires 到期的 r_time()，已经过去的时刻在下一次时钟中断时到期
+ */
+void    timer_add(struct timer* t, uint64 expires);
+
+/**
+ * 将定时器移出队列
+ * @param t 定时器
+ * @return 定时器在队列中返回 1，否则返回 0
+ */
+int     timer_del(struct timer* t);
+
+/**
+ * 将定时器移出队列，并等待其他 cpu 上已经开始的 fn 返回，之后可以释放定时器所在的结构体
+ * 不能在定时器自己的 fn 中调用
+ * @param t 定时器
+ * @return 定时器在队列中返回 1，否则返回 0
+ */
+int     timer_del_sync(struct timer* t);
+
+/**
+ * 定时器是否在队列中，即还没有到期也没有被移出
+ */
+static inline int
+timer_pending(struct timer* t)
+{
+    return t->base != NULL;
+}
+
+/**
+ * 时钟中断的公共部分：调用到期的定时器，更新 tick_counter，设定下一次时钟中断
+ * 下一次时钟中断是最早到期的定时器与下一个调度时钟中较早的一个，调度时钟停止时只看定时器
+ * @return 这次中断包含一个调度时钟时返回 1，调用者此时计入进程时间并检查抢占
+ */
+int     timer_interrupt();
+
+/**
+ * 本 cpu 即将空闲，停止调度时钟，下一次时钟中断只为最早到期的定时器，最长不超过 TIMER_IDLE_MAX
+ * 调用时需关闭中断
+ */
+void    tick_nohz_idle_enter();
+
+/**
+ * 本 cpu 结束空闲，从现在起恢复调度时钟，调用时需关闭中断
+ */
+void    tick_nohz_idle_exit();
+
+/**
+ * 读取所有 cpu 的定时器统计信息之和
+ * @param st 输出
+ */
+void    timer_get_stat(struct timer_stat* st);
+
+/**
+ * 由架构实现：在 r_time() 到达 when 时产生一次时钟中断，取代之前设定的时刻
+ * @param when 中断的时刻，已经过去时尽快产生中断
+ */
+void    timer_set_next_event(uint64 when);
+
+#endif // __TIMER_H__
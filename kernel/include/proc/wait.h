@@ -0,0 +1,114 @@
+#ifndef __WAIT_H__
+#define __WAIT_H__
+
+#include <common.h>
+#include <tools/list.h>
+#include <locking/spinlock.h>
+
+#define WQ_FLAG_EXCLUSIVE   0x01    // 独占等待，一次唤醒最多唤醒一个这样的等待者
+#define CHAN_HASH_BITS      6
+#define CHAN_HASH_SIZE      (1 << CHAN_HASH_BITS)   // sleep/wakeup 使用的散列等待队列数
+
+struct proc;
+
+// 等待队列，只挂着在其上等待的进程，唤醒不需要遍历所有进程
+struct wait_queue_head {
+    spinlock_t lock;
+    struct list_head head;          // 非独占的等待者在前，独占的在后
+};
+
+// 一个进程的一次等待，通常在等待者的栈上
+struct wait_queue_entry {
+    struct list_head list;          // 挂在 wait_queue_head.head 上
+    struct proc* proc;              // 等待的进程
+    void* key;                      // 散列队列上等待的 chan，独立的等待队列为 NULL
+    int flags;                      // WQ_FLAG_EXCLUSIVE
+    int queued;                     // 是否在队列中，唤醒时被移出队列
+};
+
+#define WAIT_QUEUE_HEAD_DEFINE(wqname) \
+    struct wait_queue_head wqname = { \
+        .lock = { .locked = UNLOCKED, .name = #wqname, .cpu = NULL }, \
+        .head = { &wqname.head, &wqname.head } \
+    }
+
+/**
+ * 初始化散列等待队列，在 proc_init 中、第一次 sleep 之前调用
+ */
+void    wait_init();
+
+/**
+ * 初始化一个等待队列
+ * @param wq 等待队列
+ * @param name 锁的名字
+ */
+void    wait_queue_head_init(struct wait_queue_head* wq, const char* name);
+
+/**
+ * 初始化当前进程的一次等待
+ * @param wait 等待项
+ * @param key 散列队列上的 chan，独立的等待队列传 NULL
+ * @param flags WQ_FLAG_EXCLUSIVE 或 0
+ */
+void    init_wait_entry(struct wait_queue_entry* wait, void* key, int flags);
+
+/**
+ * 将等待项放入队列（已在队列中则不动），并把当前进程设为 SLEEPING
+ * 调用之后再检查等待的条件：此后的唤醒都会把进程重新设为可运行，不会丢失
+ * @param wq 等待队列
+ * @param wait 等待项
+ */
+void    prepare_to_wait(struct wait_queue_head* wq, struct wait_queue_entry* wait);
+
+/**
+ * 结束等待，当前进程恢复为 RUNNING，等待项还在队列中时将其移出
+ * @param wq 等待队列
+ * @param wait 等待项
+ */
+void    finish_wait(struct wait_queue_head* wq, struct wait_queue_entry* wait);
+
+/**
+ * 在 prepare_to_wait 之后让出 CPU，期间已被唤醒时会立即重新被调度，返回时恢复原来的中断状态
+ */
+void    wait_schedule();
+
+/**
+ * 唤醒队列上的等待者，被唤醒的等待项移出队列
+ * @param wq 等待队列
+ * @param key 只唤醒 key 相同的等待项
+ * @param nr_exclusive 最多唤醒的独占等待者数，0 表示全部唤醒；非独占的等待者总是全部唤醒
+ * @return 唤醒的等待者数
+ */
+int     __wake_up(struct wait_queue_head* wq, void* key, int nr_exclusive);
+
+#define wake_up(wq)         __wake_up((wq), NULL, 1)
+#define wake_up_all(wq)     __wake_up((wq), NULL, 0)
+
+/**
+ * 取得 chan 对应的散列等待队列，sleep/wakeup 在其上等待与唤醒
+ * @param chan 等待的事件
+ */
+struct wait_queue_head* chan_wait_queue(void* chan);
+
+#define __wait_event(wq, key, flags, cond)                          \
+    do {                                                            \
+        struct wait_queue_head* __wq = (wq);                        \
+        struct wait_queue_entry __wait;                             \
+        init_wait_entry(&__wait, (key), (flags));                   \
+        for (;;) {                                                  \
+            prepare_to_wait(__wq, &__wait);                         \
+            if (cond)                                               \
+                break;                                              \
+            wait_schedule();                                        \
+        }                                                           \
+        finish_wait(__wq, &__wait);                                 \
+    } while (0)
+
+// 睡眠直到 cond 成立，条件在进入队列之后检查，使 cond 成立的一方在此后唤醒即可
+#define wait_event(wq, cond)            __wait_event((wq), NULL, 0, cond)
+// 同上，但 wake_up 一次只唤醒一个这样的等待者
+#define wait_event_exclusive(wq, cond)  __wait_event((wq), NULL, WQ_FLAG_EXCLUSIVE, cond)
+// 在 chan 的散列等待队列上睡眠直到 cond 成立，由 wakeup(chan) 唤醒
+#define wait_event_chan(chan, cond)     __wait_event(chan_wait_queue(chan), (chan), 0, cond)
+
+#endif // __WAIT_H__
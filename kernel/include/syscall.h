@@ -23,6 +23,7 @@
 #define SYS_mount 40
 #define SYS_fstat 80
 #define SYS_truncate64 45
+#define SYS_ftruncate 46
 #define SYS_faccessat 48
 
 // Process Management
@@ -46,24 +47,32 @@
 // Memory Management
 #define SYS_brk 214
 #define SYS_munmap 215
+#define SYS_mremap 216
 #define SYS_mmap 222
+#define SYS_msync 227
+#define SYS_madvise 233
+#define SYS_memfd_create 279
 
 // Others
 #define SYS_times 153
 #define SYS_uname 160
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
 #define SYS_sched_yield 124
+#define SYS_setpriority 140
+#define SYS_getpriority 141
 #define SYS_gettimeofday 169
 #define SYS_nanosleep 101
 
 #define NR_SYSCALL 30
 
 #define SYSCALLS(f) \
-    f(getcwd) f(pipe2) f(dup) f(dup3) f(chdir) f(openat) f(close) f(getdents64) f(truncate64) f(faccessat) \
+    f(getcwd) f(pipe2) f(dup) f(dup3) f(chdir) f(openat) f(close) f(getdents64) f(truncate64) f(ftruncate) f(faccessat) \
     f(read) f(write) f(linkat) f(unlinkat) f(mkdirat) f(umount2) f(mount) f(fstat) \
     f(clone) f(execve) f(wait4) f(exit) f(getppid) f(getpid) f(fork)\
     f(getuid) f(geteuid) f(getgid) f(getegid) \
-    f(brk) f(munmap) f(mmap) \
-    f(times) f(uname) f(sched_yield) f(gettimeofday) f(nanosleep)
+    f(brk) f(munmap) f(mremap) f(mmap) f(msync) f(madvise) f(memfd_create) \
+    f(times) f(uname) f(sched_setaffinity) f(sched_getaffinity) f(sched_yield) f(setpriority) f(getpriority) f(gettimeofday) f(nanosleep)
 
 typedef uint64 (*syscall_func_t)(void);
 
@@ -137,6 +146,33 @@ void syscall();
 
 #define MMAP_FAILED ((void*) -1)
 
+/* memfd_create flags */
+
+#define MFD_CLOEXEC    0x1      // 接受但不起作用，exec 目前不关闭文件
+#define MFD_NAME_MAX   249      // 名字的最大长度，不含结尾的 '\0'
+
+/* msync flags */
+
+#define MS_ASYNC       1        // 目前与 MS_SYNC 相同，同步写回
+#define MS_INVALIDATE  2
+#define MS_SYNC        4
+
+/* mremap flags */
+
+#define MREMAP_MAYMOVE 1        // 原地无法扩大时允许移动到新的地址
+#define MREMAP_FIXED   2        // 移动到指定的 new_addr，覆盖已有映射，须与 MREMAP_MAYMOVE 同时使用
+
+/* madvise advice */
+
+#define MADV_NORMAL      0      // 清除访问模式的提示
+#define MADV_RANDOM      1      // 随机访问
+#define MADV_SEQUENTIAL  2      // 顺序访问，文件映射缺页时预先映射后续的页
+#define MADV_WILLNEED    3      // 即将访问，预读文件页，换入已换出的匿名页
+#define MADV_DONTNEED    4      // 立即释放，私有页再次访问时为 0 或重新从文件读入
+#define MADV_FREE        8      // 目前与 MADV_DONTNEED 相同，只用于私有匿名映射
+#define MADV_HUGEPAGE    14     // 允许使用大页（默认）
+#define MADV_NOHUGEPAGE  15     // 不使用大页
+
 /* clone flags */
 
 #define CLONE_VM             0x00000100  // 共享地址空间 (线程)
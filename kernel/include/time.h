@@ -29,6 +29,7 @@ struct timespec {
 	long   tv_nsec;       /* nanosecond */
 };
 
+// 开机以来经过的调度时钟数，由 r_time() 换算，在每次时钟中断和结束空闲时更新
 extern uint64 tick_counter;
 
 #endif
\ No newline at end of file
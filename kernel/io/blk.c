@@ -52,7 +52,8 @@ void blkdev_submit_req(struct blkdev *dev, struct blkreq *request) {
 
 void blkdev_submit_req_wait(struct blkdev *dev, struct blkreq *request) {
     blkdev_submit_req(dev, request);
-    sleep(blkreq_wait_channel(request));
+    // the completion may come before we get to sleep
+    wait_event_chan(blkreq_wait_channel(request), request->status != BLKREQ_STATUS_INIT);
 }
 
 void blkdev_general_endio(struct blkreq *request)
@@ -73,10 +74,7 @@ int blkdev_wait_all(struct blkdev *dev)
     list_for_each_entry(request, &dev->rq_list, rq_head)
     {
         assert(request != NULL);
-        if(request->status == BLKREQ_STATUS_INIT)
-        {
-            blkreq_sleep(request);
-        }
+        blkreq_sleep(request);
 
         if(request->status == BLKREQ_STATUS_OK)
         {
@@ -40,7 +40,9 @@ void irq_response(void) {
             goto out;
         }
     
+        mycpu()->nirq++;
         ret = irq_handlers[irq](irq, irq_privates[irq]);
+        mycpu()->nirq--;
     
         if(ret == IRQ_ERR) {
             panic("Irq handle error");
@@ -55,6 +57,10 @@ void irq_init(void) {
     __irq_init_default();
 }
 
+void irq_init_hart(void) {
+    __irq_init_hart();
+}
+
 void irq_pushoff() {
     int old_intr_status = intr_get();
     intr_off();
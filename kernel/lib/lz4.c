@@ -0,0 +1,177 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+
+// LZ4 block format, see https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// a sequence is: token, literal length, literals, 16-bit offset, match length
+
+#define LZ4_MINMATCH        4
+#define LZ4_MFLIMIT         12      // last match starts at least this far from the end
+#define LZ4_LASTLITERALS    5       // last bytes are always literals
+#define LZ4_MAX_OFFSET      65535
+#define LZ4_HASH_LOG        12
+#define LZ4_RUN_MASK        15
+
+
+static inline uint32
+read32(const uint8* p)
+{
+    return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24));
+}
+
+static inline uint32
+lz4_hash(uint32 seq)
+{
+    return ((seq * 2654435761U) >> (32 - LZ4_HASH_LOG));
+}
+
+
+// write a length that does not fit in the token
+static inline uint8*
+write_length(uint8* op, int len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+
+// emit literals [anchor, anchor + litlen), and a match if mlen >= 0
+// return NULL if dst is too small
+static uint8*
+emit_sequence(uint8* op, uint8* oend, const uint8* anchor, int litlen, int offset, int mlen)
+{
+    // worst case of the length bytes, token and offset
+    if (op + litlen + litlen / 255 + (mlen > 0 ? mlen / 255 : 0) + 5 > oend)
+        return NULL;
+
+    uint8* token = op++;
+    if (litlen >= LZ4_RUN_MASK) {
+        *token = (LZ4_RUN_MASK << 4);
+        op = write_length(op, litlen - LZ4_RUN_MASK);
+    }
+    else
+        *token = (litlen << 4);
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    if (mlen < 0)
+        return op;
+
+    *op++ = (offset & 0xff);
+    *op++ = (offset >> 8);
+    if (mlen >= LZ4_RUN_MASK) {
+        *token |= LZ4_RUN_MASK;
+        op = write_length(op, mlen - LZ4_RUN_MASK);
+    }
+    else
+        *token |= mlen;
+    return op;
+}
+
+
+int
+lz4_compress(const void* src, int n, void* dst, int cap, void* wrkmem)
+{
+    const uint8 *base = src, *ip = base, *anchor = base;
+    const uint8 *iend = base + n, *mflimit = iend - LZ4_MFLIMIT, *matchlimit = iend - LZ4_LASTLITERALS;
+    uint8 *op = dst, *oend = op + cap;
+    uint16* table = wrkmem;
+
+    assert(n <= LZ4_MAX_OFFSET);
+    memset(table, 0, LZ4_WRKMEM_SIZE);
+
+    if (n >= LZ4_MFLIMIT + 1) {
+        for (ip++; ip < mflimit; ) {
+            uint32 seq = read32(ip);
+            uint32 h = lz4_hash(seq);
+            const uint8* ref = base + table[h];
+            table[h] = (ip - base);
+
+            if (ref >= ip || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8 *m = ip + LZ4_MINMATCH, *r = ref + LZ4_MINMATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            op = emit_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip - LZ4_MINMATCH);
+            if (op == NULL)
+                return 0;
+            ip = anchor = m;
+            if (ip < mflimit)
+                table[lz4_hash(read32(ip - 2))] = (ip - 2 - base);
+        }
+    }
+
+    op = emit_sequence(op, oend, anchor, iend - anchor, 0, -1);
+    return (op ? op - (uint8*) dst : 0);
+}
+
+
+int
+lz4_decompress(const void* src, int n, void* dst, int cap)
+{
+    const uint8 *ip = src, *iend = ip + n;
+    uint8 *op = dst, *oend = op + cap;
+
+    while (ip < iend) {
+        uint8 token = *ip++;
+
+        int len = (token >> 4);
+        if (len == LZ4_RUN_MASK) {
+            uint8 b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += (b = *ip++);
+            } while (b == 255);
+        }
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int offset = (ip[0] | (ip[1] << 8));
+        ip += 2;
+        if (offset == 0 || offset > op - (uint8*) dst)
+            return -1;
+
+        len = (token & LZ4_RUN_MASK);
+        if (len == LZ4_RUN_MASK) {
+            uint8 b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += (b = *ip++);
+            } while (b == 255);
+        }
+        len += LZ4_MINMATCH;
+        if (len > oend - op)
+            return -1;
+
+        // match may overlap the output, copy byte by byte
+        const uint8* match = op - offset;
+        for (int i = 0; i < len; i++)
+            op[i] = match[i];
+        op += len;
+    }
+
+    return (op - (uint8*) dst);
+}
@@ -1,5 +1,7 @@
 #include <common.h>
+#include <arch.h>
 #include <mm/mm.h>
+#include <irq/interrupt.h>
 #include <debug.h>
 
 size_t 
@@ -73,19 +75,193 @@ char*
 strdup(const char* str)
 {
     int len = strlen(str);
-    char* dst = kalloc(len);
-    return strncpy(dst, str, len);
+    char* dst = kalloc(len + 1);
+    if (dst == NULL)
+        return NULL;
+    return strncpy(dst, str, len + 1);
+}
+
+
+#define ONES        0x0101010101010101UL
+#define VEC_MIN     256             // shorter ones are not worth turning vector unit on
+#define VEC_CHUNK   (64 * 1024)     // intr stays off for at most this many bytes
+
+// vector kernels chosen by string_init(), NULL when there is no vector unit
+static void* (*vec_memcpy)(void*, const void*, size_t);
+static void* (*vec_memset)(void*, int, size_t);
+
+#ifdef __loongarch64
+void* __memcpy_lsx(void* dst, const void* src, size_t n);
+void* __memset_lsx(void* dst, int c, size_t n);
+void* __memcpy_lasx(void* dst, const void* src, size_t n);
+void* __memset_lasx(void* dst, int c, size_t n);
+#else
+void* __memcpy_rvv(void* dst, const void* src, size_t n);
+void* __memset_rvv(void* dst, int c, size_t n);
+#endif
+
+
+void
+string_init()
+{
+    int vec = vec_probe();
+#ifdef __loongarch64
+    if (vec == 2) {
+        vec_memcpy = __memcpy_lasx;
+        vec_memset = __memset_lasx;
+    }
+    else if (vec == 1) {
+        vec_memcpy = __memcpy_lsx;
+        vec_memset = __memset_lsx;
+    }
+#else
+    if (vec) {
+        vec_memcpy = __memcpy_rvv;
+        vec_memset = __memset_rvv;
+    }
+#endif
+}
+
+
+// vector state is not saved on trap or switch, so intr is off while the unit is on
+static void
+vec_copy(char* d, const char* s, size_t n)
+{
+    while (n > 0) {
+        size_t len = MIN(n, VEC_CHUNK);
+        irq_pushoff();
+        uint64 old = vec_begin();
+        vec_memcpy(d, s, len);
+        vec_end(old);
+        irq_popoff();
+        d += len;
+        s += len;
+        n -= len;
+    }
+}
+
+
+static void
+vec_set(char* d, int c, size_t n)
+{
+    while (n > 0) {
+        size_t len = MIN(n, VEC_CHUNK);
+        irq_pushoff();
+        uint64 old = vec_begin();
+        vec_memset(d, c, len);
+        vec_end(old);
+        irq_popoff();
+        d += len;
+        n -= len;
+    }
+}
+
+
+static void
+set_words(char* d, int c, size_t n)
+{
+    uint64 v = (uint8) c * ONES;
+    while (n > 0 && ((uint64) d & 7)) {
+        *d++ = c;
+        n--;
+    }
+    uint64* dw = (uint64*) d;
+    for (; n >= 32; n -= 32, dw += 4) {
+        dw[0] = v;
+        dw[1] = v;
+        dw[2] = v;
+        dw[3] = v;
+    }
+    for (; n >= 8; n -= 8)
+        *dw++ = v;
+    d = (char*) dw;
+    while (n-- > 0)
+        *d++ = c;
+}
+
+
+// forward copy, also safe for overlapping areas with d < s
+static void
+copy_words(char* d, const char* s, size_t n)
+{
+    while (n > 0 && ((uint64) d & 7)) {
+        *d++ = *s++;
+        n--;
+    }
+
+    uint64* dw = (uint64*) d;
+    uint64 off = ((uint64) s & 7);
+    if (off == 0) {
+        const uint64* sw = (const uint64*) s;
+        for (; n >= 32; n -= 32, dw += 4, sw += 4) {
+            uint64 a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+            dw[0] = a;
+            dw[1] = b;
+            dw[2] = c;
+            dw[3] = e;
+        }
+        for (; n >= 8; n -= 8)
+            *dw++ = *sw++;
+        s = (const char*) sw;
+    }
+    else if (n >= 16) {
+        // merge two aligned source words for each aligned store
+        // reading the whole aligned word around the last source byte never crosses a page
+        const uint64* sw = (const uint64*) (s - off);
+        int rs = off * 8, ls = 64 - rs;
+        uint64 w0 = *sw++;
+        for (; n >= 8; n -= 8, s += 8) {
+            uint64 w1 = *sw++;
+            *dw++ = ((w0 >> rs) | (w1 << ls));
+            w0 = w1;
+        }
+    }
+
+    d = (char*) dw;
+    while (n-- > 0)
+        *d++ = *s++;
+}
+
+
+// backward copy for overlapping areas with d > s
+static void
+copy_words_back(char* d, const char* s, size_t n)
+{
+    d += n;
+    s += n;
+    if ((((uint64) d ^ (uint64) s) & 7) == 0) {
+        while (n > 0 && ((uint64) d & 7)) {
+            *--d = *--s;
+            n--;
+        }
+        uint64* dw = (uint64*) d;
+        const uint64* sw = (const uint64*) s;
+        for (; n >= 32; n -= 32) {
+            dw -= 4;
+            sw -= 4;
+            uint64 a = sw[3], b = sw[2], c = sw[1], e = sw[0];
+            dw[3] = a;
+            dw[2] = b;
+            dw[1] = c;
+            dw[0] = e;
+        }
+        for (; n >= 8; n -= 8)
+            *--dw = *--sw;
+        d = (char*) dw;
+        s = (const char*) sw;
+    }
+    while (n-- > 0)
+        *--d = *--s;
 }
 
 
 void*
 memset(void *dst, int c, size_t n)
 {
-    char *cdst = (char *) dst;
-        int i;
-    for (i = 0; i < n; i++) {
-        cdst[i] = c;
-    }
+    if (vec_memset && n >= VEC_MIN)
+        vec_set(dst, c, n);
+    else
+        set_words(dst, c, n);
     return dst;
 }
 
@@ -93,12 +269,21 @@ memset(void *dst, int c, size_t n)
 int
 memcmp(const void *v1, const void *v2, size_t n)
 {
-    const char *s1, *s2;
+    const uint8 *s1 = v1, *s2 = v2;
 
-    s1 = v1;
-    s2 = v2;
-    while(n-- > 0){
-        if(*s1 != *s2)
+    // skip equal words, the differing byte is found below
+    if ((((uint64) s1 ^ (uint64) s2) & 7) == 0) {
+        while (n > 0 && ((uint64) s1 & 7)) {
+            if (*s1 != *s2)
+                return *s1 - *s2;
+            s1++, s2++, n--;
+        }
+        while (n >= 8 && *(const uint64*) s1 == *(const uint64*) s2)
+            s1 += 8, s2 += 8, n -= 8;
+    }
+
+    while (n-- > 0) {
+        if (*s1 != *s2)
             return *s1 - *s2;
         s1++, s2++;
     }
@@ -110,22 +295,21 @@ memcmp(const void *v1, const void *v2, size_t n)
 void*
 memmove(void *dst, const void *src, size_t n)
 {
-    const char *s;
-    char *d;
+    char* d = dst;
+    const char* s = src;
 
-    if(n == 0)
+    if (n == 0 || d == s)
         return dst;
-  
-    s = src;
-    d = dst;
-    if(s < d && s + n > d){
-        s += n;
-        d += n;
-        while(n-- > 0)
-            *--d = *--s;
-    } else
-        while(n-- > 0)
-            *d++ = *s++;
+
+    // forward copy is safe unless dst starts inside src
+    if (d < s || d >= s + n) {
+        if (vec_memcpy && n >= VEC_MIN)
+            vec_copy(d, s, n);
+        else
+            copy_words(d, s, n);
+    }
+    else
+        copy_words_back(d, s, n);
 
     return dst;
 }
@@ -137,9 +321,31 @@ memcpy(void *dst, const void *src, size_t n)
     return memmove(dst, src, n);
 }
 
+
+void
+clear_page(void* page)
+{
+    if (vec_memset)
+        vec_set(page, 0, PGSIZE);
+    else
+        set_words(page, 0, PGSIZE);
+}
+
+
+void
+copy_page(void* dst, const void* src)
+{
+    if (vec_memcpy)
+        vec_copy(dst, src, PGSIZE);
+    else
+        copy_words(dst, src, PGSIZE);
+}
+
 void* memdup(const void *src, size_t n)
 {
     void *dst = kalloc(n);
+    if (dst == NULL)
+        return NULL;
     return memcpy(dst, src, n);
 }
 
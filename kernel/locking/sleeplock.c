@@ -0,0 +1,60 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+
+#include <locking/sleeplock.h>
+#include <proc/proc.h>
+#include <proc/wait.h>
+
+void
+sleeplock_init(struct sleeplock* lk, const char* name)
+{
+    lk->locked = UNLOCKED;
+    lk->proc = NULL;
+
+    strncpy(lk->name, name, SPINLOCK_NAME_MAX_LEN);
+}
+
+
+int
+sleeplock_holding(struct sleeplock* lk)
+{
+    return (lk->locked && lk->proc == myproc());
+}
+
+
+int
+sleeplock_trylock(struct sleeplock* lk)
+{
+    if (__sync_lock_test_and_set(&lk->locked, LOCKED) != UNLOCKED)
+        return 0;
+    lk->proc = myproc();
+    return 1;
+}
+
+
+// the lock is waited for on its chan, so a release never has to look at the waiters
+void
+sleeplock_acquire(struct sleeplock* lk)
+{
+    while (!sleeplock_trylock(lk)) {
+        Assert(myproc() != NULL, "sleeplock %s is contended before any process runs", lk->name);
+        wait_event_chan(lk, lk->locked == UNLOCKED);
+    }
+}
+
+
+void
+sleeplock_release(struct sleeplock* lk)
+{
+    Assert(lk->locked, "try to release sleeplock %s, which is not held", lk->name);
+
+    lk->proc = NULL;
+
+    __sync_synchronize();
+
+    __sync_lock_release(&lk->locked);
+
+    // only the address is used, lk itself may be gone already
+    wakeup(lk);
+}
@@ -5,10 +5,14 @@
 #include <trap/trap.h>
 #include <mm/memlayout.h>
 #include <mm/mm.h>
+#include <mm/asid.h>
+#include <mm/zero_pool.h>
 #include <irq/interrupt.h>
 #include <trap/context.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <proc/smp.h>
+#include <proc/timer.h>
 #include <init.h>
 #include <io/blk.h>
 #include <io/chr.h>
@@ -34,17 +38,42 @@ struct page* pages;
 extern void timer_enable();
 #endif
 
+// the first hart to reach main boots the kernel
+static volatile int boot_hart = -1;
+
+
+// other harts are started by smp_boot once everything shared is set up,
+// so that only what belongs to the hart itself is left
+static void
+secondary_main()
+{
+    kvminithart();
+    trap_init_hart();
+    irq_init_hart();
+    timer_init_hart();
+    smp_online();
+    out("cpu%d online", (int) r_cpuid());
+
+    scheduler();
+}
+
+
 int 
 main()
 {
+    if (__sync_val_compare_and_swap(&boot_hart, -1, (int) r_cpuid()) != -1)
+        secondary_main();
+
     uart_init();
     out("Initialize uart0");
+    string_init();
 
     kinit();
     kvminit();
     out("Initialize vm");
     kvminithart();
     out("Enable paging");
+    asid_init();
 
     trap_init();
     trap_init_hart();
@@ -53,6 +82,7 @@ main()
     out("Initialize interrupt");
     proc_init();
     out("Initialize first proc");
+    zero_pool_thread_init();
 
 #ifdef __loongarch64
 #include <drivers/pci.h>
@@ -66,6 +96,8 @@ main()
     vfilesys_init();
     out("Initialize vfs");
 
+    smp_boot();
+
     out("call scheduler");
     scheduler();
 
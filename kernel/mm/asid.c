@@ -0,0 +1,102 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/asid.h>
+#include <locking/spinlock.h>
+
+static SPINLOCK_DEFINE(asid_lock);
+static int asid_bits;
+static uint64 nr_asids;
+static uint64* asid_map;                // asids used in current generation
+static uint64 next_asid;
+static volatile uint64 asid_generation; // always a nonzero multiple of nr_asids
+static volatile uint8 flush_pending[NCPU];
+
+#define ASID_MASK   (nr_asids - 1)
+#define ASID_GEN(asid) ((asid) & ~ASID_MASK)
+
+
+void
+asid_init()
+{
+    asid_bits = MIN(asid_hw_bits(), ASID_MAX_BITS);
+    nr_asids = (1UL << asid_bits);
+    // a zero asid field in upagetable never matches the current generation
+    asid_generation = nr_asids;
+    next_asid = 1;
+
+    if (asid_bits == 0) {
+        log("no asid, full tlb flush on every address space switch");
+        return;
+    }
+
+    asid_map = kcalloc((nr_asids + 63) / 64, sizeof(uint64));
+    Assert(asid_map, "no memory for asid map");
+    asid_map[0] = 1;    // asid 0 is for kernel
+    log("%d asid bits", asid_bits);
+}
+
+
+// caller must hold asid_lock
+static uint64
+new_asid()
+{
+    uint64 asid = next_asid;
+    while (asid < nr_asids && (asid_map[asid / 64] & (1UL << (asid % 64))))
+        asid++;
+
+    if (asid == nr_asids) {
+        // all used, start a new generation, every cpu flushes before using one of them
+        asid_generation += nr_asids;
+        memset(asid_map, 0, (nr_asids + 63) / 64 * sizeof(uint64));
+        asid_map[0] = 1;
+        for (int i = 0; i < NCPU; i++)
+            flush_pending[i] = 1;
+        asid = 1;
+    }
+
+    asid_map[asid / 64] |= (1UL << (asid % 64));
+    next_asid = asid + 1;
+    return (asid_generation | asid);
+}
+
+
+uint64
+asid_switch(upagetable* upgtbl)
+{
+    int cpu = r_cpuid();
+    // never cleared, entries may outlive the switch to another address space
+    if (!(upgtbl->cpus & (1UL << cpu)))
+        __sync_fetch_and_or(&upgtbl->cpus, 1UL << cpu);
+
+    if (asid_bits == 0)
+        return 0;
+
+    uint64 asid = upgtbl->asid;
+    if (ASID_GEN(asid) == asid_generation && !flush_pending[cpu])
+        return (asid & ASID_MASK);
+
+    spinlock_acquire(&asid_lock);
+    if (ASID_GEN(upgtbl->asid) != asid_generation)
+        upgtbl->asid = new_asid();
+    if (flush_pending[cpu]) {
+        flush_tlb();
+        flush_pending[cpu] = 0;
+    }
+    asid = upgtbl->asid;
+    spinlock_release(&asid_lock);
+
+    return (asid & ASID_MASK);
+}
+
+
+int64
+asid_of(upagetable* upgtbl)
+{
+    if (asid_bits == 0 || upgtbl == NULL)
+        return -1;
+    uint64 asid = upgtbl->asid;
+    return (ASID_GEN(asid) == asid_generation ? (int64) (asid & ASID_MASK) : -1);
+}
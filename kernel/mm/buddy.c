@@ -4,8 +4,11 @@
 #include <mm/page.h>
 #include <mm/buddy.h>
 #include <mm/memlayout.h>
+#include <mm/reclaim.h>
+#include <irq/interrupt.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
 
-extern struct page* pages;
 struct zone zone;
 
 static inline int 
@@ -19,56 +22,68 @@ get_order(uint64 size)
 }
 
 
-static inline void
-add_first(uint64 addr, int order)
+// pfn is taken from the address, so that blocks are aligned physically,
+// which megapages rely on
+static inline uint64
+page_to_pfn(struct page* page)
 {
-    assert(IS_PGALIGNED(addr));
-    struct block* new_block = (struct block*) addr;
-    new_block->order = order;
+    return (PAGE_ADDR(page) >> PGSHIFT);
+}
 
-    struct block* first_block = zone.free_area[order].free_list.next;
-    zone.free_area[order].free_list.next = new_block;
-    new_block->prev = &zone.free_area[order].free_list;
-    new_block->next = first_block;
-    first_block->prev = new_block;
 
-    zone.free_area[order].nr_free++;
+static inline struct page*
+pfn_to_page(uint64 pfn)
+{
+    return GET_PAGE((pfn << PGSHIFT));
 }
 
 
 static inline void
-add_last(uint64 addr, int order)
+add_first(struct page* page, int order)
 {
-    assert(IS_PGALIGNED(addr));
-    struct block* new_block = (struct block*) addr;
-    new_block->order = order;
-    // unsafe design
-    new_block->magic = BUDDY_MAGIC;
+    page->order = order;
+    page->flag |= PG_BUDDY;
+    list_insert(&zone.free_area[order].free_list, &page->list);
+    zone.free_area[order].nr_free++;
+    zone.nr_free_pages += BLOCK_NPAGES(order);
+}
 
-    struct block* last_block = zone.free_area[order].free_list.prev;
-    zone.free_area[order].free_list.prev = new_block;
-    new_block->next = &zone.free_area[order].free_list;
-    new_block->prev = last_block;
-    last_block->next = new_block;
 
+static inline void
+add_last(struct page* page, int order)
+{
+    page->order = order;
+    page->flag |= PG_BUDDY;
+    list_insert_end(&zone.free_area[order].free_list, &page->list);
     zone.free_area[order].nr_free++;
+    zone.nr_free_pages += BLOCK_NPAGES(order);
 }
 
 
 static inline void
-remove(struct block* remove_block)
+remove(struct page* page)
 {
-    struct block* prev_block = remove_block->prev;
-    struct block* next_block = remove_block->next;
-    prev_block->next = next_block;
-    next_block->prev = prev_block;
-    // nop, you should not do this
-    // buddy_free(remove_block, remove_block->order);
-    zone.free_area[remove_block->order].nr_free--;
-    // need to clear this block
-    // once allocated but not used, buddy_free will free it
-    remove_block->order = -1;
-    remove_block->magic = 0;
+    assert(page->flag & PG_BUDDY);
+    list_remove(&page->list);
+    zone.free_area[page->order].nr_free--;
+    zone.nr_free_pages -= BLOCK_NPAGES(page->order);
+    page->flag &= ~PG_BUDDY;
+}
+
+
+// cut [pfn, end_pfn) into the largest naturally aligned blocks
+// return end_pfn
+static uint64
+add_range(uint64 pfn, uint64 end_pfn)
+{
+    while (pfn < end_pfn) {
+        int order = MAX_ORDER - 1;
+        while ((pfn & (BLOCK_NPAGES(order) - 1)) || pfn + BLOCK_NPAGES(order) > end_pfn)
+            order--;
+        add_last(pfn_to_page(pfn), order);
+        pfn += BLOCK_NPAGES(order);
+    }
+    return pfn;
 }
 
 
@@ -80,68 +95,63 @@ buddy_init(uint64 start, uint64 end)
     uint64 e = PGROUNDDOWN(end);
     debug("buddy alloc %lx - %lx", s, e);
     uint64 npages = ((e - s) >> PGSHIFT);
-    uint64 npages_copy = npages;
     debug("npages: %#lx, size is: %#lx", npages, npages << PGSHIFT);
     memset(&zone, 0, sizeof(struct zone));
     Assert(s <= e, "Get s %lx, but e %lx", s, e);
-    // log("compute the number of init blocks for each free_area");
+    zone.start_page = GET_PAGE(s);
+    zone.nr_pages = npages;
 
-    // compute the number of init blocks for each free_area
-    uint64 square_npages = (MAX_ORDER * BLOCK_NPAGES(MAX_ORDER - 1));
-    if (npages > square_npages) {
-        npages -= square_npages;
-        for (int i = 0; i < MAX_ORDER; i++) {
-            zone.free_area[i].nr_free = (1 << (MAX_ORDER - 1 - i));
-        }
+    for (int i = 0; i < MAX_ORDER; i++)
+        INIT_LIST_HEAD(zone.free_area[i].free_list);
+
+    spinlock_init(&zone.lock, "zone");
+    for (int i = 0; i < NCPU; i++) {
+        struct per_cpu_pages* pcp = &zone.pcp[i];
+        spinlock_init(&pcp->lock, "pcp");
+        INIT_LIST_HEAD(pcp->list);
+        pcp->high = PCP_HIGH;
+        pcp->batch = PCP_BATCH;
     }
 
-    for (int i = MAX_ORDER - 1; i >= 0; i--) {
-        zone.free_area[i].nr_free += (npages >> i);
-        npages &= ((1 << i) - 1);
+    // every block must be aligned to its own size, so that its buddy can be found by pfn
+    uint64 pfn = page_to_pfn(zone.start_page);
+    uint64 end_pfn = pfn + npages;
+    uint64 max_npages = BLOCK_NPAGES(MAX_ORDER - 1);
 
-        // init link list
-        zone.free_area[i].free_list.prev = &zone.free_area[i].free_list;
-        zone.free_area[i].free_list.next = &zone.free_area[i].free_list;
-    }
+    // head up to the first boundary of the largest block
+    pfn = add_range(pfn, MIN(ROUNDUP(pfn, max_npages), end_pfn));
 
-    for (int i = 0; i < MAX_ORDER; i++)
-        npages_copy -= BLOCK_NPAGES(i) * zone.free_area[i].nr_free;
-    assert(npages_copy == 0);
-    // log("allocate blocks");
-
-    // allocate blocks
-    for (int i = 0; i < MAX_ORDER; i++) {
-        uint64 current_block_size = BLOCK_SIZE(i);
-        int nr_alloc = zone.free_area[i].nr_free;
-        zone.free_area[i].nr_free = 0;
-        // log("order %d get %d block, each block %d pages, start at %p", i, nr_alloc, (int)(current_block_size >> PGSHIFT), (void*)s);
-        for (int j = 0; j < nr_alloc; j++) {
-            // log("alloc %p", (void*) s);
-            add_last(s, i);
-            s += current_block_size;
+    // give each order some blocks to start with, each order takes max_npages pages,
+    // so blocks stay aligned
+    if (end_pfn - pfn > MAX_ORDER * max_npages) {
+        for (int i = 0; i < MAX_ORDER; i++) {
+            for (int j = 0; j < BLOCK_NPAGES(MAX_ORDER - 1 - i); j++) {
+                add_last(pfn_to_page(pfn), i);
+                pfn += BLOCK_NPAGES(i);
+            }
         }
     }
 
-    assert(s == e);
+    pfn = add_range(pfn, end_pfn);
+    assert(pfn == end_pfn && zone.nr_free_pages == npages);
 }
 
 
 // 1. find a bigger block and split it
 // 2. split to 1/2 + 1/4 ... + 1/2^n + 1/2^n
 // 3. a 1/2^n will be stored in list_free_list, return the other
-static inline void*
+static inline struct page*
 require(int order)
 {
     for (int i = order + 1; i < MAX_ORDER; i++) {
         if (zone.free_area[i].nr_free) {
-            struct block* free_block = zone.free_area[i].free_list.prev;
-            remove(free_block);
-            uint64 addr = (uint64) free_block;
+            struct page* page = container_of(zone.free_area[i].free_list.prev, struct page, list);
+            remove(page);
             for (int j = i - 1; j >= order; j--) {
-                add_first(addr, j);
-                addr += BLOCK_SIZE(j);
+                add_first(page, j);
+                page += BLOCK_NPAGES(j);
             }
-            return (void*) addr;
+            return page;
         } 
         else continue;
     }
@@ -149,54 +159,275 @@ require(int order)
 }
 
 
+// take a block of given order from free_area
+// caller must hold zone.lock
+static inline struct page*
+rmqueue(int order)
+{
+    if (zone.free_area[order].nr_free) {
+        struct page* page = container_of(zone.free_area[order].free_list.prev, struct page, list);
+        remove(page);
+        return page;
+    }
+    return require(order);
+}
+
+
+// merge with free buddies as long as possible, only struct page is touched
+// caller must hold zone.lock
+static void
+buddy_free_helper(struct page* page, int order)
+{
+    uint64 start_pfn = page_to_pfn(zone.start_page);
+    uint64 pfn = page_to_pfn(page);
+    while (order < MAX_ORDER - 1) {
+        uint64 buddy_pfn = BUDDY_PFN(pfn, order);
+        if (buddy_pfn < start_pfn || buddy_pfn - start_pfn >= zone.nr_pages)
+            break;
+        struct page* buddy = pfn_to_page(buddy_pfn);
+        if (!(buddy->flag & PG_BUDDY) || buddy->order != order)
+            break;
+        remove(buddy);
+        pfn = BUDDY_LOW_PFN(pfn, order);
+        order++;
+    }
+    add_last(pfn_to_page(pfn), order);
+}
+
+
+static inline void
+pcp_add(struct per_cpu_pages* pcp, struct page* page, int cold)
+{
+    page->order = 0;
+    if (cold)
+        list_insert_end(&pcp->list, &page->list);
+    else
+        list_insert(&pcp->list, &page->list);
+    pcp->count++;
+}
+
+
+static inline struct page*
+pcp_del(struct per_cpu_pages* pcp, int cold)
+{
+    struct list_head* entry = (cold ? pcp->list.prev : pcp->list.next);
+    list_remove(entry);
+    pcp->count--;
+    return container_of(entry, struct page, list);
+}
+
+
+// move up to pcp->batch pages from zone to pcp
+// caller must hold pcp->lock
+static void
+pcp_refill(struct per_cpu_pages* pcp)
+{
+    spinlock_acquire(&zone.lock);
+    for (int i = 0; i < pcp->batch; i++) {
+        struct page* page = rmqueue(0);
+        if (page == NULL)
+            break;
+        // keep refilled pages in address order, tail is the coldest
+        pcp_add(pcp, page, 1);
+    }
+    spinlock_release(&zone.lock);
+    pcp->nr_refill++;
+}
+
+
+// give nr coldest pages of pcp back to zone
+// caller must hold pcp->lock
+static int
+pcp_drain(struct per_cpu_pages* pcp, int nr)
+{
+    int drained = 0;
+    spinlock_acquire(&zone.lock);
+    while (drained < nr && pcp->count > 0) {
+        buddy_free_helper(pcp_del(pcp, 1), 0);
+        drained++;
+    }
+    spinlock_release(&zone.lock);
+    pcp->nr_drain++;
+    return drained;
+}
+
+
+static struct page*
+pcp_alloc()
+{
+    irq_pushoff();
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    spinlock_acquire(&pcp->lock);
+
+    if (pcp->count == 0) {
+        pcp->alloc_miss++;
+        pcp_refill(pcp);
+    } else {
+        pcp->alloc_hit++;
+    }
+
+    struct page* page = (pcp->count ? pcp_del(pcp, 0) : NULL);
+    spinlock_release(&pcp->lock);
+    irq_popoff();
+    return page;
+}
+
+
+static void
+pcp_free(struct page* page)
+{
+    irq_pushoff();
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    spinlock_acquire(&pcp->lock);
+    pcp_add(pcp, page, 0);
+    if (pcp->count > pcp->high)
+        pcp_drain(pcp, pcp->batch);
+    spinlock_release(&pcp->lock);
+    irq_popoff();
+}
+
+
+static struct page*
+alloc_pages(int order)
+{
+    struct page* page;
+    if (order == 0) {
+        page = pcp_alloc();
+    } else {
+        spinlock_acquire(&zone.lock);
+        page = rmqueue(order);
+        spinlock_release(&zone.lock);
+    }
+    return page;
+}
+
+
+// give up cpu for a while, so that other processes may exit and free memory
+// only possible in process context with no spinlock held
+static int
+wait_for_memory()
+{
+    if (myproc() == NULL || mycpu()->noff > 0 || in_interrupt())
+        return 0;
+
+    int intr = intr_get();
+    intr_off();
+    yield();
+    if (intr) intr_on();
+    return 1;
+}
+
+
 void*
-buddy_alloc(uint64 sz)
+buddy_alloc_gfp(uint64 sz, gfp_t gfp)
 {
     assert(sz > 0);
     uint64 size = PGROUNDUP(sz);
     int order = get_order(size);
     assert(sz <= (PGSIZE << order));
+    if (order >= MAX_ORDER)
+        return NULL;
 
-    if (zone.free_area[order].nr_free) {
-        struct block* free_block = zone.free_area[order].free_list.prev;
-        remove(free_block);
-        SET_PAGE_ORDER(free_block, pages, order);
-        return (void*) free_block;
+    struct page* page = alloc_pages(order);
+
+    for (int i = 0; page == NULL && (gfp & __GFP_RECLAIM) && i < RECLAIM_RETRIES; i++) {
+        if (reclaim_pages(BLOCK_NPAGES(order)) == 0 && (gfp & __GFP_WAIT))
+            wait_for_memory();
+        page = alloc_pages(order);
     }
-    else {
-        void* require_result = require(order);
-        if (require_result != NULL) {
-            SET_PAGE_ORDER(require_result, pages, order);
-            return require_result;
-        } else TODO();    // allocator
-        panic("Memory is out");
+
+    if (page == NULL) {
+        if (gfp & __GFP_NOWARN)
+            return NULL;
+        warn("out of memory: order %d, gfp %#x, %lu pages free", order, gfp, buddy_nr_free_pages());
+        return NULL;
     }
 
-    return NULL;
+    page->order = order;
+    return (void*) PAGE_ADDR(page);
+}
+
+
+void*
+buddy_alloc(uint64 sz)
+{
+    return buddy_alloc_gfp(sz, GFP_KERNEL);
 }
 
 
 void
-buddy_free_helper(void* addr, int order)
+buddy_free(void* addr, int order)
 {
-    struct block* buddy = (struct block*) BUDDY_BLOCK(addr, order);
-    if (order < MAX_ORDER - 1 
-        && buddy->magic == BUDDY_MAGIC && buddy->order == order  
-        && IN_RAM(buddy->prev) && IN_RAM(buddy->next))
-    {
-        remove(buddy);
-        // memset((void*) BUDDY_HIGH(addr, order), 0, sizeof(struct block));
-        buddy_free_helper((void*) BUDDY_LOW(addr, order), order + 1);
+    struct page* page = GET_PAGE(addr);
+    Assert(!(page->flag & PG_BUDDY), "double free of %p", addr);
+    if (order == 0) {
+        pcp_free(page);
+    } else {
+        spinlock_acquire(&zone.lock);
+        buddy_free_helper(page, order);
+        spinlock_release(&zone.lock);
     }
-    else {
-        add_last((uint64) addr, order);
+}
+
+
+int
+buddy_drain_local()
+{
+    irq_pushoff();
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    spinlock_acquire(&pcp->lock);
+    int drained = pcp_drain(pcp, pcp->count);
+    spinlock_release(&pcp->lock);
+    irq_popoff();
+    return drained;
+}
+
+
+int
+buddy_drain_all()
+{
+    int drained = 0;
+    for (int i = 0; i < NCPU; i++) {
+        spinlock_acquire(&zone.pcp[i].lock);
+        drained += pcp_drain(&zone.pcp[i], zone.pcp[i].count);
+        spinlock_release(&zone.pcp[i].lock);
     }
+    return drained;
 }
 
+
+uint64
+buddy_nr_free_pages()
+{
+    uint64 nr = zone.nr_free_pages;
+    for (int i = 0; i < NCPU; i++)
+        nr += zone.pcp[i].count;
+    return nr;
+}
+
+
 void
-buddy_free(void* addr, int order)
+buddy_get_stat(struct buddy_stat* st)
 {
-    // assert(GET_PAGE_ORDER(addr, pages) == order);
-    SET_PAGE_ORDER(addr, pages, 0);
-    buddy_free_helper(addr, order);
+    memset(st, 0, sizeof(*st));
+
+    spinlock_acquire(&zone.lock);
+    st->nr_pages = zone.nr_pages;
+    for (int i = 0; i < MAX_ORDER; i++)
+        st->nr_free[i] = zone.free_area[i].nr_free;
+    for (int i = 0; i < NCPU; i++) {
+        st->nr_pcp += zone.pcp[i].count;
+        st->pcp_hit += zone.pcp[i].alloc_hit;
+        st->pcp_miss += zone.pcp[i].alloc_miss;
+    }
+    spinlock_release(&zone.lock);
+
+    for (uint64 i = 0; i < zone.nr_pages; i++) {
+        struct page* page = zone.start_page + i;
+        if (page->cnt > 1) {
+            st->nr_shared++;
+            if (page->flag & PG_CACHE)
+                st->nr_shared_cache++;
+        }
+    }
 }
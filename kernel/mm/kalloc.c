@@ -1,46 +1,52 @@
 #include <common.h>
 #include <mm/page.h>
 #include <mm/buddy.h>
+#include <mm/slab.h>
+#include <mm/zero_pool.h>
 #include <debug.h>
 #include <klib.h>
 
+// small objects come from slab, others from buddy system
 void*
-kalloc(uint64 sz)
+kalloc_gfp(uint64 sz, gfp_t gfp)
 {
     assert(sz > 0);
-    // void* res;
-    // if (sz > NR_OBJS * OBJECT_SIZE)
-    //     res = buddy_alloc(sz);
-    // else
-    //     res = slab_alloc(sz);
-    // debug("kalloc: 0x%p, sz = %lu", res, sz);
-    // return res;
-    
-    // if (sz > NR_OBJS * OBJECT_SIZE)
-    //     return buddy_alloc(sz);
-    // else
-    //     return slab_alloc(sz);
-    return buddy_alloc(sz);
+    void* addr;
+    if (sz <= KMALLOC_MAX_SIZE)
+        addr = kmalloc(sz, gfp);
+    else {
+        // a pre-zeroed page saves clearing on the caller's path
+        if ((gfp & __GFP_ZERO) && sz <= PGSIZE && (addr = zero_pool_get()) != NULL)
+            return addr;
+        addr = buddy_alloc_gfp(sz, gfp);
+    }
+
+    if (addr && (gfp & __GFP_ZERO))
+        memset(addr, 0, sz);
+    return addr;
+}
+
+void*
+kalloc(uint64 sz)
+{
+    return kalloc_gfp(sz, GFP_KERNEL);
 }
 
 void *
 kcalloc(uint64 nr, uint64 sz)
 {
-    void* addr = kalloc(nr*sz);
-    memset(addr, 0, nr*sz);
-    return addr;
+    return kalloc_gfp(nr*sz, GFP_KERNEL | __GFP_ZERO);
 }
 
+// slab objects are never page-aligned, since slab header lives at the start of page
 void
 kfree(void *addr)
 {
-    // debug("kfree: 0x%p", addr);
-    buddy_free(addr, GET_PAGE_ORDER(addr, pages));
-    // if (IS_PGALIGNED(addr)) {
-    //     buddy_free(addr, GET_PAGE_ORDER(addr, pages));
-    // } else {
-    //     struct slab* s = SLAB(addr);
-    //     int idx = OBJECT_IDX(addr);
-    //     slab_free(addr, s->objs[idx].size);
-    // }
+    if (addr == NULL)
+        return;
+
+    if (IS_SLAB_OBJ(addr))
+        slab_free(addr);
+    else
+        buddy_free(addr, GET_PAGE_ORDER(addr, pages));
 }
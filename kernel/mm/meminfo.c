@@ -0,0 +1,179 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/slab.h>
+#include <mm/page_cache.h>
+#include <mm/swap.h>
+#include <mm/zram.h>
+#include <mm/zero_pool.h>
+#include <mm/shmem.h>
+#include <mm/meminfo.h>
+#include <proc/proc.h>
+#include <proc/kstack.h>
+
+#define LINE_MAX    128
+
+struct meminfo_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static const char* state_name[NR_PROC_STATE] = {
+    [INIT] = "I", [SLEEPING] = "S", [RUNNABLE] = "R", [RUNNING] = "R", [ZOMBIE] = "Z",
+};
+
+
+// append one formatted line, lines that do not fit are dropped as a whole
+// vsnprintf bounds the format rather than the output, so format into a line first
+static void
+emit(struct meminfo_buf* m, const char* fmt, ...)
+{
+    char line[LINE_MAX];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsprintf(line, fmt, ap);
+    va_end(ap);
+    assert(len < LINE_MAX);
+
+    if (m->len + len < m->size) {
+        memcpy(m->buf + m->len, line, len + 1);
+        m->len += len;
+    }
+}
+
+
+static void
+show_buddy(struct meminfo_buf* m)
+{
+    struct buddy_stat st;
+    buddy_get_stat(&st);
+
+    emit(m, "mem_total_pages %lu\n", st.nr_pages);
+    emit(m, "mem_free_pages %lu\n", buddy_nr_free_pages());
+    for (int i = 0; i < MAX_ORDER; i++)
+        emit(m, "buddy_free_blocks %d %lu\n", i, st.nr_free[i]);
+    emit(m, "pcp_pages %lu\n", st.nr_pcp);
+    emit(m, "pcp_alloc_hit %lu\n", st.pcp_hit);
+    emit(m, "pcp_alloc_miss %lu\n", st.pcp_miss);
+    emit(m, "shared_pages %lu\n", st.nr_shared);
+    emit(m, "shared_cache_pages %lu\n", st.nr_shared_cache);
+
+    struct zero_pool_stat zp;
+    zero_pool_get_stat(&zp);
+    emit(m, "zero_pool_pages %lu\n", zp.nr_pages);
+    emit(m, "zero_pool_hit %lu\n", zp.nr_hit);
+    emit(m, "zero_pool_miss %lu\n", zp.nr_miss);
+    emit(m, "zero_pool_zeroed %lu\n", zp.nr_zeroed);
+}
+
+
+static void
+show_cache_and_swap(struct meminfo_buf* m)
+{
+    uint64 nr_dirty;
+    uint64 nr_cached = page_cache_nr_pages(&nr_dirty);
+    emit(m, "page_cache_pages %lu\n", nr_cached);
+    emit(m, "page_cache_dirty %lu\n", nr_dirty);
+    emit(m, "shmem_pages %lu\n", shmem_nr_pages());
+
+    struct kstack_stat ks;
+    kstack_get_stat(&ks);
+    emit(m, "kstack_active %lu\n", ks.nr_active);
+    emit(m, "kstack_cached %lu\n", ks.nr_cached);
+    emit(m, "kstack_alloc_hit %lu\n", ks.nr_hit);
+    emit(m, "kstack_alloc_miss %lu\n", ks.nr_miss);
+
+    struct swap_stat sw;
+    struct zram_stat zr;
+    swap_get_stat(&sw);
+    zram_get_stat(&zr);
+    emit(m, "anon_lru_pages %lu\n", sw.nr_anon);
+    emit(m, "swap_pages %lu\n", zr.nr_slots);
+    emit(m, "swap_same_filled %lu\n", zr.nr_same_filled);
+    emit(m, "swap_compr_bytes %lu\n", zr.compr_bytes);
+    emit(m, "swap_pool_pages %lu\n", zr.pool_pages);
+    emit(m, "swap_rejected %lu\n", zr.nr_rejected);
+    emit(m, "swapout_total %lu\n", sw.nr_swapout);
+    emit(m, "swapin_total %lu\n", sw.nr_swapin);
+    emit(m, "swapin_ns_avg %lu\n", sw.nr_swapin ? sw.swapin_ns / sw.nr_swapin : 0);
+    emit(m, "swapin_ns_max %lu\n", sw.swapin_ns_max);
+}
+
+
+static void
+show_slab(struct meminfo_buf* m)
+{
+    struct slab_stat* st = kalloc(PGSIZE);
+    if (st == NULL)
+        return;
+
+    int n = kmem_cache_get_stat(st, PGSIZE / sizeof(struct slab_stat));
+    n = MIN(n, PGSIZE / sizeof(struct slab_stat));
+    for (int i = 0; i < n; i++)
+        emit(m, "slab %s %u %lu %lu %lu\n",
+             st[i].name, st[i].obj_size, st[i].nr_active, st[i].nr_objs, st[i].nr_slabs);
+    kfree(st);
+}
+
+
+static void
+show_proc(struct meminfo_buf* m)
+{
+    struct mm_rss rss;
+    char name[sizeof(((struct proc*) 0)->name)];
+
+    // the rss walk sleeps on the address space lock, so procs are visited
+    // by increasing pid, each picked under proc_list_lock and walked without it
+    for (int last = -1; ; ) {
+        struct proc* p = NULL;
+        upagetable* upgtbl = NULL;
+        spinlock_acquire(&proc_list_lock);
+        for (struct proc* np = proc_list; np; np = np->next)
+            if (np->pid > last && (p == NULL || np->pid < p->pid))
+                p = np;
+        if (p == NULL) {
+            spinlock_release(&proc_list_lock);
+            break;
+        }
+        int pid = p->pid, state = p->state;
+        uint64 min_flt = p->min_flt, maj_flt = p->maj_flt;
+        strncpy(name, p->name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        // pinned so that proc_set_pagetable can not free it under us
+        spinlock_acquire(&p->lock);
+        if (state != ZOMBIE && (upgtbl = p->pagetable) != NULL)
+            upgtbl_incr(upgtbl);
+        spinlock_release(&p->lock);
+        spinlock_release(&proc_list_lock);
+        last = pid;
+
+        if (upgtbl == NULL)
+            continue;
+        sleeplock_acquire(&upgtbl->lock);
+        uvm_get_rss(UPGTBL(upgtbl), &rss);
+        sleeplock_release(&upgtbl->lock);
+        upgtbl_put(upgtbl);
+        emit(m, "proc %d %s %s %lu %lu %lu %lu %lu\n",
+             pid, state_name[state], name[0] ? name : "-",
+             rss.resident, rss.shared, rss.swapped, min_flt, maj_flt);
+    }
+}
+
+
+size_t
+meminfo_show(char* buf, size_t size)
+{
+    struct meminfo_buf m = { .buf = buf, .size = size, .len = 0 };
+    if (size > 0)
+        buf[0] = '\0';
+
+    show_buddy(&m);
+    show_cache_and_swap(&m);
+    show_slab(&m);
+    show_proc(&m);
+    return m.len;
+}
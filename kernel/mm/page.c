@@ -2,13 +2,24 @@
 #include <arch.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
+#include <debug.h>
 
 extern char end[], etext[];
 
+char* zero_page;
+
+void
+zero_page_init()
+{
+    zero_page = kalloc(PGSIZE);
+    Assert(zero_page, "no memory for zero page");
+    clear_page(zero_page);
+}
+
 int
 page_ref_inc(uint64 pa)
 {
-    if (pa < (uint64) pages || pa > PHYSTOP)
+    if (pa < (uint64) pages || pa > PHYSTOP || IS_ZERO_PAGE(pa))
         return -1;
     struct page* p = GET_PAGE(pa);
     return __sync_fetch_and_add(&p->cnt, 1);
@@ -17,23 +28,39 @@ page_ref_inc(uint64 pa)
 int
 page_ref_dec(uint64 pa)
 {
-    if (pa < (uint64) pages || pa > PHYSTOP)
+    if (pa < (uint64) pages || pa > PHYSTOP || IS_ZERO_PAGE(pa))
         return -1;
     struct page* p = GET_PAGE(pa);
     return __sync_fetch_and_sub(&p->cnt, 1);
 }
 
+int
+page_ref_count(uint64 pa)
+{
+    if (pa < (uint64) pages || pa > PHYSTOP || IS_ZERO_PAGE(pa))
+        return -1;
+    return GET_PAGE(pa)->cnt;
+}
+
 pagetable_t alloc_pagetable() {
-    pagetable_t pgtbl = (pagetable_t) kalloc(PGSIZE);
-    memset(pgtbl, 0, PGSIZE);
+    pagetable_t pgtbl = (pagetable_t) kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+    // a root not wrapped by upgtbl_init yet has no address space to lock
+    if (pgtbl)
+        GET_PAGE(pgtbl)->upgtbl = NULL;
     return pgtbl;
 }
 
 upagetable* 
 upgtbl_init(pagetable_t pagetable) {
     KALLOC(upagetable, ret);
+    if (ret == NULL)
+        return NULL;
     ret->pgtbl = pagetable;
     ret->cnt = 1;
+    ret->asid = 0;
+    ret->cpus = 0;
+    sleeplock_init(&ret->lock, "upagetable");
+    GET_PAGE(KERNEL_PA2VA(pagetable))->upgtbl = ret;
     return ret;
 }
 
@@ -50,3 +77,14 @@ int upgtbl_incr(upagetable* upgtbl) {
 int upgtbl_decr(upagetable* upgtbl) {
     return __sync_fetch_and_sub(&upgtbl->cnt, 1);
 }
+
+void
+upgtbl_put(upagetable* upgtbl) {
+    if (upgtbl == NULL || upgtbl_decr(upgtbl) > 1)
+        return;
+    // reclaim may still reach the pages through rmap until they are unmapped
+    sleeplock_acquire(&upgtbl->lock);
+    free_pgtbl(upgtbl->pgtbl, NULL);
+    sleeplock_release(&upgtbl->lock);
+    kfree(upgtbl);
+}
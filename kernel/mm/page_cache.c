@@ -0,0 +1,408 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/slab.h>
+#include <mm/reclaim.h>
+#include <mm/page_cache.h>
+#include <fs/fs.h>
+#include <fs/file.h>
+#include <fs/fcntl.h>
+#include <locking/spinlock.h>
+
+static struct list_head page_cache_hash[PAGE_CACHE_HASH_SIZE];
+static DECLARE_LIST_HEAD(page_cache_lru);
+static SPINLOCK_DEFINE(page_cache_lock);
+static struct kmem_cache* page_cache_cachep;
+static uint64 nr_cached_pages;
+// bumped when cached file data changes, a page read meanwhile may be stale
+static uint64 page_cache_gen;
+
+
+static inline struct list_head*
+page_cache_bucket(struct mountpoint* mp, uint32 ino, uint64 index)
+{
+    uint64 key = ((uint64) mp >> 4) ^ ((uint64) ino << 16) ^ index;
+    key ^= (key >> 8);
+    return &page_cache_hash[key % PAGE_CACHE_HASH_SIZE];
+}
+
+
+// caller must hold page_cache_lock
+static struct page_cache*
+find_page(struct mountpoint* mp, uint32 ino, uint64 index)
+{
+    struct page_cache* pc;
+    struct list_head* bucket = page_cache_bucket(mp, ino, index);
+    list_for_each_entry(pc, bucket, hash) {
+        if (pc->mp == mp && pc->ino == ino && pc->index == index)
+            return pc;
+    }
+    return NULL;
+}
+
+
+int
+page_cache_mappable(struct file* file)
+{
+    struct inode* inode = file->f_inode;
+    return (inode && inode->i_mp && inode->i_ino != 0 && !(file->f_flags & O_DIRECTORY));
+}
+
+
+void*
+page_cache_get(struct file* file, uint64 index)
+{
+    struct mountpoint* mp = file->f_inode->i_mp;
+    uint32 ino = file->f_inode->i_ino;
+
+    spinlock_acquire(&page_cache_lock);
+    struct page_cache* pc = find_page(mp, ino, index);
+    if (pc) {
+        list_remove(&pc->lru);
+        list_insert_end(&page_cache_lru, &pc->lru);
+        page_ref_inc((uint64) pc->page);
+        spinlock_release(&page_cache_lock);
+        return pc->page;
+    }
+    uint64 gen = page_cache_gen;
+    spinlock_release(&page_cache_lock);
+
+    // read without page_cache_lock, file system may sleep, and allocation may reclaim from us
+    struct page_cache* new_pc = kmem_cache_alloc(page_cache_cachep);
+    char* page = kalloc(PGSIZE);
+    if (new_pc == NULL || page == NULL)
+        goto bad;
+
+    // part beyond end of file reads as 0
+    clear_page(page);
+    off_t off = (index << PGSHIFT);
+    if (call_interface(file->f_op, read, ssize_t, file, page, PGSIZE, &off) < 0)
+        goto bad;
+
+    spinlock_acquire(&page_cache_lock);
+    pc = find_page(mp, ino, index);
+    if (pc) {
+        // someone else has read the same page meanwhile
+        page_ref_inc((uint64) pc->page);
+        spinlock_release(&page_cache_lock);
+        kmem_cache_free(page_cache_cachep, new_pc);
+        kfree(page);
+        return pc->page;
+    }
+    if (page_cache_gen != gen) {
+        // the file was written or truncated while we read it
+        spinlock_release(&page_cache_lock);
+        kmem_cache_free(page_cache_cachep, new_pc);
+        kfree(page);
+        return page_cache_get(file, index);
+    }
+
+    new_pc->mp = mp;
+    new_pc->ino = ino;
+    new_pc->index = index;
+    new_pc->page = page;
+    new_pc->dirty = 0;
+    list_insert(page_cache_bucket(mp, ino, index), &new_pc->hash);
+    list_insert_end(&page_cache_lru, &new_pc->lru);
+    nr_cached_pages++;
+
+    // one reference for page cache, one for caller
+    GET_PAGE(page)->flag |= PG_CACHE;
+    page_ref_inc((uint64) page);
+    page_ref_inc((uint64) page);
+    spinlock_release(&page_cache_lock);
+    return page;
+
+bad:
+    if (new_pc)
+        kmem_cache_free(page_cache_cachep, new_pc);
+    kfree(page);
+    return NULL;
+}
+
+
+void
+page_cache_put(void* page)
+{
+    if (page_ref_dec((uint64) page) == 1)
+        kfree(page);
+}
+
+
+void
+page_cache_set_dirty(struct file* file, uint64 index)
+{
+    spinlock_acquire(&page_cache_lock);
+    struct page_cache* pc = find_page(file->f_inode->i_mp, file->f_inode->i_ino, index);
+    if (pc)
+        pc->dirty = 1;
+    spinlock_release(&page_cache_lock);
+}
+
+
+// drop a page from the cache, mappings keep their own references, caller must hold page_cache_lock
+static void
+remove_page(struct page_cache* pc)
+{
+    list_remove(&pc->hash);
+    list_remove(&pc->lru);
+    nr_cached_pages--;
+    GET_PAGE(pc->page)->flag &= ~PG_CACHE;
+    page_cache_put(pc->page);
+    kmem_cache_free(page_cache_cachep, pc);
+}
+
+
+// drop cached pages of inode beyond length, and zero the tail of the last one
+static void
+truncate_pages(struct mountpoint* mp, uint32 ino, off_t length)
+{
+    struct page_cache *pc, *next;
+    uint64 end = (PGROUNDUP(length) >> PGSHIFT);
+
+    spinlock_acquire(&page_cache_lock);
+    page_cache_gen++;
+    list_for_each_entry_safe(pc, next, &page_cache_lru, lru) {
+        if (pc->mp != mp || pc->ino != ino)
+            continue;
+        if (pc->index >= end)
+            remove_page(pc);
+        else if (pc->index == end - 1 && (length & (PGSIZE - 1)))
+            memset((char*) pc->page + (length & (PGSIZE - 1)), 0, PGSIZE - (length & (PGSIZE - 1)));
+    }
+    spinlock_release(&page_cache_lock);
+}
+
+
+void
+page_cache_write(struct file* file, off_t off, const void* buf, size_t len)
+{
+    if (!page_cache_mappable(file) || len == 0)
+        return;
+    struct mountpoint* mp = file->f_inode->i_mp;
+    uint32 ino = file->f_inode->i_ino;
+
+    spinlock_acquire(&page_cache_lock);
+    page_cache_gen++;
+    spinlock_release(&page_cache_lock);
+
+    for (uint64 index = (off >> PGSHIFT); index <= ((off + len - 1) >> PGSHIFT); index++) {
+        spinlock_acquire(&page_cache_lock);
+        struct page_cache* pc = find_page(mp, ino, index);
+        void* page = (pc ? pc->page : NULL);
+        if (page)
+            page_ref_inc((uint64) page);
+        spinlock_release(&page_cache_lock);
+        if (page == NULL)
+            continue;
+
+        // copied without the lock, the pin keeps the page alive if it is dropped meanwhile
+        off_t start = MAX(off, (off_t) (index << PGSHIFT));
+        off_t end = MIN(off + (off_t) len, (off_t) ((index + 1) << PGSHIFT));
+        memcpy((char*) page + (start & (PGSIZE - 1)), (const char*) buf + (start - off), end - start);
+        page_cache_put(page);
+    }
+}
+
+
+void
+page_cache_truncate(struct file* file, off_t length)
+{
+    if (page_cache_mappable(file))
+        truncate_pages(file->f_inode->i_mp, file->f_inode->i_ino, length);
+}
+
+
+void
+page_cache_invalidate(struct mountpoint* mp, uint32 ino)
+{
+    truncate_pages(mp, ino, 0);
+}
+
+
+// pin dirty page at index, return NULL if it is clean or not cached
+// only the page is pinned, truncate may drop its page_cache meanwhile
+static void*
+get_dirty_page(struct mountpoint* mp, uint32 ino, uint64 index)
+{
+    void* page = NULL;
+    spinlock_acquire(&page_cache_lock);
+    struct page_cache* pc = find_page(mp, ino, index);
+    if (pc && pc->dirty) {
+        page = pc->page;
+        page_ref_inc((uint64) page);
+    }
+    spinlock_release(&page_cache_lock);
+    return page;
+}
+
+
+// write n contiguous pages starting at index with a single write, buf is used to gather them
+static int
+write_run(struct file* file, uint64 index, void** run, int n, char* buf, off_t size)
+{
+    off_t off = (index << PGSHIFT);
+    if (off >= size)
+        return 0;   // file has been truncated, nothing to write
+
+    // never extend the file with the tail of the last page
+    size_t len = MIN((off_t) n * PGSIZE, size - off);
+    char* src = run[0];
+    if (n > 1) {
+        for (int i = 0; i < n; i++)
+            copy_page(buf + i * PGSIZE, run[i]);
+        src = buf;
+    }
+
+    ssize_t ret = call_interface(file->f_op, write, ssize_t, file, src, len, &off);
+    return (ret == len ? 0 : -EIO);
+}
+
+
+// decide whether the written page at index becomes clean, and drop the pin
+static void
+finish_page(struct mountpoint* mp, uint32 ino, uint64 index, void* page, pagetable_t pgtbl, uint64 va)
+{
+    int mapped = 0;
+    if (pgtbl) {
+        // write-protect our own mapping, so that next write marks it dirty again
+        pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+        if (pte && (*pte & PTE_V) && KERNEL_PA2VA(PTE2PA(*pte)) == (uint64) page) {
+            mapped = 1;
+            *pte &= ~PTE_WRITE;
+            flush_user_tlb(va);
+        }
+    }
+
+    spinlock_acquire(&page_cache_lock);
+    // references: page cache, our pin, and our mapping
+    // any other one may come from a writable mapping of another process
+    struct page_cache* pc = find_page(mp, ino, index);
+    if (pc && pc->page == page && page_ref_count((uint64) page) == 2 + mapped)
+        pc->dirty = 0;
+    spinlock_release(&page_cache_lock);
+
+    page_cache_put(page);
+}
+
+
+int
+page_cache_writeback(struct file* file, uint64 start, uint64 end, pagetable_t pgtbl, uint64 va)
+{
+    struct mountpoint* mp = file->f_inode->i_mp;
+    uint32 ino = file->f_inode->i_ino;
+    void* run[WRITEBACK_BATCH];
+    int nr_written = 0, err = 0;
+
+    // gather buffer is optional, fall back to one page per write
+    char* buf = kalloc_gfp(WRITEBACK_BATCH * PGSIZE, GFP_NOWAIT);
+    int batch = (buf ? WRITEBACK_BATCH : 1);
+    off_t size = call_interface(file->f_op, llseek, off_t, file, 0, SEEK_END);
+    if (size < 0) {
+        kfree(buf);
+        return -EIO;
+    }
+
+    uint64 index = start;
+    while (index < end) {
+        // collect a run of contiguous dirty pages
+        int n = 0;
+        uint64 first = index;
+        for (; index < end && n < batch; index++) {
+            void* page = get_dirty_page(mp, ino, index);
+            if (page == NULL) {
+                if (n > 0)
+                    break;
+                continue;
+            }
+            if (n == 0)
+                first = index;
+            run[n++] = page;
+        }
+        if (n == 0)
+            break;
+
+        int ret = write_run(file, first, run, n, buf, size);
+        for (int i = 0; i < n; i++) {
+            if (ret == 0)
+                finish_page(mp, ino, first + i, run[i], pgtbl, va + ((first + i - start) << PGSHIFT));
+            else
+                page_cache_put(run[i]);
+        }
+        if (ret < 0) {
+            err = ret;
+            break;
+        }
+        nr_written += n;
+    }
+
+    kfree(buf);
+    return (err < 0 ? err : nr_written);
+}
+
+
+uint64
+page_cache_nr_pages(uint64* nr_dirty)
+{
+    struct page_cache* pc;
+
+    spinlock_acquire(&page_cache_lock);
+    uint64 nr = nr_cached_pages;
+    if (nr_dirty) {
+        *nr_dirty = 0;
+        list_for_each_entry(pc, &page_cache_lru, lru)
+            *nr_dirty += pc->dirty;
+    }
+    spinlock_release(&page_cache_lock);
+
+    return nr;
+}
+
+
+uint64
+page_cache_shrink()
+{
+    struct page_cache *pc, *next;
+    uint64 nr_freed = 0;
+
+    spinlock_acquire(&page_cache_lock);
+    list_for_each_entry_safe(pc, next, &page_cache_lru, lru) {
+        // dirty pages have no file to be written to, keep them until msync or munmap
+        if (pc->dirty || page_ref_count((uint64) pc->page) != 1)
+            continue;
+        remove_page(pc);
+        nr_freed++;
+    }
+    spinlock_release(&page_cache_lock);
+
+    return nr_freed;
+}
+
+
+static uint64
+page_cache_shrinker_fn(uint64 nr)
+{
+    return page_cache_shrink();
+}
+
+static struct shrinker page_cache_shrinker = {
+    .name = "page_cache",
+    .shrink = page_cache_shrinker_fn,
+};
+
+
+void
+page_cache_init()
+{
+    for (int i = 0; i < PAGE_CACHE_HASH_SIZE; i++)
+        INIT_LIST_HEAD(page_cache_hash[i]);
+    nr_cached_pages = 0;
+    page_cache_gen = 0;
+
+    page_cache_cachep = kmem_cache_create("page_cache", sizeof(struct page_cache), 0);
+    Assert(page_cache_cachep, "no memory for page cache");
+    register_shrinker(&page_cache_shrinker);
+}
@@ -0,0 +1,63 @@
+#include <common.h>
+#include <debug.h>
+#include <mm/buddy.h>
+#include <mm/reclaim.h>
+#include <locking/spinlock.h>
+#include <proc/proc.h>
+
+static DECLARE_LIST_HEAD(shrinker_list);
+static SPINLOCK_DEFINE(shrinker_lock);
+static volatile int reclaiming = 0;
+
+
+void
+register_shrinker(struct shrinker* s)
+{
+    spinlock_acquire(&shrinker_lock);
+    list_insert_end(&shrinker_list, &s->list);
+    spinlock_release(&shrinker_lock);
+}
+
+
+void
+unregister_shrinker(struct shrinker* s)
+{
+    spinlock_acquire(&shrinker_lock);
+    list_remove(&s->list);
+    spinlock_release(&shrinker_lock);
+}
+
+
+uint64
+reclaim_pages(uint64 nr)
+{
+    // shrinkers walk caches that are only locked against process context,
+    // so an allocation from an interrupt handler gets no reclaim at all
+    if (in_interrupt())
+        return 0;
+
+    // shrinkers free memory through kfree, which should never come back here,
+    // but a shrinker that allocates must not start another round of reclaim
+    if (__sync_lock_test_and_set(&reclaiming, 1))
+        return 0;
+
+    // pages cached in pcp are already free, but they may block merging of higher orders
+    buddy_drain_all();
+    uint64 nr_free = buddy_nr_free_pages();
+
+    struct shrinker* s;
+    spinlock_acquire(&shrinker_lock);
+    list_for_each_entry(s, &shrinker_list, list) {
+        uint64 freed = s->shrink(nr);
+        debug("shrinker %s freed %lu objects", s->name, freed);
+        buddy_drain_all();
+        if (buddy_nr_free_pages() >= nr_free + nr)
+            break;
+    }
+    spinlock_release(&shrinker_lock);
+
+    uint64 now = buddy_nr_free_pages();
+    uint64 reclaimed = (now > nr_free ? now - nr_free : 0);
+    __sync_lock_release(&reclaiming);
+    return reclaimed;
+}
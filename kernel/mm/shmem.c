@@ -0,0 +1,337 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/gfp.h>
+#include <mm/shmem.h>
+#include <fs/file.h>
+#include <fs/fcntl.h>
+#include <locking/spinlock.h>
+
+static SPINLOCK_DEFINE(shmem_stat_lock);
+static uint64 nr_shmem_pages;
+
+
+static inline void
+shmem_stat_add(int64 nr)
+{
+    spinlock_acquire(&shmem_stat_lock);
+    nr_shmem_pages += nr;
+    spinlock_release(&shmem_stat_lock);
+}
+
+
+// the object gives up its reference, a page still mapped lives until it is unmapped
+static void
+shmem_release_page(void* page)
+{
+    GET_PAGE(page)->flag &= ~PG_SHMEM;
+    shmem_put_page(page);
+}
+
+
+// make pages hold at least nr slots, the array never shrinks
+static int
+shmem_reserve(struct shmem* shm, uint64 nr)
+{
+    for (;;) {
+        spinlock_acquire(&shm->lock);
+        uint64 old_nr = shm->nr_slots;
+        spinlock_release(&shm->lock);
+        if (old_nr >= nr)
+            return 0;
+
+        // doubled, so a file written in small pieces is not copied again and again
+        uint64 new_nr = MAX(nr, 2 * old_nr);
+        void** slots = kcalloc(new_nr, sizeof(void*));
+        if (slots == NULL)
+            return -ENOMEM;
+
+        spinlock_acquire(&shm->lock);
+        if (shm->nr_slots == old_nr) {
+            void** old = shm->pages;
+            if (old_nr)
+                memcpy(slots, old, old_nr * sizeof(void*));
+            shm->pages = slots;
+            shm->nr_slots = new_nr;
+            slots = old;
+        }
+        spinlock_release(&shm->lock);
+        // the old array, or ours if someone else has grown it meanwhile
+        kfree(slots);
+    }
+}
+
+
+// page at index with a reference for the caller
+// a missing page is allocated zeroed when alloc is set, otherwise NULL is returned
+static void*
+shmem_page(struct shmem* shm, uint64 index, int alloc)
+{
+    spinlock_acquire(&shm->lock);
+    void* page = (index < shm->nr_slots ? shm->pages[index] : NULL);
+    if (page)
+        page_ref_inc((uint64) page);
+    spinlock_release(&shm->lock);
+    if (page || !alloc)
+        return page;
+
+    // allocate without the lock, allocation may sleep
+    if (shmem_reserve(shm, index + 1) < 0)
+        return NULL;
+    char* new_page = kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+    if (new_page == NULL)
+        return NULL;
+
+    spinlock_acquire(&shm->lock);
+    page = shm->pages[index];
+    if (page == NULL) {
+        page = new_page;
+        new_page = NULL;
+        shm->pages[index] = page;
+        GET_PAGE(page)->flag |= PG_SHMEM;
+        page_ref_inc((uint64) page);
+    }
+    page_ref_inc((uint64) page);
+    spinlock_release(&shm->lock);
+
+    if (new_page)
+        kfree(new_page);
+    else
+        shmem_stat_add(1);
+    return page;
+}
+
+
+static void
+shmem_put(struct shmem* shm)
+{
+    spinlock_acquire(&shm->lock);
+    int ref = --shm->ref;
+    spinlock_release(&shm->lock);
+    if (ref > 0)
+        return;
+
+    int64 nr = 0;
+    for (uint64 i = 0; i < shm->nr_slots; i++) {
+        if (shm->pages[i]) {
+            shmem_release_page(shm->pages[i]);
+            nr++;
+        }
+    }
+    shmem_stat_add(-nr);
+    kfree(shm->pages);
+    kfree(shm);
+}
+
+
+static ssize_t
+shmem_read(struct file* file, char* buf, size_t count, off_t* offset)
+{
+    struct shmem* shm = file->f_private;
+    off_t pos = *offset;
+
+    spinlock_acquire(&shm->lock);
+    off_t size = shm->size;
+    spinlock_release(&shm->lock);
+    if (pos < 0)
+        return -1;
+    if (pos >= size)
+        return 0;
+
+    count = MIN(count, size - pos);
+    for (size_t done = 0, n; done < count; done += n) {
+        uint64 off = ((pos + done) & (PGSIZE - 1));
+        n = MIN(PGSIZE - off, count - done);
+        // holes never written read as 0
+        char* page = shmem_page(shm, (pos + done) >> PGSHIFT, 0);
+        if (page) {
+            memcpy(buf + done, page + off, n);
+            shmem_put_page(page);
+        }
+        else
+            memset(buf + done, 0, n);
+    }
+
+    *offset += count;
+    return count;
+}
+
+
+static ssize_t
+shmem_write(struct file* file, const char* buf, size_t count, off_t* offset)
+{
+    struct shmem* shm = file->f_private;
+    off_t pos = *offset;
+    size_t done = 0;
+
+    if (pos < 0)
+        return -1;
+    for (size_t n; done < count; done += n) {
+        uint64 off = ((pos + done) & (PGSIZE - 1));
+        n = MIN(PGSIZE - off, count - done);
+        char* page = shmem_page(shm, (pos + done) >> PGSHIFT, 1);
+        if (page == NULL)
+            break;
+        memcpy(page + off, buf + done, n);
+        shmem_put_page(page);
+    }
+    if (done == 0)
+        return -1;
+
+    spinlock_acquire(&shm->lock);
+    shm->size = MAX(shm->size, pos + (off_t) done);
+    spinlock_release(&shm->lock);
+
+    *offset += done;
+    return done;
+}
+
+
+static off_t
+shmem_llseek(struct file* file, off_t offset, int whence)
+{
+    struct shmem* shm = file->f_private;
+
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += file->fpos;
+        break;
+    case SEEK_END:
+        spinlock_acquire(&shm->lock);
+        offset += shm->size;
+        spinlock_release(&shm->lock);
+        break;
+    default:
+        return -1;
+    }
+
+    return (offset < 0 ? -1 : offset);
+}
+
+
+// pages beyond the new end are dropped from the object, but stay in the mappings holding them
+static int
+shmem_truncate(struct file* file, off_t length)
+{
+    struct shmem* shm = file->f_private;
+    if (length < 0)
+        return -1;
+
+    int64 nr = 0;
+    spinlock_acquire(&shm->lock);
+    uint64 first = (PGROUNDUP(length) >> PGSHIFT);
+    void* tail = NULL;
+    if ((length & (PGSIZE - 1)) && first - 1 < shm->nr_slots)
+        tail = shm->pages[first - 1];
+    for (uint64 i = first; i < shm->nr_slots; i++) {
+        if (shm->pages[i]) {
+            shmem_release_page(shm->pages[i]);
+            shm->pages[i] = NULL;
+            nr++;
+        }
+    }
+    // a file grown again later reads 0 there
+    if (tail && length < shm->size)
+        memset(tail + (length & (PGSIZE - 1)), 0, PGSIZE - (length & (PGSIZE - 1)));
+    shm->size = length;
+    spinlock_release(&shm->lock);
+
+    shmem_stat_add(-nr);
+    return 0;
+}
+
+
+static int
+shmem_close(struct file* file)
+{
+    shmem_put(file->f_private);
+    file->f_private = NULL;
+    return 0;
+}
+
+
+// fdt_dup copies the struct file, the copy refers to the same object
+static int
+shmem_dup(struct file* file)
+{
+    struct shmem* shm = file->f_private;
+    spinlock_acquire(&shm->lock);
+    shm->ref++;
+    spinlock_release(&shm->lock);
+    return 0;
+}
+
+
+const struct file_operations shmem_fileops = {
+    .llseek = shmem_llseek,
+    .read = shmem_read,
+    .write = shmem_write,
+    .close = shmem_close,
+    .truncate = shmem_truncate,
+    .dup = shmem_dup,
+};
+
+
+struct file*
+shmem_file_create(const char* path, off_t size)
+{
+    KCALLOC(struct file, file, 1);
+    KCALLOC(struct shmem, shm, 1);
+    if (file == NULL || shm == NULL) {
+        kfree(file);
+        kfree(shm);
+        return NULL;
+    }
+
+    spinlock_init(&shm->lock, "shmem");
+    shm->ref = 1;
+    shm->size = size;
+    file_init(file, &shmem_fileops, path, O_RDWR, shm);
+    return file;
+}
+
+
+int
+shmem_file(struct file* file)
+{
+    return (file->f_op == &shmem_fileops);
+}
+
+
+void*
+shmem_get_page(struct file* file, uint64 index)
+{
+    struct shmem* shm = file->f_private;
+
+    // mapping beyond the end of file has no page to fault in
+    spinlock_acquire(&shm->lock);
+    off_t size = shm->size;
+    spinlock_release(&shm->lock);
+    if (index >= (PGROUNDUP(size) >> PGSHIFT))
+        return NULL;
+
+    return shmem_page(shm, index, 1);
+}
+
+
+void
+shmem_put_page(void* page)
+{
+    if (page_ref_dec((uint64) page) == 1)
+        kfree(page);
+}
+
+
+uint64
+shmem_nr_pages()
+{
+    spinlock_acquire(&shmem_stat_lock);
+    uint64 nr = nr_shmem_pages;
+    spinlock_release(&shmem_stat_lock);
+    return nr;
+}
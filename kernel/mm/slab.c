@@ -0,0 +1,310 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/buddy.h>
+#include <mm/slab.h>
+#include <mm/reclaim.h>
+
+DECLARE_LIST_HEAD(slab_caches);
+static SPINLOCK_DEFINE(slab_caches_lock);
+
+// cache for struct kmem_cache itself
+static struct kmem_cache cache_cache;
+static struct kmem_cache kmalloc_caches[NR_KMALLOC_CACHES];
+
+static const char* kmalloc_names[NR_KMALLOC_CACHES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+
+static int
+kmem_cache_setup(struct kmem_cache* cache, const char* name, uint32 size, uint32 align)
+{
+    if (align == 0)
+        align = SLAB_MIN_ALIGN;
+    assert((align & (align - 1)) == 0);
+
+    size = MAX(size, sizeof(void*));
+    cache->obj_size = ROUNDUP(size, align);
+    cache->align = align;
+    cache->offset = ROUNDUP(sizeof(struct slab), align);
+    if (cache->offset + cache->obj_size > PGSIZE)
+        return -1;
+    cache->objs_per_slab = (PGSIZE - cache->offset) / cache->obj_size;
+
+    strncpy(cache->name, name, SLAB_NAME_MAX_LEN - 1);
+    INIT_LIST_HEAD(cache->partial);
+    INIT_LIST_HEAD(cache->full);
+    INIT_LIST_HEAD(cache->free);
+    cache->nr_slabs = 0;
+    cache->nr_free_slabs = 0;
+    cache->nr_active = 0;
+    spinlock_init(&cache->lock, cache->name);
+
+    spinlock_acquire(&slab_caches_lock);
+    list_insert_end(&slab_caches, &cache->cache_entry);
+    spinlock_release(&slab_caches_lock);
+
+    return 0;
+}
+
+
+// take a page from buddy system and cut it into objects
+// must not hold cache->lock, since buddy system may reclaim from this cache
+static struct slab*
+slab_grow(struct kmem_cache* cache, gfp_t gfp)
+{
+    struct slab* s = (struct slab*) buddy_alloc_gfp(PGSIZE, gfp);
+    if (s == NULL)
+        return NULL;
+
+    s->cache = cache;
+    s->inuse = 0;
+    s->total = cache->objs_per_slab;
+    s->freelist = NULL;
+
+    // build freelist backwards, so that objects are handed out in address order
+    char* base = (char*) s + cache->offset;
+    for (int i = s->total - 1; i >= 0; i--) {
+        void** obj = (void**) (base + i * cache->obj_size);
+        *obj = s->freelist;
+        s->freelist = obj;
+    }
+
+    return s;
+}
+
+
+// caller must hold cache->lock
+static void
+slab_release(struct kmem_cache* cache, struct slab* s)
+{
+    assert(s->inuse == 0);
+    list_remove(&s->list);
+    cache->nr_slabs--;
+    buddy_free(s, 0);
+}
+
+
+void*
+kmem_cache_alloc_gfp(struct kmem_cache* cache, gfp_t gfp)
+{
+    struct slab* s;
+
+    spinlock_acquire(&cache->lock);
+
+    if (cache->partial.next != &cache->partial) {
+        s = container_of(cache->partial.next, struct slab, list);
+    }
+    else if (cache->free.next != &cache->free) {
+        s = container_of(cache->free.next, struct slab, list);
+        list_remove(&s->list);
+        list_insert(&cache->partial, &s->list);
+        cache->nr_free_slabs--;
+    }
+    else {
+        spinlock_release(&cache->lock);
+        s = slab_grow(cache, gfp);
+        if (s == NULL)
+            return NULL;
+        spinlock_acquire(&cache->lock);
+        list_insert(&cache->partial, &s->list);
+        cache->nr_slabs++;
+    }
+
+    void** obj = (void**) s->freelist;
+    assert(obj);
+    s->freelist = *obj;
+    s->inuse++;
+    cache->nr_active++;
+
+    if (s->inuse == s->total) {
+        list_remove(&s->list);
+        list_insert(&cache->full, &s->list);
+    }
+
+    spinlock_release(&cache->lock);
+    return (void*) obj;
+}
+
+
+void*
+kmem_cache_alloc(struct kmem_cache* cache)
+{
+    return kmem_cache_alloc_gfp(cache, GFP_KERNEL);
+}
+
+
+void
+kmem_cache_free(struct kmem_cache* cache, void* obj)
+{
+    struct slab* s = SLAB(obj);
+    Assert(s->cache == cache, "object %p does not belong to cache %s", obj, cache->name);
+
+    spinlock_acquire(&cache->lock);
+    assert(s->inuse > 0);
+
+    *(void**) obj = s->freelist;
+    s->freelist = obj;
+    cache->nr_active--;
+
+    if (s->inuse-- == s->total) {
+        // full -> partial
+        list_remove(&s->list);
+        list_insert(&cache->partial, &s->list);
+    }
+
+    if (s->inuse == 0) {
+        // partial -> free, give the page back when there are enough empty slabs
+        list_remove(&s->list);
+        list_insert(&cache->free, &s->list);
+        if (cache->nr_free_slabs >= SLAB_MAX_FREE)
+            slab_release(cache, s);
+        else
+            cache->nr_free_slabs++;
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+
+uint64
+kmem_cache_shrink(struct kmem_cache* cache)
+{
+    struct slab *s, *next;
+    uint64 nr_freed = 0;
+
+    spinlock_acquire(&cache->lock);
+    list_for_each_entry_safe(s, next, &cache->free, list) {
+        slab_release(cache, s);
+        nr_freed++;
+    }
+    cache->nr_free_slabs = 0;
+    spinlock_release(&cache->lock);
+
+    return nr_freed;
+}
+
+
+uint64
+kmem_cache_shrink_all()
+{
+    struct kmem_cache* cache;
+    uint64 nr_freed = 0;
+
+    spinlock_acquire(&slab_caches_lock);
+    list_for_each_entry(cache, &slab_caches, cache_entry)
+        nr_freed += kmem_cache_shrink(cache);
+    spinlock_release(&slab_caches_lock);
+
+    return nr_freed;
+}
+
+
+int
+kmem_cache_get_stat(struct slab_stat* st, int max)
+{
+    struct kmem_cache* cache;
+    int n = 0;
+
+    spinlock_acquire(&slab_caches_lock);
+    list_for_each_entry(cache, &slab_caches, cache_entry) {
+        if (n < max) {
+            spinlock_acquire(&cache->lock);
+            strncpy(st[n].name, cache->name, SLAB_NAME_MAX_LEN);
+            st[n].obj_size = cache->obj_size;
+            st[n].nr_active = cache->nr_active;
+            st[n].nr_slabs = cache->nr_slabs;
+            st[n].nr_objs = cache->nr_slabs * cache->objs_per_slab;
+            spinlock_release(&cache->lock);
+        }
+        n++;
+    }
+    spinlock_release(&slab_caches_lock);
+
+    return n;
+}
+
+
+static uint64
+slab_shrink(uint64 nr)
+{
+    return kmem_cache_shrink_all();
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .shrink = slab_shrink,
+};
+
+
+struct kmem_cache*
+kmem_cache_create(const char* name, uint32 size, uint32 align)
+{
+    struct kmem_cache* cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL)
+        return NULL;
+
+    if (kmem_cache_setup(cache, name, size, align) < 0) {
+        error("object size %u of cache %s is too large", size, name);
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+
+void
+kmem_cache_destroy(struct kmem_cache* cache)
+{
+    Assert(cache->nr_active == 0, "cache %s still has %lu objects in use", cache->name, cache->nr_active);
+
+    spinlock_acquire(&slab_caches_lock);
+    list_remove(&cache->cache_entry);
+    spinlock_release(&slab_caches_lock);
+
+    kmem_cache_shrink(cache);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+
+static inline struct kmem_cache*
+kmalloc_cache(uint64 size)
+{
+    int idx = 0;
+    while ((KMALLOC_MIN_SIZE << idx) < size)
+        idx++;
+    return &kmalloc_caches[idx];
+}
+
+
+void*
+kmalloc(uint64 size, gfp_t gfp)
+{
+    assert(size > 0 && size <= KMALLOC_MAX_SIZE);
+    return kmem_cache_alloc_gfp(kmalloc_cache(size), gfp);
+}
+
+
+void
+slab_free(void* obj)
+{
+    kmem_cache_free(SLAB(obj)->cache, obj);
+}
+
+
+void
+slab_init()
+{
+    assert(sizeof(struct kmem_cache) + ROUNDUP(sizeof(struct slab), SLAB_MIN_ALIGN) <= PGSIZE);
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0);
+
+    for (int i = 0; i < NR_KMALLOC_CACHES; i++) {
+        uint32 size = KMALLOC_MIN_SIZE << i;
+        kmem_cache_setup(&kmalloc_caches[i], kmalloc_names[i], size, MIN(size, SLAB_MAX_ALIGN));
+    }
+
+    register_shrinker(&slab_shrinker);
+}
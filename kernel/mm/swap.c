@@ -0,0 +1,403 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <time.h>
+#include <mm/mm.h>
+#include <mm/slab.h>
+#include <mm/swap.h>
+#include <mm/zram.h>
+#include <mm/reclaim.h>
+#include <proc/proc.h>
+#include <proc/smp.h>
+#include <locking/sleeplock.h>
+#include <locking/spinlock.h>
+
+#define TICKS_TO_NS(t) ((t) * (1000000000UL / CLOCK_FREQUNCY))
+#define SWAP_BATCH      32      // pages write protected together and shot down with one flush
+#define SWAP_MAX_MM     16      // address spaces locked by one batch
+
+static SPINLOCK_DEFINE(lru_lock);
+static DECLARE_LIST_HEAD(anon_lru);
+static struct kmem_cache* rmap_cachep;
+static struct swap_stat stat;
+
+// address spaces whose locks a batch holds from write protecting its pages to rewriting their ptes
+struct swap_mm_locks {
+    int n;
+    upagetable* mm[SWAP_MAX_MM];
+};
+
+
+void
+page_add_anon_rmap(uint64 kva, pagetable_t pgtbl, uint64 va)
+{
+    struct page* page = GET_PAGE(kva);
+    // allocate before taking lru_lock, it may reclaim
+    struct rmap_item* item = kmem_cache_alloc(rmap_cachep);
+
+    spinlock_acquire(&lru_lock);
+    if (!(page->flag & PG_ANON)) {
+        page->flag |= PG_ANON;
+        page->rmap = NULL;
+        list_insert_end(&anon_lru, &page->list);
+        stat.nr_anon++;
+    }
+    if (item) {
+        item->pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
+        item->va = va;
+        item->wp = 0;
+        item->next = page->rmap;
+        page->rmap = item;
+    }
+    spinlock_release(&lru_lock);
+}
+
+
+void
+page_remove_rmap(uint64 kva, pagetable_t pgtbl, uint64 va)
+{
+    struct page* page = GET_PAGE(kva);
+    struct rmap_item* found = NULL;
+    pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
+
+    spinlock_acquire(&lru_lock);
+    if (!(page->flag & PG_ANON)) {
+        spinlock_release(&lru_lock);
+        return;
+    }
+
+    for (struct rmap_item** pp = &page->rmap; *pp; pp = &(*pp)->next) {
+        if ((*pp)->pgtbl == pgtbl && (*pp)->va == va) {
+            found = *pp;
+            *pp = found->next;
+            break;
+        }
+    }
+    if (page->rmap == NULL) {
+        list_remove(&page->list);
+        page->flag &= ~PG_ANON;
+        stat.nr_anon--;
+    }
+    spinlock_release(&lru_lock);
+
+    if (found)
+        kmem_cache_free(rmap_cachep, found);
+}
+
+
+void
+page_move_anon_rmap(uint64 kva, pagetable_t pgtbl, uint64 old_va, uint64 new_va)
+{
+    struct page* page = GET_PAGE(kva);
+    pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
+
+    spinlock_acquire(&lru_lock);
+    if (page->flag & PG_ANON) {
+        for (struct rmap_item* item = page->rmap; item; item = item->next) {
+            if (item->pgtbl == pgtbl && item->va == old_va) {
+                item->va = new_va;
+                break;
+            }
+        }
+    }
+    spinlock_release(&lru_lock);
+}
+
+
+// whether any mapping has used the page since last check
+// loongarch has no accessed bit, its LRU is plain FIFO
+static int
+page_referenced(struct page* page)
+{
+    int referenced = 0;
+#ifndef __loongarch64
+    for (struct rmap_item* item = page->rmap; item; item = item->next) {
+        pte_t* pte = walk(item->pgtbl, item->va, WALK_NOALLOC);
+        // clearing A without a flush only makes the page look older than it is
+        if (pte && (*pte & PTE_A)) {
+            *pte &= ~PTE_A;
+            referenced = 1;
+        }
+    }
+#endif
+    return referenced;
+}
+
+
+// release the locks taken after the first keep ones
+static void
+swap_unlock_mm(struct swap_mm_locks* locks, int keep)
+{
+    while (locks->n > keep)
+        sleeplock_release(&locks->mm[--locks->n]->lock);
+}
+
+
+// trylock the address space of every mapping of page, locks the batch holds already are reused
+// nothing else changes these ptes until the locks are released, caller must hold lru_lock
+// return -EBUSY with only the old locks held if one of them is busy, or not wrapped yet
+static int
+swap_lock_mm(struct page* page, struct swap_mm_locks* locks)
+{
+    int keep = locks->n;
+    for (struct rmap_item* item = page->rmap; item; item = item->next) {
+        upagetable* mm = pgtbl_upgtbl(item->pgtbl);
+        int i = 0;
+        while (i < locks->n && locks->mm[i] != mm)
+            i++;
+        if (i < locks->n)
+            continue;
+        // the faulting cpu that is reclaiming holds its own one
+        if (mm == NULL || locks->n == SWAP_MAX_MM || !sleeplock_trylock(&mm->lock)) {
+            swap_unlock_mm(locks, keep);
+            return -EBUSY;
+        }
+        locks->mm[locks->n++] = mm;
+    }
+    return 0;
+}
+
+
+// take write permission from every mapping of page and pin it, caller must hold lru_lock
+// and the locks of the address spaces mapping it
+// stores through TLB entries of other cpus are still possible until the next shootdown
+static int
+swap_out_prepare(struct page* page)
+{
+    uint64 kva = PAGE_ADDR(page);
+    struct rmap_item* item;
+    int n = 0;
+    for (item = page->rmap; item; item = item->next)
+        n++;
+
+    // someone pins it, or some mapping is not recorded
+    if (n == 0 || page_ref_count(kva) != n)
+        return -EBUSY;
+
+    for (item = page->rmap; item; item = item->next) {
+        pte_t* pte = walk(item->pgtbl, item->va, WALK_NOALLOC);
+        assert(pte && (*pte & PTE_V) && KERNEL_PA2VA(PTE2PA(*pte)) == kva);
+        item->wp = ((*pte & PTE_WRITE) != 0);
+        *pte &= ~PTE_WRITE;
+    }
+    // finish expects this pin besides the mappings
+    page_ref_inc(kva);
+    return 0;
+}
+
+
+// give back the write permission swap_out_prepare took, caller must hold lru_lock
+static void
+swap_out_undo(struct page* page)
+{
+    uint64 kva = PAGE_ADDR(page);
+    for (struct rmap_item* item = page->rmap; item; item = item->next) {
+        pte_t* pte = walk(item->pgtbl, item->va, WALK_NOALLOC);
+        // a fork meanwhile made it COW, which takes a copy on write
+        if (item->wp && pte && (*pte & PTE_V) && KERNEL_PA2VA(PTE2PA(*pte)) == kva && !(*pte & PTE_COW))
+            *pte |= PTE_WRITE;
+        item->wp = 0;
+    }
+}
+
+
+// the data in slot was compressed after every cpu lost write access to page, or the store failed
+// replace every mapping with a swap pte, caller must hold lru_lock and the locks swap_out_prepare needed
+// return 0 if the page is no longer used and must be freed after a flush
+static int
+swap_out_finish(struct page* page, int slot)
+{
+    uint64 kva = PAGE_ADDR(page);
+    struct rmap_item* item;
+    int n = 0, clean = (slot >= 0);
+
+    if (page->flag & PG_ANON) {
+        for (item = page->rmap; item; item = item->next) {
+            pte_t* pte = walk(item->pgtbl, item->va, WALK_NOALLOC);
+            if (!pte || !(*pte & PTE_V) || KERNEL_PA2VA(PTE2PA(*pte)) != kva || (*pte & PTE_WRITE))
+                clean = 0;
+            n++;
+        }
+    }
+    // besides our pin, only the mappings recorded may hold it
+    if (n == 0 || page_ref_count(kva) != n + 1)
+        clean = 0;
+
+    if (!clean) {
+        if (slot >= 0)
+            zram_free(slot);
+        if (page->flag & PG_ANON)
+            swap_out_undo(page);
+        // all mappings may have gone while it was compressed
+        return (page_ref_dec(kva) == 1 ? 0 : -EBUSY);
+    }
+
+    for (int i = 1; i < n; i++)
+        zram_dup(slot);
+    while ((item = page->rmap)) {
+        pte_t* pte = walk(item->pgtbl, item->va, WALK_NOALLOC);
+        pte_t old = *pte;
+        if (item->wp && !(old & PTE_COW))
+            old |= PTE_WRITE;
+        *pte = SWAP_PTE(slot, old);
+        page->rmap = item->next;
+        kmem_cache_free(rmap_cachep, item);
+        page_ref_dec(kva);
+    }
+    page_ref_dec(kva);
+
+    list_remove(&page->list);
+    page->flag &= ~PG_ANON;
+    stat.nr_anon--;
+    stat.nr_swapout++;
+    return 0;
+}
+
+
+// pick up to max unreferenced pages from the LRU and write protect them
+// the address spaces mapping them are left locked in locks
+static int
+swap_out_isolate(struct page** batch, int max, uint64* nr_scan, struct swap_mm_locks* locks)
+{
+    int n = 0;
+
+    spinlock_acquire(&lru_lock);
+    while (n < max && *nr_scan > 0 && anon_lru.next != &anon_lru) {
+        struct page* page = container_of(anon_lru.next, struct page, list);
+        list_remove(&page->list);
+        list_insert_end(&anon_lru, &page->list);
+        (*nr_scan)--;
+
+        // busy, or another cpu is swapping it out
+        int keep = locks->n;
+        if (swap_lock_mm(page, locks) < 0)
+            continue;
+        if (page_referenced(page) || swap_out_prepare(page) < 0) {
+            swap_unlock_mm(locks, keep);
+            continue;
+        }
+        batch[n++] = page;
+    }
+    spinlock_release(&lru_lock);
+    return n;
+}
+
+
+uint64
+swap_out(uint64 nr)
+{
+    DECLARE_LIST_HEAD(freed);
+    struct page* batch[SWAP_BATCH];
+    int slots[SWAP_BATCH];
+    struct swap_mm_locks locks = { .n = 0 };
+    uint64 nr_freed = 0;
+
+    spinlock_acquire(&lru_lock);
+    // two rounds at most, pages referenced in the first one get a second chance
+    uint64 nr_scan = 2 * stat.nr_anon;
+    spinlock_release(&lru_lock);
+
+    while (nr_freed < nr) {
+        int n = swap_out_isolate(batch, MIN(nr - nr_freed, SWAP_BATCH), &nr_scan, &locks);
+        if (n == 0) {
+            swap_unlock_mm(&locks, 0);
+            break;
+        }
+
+        // no cpu writes these pages any more once this returns, compress them as they are
+        flush_tlb_all();
+        for (int i = 0; i < n; i++)
+            slots[i] = zram_store((void*) PAGE_ADDR(batch[i]), 1);
+
+        spinlock_acquire(&lru_lock);
+        for (int i = 0; i < n; i++) {
+            if (swap_out_finish(batch[i], slots[i]) == 0) {
+                list_insert(&freed, &batch[i]->list);
+                nr_freed++;
+            }
+        }
+        spinlock_release(&lru_lock);
+
+        // writers that faulted meanwhile find a swap pte or their write permission back
+        swap_unlock_mm(&locks, 0);
+    }
+
+    if (nr_freed == 0)
+        return 0;
+
+    // ptes of other address spaces are changed as well, which may be running on other cpus
+    flush_tlb_all();
+    struct page *page, *next;
+    list_for_each_entry_safe(page, next, &freed, list) {
+        list_remove(&page->list);
+        kfree((void*) PAGE_ADDR(page));
+    }
+    return nr_freed;
+}
+
+
+int
+do_swap_page(pagetable_t pgtbl, pte_t* pte, uint64 va)
+{
+    uint64 start = r_time();
+    pte_t swp = *pte;
+    int slot = SWAP_PTE_SLOT(swp);
+
+    // reclaim never touches a swap pte, so it is still there after kalloc
+    char* mem = kalloc(PGSIZE);
+    if (mem == NULL)
+        return -ENOMEM;
+    if (zram_load(slot, mem) < 0) {
+        kfree(mem);
+        return -EIO;
+    }
+
+    *pte = PA2PTE(KERNEL_VA2PA(mem)) | (PTE_FLAGS(swp) & ~PTE_SWAP) | PTE_V;
+    page_ref_inc((uint64) mem);
+    zram_free(slot);
+    page_add_anon_rmap((uint64) mem, pgtbl, va);
+    flush_user_tlb(va);
+
+    uint64 ns = TICKS_TO_NS(r_time() - start);
+    spinlock_acquire(&lru_lock);
+    stat.nr_swapin++;
+    stat.swapin_ns += ns;
+    stat.swapin_ns_max = MAX(stat.swapin_ns_max, ns);
+    spinlock_release(&lru_lock);
+    return 0;
+}
+
+
+void
+swap_get_stat(struct swap_stat* st)
+{
+    spinlock_acquire(&lru_lock);
+    *st = stat;
+    spinlock_release(&lru_lock);
+}
+
+
+static uint64
+swap_shrinker_fn(uint64 nr)
+{
+    return swap_out(nr);
+}
+
+static struct shrinker swap_shrinker = {
+    .name = "swap",
+    .shrink = swap_shrinker_fn,
+};
+
+
+void
+swap_init()
+{
+    rmap_cachep = kmem_cache_create("rmap", sizeof(struct rmap_item), 0);
+    Assert(rmap_cachep, "no memory for rmap");
+    zram_init();
+    memset(&stat, 0, sizeof(stat));
+    // registered after page cache, clean cache pages are cheaper to drop
+    register_shrinker(&swap_shrinker);
+}
@@ -2,59 +2,28 @@
 #include <arch.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
+#include <mm/page_cache.h>
+#include <mm/vma.h>
+#include <mm/swap.h>
+#include <mm/shmem.h>
 #include <proc/proc.h>
 #include <irq/interrupt.h>
 #include <fs/kernel.h>
 #include <fs/fcntl.h>
 
 #include <syscall.h>
+#include <errno.h>
 
 
-uint64 
-find_free_vma_range(struct proc *p, size_t length) 
-{
-    uint64 hint = p->mmap_brk - length; 
-    struct vm_area *vma;
-    
-    for (vma = p->vma_list; vma; vma = vma->next) {
-        if (hint + length <= vma->start) {
-            return hint;
-        }
-        hint = vma->end - length; 
-    }
-    
-    if (hint < p->mmap_base) {
-        uint64 expand_size = MAX(length, MMAP_EXPAND);
-        uint64 new_brk = p->mmap_brk + expand_size;
-
-        // TODO: CHECK BOUND
-        
-        p->mmap_brk = new_brk;
-        return 0; 
-    }
-    return hint;
-}
-
-struct vm_area* 
-find_vma(struct proc* p, uint64 va)
-{
-    struct vm_area* vma;
-    for (vma = p->vma_list; vma; vma = vma->next) {
-        if (va >= vma->start && va < vma->end)
-            return vma;
-    }
-    return NULL;
-}
-
 // suppose cond is true, if not, return MMAP_FAILED
 #define MMAP_CHECK(cond) \
     if (!(cond)) return MMAP_FAILED
 
 
-SYSCALL_DEFINE6(mmap, void*, void*, addr, size_t, length, int, prot, int, flags, int, fd, off_t, offset) 
+// caller holds the lock of p->pagetable
+static void*
+do_mmap(struct proc* p, void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-    struct proc* p = myproc();
-
     MMAP_CHECK(length != 0 && IS_PGALIGNED(offset));
     MMAP_CHECK((offset & (PGSIZE - 1)) == 0); // offset must be aligned
 
@@ -70,124 +39,428 @@ SYSCALL_DEFINE6(mmap, void*, void*, addr, size_t, length, int, prot, int, flags,
         MMAP_CHECK(va);
     }
 
+    struct file* file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        // filesystem, help to check fd valid
+        MMAP_CHECK(fd >= 0 && fd < NR_OPEN);
+        file = fd_get(p->fdt, fd);
+        MMAP_CHECK(file != NULL);
+        // file pages are served from page cache, or from the object of a memfd
+        MMAP_CHECK(page_cache_mappable(file) || shmem_file(file));
+        MMAP_CHECK((file->f_flags & O_ACCMODE) != O_WRONLY);
+        // shared writable mapping writes to file
+        MMAP_CHECK(!((flags & MAP_SHARED) && (prot & PROT_WRITE)) || (file->f_flags & O_ACCMODE) == O_RDWR);
+    }
+
     KALLOC(struct vm_area, vma);
+    if (vma == NULL)
+        return (void*) -ENOMEM;
+    if ((flags & MAP_ANONYMOUS) && (flags & MAP_SHARED)) {
+        // shared anonymous memory is a shmem object of its own, fork shares it through vma->file
+        file = shmem_file_create("/dev/zero", length);
+        if (file == NULL) {
+            kfree(vma);
+            return (void*) -ENOMEM;
+        }
+        offset = 0;
+    }
     vma->start = va;
     vma->end = va + length;
     vma->prot = prot;
     vma->flags = flags;
+    vma->vm_flags = 0;
     vma->offset = offset;
+    vma->file = file;
+    vma->refcnt = 1;
+    if (file)
+        file_get(file);
 
-    if (flags & MAP_ANONYMOUS) {
-        vma->file = NULL;
-    } else {
-        // filesystem, help to check fd valid
-        MMAP_CHECK(fd >= 0 && fd < NR_OPEN);
-        vma->file = fd_get(p->fdt, fd);
+    // MAP_FIXED replaces whatever is mapped there
+    if (flags & MAP_FIXED)
+        do_munmap((void*) va, length);
+    // pages are allocated on first access by page fault handler
+    if (vma_insert(p, vma) < 0) {
+        if (file)
+            file_put(file);
+        kfree(vma);
+        return MMAP_FAILED;
+    }
+    
+    return (void*) va;
+}
 
-        MMAP_CHECK(vma->file != NULL);
-        file_get(vma->file);
+SYSCALL_DEFINE6(mmap, void*, void*, addr, size_t, length, int, prot, int, flags, int, fd, off_t, offset) 
+{
+    struct proc* p = myproc();
+
+    sleeplock_acquire(&p->pagetable->lock);
+    void* ret = do_mmap(p, addr, length, prot, flags, fd, offset);
+    sleeplock_release(&p->pagetable->lock);
+    return ret;
+}
+
+// the file lives in memory only, its pages are shared by every mapping and every process holding it
+SYSCALL_DEFINE2(memfd_create, int, const char*, name, unsigned int, flags)
+{
+    struct proc* p = myproc();
+    char path[MAX_PATH_LEN] = "/memfd:";
+    size_t prefix = strlen(path);
+
+    if (flags & ~MFD_CLOEXEC)
+        return -EINVAL;
+    // the name is copied with its '\0'
+    ssize_t len = copy_from_user_str(path + prefix, name, MFD_NAME_MAX + 1);
+    if (len < 0)
+        return -EINVAL;
+
+    struct file* file = shmem_file_create(path, 0);
+    if (file == NULL)
+        return -ENOMEM;
+    fd_t fd = fd_alloc(p->fdt, file);
+    if (fd < 0) {
+        // drop it through the usual path, which closes the shmem object
+        file_get(file);
+        file_put(file);
+        return -EMFILE;
     }
+    return fd;
+}
 
-    vma->next = p->vma_list;
-    if (p->vma_list) p->vma_list->prev = vma;
-    p->vma_list = vma;
-    
-    return NULL;
+// write dirty pages of a shared file mapping in [start, end) back to file
+static int
+vma_writeback(struct proc* p, struct vm_area* vma, uint64 start, uint64 end)
+{
+    uint64 index = (vma->offset + (start - vma->start)) >> PGSHIFT;
+    uint64 npages = (end - start) >> PGSHIFT;
+    return page_cache_writeback(vma->file, index, index + npages, UPGTBL(p->pagetable), start);
 }
 
 int do_munmap(void* addr, size_t length) {
-    uint64 va = PGROUNDDOWN(addr);
+    uint64 start = PGROUNDDOWN(addr);
     length = PGROUNDUP(length);
     if (length == 0) return -1;
+    uint64 end = start + length;
 
     struct proc* p = myproc();
+    assert(sleeplock_holding(&p->pagetable->lock));
 
-    struct vm_area* vma = find_vma(p, va);
-    if (!vma) return -1;
-
-    uint64 unmap_start = MAX(va, vma->start);
-    uint64 unmap_end = MIN(va + length, vma->end);
-    size_t unmap_len = unmap_end - unmap_start;
-
-    int write_back = ((vma->flags & MAP_SHARED) && !(vma->flags & MAP_PRIVATE));
-    if (write_back) {
-        for (uint64 a = unmap_start; a < unmap_end; a += PGSIZE) {
-            pte_t* pte = walk(UPGTBL(p->pagetable), a, WALK_NOALLOC);
-            if (*pte & PTE_D) {
-                kernel_lseek(vma->file, vma->offset + (a - vma->start), SEEK_SET);
-                kernel_write(vma->file, (const void*)a, PGSIZE);
-                // write this page back to file
-                // vma->offset  
-            }
+    struct vm_area* vma = find_vma_after(p, start);
+    if (!vma || vma->start >= end) return -1;
+
+    // the range may cover several vmas
+    for (struct vm_area* next; vma && vma->start < end; vma = next) {
+        next = vma->next;
+        uint64 unmap_start = MAX(start, vma->start);
+        uint64 unmap_end = MIN(end, vma->end);
+        size_t unmap_len = unmap_end - unmap_start;
+
+        // splitting needs a new vma, get it before anything is unmapped
+        struct vm_area* new_vma = NULL;
+        if (unmap_start > vma->start && unmap_end < vma->end) {
+            new_vma = kalloc(sizeof(struct vm_area));
+            if (new_vma == NULL)
+                return -ENOMEM;
+        }
+
+        int write_back = (vma->file && !shmem_file(vma->file) && (vma->flags & MAP_SHARED) && !(vma->flags & MAP_PRIVATE));
+        if (write_back)
+            vma_writeback(p, vma, unmap_start, unmap_end);
+
+        // only fails when a megapage can not be split, nothing is unmapped then
+        if (uvmunmap(UPGTBL(p->pagetable), unmap_start, (unmap_len >> PGSHIFT), UVMUNMAP_FREE) < 0) {
+            kfree(new_vma);
+            return -ENOMEM;
+        }
+
+        if (unmap_start == vma->start && unmap_end == vma->end) {
+            vma_remove(p, vma);
+            if (vma->file) file_put(vma->file);
+            kfree(vma);
+        }
+        else if (unmap_start == vma->start) {
+            vma->offset += unmap_end - vma->start;
+            vma_adjust(p, vma, unmap_end, vma->end);
+        }
+        else if (unmap_end == vma->end) {
+            vma_adjust(p, vma, vma->start, unmap_start);
+        }
+        else {
+            memmove(new_vma, vma, sizeof(struct vm_area));
+            new_vma->offset += unmap_end - vma->start;
+            new_vma->start = unmap_end;
+            if (new_vma->file)
+                file_get(new_vma->file);
+            vma_adjust(p, vma, vma->start, unmap_start);
+            vma_insert(p, new_vma);
         }
     }
 
-    uvmunmap(UPGTBL(p->pagetable), unmap_start, (unmap_len >> PGSHIFT), UVMUNMAP_FREE);
-    
-    if (unmap_start == vma->start && unmap_end == vma->end) {
-        if (vma->prev) {
-            vma->prev->next = vma->next;
-            if (vma->next) vma->next->prev = vma->prev;
-        } else {
-            p->vma_list = vma->next;
-            vma->next->prev = NULL;
-        } 
-
-        if (vma->file) file_put(vma->file);
-        kfree(vma);
+    return 0;
+}
+
+SYSCALL_DEFINE2(munmap, int, void*, addr, size_t, length)
+{
+    struct proc* p = myproc();
+
+    sleeplock_acquire(&p->pagetable->lock);
+    int ret = do_munmap(addr, length);
+    sleeplock_release(&p->pagetable->lock);
+    return ret;
+}
+
+// MS_ASYNC is done synchronously as well, MS_INVALIDATE is ignored
+// since private pages never go into page cache
+SYSCALL_DEFINE3(msync, int, void*, addr, size_t, length, int, flags)
+{
+    struct proc* p = myproc();
+    uint64 start = (uint64) addr;
+    uint64 end = PGROUNDUP(start + length);
+
+    if (!IS_PGALIGNED(start) || ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+        return -EINVAL;
+
+    int err = 0;
+    sleeplock_acquire(&p->pagetable->lock);
+    for (uint64 va = start; va < end && err == 0; ) {
+        struct vm_area* vma = find_vma(p, va);
+        if (vma == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        uint64 e = MIN(end, vma->end);
+        if (vma->file && !shmem_file(vma->file) && (vma->flags & MAP_SHARED)) {
+            if (vma_writeback(p, vma, va, e) < 0)
+                err = -EIO;
+        }
+        va = e;
     }
-    else if (unmap_start == vma->start) {
-        vma->start = unmap_end;
+    sleeplock_release(&p->pagetable->lock);
+
+    return err;
+}
+
+// the range must lie in one vma, it is moved to a vma of its own at new
+// megapages of the range keep their offset within 2 MiB and move as a whole
+static void*
+mremap_move(struct proc* p, struct vm_area* vma, uint64 old, size_t old_size, uint64 new, size_t new_size)
+{
+    if (old > vma->start && (vma = vma_split(p, vma, old)) == NULL)
+        return (void*) -ENOMEM;
+    if (old + old_size < vma->end && vma_split(p, vma, old + old_size) == NULL)
+        return (void*) -ENOMEM;
+
+    if (uvmmove(UPGTBL(p->pagetable), old, new, old_size) < 0)
+        return (void*) -ENOMEM;
+
+    // offset of a file mapping is still right after splitting
+    vma_remove(p, vma);
+    vma->start = new;
+    vma->end = new + new_size;
+    assert(vma_insert(p, vma) == 0);
+    return (void*) new;
+}
+
+// caller holds the lock of p->pagetable
+static void*
+do_mremap(struct proc* p, void* old_addr, size_t old_size, size_t new_size, int flags, void* new_addr)
+{
+    uint64 old = (uint64) old_addr;
+    uint64 new = (uint64) new_addr;
+    old_size = PGROUNDUP(old_size);
+    new_size = PGROUNDUP(new_size);
+
+    // old_size of 0 duplicates a shared mapping in linux, which is not supported
+    if (!IS_PGALIGNED(old) || old_size == 0 || new_size == 0)
+        return (void*) -EINVAL;
+    if ((flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)))
+        return (void*) -EINVAL;
+    if ((flags & MREMAP_FIXED) && (!IS_PGALIGNED(new) || new + new_size > MAXVA - L2PGSIZE ||
+        (new < old + old_size && old < new + new_size)))
+        return (void*) -EINVAL;
+
+    struct vm_area* vma = find_vma(p, old);
+    if (vma == NULL || old + old_size > vma->end)
+        return (void*) -EFAULT;
+
+    // shrinking always happens in place, the tail is unmapped
+    if (new_size < old_size) {
+        if (do_munmap((void*) (old + new_size), old_size - new_size) < 0)
+            return (void*) -ENOMEM;
+        old_size = new_size;
     }
-    else if (unmap_end == vma->end) {
-        vma->end = unmap_start;
+
+    if (flags & MREMAP_FIXED) {
+        // whatever lies at the target is replaced, it does not overlap vma
+        if (do_munmap(new_addr, new_size) == -ENOMEM)
+            return (void*) -ENOMEM;
+        return mremap_move(p, vma, old, old_size, new, new_size);
     }
-    else {
-        KALLOC(struct vm_area, new_vma);
-        memmove(new_vma, vma, sizeof(struct vm_area));
-        new_vma->start = unmap_end;
-        vma->end = unmap_start;
-        new_vma->next = vma->next;
-        vma->next = new_vma;
-        if (new_vma->next) new_vma->next->prev = new_vma;
-        new_vma->prev = vma;
+    if (new_size == old_size)
+        return old_addr;
+
+    // grow in place when the vma ends here and the space above is free
+    uint64 new_end = old + new_size;
+    if (old + old_size == vma->end && new_end <= MAXVA - L2PGSIZE &&
+        (vma->next == NULL || vma->next->start >= new_end)) {
+        vma_adjust(p, vma, vma->start, new_end);
+        return old_addr;
     }
 
+    if (!(flags & MREMAP_MAYMOVE))
+        return (void*) -ENOMEM;
+    uint64 base = find_free_vma_range(p, new_size + MEGAPGSIZE - PGSIZE);
+    if (base == 0)
+        return (void*) -ENOMEM;
+    new = base + ((old - base) & (MEGAPGSIZE - 1));
+    return mremap_move(p, vma, old, old_size, new, new_size);
+}
+
+// errors are returned as negative errno cast to a pointer
+SYSCALL_DEFINE5(mremap, void*, void*, old_addr, size_t, old_size, size_t, new_size, int, flags, void*, new_addr)
+{
+    struct proc* p = myproc();
+
+    sleeplock_acquire(&p->pagetable->lock);
+    void* ret = do_mremap(p, old_addr, old_size, new_size, flags, new_addr);
+    sleeplock_release(&p->pagetable->lock);
+    return ret;
+}
+
+// hints only change vm_flags, the range is split off into a vma of its own first
+static int
+madvise_hint(struct proc* p, struct vm_area* vma, uint64 start, uint64 end, int set, int clear)
+{
+    if (((vma->vm_flags & ~clear) | set) == vma->vm_flags)
+        return 0;
+    if (start > vma->start && (vma = vma_split(p, vma, start)) == NULL)
+        return -ENOMEM;
+    if (end < vma->end && vma_split(p, vma, end) == NULL)
+        return -ENOMEM;
+    vma->vm_flags = (vma->vm_flags & ~clear) | set;
     return 0;
 }
 
-// not implement write back
-SYSCALL_DEFINE2(munmap, int, void*, addr, size_t, length)
+// swap in anonymous pages, and read file pages into page cache
+static int
+madvise_willneed(struct proc* p, struct vm_area* vma, uint64 start, uint64 end)
 {
-    return do_munmap(addr, length);
+    pagetable_t pgtbl = UPGTBL(p->pagetable);
+    for (uint64 va = start; va < end; va += PGSIZE) {
+        pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+        if (pte && PTE_IS_SWAP(*pte) && do_swap_page(pgtbl, pte, va) < 0)
+            return -ENOMEM;
+    }
+
+    // shmem pages are always in memory
+    if (vma == NULL || vma->file == NULL || shmem_file(vma->file))
+        return 0;
+    // cached pages are mapped on fault without i/o
+    uint64 index = (vma->offset + (start - vma->start)) >> PGSHIFT;
+    for (uint64 va = start; va < end; va += PGSIZE, index++) {
+        void* page = page_cache_get(vma->file, index);
+        if (page == NULL)
+            return -ENOMEM;
+        page_cache_put(page);
+    }
+    return 0;
+}
+
+// vma is NULL for the heap, which takes no hints
+static int
+madvise_range(struct proc* p, struct vm_area* vma, uint64 start, uint64 end, int advice)
+{
+    switch (advice) {
+    case MADV_NORMAL:
+        return (vma ? madvise_hint(p, vma, start, end, 0, VMA_SEQ_READ | VMA_RAND_READ) : 0);
+    case MADV_RANDOM:
+        return (vma ? madvise_hint(p, vma, start, end, VMA_RAND_READ, VMA_SEQ_READ) : 0);
+    case MADV_SEQUENTIAL:
+        return (vma ? madvise_hint(p, vma, start, end, VMA_SEQ_READ, VMA_RAND_READ) : 0);
+    case MADV_HUGEPAGE:
+        return (vma ? madvise_hint(p, vma, start, end, 0, VMA_NOHUGEPAGE) : 0);
+    case MADV_NOHUGEPAGE:
+        return (vma ? madvise_hint(p, vma, start, end, VMA_NOHUGEPAGE, 0) : 0);
+    case MADV_WILLNEED:
+        return madvise_willneed(p, vma, start, end);
+    case MADV_FREE:
+        if (vma && (vma->file || (vma->flags & MAP_SHARED)))
+            return -EINVAL;
+        // fall through, pages are freed at once rather than lazily
+    case MADV_DONTNEED:
+        // private pages read as zero or from file again, shared file pages stay in page cache
+        return uvmunmap(UPGTBL(p->pagetable), start, (end - start) >> PGSHIFT, UVMUNMAP_FREE);
+    }
+    return -EINVAL;
+}
+
+SYSCALL_DEFINE3(madvise, int, void*, addr, size_t, length, int, advice)
+{
+    struct proc* p = myproc();
+    uint64 start = (uint64) addr;
+    uint64 end = PGROUNDUP(start + length);
+
+    if (!IS_PGALIGNED(start) || end < start)
+        return -EINVAL;
+    switch (advice) {
+    case MADV_NORMAL: case MADV_RANDOM: case MADV_SEQUENTIAL: case MADV_WILLNEED:
+    case MADV_DONTNEED: case MADV_FREE: case MADV_HUGEPAGE: case MADV_NOHUGEPAGE:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    // the range may cover several vmas, a hole in it is an error
+    int err = 0;
+    sleeplock_acquire(&p->pagetable->lock);
+    for (uint64 va = start, e; va < end && err == 0; va = e) {
+        struct vm_area* vma = NULL;
+        if (va >= p->heap_start && va < PGROUNDUP(p->sz))
+            e = MIN(end, PGROUNDUP(p->sz));
+        else {
+            vma = find_vma(p, va);
+            if (vma == NULL) {
+                err = -ENOMEM;
+                break;
+            }
+            e = MIN(end, vma->end);
+        }
+
+        err = madvise_range(p, vma, va, e, advice);
+    }
+    sleeplock_release(&p->pagetable->lock);
+
+    return (err < 0 ? err : 0);
 }
 
 SYSCALL_DEFINE1(brk, uintptr_t, uintptr_t, brk)
 {
     struct proc* p = myproc();
-    uint64 old_brk = p->sz;
     uint64 heap_start = p->heap_start;
 
     if (brk == 0)
-        return old_brk;
+        return p->sz;
     if (brk < heap_start || brk > MAXVA)
         return -1;
 
     uint64 new_brk = PGROUNDUP(brk);
+    int err = 0;
 
+    // faults of other threads look at p->sz, and must not refill a range being freed
+    sleeplock_acquire(&p->pagetable->lock);
+    uint64 old_brk = p->sz;
+    // growing only moves brk, pages are allocated on first access
     if (new_brk > old_brk) {
-        uint64 size = new_brk - old_brk;
-        uint64 pa = KERNEL_VA2PA(kalloc(size));
-        if (!pa) return -1;
-        mappages(UPGTBL(p->pagetable), old_brk, pa, size, PTE_RW | PTE_U);
+        if (new_brk > p->mmap_base)
+            err = -ENOMEM;
     }
     else if (new_brk < old_brk) {
         int npages = (old_brk - new_brk) >> PGSHIFT;
-        uvmunmap(UPGTBL(p->pagetable), new_brk, npages, UVMUNMAP_FREE);
+        if (uvmunmap(UPGTBL(p->pagetable), new_brk, npages, UVMUNMAP_FREE) < 0)
+            err = -ENOMEM;
     }
+    if (err == 0)
+        p->sz = new_brk;
+    sleeplock_release(&p->pagetable->lock);
 
-    p->sz = new_brk;
-    return 0;
+    return err;
 }
-
-
@@ -0,0 +1,282 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/memlayout.h>
+#include <proc/proc.h>
+
+#define ONES    0x0101010101010101UL
+#define HIGHS   0x8080808080808080UL
+// nonzero if some byte of word v is 0
+#define HAS_ZERO_BYTE(v) (((v) - ONES) & ~(v) & HIGHS)
+
+
+// translation cursor over a user range
+// the L0 table (or megapage) covering the last page is kept,
+// so the page table is walked again only when a copy leaves a 2 MiB region
+// the address space lock is held from the first page to uwalk_done, except while faulting,
+// so the tables the cursor points into are not freed under it
+// the page being copied is pinned until the cursor moves on, reclaim leaves pinned pages alone
+struct uwalk {
+    pagetable_t pgtbl;
+    upagetable* upgtbl; // NULL for a table not wrapped yet, which nobody else sees
+    int locked;
+    uint64 pinned;      // kernel address of the pinned page, 0 if none
+    uint64 base;        // 2 MiB region tbl belongs to
+    pte_t* tbl;         // L0 table of the region, or its megapage pte, NULL if unknown
+    int mega;
+};
+
+
+static inline void
+uwalk_init(struct uwalk* w, pagetable_t pgtbl)
+{
+    w->pgtbl = pgtbl;
+    w->upgtbl = pgtbl_upgtbl(pgtbl);
+    w->locked = 0;
+    w->pinned = 0;
+    w->tbl = NULL;
+}
+
+
+static inline void
+uwalk_unpin(struct uwalk* w)
+{
+    // the last reference if the page was unmapped while we copied
+    if (w->pinned && page_ref_dec(w->pinned) == 1)
+        kfree((void*) w->pinned);
+    w->pinned = 0;
+}
+
+
+static inline void
+uwalk_unlock(struct uwalk* w)
+{
+    if (w->locked)
+        sleeplock_release(&w->upgtbl->lock);
+    w->locked = 0;
+}
+
+
+// end of a copy
+static inline void
+uwalk_done(struct uwalk* w)
+{
+    uwalk_unpin(w);
+    uwalk_unlock(w);
+}
+
+
+// fault in user page for kernel access, pgtbl must belong to current process
+static int
+fault_in_user(pagetable_t pgtbl, uint64 va, int write)
+{
+    struct proc* p = myproc();
+    if (p == NULL || KERNEL_PA2VA(UPGTBL(p->pagetable)) != KERNEL_PA2VA(pgtbl))
+        return -EFAULT;
+    return handle_mm_fault(p, va, write);
+}
+
+
+static inline int
+pte_usable(pte_t pte, int write)
+{
+    if ((pte & PTE_V) == 0 || (pte & PTE_U) != PTE_U)
+        return 0;
+    // COW pages and clean shared file pages must go through the fault handler
+    return (!write || ((pte & PTE_W) && !(pte & PTE_COW)));
+}
+
+
+// kernel address of the user page at va, faulting it in when needed
+// return 0 if va can not be accessed
+static uint64
+uwalk_page(struct uwalk* w, uint64 va, int write)
+{
+    uwalk_unpin(w);
+    if (va >= MAXVA)
+        return 0;
+
+    for (int faulted = 0; ; faulted = 1) {
+        // tables may have changed while the lock was dropped
+        if (w->upgtbl && !w->locked) {
+            sleeplock_acquire(&w->upgtbl->lock);
+            w->locked = 1;
+            w->tbl = NULL;
+        }
+        if (w->tbl == NULL || MEGAPGROUNDDOWN(va) != w->base) {
+            pte_t* pte = walk(w->pgtbl, va, WALK_NOALLOC);
+            w->base = MEGAPGROUNDDOWN(va);
+            w->mega = (pte && PTE_IS_MEGA(*pte));
+            w->tbl = (pte == NULL || w->mega ? pte : pte - PX(0, va));
+        }
+
+        pte_t* pte = (w->tbl && !w->mega ? w->tbl + PX(0, va) : w->tbl);
+        if (pte && pte_usable(*pte, write)) {
+            uint64 kva = KERNEL_PA2VA(PTE_PAGE_PA(*pte, va));
+            // the zero page and pages outside the page array are never freed
+            if (page_ref_inc(kva) >= 0)
+                w->pinned = kva;
+            return kva;
+        }
+
+        // fault may allocate tables or split a megapage, it takes the lock itself
+        if (faulted)
+            return 0;
+        uwalk_unlock(w);
+        if (fault_in_user(w->pgtbl, va, write) < 0)
+            return 0;
+        w->tbl = NULL;
+    }
+}
+
+
+// copy a string of at most max bytes within one page
+// return bytes copied including '\0', or -1 if no '\0' is met
+static int64
+uaccess_copystr(char* dst, const char* src, size_t max)
+{
+    size_t i = 0;
+
+    // a whole aligned word never crosses the page
+    if ((((uint64) dst ^ (uint64) src) & 7) == 0) {
+        for (; i < max && ((uint64) (src + i) & 7); i++) {
+            if ((dst[i] = src[i]) == '\0')
+                return i + 1;
+        }
+        for (; i + 8 <= max; i += 8) {
+            uint64 v = *(const uint64*) (src + i);
+            if (HAS_ZERO_BYTE(v))
+                break;
+            *(uint64*) (dst + i) = v;
+        }
+    }
+
+    for (; i < max; i++) {
+        if ((dst[i] = src[i]) == '\0')
+            return i + 1;
+    }
+    return -1;
+}
+
+
+// given userspace destination virtual address
+// copy len bytes from kernel to user
+// return 0 on success
+int
+copyout(pagetable_t pgtbl, uint64 dstva, void* src, size_t len)
+{
+    struct uwalk w;
+    uwalk_init(&w, pgtbl);
+
+    while (len > 0) {
+        uint64 va0 = PGROUNDDOWN(dstva);
+        uint64 pa0 = uwalk_page(&w, va0, 1);
+        if (pa0 == 0) {
+            uwalk_done(&w);
+            return -1;
+        }
+
+        uint64 n = MIN(PGSIZE - (dstva - va0), len);
+        memcpy((void*) (pa0 + dstva - va0), src, n);
+
+        len -= n;
+        src += n;
+        dstva = va0 + PGSIZE;
+    }
+
+    uwalk_done(&w);
+    return 0;
+}
+
+
+// copy from user to kernel
+// if dst is NULL will alloc a space for it
+int
+copyin(pagetable_t pagetable, char* dst, uint64 srcva, size_t len)
+{
+    struct uwalk w;
+    uwalk_init(&w, pagetable);
+
+    if (dst == NULL) dst = kalloc(len);
+    if (dst == NULL) return -1;
+
+    int cnt = 0;
+
+    while (len > 0) {
+        uint64 va0 = PGROUNDDOWN(srcva);
+        uint64 pa0 = uwalk_page(&w, va0, 0);
+        if (pa0 == 0) {
+            uwalk_done(&w);
+            return (cnt > 0 ? cnt : -1);
+        }
+
+        uint64 n = MIN(PGSIZE - (srcva - va0), len);
+        memcpy(dst, (void*) (pa0 + srcva - va0), n);
+
+        len -= n;
+        dst += n;
+        srcva = va0 + PGSIZE;
+        cnt += n;
+    }
+
+    uwalk_done(&w);
+    return 0;
+}
+
+
+size_t
+copyinstr(pagetable_t pagetable, char* dst, uint64 srcva, size_t max)
+{
+    struct uwalk w;
+    uwalk_init(&w, pagetable);
+    size_t cnt = 0;
+
+    while (max > 0) {
+        uint64 va0 = PGROUNDDOWN(srcva);
+        uint64 pa0 = uwalk_page(&w, va0, 0);
+        if (pa0 == 0)
+            break;
+
+        uint64 n = MIN(PGSIZE - (srcva - va0), max);
+        int64 got = uaccess_copystr(dst, (char*) (pa0 + srcva - va0), n);
+        if (got >= 0) {
+            uwalk_done(&w);
+            return cnt + got;
+        }
+
+        cnt += n;
+        max -= n;
+        dst += n;
+        srcva = va0 + PGSIZE;
+    }
+
+    uwalk_done(&w);
+    return -1;
+}
+
+
+ssize_t copy_from_user(void *to, const void *from, size_t n) {
+    if(copyin(UPGTBL(myproc()->pagetable), (char *) to, (uint64) from, n) != 0)
+        return -1;
+    return n;
+}
+
+ssize_t copy_to_user(void *to, const void *from, size_t n) {
+    if(copyout(UPGTBL(myproc()->pagetable), (uint64) to, (void *) from, n) < 0)
+        return -1;
+    return n;
+}
+
+ssize_t copy_from_user_str(char* to, const void* from, size_t max) {
+    return copyinstr(UPGTBL(myproc()->pagetable), to, (uint64)from, max);
+}
+
+ssize_t copy_to_user_str(void* to, const char* from, size_t max) {
+    size_t len = min_uint64(strlen(from) + 1, max);
+    if(copy_to_user(to, (const void*)from, len) < 0)
+        return -1;
+    return len;
+}
@@ -9,11 +9,65 @@
 #include <common.h>
 #include <arch.h>
 #include <mm/buddy.h>
+#include <mm/slab.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
 #include <mm/vma.h>
+#include <mm/asid.h>
+#include <mm/swap.h>
+#include <mm/zram.h>
+#include <mm/zero_pool.h>
+#include <mm/page_cache.h>
+#include <mm/shmem.h>
 #include <proc/proc.h>
+#include <proc/smp.h>
 #include <debug.h>
+#include <errno.h>
+#include <syscall.h>
+
+// without a valid asid the address space may still own entries of an old generation,
+// so fall back to a flush that ignores asid
+void
+flush_user_tlb(uint64 va)
+{
+    struct proc* p = myproc();
+    int64 asid = (p ? asid_of(p->pagetable) : -1);
+#ifdef __loongarch64
+    if (asid >= 0)
+        flush_tlb_one(asid, va);
+    else
+        flush_tlb();
+#else
+    if (asid >= 0)
+        flush_tlb_one_asid(asid, va);
+    else
+        flush_tlb_one(va);
+#endif
+    // threads sharing the pagetable, or cpus this process has run on before
+    if (p && p->pagetable)
+        flush_tlb_others(p->pagetable->cpus);
+}
+
+
+void
+flush_user_tlb_range(uint64 start, uint64 end)
+{
+    if (start >= end)
+        return;
+    if (((end - start) >> PGSHIFT) <= TLB_FLUSH_ONE_MAX) {
+        for (uint64 va = start; va < end; va += PGSIZE)
+            flush_user_tlb(va);
+        return;
+    }
+    struct proc* p = myproc();
+    int64 asid = (p ? asid_of(p->pagetable) : -1);
+    if (asid >= 0)
+        flush_tlb_asid(asid);
+    else
+        flush_tlb();
+    if (p && p->pagetable)
+        flush_tlb_others(p->pagetable->cpus);
+}
 
 void
 kmem_init(uint64 va_start, uint64 va_end)
@@ -29,301 +83,736 @@ kmem_init(uint64 va_start, uint64 va_end)
     // debug("Initialize npages %#lx, a single page takes %d bytes", npages, (int)sizeof(struct page));
     buddy_init(s, e);  
     out("Initialize buddy system");
-    // slab_init();
-    // out("Initialize slab");
+    slab_init();
+    out("Initialize slab");
+    zero_page_init();
+    zero_pool_init();
+    page_cache_init();
+    swap_init();
 }
 
 
-void
+int
 mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, uint64 flags)
 {
-    uint64 start_va = PGROUNDDOWN(va);
+    uint64 a = PGROUNDDOWN(va);
     uint64 end_va = PGROUNDUP(va + sz - 1);
-    int npages = (end_va - start_va) >> PGSHIFT;
-    pte_t* pte = walk(pgtbl, va, WALK_ALLOC);
-    assert(pte);
-    int nr_mapped = 0;
+    pte_t* pte = NULL;
+
+    int mega = PTE_IS_MEGA(flags);
+    if (mega)
+        flags &= ~PTE_MEGA;
+
+    while (a < end_va) {
+        if (mega && IS_MEGAPGALIGNED(a) && IS_MEGAPGALIGNED(pa) && end_va - a >= MEGAPGSIZE) {
+            pte_t* pmd = walk_megapage(pgtbl, a, WALK_ALLOC);
+            if (pmd == NULL)
+                return -ENOMEM;
+            if (*pmd == 0) {
+                *pmd = PA2PTE(pa) | flags | PTE_MEGA | PTE_V;
+                // every page keeps its own count, so a split needs no fixup
+                for (int i = 0; i < MEGAPG_NPAGES; i++)
+                    page_ref_inc(KERNEL_PA2VA(pa + i * PGSIZE));
+                a += MEGAPGSIZE;
+                pa += MEGAPGSIZE;
+                pte = NULL;
+                continue;
+            }
+        }
 
-    while (nr_mapped++ < npages) {
+        // if this is the last pte in L0 pgtbl, start from another pgtbl
+        if (pte == NULL || IS_PGALIGNED(pte)) {
+            pte = walk(pgtbl, a, WALK_ALLOC);
+            if (pte == NULL)
+                return -ENOMEM;
+            Assert(!PTE_IS_MEGA(*pte), "mappages: %lx is in a megapage", a);
+        }
         *pte = PA2PTE(pa) | flags | PTE_V;
         pte++;
-        page_ref_inc(pa);
+        page_ref_inc(KERNEL_PA2VA(pa));
+        a += PGSIZE;
         pa += PGSIZE;
-        // if this is the last pte in L0 pgtbl, start from another pgtbl
-        if (IS_PGALIGNED(pte)) {
-            pte = walk(pgtbl, va + nr_mapped * PGSIZE, WALK_ALLOC);
-            assert(pte);
-        }
     }
+
+    return 0;
 }
 
 
-// for fork() copy child process userspace
-// add load page fault handler later 
-void
-uvmcopy(pagetable_t cpgtbl, pagetable_t ppgtbl, uint64 sz)
+int
+split_megapage(pagetable_t pgtbl, uint64 va)
 {
-    // copy .text & .data & stack & heap
-    for (uint64 va = 0; va < sz; va += PGSIZE) {
-        pte_t *ppte = walk(ppgtbl, va, WALK_NOALLOC);
-        // Assert(*ppte && (*ppte & PTE_V), "Invalid pte: %lx", *ppte);
-        
-        uint64 pa = PTE2PA(*ppte);
-        if (pa) {
-            uint64 flags = PTE_FLAGS(*ppte);
-            flags = ((*ppte & PTE_W) ? ((flags & ~PTE_W) | PTE_COW) : flags);
-
-            mappages(cpgtbl, va, pa, PGSIZE, flags);
-        }
+    pte_t* pmd = walk_megapage(pgtbl, va, WALK_NOALLOC);
+    if (pmd == NULL || !PTE_IS_MEGA(*pmd))
+        return 0;
+
+    // let walk allocate the L0 table, so the directory entry is in arch format
+    pte_t old = *pmd;
+    *pmd = 0;
+    va = MEGAPGROUNDDOWN(va);
+    pte_t* pte = walk(pgtbl, va, WALK_ALLOC);
+    if (pte == NULL) {
+        *pmd = old;
+        return -ENOMEM;
+    }
+
+    uint64 pa = PTE2PA(old);
+    uint64 flags = (PTE_FLAGS(old) & ~PTE_MEGA);
+    for (int i = 0; i < MEGAPG_NPAGES; i++)
+        pte[i] = PA2PTE(pa + i * PGSIZE) | flags;
+
+    flush_user_tlb(va);
+    return 0;
+}
+
+
+// free the pages collected on freed, once the TLB shootdown dropped their last mappings
+static void
+free_page_list(struct list_head* freed)
+{
+    struct page *page, *next;
+    list_for_each_entry_safe(page, next, freed, list) {
+        list_remove(&page->list);
+        kfree((void*) PAGE_ADDR(page));
     }
 }
 
-void 
-uvmcopy_alloc(pagetable_t cpgtbl, pagetable_t ppgtbl, struct vm_area* vma_list) {
-    struct vm_area *vma = vma_list;
-    while (vma) {
-        int perms = vma->prot;
-        for (uint64 va = vma->start; va < vma->end; va += PGSIZE) {
-            mappages(cpgtbl, va, (uint64)kalloc(PGSIZE), PGSIZE, perms);
-        }
-        vma = vma->next;
+
+// drop the references of a megapage held by one mapping,
+// pages nobody maps any more are collected on freed, each of them is an order 0 page
+static void
+put_megapage(uint64 kva, struct list_head* freed)
+{
+    for (int i = 0; i < MEGAPG_NPAGES; i++) {
+        if (page_ref_dec(kva + i * PGSIZE) == 1)
+            list_insert(freed, &GET_PAGE(kva + i * PGSIZE)->list);
     }
 }
 
 
-// given userspace destination virtual address
-// copy len bytes from kernel to user
-// return 0 on success
+static inline int
+page_is_shared(uint64 pa)
+{
+    return IS_ZERO_PAGE(pa) || (GET_PAGE(pa)->flag & (PG_CACHE | PG_SHMEM));
+}
+
+// for fork() share every page present in parent userspace with child
+// private writable pages become read-only COW in both, and are copied on first write
+// pages never touched stay unmapped in both
 int
-copyout(pagetable_t pgtbl, uint64 dstva, void* src, size_t len)
+uvmcopy(pagetable_t cpgtbl, pagetable_t ppgtbl)
 {
-    // char* s = (char*) src;
-    uint64 va0 = 0, pa0 = 0;
-    pte_t *pte = NULL;
-
-    while (len > 0) {
-        va0 = PGROUNDDOWN(dstva);
-        
-        pte = walk(pgtbl, va0, WALK_NOALLOC);
-        EXIT_IF((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0, "copyout occurs pte illegal");
-            
-        pa0 = KERNEL_PA2VA(PTE2PA(*pte));
-        if (pa0 == 0)
-            return -1;
-
-        if (*pte & PTE_COW) {
-            char* mem = kalloc(PGSIZE);
-            EXIT_IF(mem == NULL, "out of memory");
-
-            memmove(mem, (void*) pa0, PGSIZE);
-
-            uint64 flags = PTE_FLAGS(*pte);
-            flags = (flags & ~PTE_COW) | PTE_W;
-
-            *pte = (PA2PTE(mem) | flags);
-                
-            if (page_ref_dec(pa0) == 1)  // ref count is zero now
-                kfree((void*) pa0);
-
-            pa0 = (uint64) mem;
+    ppgtbl = (pagetable_t) KERNEL_PA2VA(ppgtbl);
+    int err = 0;
+
+    // not copy trapframe & trampoline
+    for (int i = 0; i < 511 && err == 0; i++) {
+        if (PTE2PA(ppgtbl[i]) == 0)
+            continue;
+        pagetable_t pgtbl1 = (pagetable_t) KERNEL_PA2VA(PTE2PA(ppgtbl[i]));
+        for (int j = 0; j < 512 && err == 0; j++) {
+            if (PTE2PA(pgtbl1[j]) == 0)
+                continue;
+            if (PTE_IS_MEGA(pgtbl1[j])) {
+                // megapages are always private anonymous memory, child gets a megapage as well
+                pte_t* ppmd = &pgtbl1[j];
+                uint64 va = ((uint64) i << 30) | ((uint64) j << 21);
+                if (*ppmd & PTE_W)
+                    *ppmd = ((*ppmd & ~PTE_WRITE) | PTE_COW);
+                if (mappages(cpgtbl, va, PTE2PA(*ppmd), MEGAPGSIZE, PTE_FLAGS(*ppmd)) < 0)
+                    err = -ENOMEM;
+                continue;
+            }
+            pagetable_t pgtbl2 = (pagetable_t) KERNEL_PA2VA(PTE2PA(pgtbl1[j]));
+            for (int k = 0; k < 512; k++) {
+                pte_t* ppte = &pgtbl2[k];
+                uint64 va = ((uint64) i << 30) | ((uint64) j << 21) | ((uint64) k << PGSHIFT);
+
+                // swapped out page, child shares the zram slot
+                if (PTE_IS_SWAP(*ppte)) {
+                    pte_t* cpte = walk(cpgtbl, va, WALK_ALLOC);
+                    if (cpte == NULL) {
+                        err = -ENOMEM;
+                        break;
+                    }
+                    *cpte = *ppte;
+                    zram_dup(SWAP_PTE_SLOT(*ppte));
+                    continue;
+                }
+                if ((*ppte & PTE_V) == 0)
+                    continue;
+
+                uint64 pa = PTE2PA(*ppte);
+                uint64 kva = KERNEL_PA2VA(pa);
+                int anon = (GET_PAGE(kva)->flag & PG_ANON);
+
+                // writable page cache and shmem pages belong to MAP_SHARED, keep sharing them
+                if ((*ppte & PTE_W) && !page_is_shared(kva))
+                    *ppte = ((*ppte & ~PTE_WRITE) | PTE_COW);
+
+                // pinned, so that reclaim in mappages can not swap it out
+                if (anon)
+                    page_ref_inc(kva);
+                if (mappages(cpgtbl, va, pa, PGSIZE, PTE_FLAGS(*ppte)) < 0)
+                    err = -ENOMEM;
+                else if (anon)
+                    page_add_anon_rmap(kva, cpgtbl, va);
+                if (anon)
+                    page_ref_dec(kva);
+                if (err < 0)
+                    break;
+            }
         }
-        
-        uint64 n = PGSIZE - (dstva - va0);
-        n = (n > len ? len : n);
+    }
 
-        memmove((void*)(pa0 + dstva - va0), src, n);
+    // parent may still hold writable entries in TLB, on any cpu its threads run on
+    flush_tlb_all();
+    return err;
+}
+
+
+// replace a COW mapping with a private copy of the page
+static int
+do_wp_page(pagetable_t pgtbl, pte_t* pte, uint64 va)
+{
+    uint64 pa = KERNEL_PA2VA(PTE2PA(*pte));
 
-        len -= n;
-        src += n;
-        dstva = va0 + PGSIZE;
+    // nobody else maps this page any more, just take it
+    if (page_ref_count(pa) == 1 && !page_is_shared(pa)) {
+        *pte = ((*pte & ~PTE_COW) | PTE_WRITE);
+        flush_user_tlb(va);
+        return 0;
     }
 
+    // pinned, so that reclaim in kalloc can not swap it out
+    page_ref_inc(pa);
+    int zero = IS_ZERO_PAGE(pa);
+    char* mem = kalloc_gfp(PGSIZE, GFP_KERNEL | (zero ? __GFP_ZERO : 0));
+    if (mem == NULL) {
+        page_ref_dec(pa);
+        return -ENOMEM;
+    }
+
+    if (!zero)
+        copy_page(mem, (void*) pa);
+
+    uint64 flags = PTE_FLAGS(*pte);
+    flags = ((flags & ~PTE_COW) | PTE_WRITE);
+    page_remove_rmap(pa, pgtbl, va);
+    *pte = (PA2PTE(KERNEL_VA2PA(mem)) | flags);
+    page_ref_inc((uint64) mem);
+    page_add_anon_rmap((uint64) mem, pgtbl, va);
+
+    // the pin and the old mapping, freed only after other cpus dropped it from their TLB
+    page_ref_dec(pa);
+    int last = (page_ref_dec(pa) == 1);
+    flush_user_tlb(va);
+    if (last)
+        kfree((void*) pa);
     return 0;
 }
 
 
-// copy from user to kernel
-// if dst is NULL will alloc a space for it
-int 
-copyin(pagetable_t pagetable, char* dst, uint64 srcva, size_t len)
+// write to a COW megapage
+// the whole megapage is taken if nobody else maps any page of it,
+// otherwise it is split and only the page written is copied
+static int
+do_wp_megapage(pagetable_t pgtbl, pte_t* pmd, uint64 va)
 {
-    uint64 va0 = 0, pa0 = 0;
+    uint64 pa = KERNEL_PA2VA(PTE2PA(*pmd));
+    int shared = 0;
+    for (int i = 0; i < MEGAPG_NPAGES && !shared; i++)
+        shared = (page_ref_count(pa + i * PGSIZE) != 1);
+
+    if (!shared) {
+        *pmd = ((*pmd & ~PTE_COW) | PTE_WRITE);
+        flush_user_tlb(MEGAPGROUNDDOWN(va));
+        return 0;
+    }
 
-    if (dst == NULL) dst = kalloc(len);
-    if (dst == NULL) return -1;
+    if (split_megapage(pgtbl, va) < 0)
+        return -ENOMEM;
+    return do_wp_page(pgtbl, walk(pgtbl, va, WALK_NOALLOC), va);
+}
 
-    int cnt = 0;
 
-    while (len > 0) {
-        va0 = PGROUNDDOWN(srcva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0) {
-            // Log(ANSI_FG_RED, "va0 %lx not found", va0);
-            return cnt;
-        }
+// back the whole 2 MiB around va with a megapage
+// fails when memory is fragmented or part of the area is mapped already
+static int
+do_anonymous_megapage(pagetable_t pgtbl, uint64 va, uint64 perm)
+{
+    va = MEGAPGROUNDDOWN(va);
+    pte_t* pmd = walk_megapage(pgtbl, va, WALK_NOALLOC);
+    if (pmd && *pmd != 0)
+        return -EEXIST;
+
+    // never reclaim for a megapage, 4 KiB pages will do
+    char* mem = buddy_alloc_gfp(MEGAPGSIZE, GFP_ATOMIC | __GFP_NOWARN);
+    if (mem == NULL)
+        return -ENOMEM;
+    memset(mem, 0, MEGAPGSIZE);
+
+    // after a split, each page is freed alone
+    for (int i = 0; i < MEGAPG_NPAGES; i++)
+        GET_PAGE(mem + i * PGSIZE)->order = 0;
+
+    if (mappages(pgtbl, va, KERNEL_VA2PA(mem), MEGAPGSIZE, perm | PTE_MEGA) < 0) {
+        buddy_free(mem, MEGAPG_ORDER);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
 
-        uint64 offset = srcva - va0;
-        uint64 n = PGSIZE - offset;
-        n = (n > len ? len : n);
+// nothing is mapped at va yet, checked again right before a new page goes in
+static inline int
+pte_none(pagetable_t pgtbl, uint64 va)
+{
+    pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+    return (pte == NULL || (!(*pte & PTE_V) && !PTE_IS_SWAP(*pte)));
+}
 
-        memmove(dst, (void*)(KERNEL_PA2VA(pa0 + offset)), n);
 
-        len -= n;
-        dst += n;
-        srcva = va0 + PGSIZE;
+// populate a page that has never been touched
+// read faults on anonymous memory share the zero page until written
+// a write fault tries a megapage first, if the 2 MiB around va lies in [start, end)
+static int
+do_anonymous_page(pagetable_t pgtbl, uint64 va, int prot, int write, uint64 start, uint64 end)
+{
+    uint64 perm = prot_to_pte(prot);
 
-        cnt += n;
+    if (!write) {
+        if (prot & PROT_WRITE)
+            perm = (prot_to_pte(prot & ~PROT_WRITE) | PTE_COW);
+        return (pte_none(pgtbl, va) ? mappages(pgtbl, va, KERNEL_VA2PA(zero_page), PGSIZE, perm) : 0);
     }
 
+    uint64 mva = MEGAPGROUNDDOWN(va);
+    if (mva >= start && mva + MEGAPGSIZE <= end && do_anonymous_megapage(pgtbl, va, perm) == 0)
+        return 0;
+
+    char* mem = kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+    if (mem == NULL)
+        return -ENOMEM;
+
+    // mappages overwrites whatever it finds, never let it drop a page mapped here
+    if (!pte_none(pgtbl, va)) {
+        kfree(mem);
+        return 0;
+    }
+    if (mappages(pgtbl, va, KERNEL_VA2PA(mem), PGSIZE, perm) < 0) {
+        kfree(mem);
+        return -ENOMEM;
+    }
+    page_add_anon_rmap((uint64) mem, pgtbl, va);
     return 0;
 }
 
-size_t
-copyinstr(pagetable_t pagetable, char* dst, uint64 srcva, size_t max)
-{
-    int got_null = 0;
-    pagetable = (pagetable_t) KERNEL_PA2VA(pagetable);
-    size_t cnt = 0;
-
-    while (got_null == 0 && max > 0) {
-        uint64 va0 = PGROUNDDOWN(srcva);
-        uint64 pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0) return -1;
-
-        uint64 n = PGSIZE - (srcva - va0);
-        n = (n > max ? max : n);
-
-        char *p = (char *) KERNEL_PA2VA(pa0 + (srcva - va0));
-        while (n > 0) {
-            cnt++;
-            if (*p == '\0') {
-                *dst = '\0';
-                got_null = 1;
-                break;
-            } else {
-                *dst = *p;
-            }
 
-            --n;
-            --max;
-            p++;
-            dst++;
+// map a page of file through page cache, or from the object of a shmem file
+// shared pages are mapped read-only until the first write marks them dirty,
+// shmem pages have nothing to write back and are mapped writable at once,
+// private pages are COW from page cache
+static int
+do_file_page(pagetable_t pgtbl, struct vm_area* vma, uint64 va, int write)
+{
+    uint64 index = ((vma->offset + (va - vma->start)) >> PGSHIFT);
+    int shmem = shmem_file(vma->file);
+    char* page = (shmem ? shmem_get_page(vma->file, index) : page_cache_get(vma->file, index));
+    if (page == NULL)
+        return -ENOMEM;
+
+    int err;
+    // mappages overwrites whatever it finds, keep a page mapped here meanwhile
+    if (!pte_none(pgtbl, va))
+        err = 0;
+    else if (vma->flags & MAP_SHARED) {
+        if (write && !shmem)
+            page_cache_set_dirty(vma->file, index);
+        uint64 perm = prot_to_pte(write || shmem ? vma->prot : (vma->prot & ~PROT_WRITE));
+        err = mappages(pgtbl, va, KERNEL_VA2PA(page), PGSIZE, perm);
+    }
+    else if (write) {
+        // copy right now, rather than map and fault again
+        char* mem = kalloc(PGSIZE);
+        err = -ENOMEM;
+        if (mem) {
+            copy_page(mem, page);
+            err = mappages(pgtbl, va, KERNEL_VA2PA(mem), PGSIZE, prot_to_pte(vma->prot));
+            if (err < 0)
+                kfree(mem);
+            else
+                page_add_anon_rmap((uint64) mem, pgtbl, va);
         }
     }
+    else {
+        uint64 perm = prot_to_pte(vma->prot & ~PROT_WRITE);
+        if (vma->prot & PROT_WRITE)
+            perm |= PTE_COW;
+        err = mappages(pgtbl, va, KERNEL_VA2PA(page), PGSIZE, perm);
+    }
 
-    return (got_null ? cnt : -1);
+    if (shmem)
+        shmem_put_page(page);
+    else
+        page_cache_put(page);
+    return err;
 }
 
 
-ssize_t copy_from_user(void *to, const void *from, size_t n) {
-    if(copyin(UPGTBL(myproc()->pagetable), (char *) to, (uint64) from, n) < 0)
-        return -1;
-    return n;
+// map the file pages following va of a sequentially read vma read-only,
+// so that the next faults are saved, stop at the first page mapped already
+static void
+file_fault_around(pagetable_t pgtbl, struct vm_area* vma, uint64 va)
+{
+    uint64 end = MIN(vma->end, va + (FILE_FAULT_AROUND + 1) * PGSIZE);
+    for (va += PGSIZE; va < end; va += PGSIZE) {
+        pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+        if (pte && ((*pte & PTE_V) || PTE_IS_SWAP(*pte)))
+            break;
+        if (do_file_page(pgtbl, vma, va, 0) < 0)
+            break;
+    }
 }
 
-ssize_t copy_to_user(void *to, const void *from, size_t n) {
-    if(copyout(UPGTBL(myproc()->pagetable), (uint64) to, (void *) from, n) < 0)
-        return -1;
-    return n;
+
+// caller holds the lock of p->pagetable
+static int
+__handle_mm_fault(struct proc* p, uint64 va, int write)
+{
+    pagetable_t pgtbl = UPGTBL(p->pagetable);
+    pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+
+    struct vm_area* vma = NULL;
+    p->min_flt++;
+
+    if (pte && PTE_IS_SWAP(*pte)) {
+        p->maj_flt++;
+        return do_swap_page(pgtbl, pte, va);
+    }
+
+    if (pte && (*pte & PTE_V)) {
+        // page is present, only a write to COW page or clean shared file page is legal
+        if (!write)
+            return -EFAULT;
+        if (PTE_IS_MEGA(*pte))
+            return ((*pte & PTE_COW) ? do_wp_megapage(pgtbl, pte, va) : -EFAULT);
+        if (*pte & PTE_COW)
+            return do_wp_page(pgtbl, pte, va);
+        vma = find_vma(p, va);
+        if (vma && vma->file && !shmem_file(vma->file) && (vma->flags & MAP_SHARED) && (vma->prot & PROT_WRITE)) {
+            page_cache_set_dirty(vma->file, (vma->offset + (va - vma->start)) >> PGSHIFT);
+            *pte |= PTE_WRITE;
+            flush_user_tlb(va);
+            return 0;
+        }
+        return -EFAULT;
+    }
+
+    int prot;
+    // range where a megapage may be used, only private anonymous memory qualifies
+    uint64 start = 0, end = 0;
+    if (va >= p->heap_start && va < PGROUNDUP(p->sz)) {
+        prot = PROT_READ | PROT_WRITE;
+        start = p->heap_start;
+        end = PGROUNDUP(p->sz);
+    }
+    else {
+        vma = find_vma(p, va);
+        if (vma == NULL)
+            return -EFAULT;
+        prot = vma->prot;
+        if (!(vma->flags & MAP_SHARED) && !(vma->vm_flags & VMA_NOHUGEPAGE)) {
+            start = vma->start;
+            end = vma->end;
+        }
+    }
+
+    if (prot == PROT_NONE || (write && !(prot & PROT_WRITE)))
+        return -EFAULT;
+
+    if (vma && vma->file) {
+        int err = do_file_page(pgtbl, vma, va, write);
+        if (err == 0 && (vma->vm_flags & VMA_SEQ_READ))
+            file_fault_around(pgtbl, vma, va);
+        return err;
+    }
+    return do_anonymous_page(pgtbl, va, prot, write, start, end);
 }
 
-ssize_t copy_from_user_str(char* to, const void* from, size_t max) {
-    return copyinstr(UPGTBL(myproc()->pagetable), to, (uint64)from, max);
+
+int
+handle_mm_fault(struct proc* p, uint64 va, int write)
+{
+    va = PGROUNDDOWN(va);
+    if (va >= MAXVA)
+        return -EFAULT;
+
+    // threads sharing the pagetable may fault on the same page, or unmap it meanwhile
+    sleeplock_acquire(&p->pagetable->lock);
+    int err = __handle_mm_fault(p, va, write);
+    sleeplock_release(&p->pagetable->lock);
+    return err;
 }
 
-ssize_t copy_to_user_str(void* to, const char* from, size_t max) {
-    size_t len = min_uint64(strlen(from) + 1, max);
-    if(copy_to_user(to, (const void*)from, len) < 0)
-        return -1;
-    return len;
+
+static inline int
+pgtbl_empty(pagetable_t pgtbl)
+{
+    for (int i = 0; i < 512; i++) {
+        if (pgtbl[i] != 0)
+            return 0;
+    }
+    return 1;
 }
 
-void
-store_page_fault_handler()
+
+// clear ptes of [va, end) in one L0 pagetable of pgtbl, pages to free are collected on freed
+// return the number of pages unmapped
+static int
+unmap_pte_range(pagetable_t pgtbl, pagetable_t pgtbl0, uint64 va, uint64 end, int do_free, struct list_head* freed)
 {
-    log("store fault");
-    // kernel_trap_error();
-    // struct proc* p = myproc();
-    uint64 badv = trap_get_badv();
-    uint64 va = PGROUNDDOWN(badv);
-
-    // pte_t *pte = walk(UPGTBL(p->pagetable), va, WALK_NOALLOC);
-    pte_t *pte = walk(kernel_pagetable, va, WALK_NOALLOC);
-    EXIT_IF(pte == NULL, "addr %lx pte not found, epc: %lx", badv, r_sepc());
-
-    // if (!CHECK_PTE(pte, PTE_V | PTE_U | PTE_COW)) {
-    if ((*pte == 0) || ((*pte & PTE_V) == 0) || ((*pte & PTE_COW) == 0)) {
-        Log(ANSI_FG_RED, "*pte: %lx\tV: %lx\tU: %lx\tCOW: %lx", *pte, (*pte & PTE_V), (*pte & PTE_U), (*pte & PTE_COW));
-        kernel_trap_error();
+    int nr = 0;
+    for (; va < end; va += PGSIZE) {
+        pte_t* pte = pgtbl0 + PX(0, va);
+        if (PTE_IS_SWAP(*pte)) {
+            if (do_free)
+                zram_free(SWAP_PTE_SLOT(*pte));
+            *pte = 0;
+            continue;
+        }
+        if ((*pte & PTE_V) == 0)
+            continue;
+        uint64 a = KERNEL_PA2VA(PTE2PA(*pte));
+        page_remove_rmap(a, pgtbl, va);
+        if (do_free && page_ref_dec(a) == 1)
+            list_insert(freed, &GET_PAGE(a)->list);
+        *pte = 0;
+        nr++;
     }
+    return nr;
+}
 
-    char* mem = kalloc(PGSIZE);
-    uint64 pa = KERNEL_PA2VA(PTE2PA(*pte));
-    memmove(mem, (void*) pa, PGSIZE);
 
-    uint64 flags = PTE_FLAGS(*pte);
-    flags = ((flags & ~PTE_COW) | PTE_W);
-    // mappages(kernel_pagetable, va, KERNEL_VA2PA(mem), PGSIZE, flags);
-    *pte = (PA2PTE(mem) | flags);
-    page_ref_inc((uint64) mem);
+int
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+    assert(IS_PGALIGNED(va));
+    pagetable = (pagetable_t) KERNEL_PA2VA(pagetable);
+    if (npages == 0)
+        return 0;
+    uint64 end = va + (npages << PGSHIFT);
+
+    // megapages sticking out of either end are split first,
+    // so that a failure leaves everything mapped
+    uint64 head = MEGAPGROUNDDOWN(va), tail = MEGAPGROUNDDOWN(end - 1);
+    if ((head != va || end - head < MEGAPGSIZE) && split_megapage(pagetable, va) < 0)
+        return -ENOMEM;
+    if (tail != head && end - tail < MEGAPGSIZE && split_megapage(pagetable, tail) < 0)
+        return -ENOMEM;
+
+    // only subtrees under the range are visited, holes are skipped a table at a time
+    // pages and tables are freed after the shootdown, other cpus may still walk or write them until then
+    DECLARE_LIST_HEAD(freed);
+    uint64 flush_start = end, flush_end = va;
+    int freed_table = 0;
+    for (uint64 a = va, next2; a < end; a = next2) {
+        next2 = MIN(ROUNDDOWN(a, L2PGSIZE) + L2PGSIZE, end);
+        pte_t* pgd = pagetable + PX(2, a);
+        if (PTE2PA(*pgd) == 0)
+            continue;
+        pagetable_t pgtbl1 = (pagetable_t) KERNEL_PA2VA(PTE2PA(*pgd));
+
+        for (uint64 b = a, next1; b < next2; b = next1) {
+            next1 = MIN(MEGAPGROUNDDOWN(b) + MEGAPGSIZE, next2);
+            pte_t* pmd = pgtbl1 + PX(1, b);
+            if (PTE2PA(*pmd) == 0)
+                continue;
+
+            if (PTE_IS_MEGA(*pmd)) {
+                // partly covered ones have been split, so this one is covered wholly
+                if (do_free)
+                    put_megapage(KERNEL_PA2VA(PTE2PA(*pmd)), &freed);
+                *pmd = 0;
+            }
+            else {
+                pagetable_t pgtbl0 = (pagetable_t) KERNEL_PA2VA(PTE2PA(*pmd));
+                if (unmap_pte_range(pagetable, pgtbl0, b, next1, do_free, &freed) == 0 && !pgtbl_empty(pgtbl0))
+                    continue;
+                if (pgtbl_empty(pgtbl0)) {
+                    *pmd = 0;
+                    list_insert(&freed, &GET_PAGE(pgtbl0)->list);
+                    freed_table = 1;
+                }
+            }
+            flush_start = MIN(flush_start, b);
+            flush_end = MAX(flush_end, next1);
+        }
 
-    if (page_ref_dec(pa) == 1)
-        kfree((void*) pa);
+        if (pgtbl_empty(pgtbl1)) {
+            *pgd = 0;
+            list_insert(&freed, &GET_PAGE(pgtbl1)->list);
+            freed_table = 1;
+        }
+    }
+
+    // hardware may cache non-leaf entries as well, freed tables need a full flush
+    if (freed_table)
+        flush_user_tlb_range(0, MAXVA);
+    else
+        flush_user_tlb_range(flush_start, flush_end);
+    free_page_list(&freed);
+    return 0;
+}
 
-#ifdef ARCH_LOONGARCH
-    flush_tlb_one(myproc()->pid, va);
-#endif
 
-    log("store page fault handle");
+// the L1 entry covering va is empty, or its L1 table is missing
+static inline int
+pmd_none(pagetable_t pgtbl, uint64 va)
+{
+    pte_t* pmd = walk_megapage(pgtbl, va, WALK_NOALLOC);
+    return (pmd == NULL || PTE2PA(*pmd) == 0);
 }
 
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+
+int
+uvmmove(pagetable_t pagetable, uint64 old, uint64 new, uint64 len)
+{
+    assert(IS_PGALIGNED(old) && IS_PGALIGNED(new) && IS_PGALIGNED(len));
+    uint64 end = old + len;
+    int congruent = (((old ^ new) & (MEGAPGSIZE - 1)) == 0);
+
+    // allocate every table first, reclaim meanwhile may only turn present ptes into swap ptes
+    for (uint64 va = old; va < end; va += PGSIZE) {
+        if (pmd_none(pagetable, va)) {
+            va = MIN(MEGAPGROUNDDOWN(va) + MEGAPGSIZE, end) - PGSIZE;
+            continue;
+        }
+        pte_t* pmd = walk_megapage(pagetable, va, WALK_NOALLOC);
+        if (PTE_IS_MEGA(*pmd)) {
+            uint64 mva = MEGAPGROUNDDOWN(va);
+            if (congruent && mva >= old && mva + MEGAPGSIZE <= end) {
+                pte_t* npmd = walk_megapage(pagetable, new + (mva - old), WALK_ALLOC);
+                if (npmd == NULL)
+                    return -ENOMEM;
+                // an empty L0 table left there blocks it, move the pages one by one then
+                if (PTE2PA(*npmd) == 0) {
+                    va = mva + MEGAPGSIZE - PGSIZE;
+                    continue;
+                }
+            }
+            if (split_megapage(pagetable, va) < 0)
+                return -ENOMEM;
+        }
+        pte_t* pte = walk(pagetable, va, WALK_NOALLOC);
+        if (pte && (*pte & PTE_V || PTE_IS_SWAP(*pte)) && walk(pagetable, new + (va - old), WALK_ALLOC) == NULL)
+            return -ENOMEM;
+    }
+
+    // nothing below allocates, so it can not fail
+    for (uint64 va = old; va < end; va += PGSIZE) {
+        uint64 nva = new + (va - old);
+        if (pmd_none(pagetable, va)) {
+            va = MIN(MEGAPGROUNDDOWN(va) + MEGAPGSIZE, end) - PGSIZE;
+            continue;
+        }
+        pte_t* pmd = walk_megapage(pagetable, va, WALK_NOALLOC);
+        if (PTE_IS_MEGA(*pmd)) {
+            *walk_megapage(pagetable, nva, WALK_NOALLOC) = *pmd;
+            *pmd = 0;
+            va += MEGAPGSIZE - PGSIZE;
+            continue;
+        }
+
+        pte_t* pte = walk(pagetable, va, WALK_NOALLOC);
+        if (!(*pte & PTE_V) && !PTE_IS_SWAP(*pte))
+            continue;
+        pte_t* npte = walk(pagetable, nva, WALK_NOALLOC);
+        assert(npte && !(*npte & PTE_V) && !PTE_IS_SWAP(*npte));
+        *npte = *pte;
+        *pte = 0;
+        if (*npte & PTE_V)
+            page_move_anon_rmap(KERNEL_PA2VA(PTE2PA(*npte)), pagetable, va, nva);
+    }
+
+    // every pte left is empty, this only frees the tables
+    uvmunmap(pagetable, old, len >> PGSHIFT, UVMUNMAP_NOFREE);
+    // megapages moved away are not seen by uvmunmap
+    flush_user_tlb_range(old, end);
+    return 0;
+}
+
+
+// unmap and free all user pages, for tearing down a whole address space
+// no cpu runs in it any more, so nothing waits for a shootdown
+static void
+uvmunmap_all(pagetable_t pagetable)
 {
-    assert(IS_PGALIGNED(va));
     pagetable = (pagetable_t) KERNEL_PA2VA(pagetable);
+    DECLARE_LIST_HEAD(freed);
 
     // not free trapframe & trapoline
     for (int i = 0; i < 511; i++) {
-        if (PTE2PA(pagetable[i] != 0)) {
-            pagetable_t pgtbl1 = (pagetable_t) KERNEL_PA2VA(PA2PTE(pagetable[i]));
+        if (PTE2PA(pagetable[i]) != 0) {
+            pagetable_t pgtbl1 = (pagetable_t) KERNEL_PA2VA(PTE2PA(pagetable[i]));
             for (int j = 0; j < 512; j++) {
-                if (PTE2PA(pgtbl1[j]) != 0) {
-                    pagetable_t pgtbl2 = (pagetable_t) KERNEL_PA2VA(PA2PTE(pgtbl1[j]));
+                if (PTE_IS_MEGA(pgtbl1[j])) {
+                    put_megapage(KERNEL_PA2VA(PTE2PA(pgtbl1[j])), &freed);
+                    pgtbl1[j] = 0;
+                }
+                else if (PTE2PA(pgtbl1[j]) != 0) {
+                    pagetable_t pgtbl2 = (pagetable_t) KERNEL_PA2VA(PTE2PA(pgtbl1[j]));
                     for (int k = 0; k < 512; k++) {
-                        pte_t pte = pgtbl2[k];
-                        uint64 pa = PTE2PA(pte);
-
-                        if (pa) {
-                            if (do_free) {
-                                uint64 a = KERNEL_PA2VA(pa);
-                                if (page_ref_dec(a) == 1)
-                                    kfree((void*) a);
-                            }
-                            pgtbl2[k] = 0;
-#ifdef ARCH_LOONGARCH
-                            flush_tlb_one(myproc()->pid, addr);
-#endif
+                        uint64 va = ((uint64) i << 30) | ((uint64) j << 21) | ((uint64) k << PGSHIFT);
+                        if (PTE_IS_SWAP(pgtbl2[k]))
+                            zram_free(SWAP_PTE_SLOT(pgtbl2[k]));
+                        else if (PTE2PA(pgtbl2[k])) {
+                            uint64 a = KERNEL_PA2VA(PTE2PA(pgtbl2[k]));
+                            page_remove_rmap(a, pagetable, va);
+                            if (page_ref_dec(a) == 1)
+                                kfree((void*) a);
                         }
+                        pgtbl2[k] = 0;
                     }
                 }
             }
         }
     }
+    free_page_list(&freed);
+}
+
+
+void
+uvm_get_rss(pagetable_t pagetable, struct mm_rss* rss)
+{
+    pagetable = (pagetable_t) KERNEL_PA2VA(pagetable);
+    memset(rss, 0, sizeof(*rss));
 
-//     for (uint64 addr = va; addr < va + (npages << PGSHIFT); addr += PGSIZE) {
-//         pte_t* pte = walk(pagetable, addr, WALK_NOALLOC);
-//         assert(pte && (*pte & PTE_V));
-//         if (do_free) {
-//             uint64 a = KERNEL_PA2VA(PTE2PA(*pte));
-//             if (page_ref_dec(a) == 1)
-//                 kfree((void*) a);
-//         }
-//         *pte = 0;
-// #ifdef ARCH_LOONGARCH
-//         flush_tlb_one(myproc()->pid, addr);
-// #endif
-//     }
+    // skip trapframe & trampoline
+    for (int i = 0; i < 511; i++) {
+        if (PTE2PA(pagetable[i]) == 0)
+            continue;
+        pagetable_t pgtbl1 = (pagetable_t) KERNEL_PA2VA(PTE2PA(pagetable[i]));
+        for (int j = 0; j < 512; j++) {
+            if (PTE2PA(pgtbl1[j]) == 0)
+                continue;
+            if (PTE_IS_MEGA(pgtbl1[j])) {
+                rss->resident += MEGAPGSIZE / PGSIZE;
+                if (page_ref_count(KERNEL_PA2VA(PTE2PA(pgtbl1[j]))) > 1)
+                    rss->shared += MEGAPGSIZE / PGSIZE;
+                continue;
+            }
+            pagetable_t pgtbl2 = (pagetable_t) KERNEL_PA2VA(PTE2PA(pgtbl1[j]));
+            for (int k = 0; k < 512; k++) {
+                if (PTE_IS_SWAP(pgtbl2[k]))
+                    rss->swapped++;
+                else if ((pgtbl2[k] & PTE_V) && !IS_ZERO_PAGE(PTE2PA(pgtbl2[k]))) {
+                    rss->resident++;
+                    if (page_ref_count(KERNEL_PA2VA(PTE2PA(pgtbl2[k]))) > 1)
+                        rss->shared++;
+                }
+            }
+        }
+    }
 }
 
 
@@ -338,7 +827,8 @@ void freewalk(pagetable_t pgtbl, int level) {
     for (int i = 0; i < npte; i++) {
         pte_t pte = pgtbl[i];
         uint64 child = PTE2PA(pte);
-        if (child != 0)
+        // megapage is a leaf, not a pagetable
+        if (child != 0 && !(level == 1 && PTE_IS_MEGA(pte)))
             freewalk((pagetable_t) child, level + 1);
         pgtbl[i] = 0;
     }
@@ -351,18 +841,14 @@ void freewalk(pagetable_t pgtbl, int level) {
 void uvmfree(pagetable_t pgtbl, uint64 sz) 
 {   
     pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
-    if (sz > 0)
-        uvmunmap(pgtbl, 0, (PGROUNDUP(sz) >> PGSHIFT), UVMUNMAP_FREE);
+    uvmunmap_all(pgtbl);
     freewalk(pgtbl, 0);
 }   
 
 void uvmfree_vma(pagetable_t pgtbl, struct vm_area* vma_list) 
 {   
+    // heap, stack and pages outside of vmas must be freed as well
     pgtbl = (pagetable_t) KERNEL_PA2VA(pgtbl);
-    struct vm_area *vma = vma_list;
-    while (vma) {
-        uvmunmap(pgtbl, vma->start, ((vma->end - vma->start) >> PGSHIFT), UVMUNMAP_FREE);
-        vma = vma->next;
-    }
+    uvmunmap_all(pgtbl);
     freewalk(pgtbl, 0);
 }
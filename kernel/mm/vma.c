@@ -0,0 +1,277 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/memlayout.h>
+#include <mm/vma.h>
+#include <proc/proc.h>
+
+
+static inline int
+vma_cmp(struct vm_area* a, struct vm_area* b)
+{
+    if (a->start < b->start)
+        return -1;
+    if (a->start > b->start)
+        return 1;
+    return 0;
+}
+
+
+// recompute max_gap of x from its own gap and its children
+static inline void
+vma_augment(struct vm_area* x)
+{
+    uint64 max_gap = x->gap;
+    struct vm_area* child;
+    if ((child = RB_LEFT(x, rb)) && child->max_gap > max_gap)
+        max_gap = child->max_gap;
+    if ((child = RB_RIGHT(x, rb)) && child->max_gap > max_gap)
+        max_gap = child->max_gap;
+    x->max_gap = max_gap;
+}
+
+// RB_AUGMENT is expanded where the tree functions are generated,
+// so rotations keep max_gap of the nodes they move
+#undef RB_AUGMENT
+#define RB_AUGMENT(x) vma_augment(x)
+
+RB_GENERATE_INTERNAL(vma_tree, vm_area, rb, vma_cmp, static inline)
+
+
+// fix max_gap from x up to the root
+static void
+vma_propagate(struct vm_area* x)
+{
+    for (; x; x = RB_PARENT(x, rb))
+        vma_augment(x);
+}
+
+
+static void
+vma_update_gap(struct vm_area* vma)
+{
+    vma->gap = vma->start - (vma->prev ? vma->prev->end : 0);
+    vma_propagate(vma);
+}
+
+
+struct vm_area*
+find_vma_after(struct proc* p, uint64 va)
+{
+    struct vm_area *vma = RB_ROOT(&p->vma_tree), *ret = NULL;
+
+    // vmas do not overlap, so their ends are sorted as well as their starts
+    while (vma) {
+        if (vma->end > va) {
+            ret = vma;
+            if (vma->start <= va)
+                break;
+            vma = RB_LEFT(vma, rb);
+        }
+        else
+            vma = RB_RIGHT(vma, rb);
+    }
+    return ret;
+}
+
+
+struct vm_area*
+find_vma(struct proc* p, uint64 va)
+{
+    // faults tend to hit the same vma again and again
+    struct vm_area* vma = p->vma_cache;
+    if (vma && va >= vma->start && va < vma->end)
+        return vma;
+
+    vma = find_vma_after(p, va);
+    if (vma && va >= vma->start) {
+        p->vma_cache = vma;
+        return vma;
+    }
+    return NULL;
+}
+
+
+int
+vma_insert(struct proc* p, struct vm_area* vma)
+{
+    struct vm_area* next = find_vma_after(p, vma->start);
+    if (next && next->start < vma->end)
+        return -EINVAL;
+    struct vm_area* prev = (next ? next->prev : RB_MAX(vma_tree, &p->vma_tree));
+
+    vma->prev = prev;
+    vma->next = next;
+    if (prev) prev->next = vma;
+    else p->vma_list = vma;
+    if (next) next->prev = vma;
+
+    vma->gap = vma->start - (prev ? prev->end : 0);
+    vma->max_gap = vma->gap;
+    RB_INSERT(vma_tree, &p->vma_tree, vma);
+    // RB_INSERT only fixes the direct parent
+    vma_propagate(vma);
+
+    if (next)
+        vma_update_gap(next);
+    return 0;
+}
+
+
+void
+vma_remove(struct proc* p, struct vm_area* vma)
+{
+    struct vm_area *prev = vma->prev, *next = vma->next;
+
+    // take its gap out of the ancestors first, then the tree stays exact after removal
+    vma->gap = 0;
+    vma_propagate(vma);
+    RB_REMOVE(vma_tree, &p->vma_tree, vma);
+
+    if (prev) prev->next = next;
+    else p->vma_list = next;
+    if (next) {
+        next->prev = prev;
+        vma_update_gap(next);
+    }
+
+    vma->next = vma->prev = NULL;
+    if (p->vma_cache == vma)
+        p->vma_cache = NULL;
+}
+
+
+void
+vma_adjust(struct proc* p, struct vm_area* vma, uint64 start, uint64 end)
+{
+    assert(start < end);
+    assert(vma->prev == NULL || vma->prev->end <= start);
+    assert(vma->next == NULL || end <= vma->next->start);
+
+    // the order does not change, so start can be modified in place
+    vma->start = start;
+    vma->end = end;
+    vma_update_gap(vma);
+    if (vma->next)
+        vma_update_gap(vma->next);
+}
+
+
+struct vm_area*
+vma_split(struct proc* p, struct vm_area* vma, uint64 addr)
+{
+    assert(addr > vma->start && addr < vma->end && IS_PGALIGNED(addr));
+
+    KALLOC(struct vm_area, new_vma);
+    if (new_vma == NULL)
+        return NULL;
+    *new_vma = *vma;
+    new_vma->refcnt = 1;
+    new_vma->start = addr;
+    new_vma->offset += addr - vma->start;
+    if (new_vma->file)
+        file_get(new_vma->file);
+
+    vma_adjust(p, vma, vma->start, addr);
+    vma_insert(p, new_vma);
+    return new_vma;
+}
+
+
+// find the highest vma whose gap below it, clipped to [lo, hi), holds length bytes
+static struct vm_area*
+gap_search(struct vm_area* node, uint64 length, uint64 lo, uint64 hi)
+{
+    if (node == NULL || node->max_gap < length)
+        return NULL;
+
+    // the whole right subtree lies above hi
+    if (node->start > hi)
+        return gap_search(RB_LEFT(node, rb), length, lo, hi);
+
+    struct vm_area* found = gap_search(RB_RIGHT(node, rb), length, lo, hi);
+    if (found)
+        return found;
+
+    // gaps of this node and its left subtree end below lo
+    if (node->start <= lo)
+        return NULL;
+
+    uint64 gap_start = MAX(node->start - node->gap, lo);
+    if (node->start - gap_start >= length)
+        return node;
+
+    return gap_search(RB_LEFT(node, rb), length, lo, hi);
+}
+
+
+uint64
+find_free_vma_range(struct proc *p, size_t length)
+{
+    uint64 lo = p->mmap_base, hi = p->mmap_brk;
+    struct vm_area* vma;
+
+    // free space right below mmap_brk
+    vma = find_vma_after(p, hi - 1);
+    if (vma == NULL || vma->start >= hi) {
+        struct vm_area* prev = (vma ? vma->prev : RB_MAX(vma_tree, &p->vma_tree));
+        uint64 free_start = MAX(prev ? prev->end : 0, lo);
+        if (hi > free_start && hi - free_start >= length)
+            return hi - length;
+    }
+
+    // highest hole between vmas
+    vma = gap_search(RB_ROOT(&p->vma_tree), length, lo, hi);
+    if (vma)
+        return vma->start - length;
+
+    // expand mmap area, skip vmas mapped above mmap_brk by MAP_FIXED
+    // TODO: CHECK BOUND
+    for (;;) {
+        uint64 new_brk = p->mmap_brk + MAX(length, MMAP_EXPAND);
+        vma = find_vma_after(p, new_brk - length);
+        if (vma == NULL || vma->start >= new_brk) {
+            p->mmap_brk = new_brk;
+            return new_brk - length;
+        }
+        p->mmap_brk = PGROUNDUP(vma->end);
+    }
+}
+
+
+int
+copy_vma_list(struct proc* child, struct proc* parent)
+{
+    struct vm_area* vma;
+
+    for (vma = parent->vma_list; vma; vma = vma->next) {
+        KALLOC(struct vm_area, new_vma);
+        if (new_vma == NULL)
+            return -ENOMEM;
+        *new_vma = *vma;
+        new_vma->refcnt = 1;
+        if (new_vma->file)
+            file_get(new_vma->file);
+        vma_insert(child, new_vma);
+    }
+
+    return 0;
+}
+
+
+void
+free_vma_list(struct proc* p)
+{
+    struct vm_area *vma, *next;
+    for (vma = p->vma_list; vma; vma = next) {
+        next = vma->next;
+        if (vma->file)
+            file_put(vma->file);
+        kfree(vma);
+    }
+    p->vma_list = NULL;
+    p->vma_cache = NULL;
+    RB_INIT(&p->vma_tree);
+}
@@ -0,0 +1,147 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/reclaim.h>
+#include <mm/zero_pool.h>
+#include <irq/interrupt.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <proc/wait.h>
+#include <locking/spinlock.h>
+
+static DECLARE_LIST_HEAD(zero_pool);
+static SPINLOCK_DEFINE(zero_pool_lock);
+static struct zero_pool_stat stat;
+static struct proc* kzerod;
+static volatile int kzerod_kicked;  // set by zero_pool_idle before it wakes kzerod
+
+
+// caller must hold zero_pool_lock
+static void*
+zero_pool_pop()
+{
+    if (zero_pool.next == &zero_pool)
+        return NULL;
+    struct page* page = container_of(zero_pool.next, struct page, list);
+    list_remove(&page->list);
+    stat.nr_pages--;
+    return (void*) PAGE_ADDR(page);
+}
+
+
+void*
+zero_pool_get()
+{
+    spinlock_acquire(&zero_pool_lock);
+    void* mem = zero_pool_pop();
+    if (mem)
+        stat.nr_hit++;
+    else
+        stat.nr_miss++;
+    spinlock_release(&zero_pool_lock);
+
+    return mem;
+}
+
+
+int
+zero_pool_refill(int nr)
+{
+    int n = 0;
+    for (; n < nr && stat.nr_pages < ZERO_POOL_HIGH; n++) {
+        // the pool is only worth free memory, never reclaim for it
+        void* mem = buddy_alloc_gfp(PGSIZE, GFP_ATOMIC | __GFP_NOWARN);
+        if (mem == NULL)
+            break;
+        clear_page(mem);
+
+        spinlock_acquire(&zero_pool_lock);
+        list_insert_end(&zero_pool, &GET_PAGE(mem)->list);
+        stat.nr_pages++;
+        stat.nr_zeroed++;
+        spinlock_release(&zero_pool_lock);
+    }
+    return n;
+}
+
+
+// whether some process other than kzerod wants the CPU, kzerod itself is running and not queued
+static int
+others_runnable()
+{
+    return sched_nr_queued() > 0;
+}
+
+
+static void
+kzerod_main()
+{
+    intr_on();
+    for (;;) {
+        // a kick that comes while we refill is seen by the wait below
+        kzerod_kicked = 0;
+        while (!others_runnable() && zero_pool_refill(1) == 1)
+            ;
+        wait_event_chan(&zero_pool, kzerod_kicked);
+    }
+}
+
+
+void
+zero_pool_idle()
+{
+    if (kzerod && stat.nr_pages < ZERO_POOL_HIGH) {
+        kzerod_kicked = 1;
+        wakeup(&zero_pool);
+    }
+}
+
+
+void
+zero_pool_thread_init()
+{
+    kzerod = kthread_create("kzerod", kzerod_main);
+    Assert(kzerod, "out of memory");
+    // only the idle CPU time is meant for zeroing
+    sched_set_nice(kzerod, NICE_MAX);
+}
+
+
+static uint64
+zero_pool_shrink(uint64 nr)
+{
+    uint64 nr_freed = 0;
+    for (; nr_freed < nr; nr_freed++) {
+        spinlock_acquire(&zero_pool_lock);
+        void* mem = zero_pool_pop();
+        spinlock_release(&zero_pool_lock);
+        if (mem == NULL)
+            break;
+        kfree(mem);
+    }
+    return nr_freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+    .name = "zero_pool",
+    .shrink = zero_pool_shrink,
+};
+
+
+void
+zero_pool_get_stat(struct zero_pool_stat* st)
+{
+    spinlock_acquire(&zero_pool_lock);
+    *st = stat;
+    spinlock_release(&zero_pool_lock);
+}
+
+
+void
+zero_pool_init()
+{
+    memset(&stat, 0, sizeof(stat));
+    register_shrinker(&zero_pool_shrinker);
+}
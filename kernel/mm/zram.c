@@ -0,0 +1,255 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/zram.h>
+#include <locking/spinlock.h>
+
+#define ZBUD_CHUNK_SHIFT    6
+#define ZBUD_CHUNK_SIZE     (1 << ZBUD_CHUNK_SHIFT)
+#define ZBUD_NCHUNKS        (PGSIZE >> ZBUD_CHUNK_SHIFT)
+#define ZBUD_LAST           1UL     // handle of the object at the end of a pool page
+
+struct zram_slot {
+    uint64 handle;      // pool object; fill value if len is 0; next free slot if cnt is 0
+    uint16 len;         // compressed length
+    uint16 cnt;         // swap ptes pointing here
+};
+
+static SPINLOCK_DEFINE(zram_lock);
+static struct zram_slot* slots;
+static int free_slot;
+static struct zram_stat stat;
+
+// pool pages holding one object, indexed by their free chunks
+static struct list_head unbuddied[ZBUD_NCHUNKS];
+
+// compression scratch, protected by zram_lock
+static uint16 lz4_wrkmem[LZ4_WRKMEM_SIZE / sizeof(uint16)];
+static uint8 compr_buf[ZRAM_MAX_CLEN];
+
+
+void
+zram_init()
+{
+    slots = kcalloc(ZRAM_NR_SLOTS, sizeof(struct zram_slot));
+    Assert(slots, "no memory for zram");
+
+    // slot 0 is never used, so a swap pte never looks like an empty one
+    for (int i = 1; i < ZRAM_NR_SLOTS; i++)
+        slots[i].handle = (i + 1 < ZRAM_NR_SLOTS ? i + 1 : 0);
+    free_slot = 1;
+
+    for (int i = 0; i < ZBUD_NCHUNKS; i++)
+        INIT_LIST_HEAD(unbuddied[i]);
+    memset(&stat, 0, sizeof(stat));
+}
+
+
+static inline int
+zbud_chunks(int size)
+{
+    return ((size + ZBUD_CHUNK_SIZE - 1) >> ZBUD_CHUNK_SHIFT);
+}
+
+
+static inline int
+zbud_free_chunks(struct page* page)
+{
+    return (ZBUD_NCHUNKS - page->zbud.first - page->zbud.last);
+}
+
+
+// caller must hold zram_lock
+static uint64
+zbud_alloc(int size)
+{
+    int n = zbud_chunks(size);
+    struct page* page = NULL;
+
+    for (int i = n; i < ZBUD_NCHUNKS && page == NULL; i++) {
+        if (unbuddied[i].next != &unbuddied[i]) {
+            page = container_of(unbuddied[i].next, struct page, list);
+            list_remove(&page->list);
+        }
+    }
+
+    if (page == NULL) {
+        // never reclaim, we are probably called by reclaim
+        void* mem = buddy_alloc_gfp(PGSIZE, GFP_ATOMIC | __GFP_NOWARN);
+        if (mem == NULL)
+            return 0;
+        page = GET_PAGE(mem);
+        page->zbud.first = page->zbud.last = 0;
+        stat.pool_pages++;
+    }
+
+    uint64 handle = PAGE_ADDR(page);
+    if (page->zbud.first == 0)
+        page->zbud.first = n;
+    else {
+        page->zbud.last = n;
+        handle |= ZBUD_LAST;
+    }
+
+    // a page holding two objects is full, whatever space is left between them
+    if (page->zbud.last == 0 && zbud_free_chunks(page) > 0)
+        list_insert(&unbuddied[zbud_free_chunks(page)], &page->list);
+    return handle;
+}
+
+
+static inline void*
+zbud_map(uint64 handle)
+{
+    uint64 addr = (handle & ~ZBUD_LAST);
+    if (handle & ZBUD_LAST)
+        addr += PGSIZE - (GET_PAGE(addr)->zbud.last << ZBUD_CHUNK_SHIFT);
+    return (void*) addr;
+}
+
+
+// caller must hold zram_lock
+static void
+zbud_free(uint64 handle)
+{
+    uint64 addr = (handle & ~ZBUD_LAST);
+    struct page* page = GET_PAGE(addr);
+    int was_full = (page->zbud.first && page->zbud.last);
+
+    if (!was_full)
+        list_remove(&page->list);
+    if (handle & ZBUD_LAST)
+        page->zbud.last = 0;
+    else
+        page->zbud.first = 0;
+
+    if (page->zbud.first == 0 && page->zbud.last == 0) {
+        kfree((void*) addr);
+        stat.pool_pages--;
+        return;
+    }
+    list_insert(&unbuddied[zbud_free_chunks(page)], &page->list);
+}
+
+
+// return 1 and the value if the page is filled with one 8-byte value
+static int
+page_same_filled(const void* page, uint64* value)
+{
+    const uint64* p = page;
+    for (int i = 1; i < PGSIZE / sizeof(uint64); i++) {
+        if (p[i] != p[0])
+            return 0;
+    }
+    *value = p[0];
+    return 1;
+}
+
+
+int
+zram_store(const void* page, int nr_ref)
+{
+    uint64 value;
+    int err = -ENOMEM;
+
+    spinlock_acquire(&zram_lock);
+    if (free_slot == 0)
+        goto out;
+    int slot = free_slot;
+    struct zram_slot* s = &slots[slot];
+    int next_free = s->handle;
+
+    if (page_same_filled(page, &value)) {
+        s->handle = value;
+        s->len = 0;
+        stat.nr_same_filled++;
+    }
+    else {
+        int len = lz4_compress(page, PGSIZE, compr_buf, ZRAM_MAX_CLEN, lz4_wrkmem);
+        if (len == 0) {
+            stat.nr_rejected++;
+            err = -E2BIG;
+            goto out;
+        }
+        uint64 handle = zbud_alloc(len);
+        if (handle == 0)
+            goto out;
+        memcpy(zbud_map(handle), compr_buf, len);
+        s->handle = handle;
+        s->len = len;
+        stat.compr_bytes += len;
+    }
+
+    free_slot = next_free;
+    s->cnt = nr_ref;
+    err = slot;
+    stat.nr_slots++;
+
+out:
+    spinlock_release(&zram_lock);
+    return err;
+}
+
+
+int
+zram_load(int slot, void* page)
+{
+    int err = 0;
+
+    spinlock_acquire(&zram_lock);
+    struct zram_slot* s = &slots[slot];
+    assert(slot > 0 && slot < ZRAM_NR_SLOTS && s->cnt > 0);
+    if (s->len == 0) {
+        uint64* p = page;
+        for (int i = 0; i < PGSIZE / sizeof(uint64); i++)
+            p[i] = s->handle;
+    }
+    else if (lz4_decompress(zbud_map(s->handle), s->len, page, PGSIZE) != PGSIZE)
+        err = -EIO;
+    spinlock_release(&zram_lock);
+
+    return err;
+}
+
+
+void
+zram_dup(int slot)
+{
+    spinlock_acquire(&zram_lock);
+    assert(slot > 0 && slot < ZRAM_NR_SLOTS && slots[slot].cnt > 0);
+    slots[slot].cnt++;
+    spinlock_release(&zram_lock);
+}
+
+
+void
+zram_free(int slot)
+{
+    spinlock_acquire(&zram_lock);
+    struct zram_slot* s = &slots[slot];
+    assert(slot > 0 && slot < ZRAM_NR_SLOTS && s->cnt > 0);
+    if (--s->cnt == 0) {
+        if (s->len == 0)
+            stat.nr_same_filled--;
+        else {
+            zbud_free(s->handle);
+            stat.compr_bytes -= s->len;
+        }
+        s->handle = free_slot;
+        free_slot = slot;
+        stat.nr_slots--;
+    }
+    spinlock_release(&zram_lock);
+}
+
+
+void
+zram_get_stat(struct zram_stat* st)
+{
+    spinlock_acquire(&zram_lock);
+    *st = stat;
+    spinlock_release(&zram_lock);
+}
@@ -43,14 +43,20 @@ uint16 csum_finalize(uint32 *csum)
 	return ~((uint16)*csum);
 }
 
-struct packet *packet_alloc(void)
+struct packet *packet_alloc_gfp(gfp_t gfp)
 {
-	struct packet *pkt = (struct packet *)kalloc(PACKET_SIZE);
-	memset(pkt, 0, PACKET_SIZE);
+	struct packet *pkt = (struct packet *)kalloc_gfp(PACKET_SIZE, gfp | __GFP_ZERO);
+	if (pkt == NULL)
+		return NULL;
 	pkt->capacity = PACKET_CAPACITY;
 	return pkt;
 }
 
+struct packet *packet_alloc(void)
+{
+	return packet_alloc_gfp(GFP_KERNEL);
+}
+
 void packet_free(struct packet *pkt)
 {
 	kfree((void *)pkt);
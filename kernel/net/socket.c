@@ -54,6 +54,7 @@ struct socket* socket_socket(int domain, int type, int protocol)
 	memset(sock, 0, sizeof(struct socket));
 	sock->ops = ops;
 	INIT_LIST_HEAD(sock->recvq);
+	wait_queue_head_init(&sock->recv_wait, "recv_wait");
 
     sock->netdev = netdev_get_default_dev();
     assert(sock->netdev != NULL);
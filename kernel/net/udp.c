@@ -97,7 +97,8 @@ void udp_recv(struct netif *netif, struct packet *pkt)
 			 * need to better check here
              */
 			list_insert_end(&entry->sock->recvq, &pkt->list);
-            wakeup(&entry->sock);
+			// one packet is for one receiver
+			wake_up(&entry->sock->recv_wait);
 			return;
 		} else {
 			if (entry->port == ntohs(pkt->udp->dst_port)) {
@@ -350,11 +351,7 @@ int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
 	}
 
 	/* Get packet or wait for one to come */
-	pkt = socket_recvq_get(sock);
-	while (!pkt) {
-        sleep(sock);
-		pkt = socket_recvq_get(sock);
-	}
+	wait_event_exclusive(&sock->recv_wait, (pkt = socket_recvq_get(sock)) != NULL);
 
 	/* This may not be standard, but we only allow recv()ing entire packets,
 	 * no less. */
@@ -0,0 +1,212 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/memlayout.h>
+#include <mm/reclaim.h>
+#include <proc/proc.h>
+#include <proc/kstack.h>
+#include <proc/smp.h>
+#include <locking/spinlock.h>
+
+// a slot is either in use, cached with its stack and trapframe still mapped, or empty
+struct kstack {
+    struct list_head list;          // on kstack_cache or kstack_empty when not in use
+    struct trapframe* trapframe;    // NULL when nothing is mapped
+};
+
+static struct kstack kstacks[KSTACK_NR_SLOTS];
+static DECLARE_LIST_HEAD(kstack_cache);
+static DECLARE_LIST_HEAD(kstack_empty);
+static SPINLOCK_DEFINE(kstack_lock);
+static int next_slot = 1;           // slots from next_slot on have never been used
+static struct kstack_stat stat;
+
+
+static inline struct kstack*
+slot_kstack(int slot)
+{
+    return &kstacks[slot - 1];
+}
+
+
+static inline int
+kstack_slot(struct kstack* ks)
+{
+    return ks - kstacks + 1;
+}
+
+
+static int
+kstack_map(struct kstack* ks)
+{
+    void* trapframe = kalloc(PGSIZE);
+    if (trapframe == NULL)
+        return -ENOMEM;
+    // the page below the stack is never mapped, it is the guard of this stack
+    if (map_stack(kernel_pagetable, KSTACK(kstack_slot(ks))) < 0) {
+        kfree(trapframe);
+        return -ENOMEM;
+    }
+    // the pool's own reference, unmapping a user pagetable never frees the trapframe
+    page_ref_inc((uint64) trapframe);
+    ks->trapframe = trapframe;
+    return 0;
+}
+
+
+static void
+kstack_unmap(struct kstack* ks)
+{
+    uint64 va = KSTACK(kstack_slot(ks));
+    pte_t* pte = walk(kernel_pagetable, va, WALK_NOALLOC);
+    assert(pte && (*pte & PTE_V));
+    char* stack = (char*) KERNEL_PA2VA(PTE2PA(*pte));
+
+    // map_stack takes a reference on each page, the block is freed as a whole
+    uvmunmap(kernel_pagetable, va, KSTACK_SIZE / PGSIZE, UVMUNMAP_NOFREE);
+    flush_tlb_all();
+    for (int i = 0; i < KSTACK_SIZE / PGSIZE; i++)
+        page_ref_dec((uint64) stack + i * PGSIZE);
+    kfree(stack);
+
+    if (page_ref_dec((uint64) ks->trapframe) == 1)
+        kfree(ks->trapframe);
+    ks->trapframe = NULL;
+}
+
+
+int
+kstack_alloc(struct proc* p)
+{
+    struct kstack* ks = NULL;
+
+    spinlock_acquire(&kstack_lock);
+    // the most recently freed stack is the most likely to be cache hot
+    if (kstack_cache.next != &kstack_cache) {
+        ks = container_of(kstack_cache.next, struct kstack, list);
+        list_remove(&ks->list);
+        stat.nr_cached--;
+        stat.nr_hit++;
+    }
+    else if (kstack_empty.next != &kstack_empty) {
+        ks = container_of(kstack_empty.next, struct kstack, list);
+        list_remove(&ks->list);
+        stat.nr_miss++;
+    }
+    else if (next_slot <= KSTACK_NR_SLOTS) {
+        ks = slot_kstack(next_slot++);
+        stat.nr_miss++;
+    }
+    if (ks)
+        stat.nr_active++;
+    spinlock_release(&kstack_lock);
+
+    if (ks == NULL)
+        return -ENOMEM;
+
+    // map without the lock, allocation may reclaim from us
+    if (ks->trapframe == NULL && kstack_map(ks) < 0) {
+        spinlock_acquire(&kstack_lock);
+        list_insert(&kstack_empty, &ks->list);
+        stat.nr_active--;
+        spinlock_release(&kstack_lock);
+        return -ENOMEM;
+    }
+
+    memset(ks->trapframe, 0, sizeof(struct trapframe));
+    p->kstack = kstack_slot(ks);
+    p->stack = KSTACK(p->kstack);
+    p->trapframe = ks->trapframe;
+    return 0;
+}
+
+
+void
+kstack_free(struct proc* p)
+{
+    if (p->kstack == 0)
+        return;
+    struct kstack* ks = slot_kstack(p->kstack);
+    p->kstack = 0;
+    p->stack = 0;
+    p->trapframe = NULL;
+
+    // a trapframe still mapped by a pagetable shared with a live thread must not be handed out again
+    int reusable = (page_ref_count((uint64) ks->trapframe) == 1);
+
+    spinlock_acquire(&kstack_lock);
+    stat.nr_active--;
+    if (reusable && stat.nr_cached < KSTACK_CACHE_MAX) {
+        list_insert(&kstack_cache, &ks->list);
+        stat.nr_cached++;
+        ks = NULL;
+    }
+    spinlock_release(&kstack_lock);
+    if (ks == NULL)
+        return;
+
+    kstack_unmap(ks);
+    spinlock_acquire(&kstack_lock);
+    list_insert(&kstack_empty, &ks->list);
+    spinlock_release(&kstack_lock);
+}
+
+
+uint64
+kstack_shrink()
+{
+    uint64 nr_freed = 0;
+
+    for (;;) {
+        spinlock_acquire(&kstack_lock);
+        struct kstack* ks = NULL;
+        if (kstack_cache.next != &kstack_cache) {
+            ks = container_of(kstack_cache.next, struct kstack, list);
+            list_remove(&ks->list);
+            stat.nr_cached--;
+        }
+        spinlock_release(&kstack_lock);
+        if (ks == NULL)
+            break;
+
+        // unmap without the lock, the slot is unreachable meanwhile
+        kstack_unmap(ks);
+        spinlock_acquire(&kstack_lock);
+        list_insert(&kstack_empty, &ks->list);
+        spinlock_release(&kstack_lock);
+        nr_freed += KSTACK_SIZE / PGSIZE + 1;
+    }
+
+    return nr_freed;
+}
+
+
+static uint64
+kstack_shrinker_fn(uint64 nr)
+{
+    return kstack_shrink();
+}
+
+static struct shrinker kstack_shrinker = {
+    .name = "kstack",
+    .shrink = kstack_shrinker_fn,
+};
+
+
+void
+kstack_get_stat(struct kstack_stat* st)
+{
+    spinlock_acquire(&kstack_lock);
+    *st = stat;
+    spinlock_release(&kstack_lock);
+}
+
+
+void
+kstack_init()
+{
+    register_shrinker(&kstack_shrinker);
+}
@@ -13,8 +13,10 @@
 #include <irq/interrupt.h>
 #include <trap/context.h>
 #include <proc/proc.h>
+#include <proc/kstack.h>
 #include <trap/trap.h>
 #include <proc/sched.h>
+#include <proc/wait.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
 #include <fs/file.h>
@@ -23,33 +25,40 @@
 
 volatile int next_pid = 1;
 struct proc* init_proc = NULL;
+SPINLOCK_DEFINE(proc_list_lock);
 
 int
 alloc_pid()
 {
-    return next_pid++;
+    return __sync_fetch_and_add(&next_pid, 1);
 }
 
 
 // alloc a new proc and initialize it
 // which can be sched after init
 // alloc pid, kstack, trapframe
+// return NULL if out of memory
 struct proc*
 alloc_proc()
 {
     KCALLOC(struct proc, p, 1);
+    if (p == NULL)
+        return NULL;
     
     p->pid = alloc_pid();
-    p->stack = KSTACK(p->pid);
-    
-    map_stack(kernel_pagetable, p->stack);
 
+    // stack and trapframe come from the pool, a recycled pair is already mapped
+    if (kstack_alloc(p) < 0)
+        goto bad;
+
+    spinlock_init(&p->lock, "proc");
     p->state = INIT;
     p->killed = 0;
-    p->sleeping_due = -1;
-
-    p->trapframe = (struct trapframe*) kalloc(sizeof(struct trapframe));
-    Assert(p->trapframe, "out of memory");
+    wait_queue_head_init(&p->wait_child, "wait_child");
+    p->cpu = r_cpuid();
+    // a new proc may run where its creator may, as after fork
+    struct proc* creator = myproc();
+    p->cpus_allowed = (creator ? creator->cpus_allowed : ~0UL);
 
     memset(&p->context, 0, sizeof(struct context));
     // leave space for pt_regs
@@ -62,31 +71,45 @@ alloc_proc()
 
     // init mmap
     p->vma_list = NULL;
+    p->vma_cache = NULL;
+    RB_INIT(&p->vma_tree);
     p->mmap_base = MMAP_BASE;
     p->mmap_brk = MMAP_BASE + MMAP_INIT_SIZE;
 
     p->cwd = strdup("/");
-    Assert(p->cwd, "out of memory");
+    if (p->cwd == NULL)
+        goto bad;
 
     p->fdt = (struct files_struct*) kalloc(sizeof(struct files_struct));
-    Assert(p->fdt, "out of memory");
+    if (p->fdt == NULL)
+        goto bad;
     fdt_init(p->fdt, "fdt_lock");
 
     p->utime = 0;
     p->stime = 0;
+    p->min_flt = 0;
+    p->maj_flt = 0;
 
     return p;
+
+bad:
+    kstack_free(p);
+    kfree(p->cwd);
+    kfree(p);
+    return NULL;
 }
 
 
 void
 proc_init()
 {
+    sched_init();
+    timers_init();
+    wait_init();
+    kstack_init();
     struct proc* p = alloc_proc();
+    Assert(p, "out of memory");
 
-#ifdef ARCH_LOONGARCH
-    asid_init(p->pid, sizeof(p->pid));
-#endif
     // user vm space init
     pagetable_t user_pagetable = uvminit((uint64)p->trapframe, INIT_CODE, INIT_CODE_SIZE);
     // pagetable_t user_pagetable = uvminit((uint64)p->trapframe, deadloop, sizeof(deadloop));
@@ -95,34 +118,65 @@ proc_init()
     p->sz = 18*PGSIZE;
 
     KCALLOC(struct vm_area, vma, 1);
-    p->vma_list = vma;
-    p->vma_list->start = 0;
-    p->vma_list->end = p->sz;
-    p->vma_list->prot = PTE_RWX | PTE_U;
-    p->vma_list->next = p->vma_list->prev = p->vma_list;
+    Assert(vma, "out of memory");
+    vma->start = 0;
+    vma->end = p->sz;
+    vma->prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    vma_insert(p, vma);
 
     trapframe_set_era(p, 0);
     trapframe_set_stack(p, 18*PGSIZE);
 
     strcpy(p->name, "init");
-    
-    p->state = RUNNABLE;
 
     proc_list = p;
     init_proc = p;
+    sched_wakeup(p);
+}
+
+// link p right behind the head of proc_list
+static void
+insert_behind_init(struct proc* p)
+{
+    spinlock_acquire(&proc_list_lock);
+    p->next = proc_list->next;
+    p->prev = proc_list;
+    if (proc_list->next)
+        proc_list->next->prev = p;
+    proc_list->next = p;
+    spinlock_release(&proc_list_lock);
 }
 
+
 void 
 test_proc_init(uint64 test_func)
 {
     struct proc* test_proc = alloc_proc();
+    Assert(test_proc, "out of memory");
     context_set_init_func(test_proc, test_func);
 
     strcpy(test_proc->name, "test");
-    test_proc->state = RUNNABLE;
+    // tests look at the per-cpu state of the cpu they run on, and their kthreads inherit this
+    test_proc->cpus_allowed = 1UL << r_cpuid();
+
+    insert_behind_init(test_proc);
+    sched_wakeup(test_proc);
+}
+
 
-    proc_list->next = test_proc;
-    test_proc->prev = proc_list;
+struct proc*
+kthread_create(const char* name, void (*fn)())
+{
+    struct proc* p = alloc_proc();
+    if (p == NULL)
+        return NULL;
+    context_set_init_func(p, (uint64) fn);
+    strncpy(p->name, name, sizeof(p->name) - 1);
+
+    // no parent, nobody waits for a kernel thread
+    insert_behind_init(p);
+    sched_wakeup(p);
+    return p;
 }
 
 
@@ -130,36 +184,27 @@ void
 sleep(void* chan)
 {
     struct proc *p = myproc();
+    struct wait_queue_head* wq = chan_wait_queue(chan);
+    struct wait_queue_entry wait;
     // debug("sleep on chan %p", chan);
     p->chan = chan;
-    p->state = SLEEPING;
 
-    int int_status = intr_get();
-
-    sched();
-
-    if (int_status) intr_on();
-    else intr_off(); 
+    init_wait_entry(&wait, chan, 0);
+    prepare_to_wait(wq, &wait);
+    wait_schedule();
+    finish_wait(wq, &wait);
 
     p->chan = NULL;
 }
 
 
 // wake up all process sleeping on the chan
-// P.S. current NCPU = 1, so no need to worry about Lost Wakeup
+// only the waiters hashed to the same queue are looked at
 void
 wakeup(void* chan) 
 {
-    struct proc* cur = myproc();
     // debug("wakeup on chan %p", chan);
-
-    for (struct proc* p = proc_list; p; p = p->next) {
-        // p != myproc()
-        if (p != cur) {
-            if (p->state == SLEEPING && p->chan == chan)
-                p->state = RUNNABLE;
-        }
-    }
+    __wake_up(chan_wait_queue(chan), chan, 0);
 }
 
 
@@ -169,10 +214,13 @@ do_exit(int status)
 {
     struct proc* p = myproc();
 
-    // munmap all vma
-    for (struct vm_area* vma = p->vma_list; vma; vma = vma->next) {
+    // munmap all vma, shared file pages are written back here
+    sleeplock_acquire(&p->pagetable->lock);
+    for (struct vm_area *vma = p->vma_list, *next; vma; vma = next) {
+        next = vma->next;
         do_munmap((void*) vma->start, vma->end - vma->start);
     }
+    sleeplock_release(&p->pagetable->lock);
 
     // close opened files
     fdt_freeall(p->fdt);
@@ -180,17 +228,25 @@ do_exit(int status)
 
     kfree(p->cwd);
 
+    // no timer may yield us once we are ZOMBIE
+    intr_off();
+    spinlock_acquire(&proc_list_lock);
+
     // reparent to init
     reparent(p);
 
-    // wakeup parent, which might be sleeping in wait
-    wakeup(p->parent);
-
-    // set status ZOMBIE
+    // set status ZOMBIE before waking the parent, it checks for zombies after it is queued
     p->status = status;
+    spinlock_acquire(&p->lock);
     p->state = ZOMBIE;
+    spinlock_release(&p->lock);
+
+    // wakeup parent, which might be sleeping in wait
+    // it can not exit and be freed meanwhile, parent is changed only under proc_list_lock
+    if (p->parent)
+        wake_up_all(&p->parent->wait_child);
+    spinlock_release(&proc_list_lock);
 
-    intr_off();
     // swtch to scheduler, should never return
     sched();
     panic("proc %s should be exited", p->name);
@@ -202,15 +258,17 @@ do_exit(int status)
 int
 kill(int pid)
 {
+    spinlock_acquire(&proc_list_lock);
     for (struct proc* p = proc_list; p; p = p->next) {
         if (p->pid == pid) {
             p->killed = 1;
             // if this proc is sleeping, wake it up
-            p->state = (p->state == SLEEPING ? RUNNABLE : p->state);
-
+            sched_wakeup(p);
+            spinlock_release(&proc_list_lock);
             return 0;
         }
     }
+    spinlock_release(&proc_list_lock);
 
     // not found
     return -1;
@@ -218,27 +276,28 @@ kill(int pid)
 
 
 // Pass p's abandoned children to init.
-// Caller must hold wait_lock，a big lock protect processes in wait
+// Caller must hold proc_list_lock
 void
 reparent(struct proc* p)
 {
     for (struct proc* np = proc_list; np; np = np->next) {
         if (np->parent == p) {
             np->parent = init_proc;
-            wakeup(init_proc);
+            wake_up_all(&init_proc->wait_child);
         }
     }
 }
 
 void
-proc_free_pagetable(struct proc* p)
+proc_set_pagetable(struct proc* p, upagetable* upgtbl)
 {
-    if (upgtbl_decr(p->pagetable) > 1) 
-        return;
+    // meminfo pins p->pagetable under p->lock
+    spinlock_acquire(&p->lock);
+    upagetable* old = p->pagetable;
+    p->pagetable = upgtbl;
+    spinlock_release(&p->lock);
 
-    pagetable_t pgtbl = UPGTBL(p->pagetable);
-
-    free_pgtbl(pgtbl, p->vma_list);
+    upgtbl_put(old);
 }
 
 
@@ -247,11 +306,17 @@ freeproc(struct proc* p)
 {
     assert(p != init_proc);
 
-    // free trapfram physical space at the same time
-    if (p->pagetable) 
-        proc_free_pagetable(p);
+    // a zombie reaped by its parent may still be switching away on another cpu
+    while (p->on_cpu)
+        ;
+    // nor may its sleep timer still be waking it up
+    timer_del_sync(&p->sleep_timer);
+
+    // pagetable drops its reference on trapframe, the pool still holds one
+    proc_set_pagetable(p, NULL);
     
     // remove p from proc_list
+    spinlock_acquire(&proc_list_lock);
     if (p == proc_list) {
         Assert(p->next, "there should be at least two processes");
         proc_list = p->next;
@@ -261,6 +326,9 @@ freeproc(struct proc* p)
     struct proc* next = p->next;
     if (prev) prev->next = next;
     if (next) next->prev = prev;
+    spinlock_release(&proc_list_lock);
 
+    // p never runs again, its stack and trapframe go back to the pool
+    kstack_free(p);
     kfree(p);
 }
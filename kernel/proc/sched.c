@@ -11,6 +11,7 @@
 #include <debug.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
+#include <mm/zero_pool.h>
 #include <irq/interrupt.h>
 #include <trap/context.h>
 #include <proc/proc.h>
@@ -19,12 +20,340 @@
 #include <arch.h>
 #include <syscall.h>
 #include <time.h>
+#include <proc/timer.h>
+#include <proc/smp.h>
+#include <locking/spinlock.h>
+#include <errno.h>
 
 struct proc* proc_list;
+struct rq runqueues[NCPU];
 
 extern void timer_intr_on();
 extern void timer_intr_off();
 
+#define SCHED_GRANULARITY   INTERVAL        // vruntime lead over the leftmost before the current proc is preempted
+#define SCHED_WAKEUP_CREDIT (2 * INTERVAL)  // how far behind min_vruntime a woken sleeper may be placed
+#define SCHED_BALANCE_INTERVAL (4 * INTERVAL)   // how often a busy cpu compares its queue with the others
+
+// weight of nice -20 .. 19, each level is about 10% of CPU time apart
+static const uint32 nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+
+static inline uint64
+proc_weight(struct proc* p)
+{
+    return nice_to_weight[p->nice - NICE_MIN];
+}
+
+
+static inline int
+rq_cmp(struct proc* a, struct proc* b)
+{
+    if (a->vruntime != b->vruntime)
+        return (a->vruntime < b->vruntime ? -1 : 1);
+    return a->pid - b->pid;
+}
+
+RB_GENERATE_INTERNAL(rq_tree, proc, rq_node, rq_cmp, static inline)
+
+
+// the caller holds rq->lock for all of the following
+static void
+enqueue(struct rq* rq, struct proc* p)
+{
+    RB_INSERT(rq_tree, &rq->tree, p);
+    p->on_rq = 1;
+    rq->nr_running++;
+    rq->load += proc_weight(p);
+}
+
+
+static void
+dequeue(struct rq* rq, struct proc* p)
+{
+    RB_REMOVE(rq_tree, &rq->tree, p);
+    p->on_rq = 0;
+    rq->nr_running--;
+    rq->load -= proc_weight(p);
+}
+
+
+// charge the time curr has run since exec_start, scaled by its weight
+static void
+update_curr(struct proc* curr)
+{
+    uint64 now = r_time();
+    curr->vruntime += (now - curr->exec_start) * NICE_0_WEIGHT / proc_weight(curr);
+    curr->exec_start = now;
+}
+
+
+// follow the smallest vruntime of curr and the queue, never going back
+static void
+update_min_vruntime(struct rq* rq, struct proc* curr)
+{
+    struct proc* left = RB_MIN(rq_tree, &rq->tree);
+    uint64 vruntime = rq->min_vruntime;
+
+    if (curr && left)
+        vruntime = MIN(curr->vruntime, left->vruntime);
+    else if (curr)
+        vruntime = curr->vruntime;
+    else if (left)
+        vruntime = left->vruntime;
+    rq->min_vruntime = MAX(rq->min_vruntime, vruntime);
+}
+
+
+static inline int
+cpu_allowed(struct proc* p, int cpu)
+{
+    return (p->cpus_allowed >> cpu) & 1;
+}
+
+
+// queued plus running, read without the lock by whoever places or balances
+static inline uint64
+rq_len(struct rq* rq)
+{
+    return rq->nr_running + (rq->curr != NULL);
+}
+
+
+// two queues always in address order, so that two cpus moving procs between them do not deadlock
+static void
+double_rq_lock(struct rq* a, struct rq* b)
+{
+    if (a == b) {
+        spinlock_acquire(&a->lock);
+        return;
+    }
+    if (a > b) {
+        struct rq* t = a;
+        a = b;
+        b = t;
+    }
+    spinlock_acquire(&a->lock);
+    spinlock_acquire(&b->lock);
+}
+
+
+static void
+double_rq_unlock(struct rq* a, struct rq* b)
+{
+    spinlock_release(&a->lock);
+    if (a != b)
+        spinlock_release(&b->lock);
+}
+
+
+// the shortest queue among the online cpus p may use, its own cpu wins a tie
+static int
+select_cpu(struct proc* p)
+{
+    uint64 allowed = p->cpus_allowed & cpu_online_mask;
+    int best = p->cpu;
+
+    // nothing is online before smp_boot
+    if (allowed == 0)
+        return best;
+    if (!cpu_allowed(p, best) || !cpu_online(best))
+        best = __builtin_ctzl(allowed);
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (((allowed >> cpu) & 1) && rq_len(&runqueues[cpu]) < rq_len(&runqueues[best]))
+            best = cpu;
+    }
+    return best;
+}
+
+
+// p is off both trees and both locks are held, it keeps its lead or lag relative to min_vruntime
+static void
+set_task_cpu(struct proc* p, struct rq* src, int dst)
+{
+    struct rq* drq = &runqueues[dst];
+    int64 lag = (int64) (p->vruntime - src->min_vruntime);
+
+    if (lag < 0 && (uint64) -lag > drq->min_vruntime)
+        p->vruntime = 0;
+    else
+        p->vruntime = drq->min_vruntime + lag;
+    p->cpu = dst;
+    drq->nr_migrations++;
+}
+
+
+// lock the queue p belongs to, p->cpu may change until its lock is held
+static struct rq*
+task_rq_lock(struct proc* p)
+{
+    for (;;) {
+        struct rq* rq = &runqueues[p->cpu];
+        spinlock_acquire(&rq->lock);
+        if (rq == &runqueues[p->cpu])
+            return rq;
+        spinlock_release(&rq->lock);
+    }
+}
+
+
+// the only change of state made without p->lock, a queued proc is reached only through rq->lock
+static struct proc*
+pick_next(struct rq* rq)
+{
+    spinlock_acquire(&rq->lock);
+    struct proc* p = RB_MIN(rq_tree, &rq->tree);
+    if (p) {
+        dequeue(rq, p);
+        p->state = RUNNING;
+        p->on_cpu = 1;
+        p->exec_start = r_time();
+        rq->curr = p;
+        rq->nr_switches++;
+    }
+    spinlock_release(&rq->lock);
+    return p;
+}
+
+
+// prev has switched back to the scheduler, queue it again if it still wants the CPU
+// one whose affinity no longer allows this cpu goes to the shortest queue it may use
+static void
+put_prev(int cpu, struct proc* prev)
+{
+    struct rq* rq = &runqueues[cpu];
+    struct rq* drq;
+    int dst;
+
+    for (;;) {
+        dst = (cpu_allowed(prev, cpu) ? cpu : select_cpu(prev));
+        drq = &runqueues[dst];
+        double_rq_lock(rq, drq);
+        // the affinity changes only under rq->lock, look again now that it cannot
+        if (cpu_allowed(prev, dst) || !(prev->cpus_allowed & cpu_online_mask))
+            break;
+        double_rq_unlock(rq, drq);
+    }
+
+    update_curr(prev);
+    prev->on_cpu = 0;
+    rq->curr = NULL;
+    int moved = 0;
+    if (prev->state == RUNNABLE) {
+        if (drq != rq) {
+            set_task_cpu(prev, rq, dst);
+            moved = 1;
+        }
+        // a yield gives way to everyone already queued with a vruntime no larger
+        struct proc* left = RB_MIN(rq_tree, &drq->tree);
+        if (left && prev->vruntime <= left->vruntime)
+            prev->vruntime = left->vruntime + 1;
+        enqueue(drq, prev);
+    }
+    update_min_vruntime(rq, NULL);
+    double_rq_unlock(rq, drq);
+
+    if (moved)
+        smp_send_ipi(dst, IPI_RESCHED);
+}
+
+
+// move up to n queued procs allowed here from the back of src's tree, the last ones due to run there
+static int
+pull_tasks(int cpu, int src, int n)
+{
+    struct rq* rq = &runqueues[cpu];
+    struct rq* srq = &runqueues[src];
+    int moved = 0;
+
+    double_rq_lock(rq, srq);
+    struct proc* p = RB_MAX(rq_tree, &srq->tree);
+    while (p && moved < n) {
+        struct proc* prev = RB_PREV(rq_tree, &srq->tree, p);
+        if (cpu_allowed(p, cpu)) {
+            dequeue(srq, p);
+            set_task_cpu(p, srq, cpu);
+            enqueue(rq, p);
+            moved++;
+        }
+        p = prev;
+    }
+    double_rq_unlock(rq, srq);
+    return moved;
+}
+
+
+// the other online cpu with the most procs waiting, -1 if none is waiting anywhere
+static int
+find_busiest(int cpu)
+{
+    int busiest = -1;
+    uint64 max = 0;
+
+    for (int i = 0; i < NCPU; i++) {
+        if (i != cpu && cpu_online(i) && runqueues[i].nr_running > max) {
+            busiest = i;
+            max = runqueues[i].nr_running;
+        }
+    }
+    return busiest;
+}
+
+
+// our queue is empty, steal half of what waits on the busiest cpu
+static int
+idle_balance(int cpu)
+{
+    int src = find_busiest(cpu);
+    if (src < 0)
+        return 0;
+    return pull_tasks(cpu, src, (int) (runqueues[src].nr_running + 1) / 2);
+}
+
+
+// even out with the busiest cpu, then wake idle cpus to steal what still waits here
+static void
+load_balance(int cpu)
+{
+    struct rq* rq = &runqueues[cpu];
+    int src = find_busiest(cpu);
+
+    if (src >= 0) {
+        uint64 len = rq_len(rq), src_len = rq_len(&runqueues[src]);
+        if (src_len > len + 1)
+            pull_tasks(cpu, src, (int) (src_len - len) / 2);
+    }
+
+    // their tick is stopped, nobody else tells them there is work
+    uint64 spare = rq->nr_running;
+    for (int i = 0; i < NCPU && spare > 0; i++) {
+        if (i != cpu && cpu_online(i) && rq_len(&runqueues[i]) == 0) {
+            smp_send_ipi(i, IPI_RESCHED);
+            spare--;
+        }
+    }
+}
+
+
+void
+sched_init()
+{
+    for (int i = 0; i < NCPU; i++) {
+        spinlock_init(&runqueues[i].lock, "rq");
+        RB_INIT(&runqueues[i].tree);
+    }
+}
+
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -35,47 +364,44 @@ extern void timer_intr_off();
 void
 scheduler()
 {
-    struct proc* p;
     struct cpu* c = mycpu();
+    int cpu = r_cpuid();
+    struct rq* rq = &runqueues[cpu];
 
     c->proc = NULL;
 
-    intr_on();
-
     for (;;) {
-        for (p = proc_list; p; p = p->next) {
-            // lock process
-            if (p->state == SLEEPING && p->sleeping_due != -1) {
-                if (tick_counter >= p->sleeping_due) {
-                    p->sleeping_due = -1;
-                    p->state = RUNNABLE;
-                }
+        // no timer may preempt us between the pick and the switch
+        intr_off();
+        struct proc* p = pick_next(rq);
+        if (p == NULL) {
+            // work waiting on a busier cpu comes before zeroing pages
+            if (idle_balance(cpu) > 0)
+                continue;
+            // nothing to run, let the page zeroing thread use the CPU
+            zero_pool_idle();
+            // still nothing, sleep without the tick until a timer or a device interrupt
+            if (sched_nr_queued() == 0) {
+                tick_nohz_idle_enter();
+                cpu_idle();
+                tick_nohz_idle_exit();
             }
-            if (p->state == RUNNABLE) {
-                // switch to this process
-                p->state = RUNNING;
-                c->proc = p;
-                swtch(&c->context, &p->context);
-                //  prev running process is done
-                // it should have changed its state brfore swtch back
-                c->proc = 0;
-            }
-        }
-
-        // if all processes are sleeping, wait for interrupt
-        struct proc *check_ptr;
-        for (check_ptr = proc_list; check_ptr; check_ptr = check_ptr->next) {
-            if (check_ptr->state != SLEEPING)
-                break;
-        }
-        if (check_ptr == NULL) {
+            // take interrupts, one of them may make a process runnable
             intr_on();
+            continue;
         }
+
+        c->proc = p;
+        swtch(&c->context, &p->context);
+        // prev running process is done
+        // it should have changed its state brfore swtch back
+        c->proc = NULL;
+        put_prev(cpu, p);
     }
 }
 
 
-// Switch to scheduler. Must hold only p->lock
+// Switch to scheduler. Must hold no lock, have intr off
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -116,6 +442,169 @@ void
 yield(void)
 {
     struct proc *p = myproc();
+    spinlock_acquire(&p->lock);
+    p->state = RUNNABLE;
+    spinlock_release(&p->lock);
+    sched();
+}
+
+
+void
+sched_wakeup(struct proc* p)
+{
+    // woken before its sleep is over
+    timer_del(&p->sleep_timer);
+
+    // wakers of the same proc are serialized here, the state is looked at only once
+    spinlock_acquire(&p->lock);
+    if (p->state != INIT && p->state != SLEEPING) {
+        spinlock_release(&p->lock);
+        return;
+    }
+
+    // off every queue and cpu, p->cpu is ours to change while p->lock is held
+    // one still on its way out of a cpu stays there, put_prev queues it
+    struct rq* rq;
+    int cpu = (p->on_cpu ? p->cpu : select_cpu(p)), queued = 0;
+    if (cpu != p->cpu) {
+        struct rq* src = &runqueues[p->cpu];
+        rq = &runqueues[cpu];
+        double_rq_lock(src, rq);
+        set_task_cpu(p, src, cpu);
+        spinlock_release(&src->lock);
+    }
+    else
+        rq = task_rq_lock(p);
+
+    // a new proc starts level with the queue, a sleeper gets only a bounded credit
+    if (p->state == INIT)
+        p->vruntime = rq->min_vruntime;
+    else if (rq->min_vruntime > SCHED_WAKEUP_CREDIT)
+        p->vruntime = MAX(p->vruntime, rq->min_vruntime - SCHED_WAKEUP_CREDIT);
     p->state = RUNNABLE;
+    // a proc still on its way out of the CPU is queued by put_prev
+    if (!p->on_cpu && !p->on_rq) {
+        enqueue(rq, p);
+        queued = 1;
+    }
+    spinlock_release(&rq->lock);
+
+    // the other cpu may be in cpu_idle with its tick stopped
+    if (queued && cpu != r_cpuid())
+        smp_send_ipi(cpu, IPI_RESCHED);
+    spinlock_release(&p->lock);
+}
+
+
+int
+sched_tick()
+{
+    struct proc* p = myproc();
+    if (p == NULL || p->state != RUNNING)
+        return 0;
+
+    int cpu = r_cpuid();
+    struct rq* rq = &runqueues[cpu];
+    // its affinity changed while it ran here, put_prev moves it
+    if (!cpu_allowed(p, cpu))
+        return 1;
+    if (r_time() >= rq->next_balance) {
+        rq->next_balance = r_time() + SCHED_BALANCE_INTERVAL;
+        load_balance(cpu);
+    }
+
+    spinlock_acquire(&rq->lock);
+    update_curr(p);
+    update_min_vruntime(rq, p);
+    struct proc* left = RB_MIN(rq_tree, &rq->tree);
+    int resched = (left && p->vruntime > left->vruntime + SCHED_GRANULARITY);
+    spinlock_release(&rq->lock);
+
+    return resched;
+}
+
+
+static void
+sleep_timer_fn(struct timer* t)
+{
+    sched_wakeup(container_of(t, struct proc, sleep_timer));
+}
+
+
+void
+sleep_until(uint64 expires)
+{
+    struct proc* p = myproc();
+
+    timer_setup(&p->sleep_timer, sleep_timer_fn);
+    spinlock_acquire(&p->lock);
+    p->state = SLEEPING;
+    spinlock_release(&p->lock);
+    // UINT64_MAX never expires, only another event wakes us
+    if (expires != UINT64_MAX)
+        timer_add(&p->sleep_timer, expires);
     sched();
+    // a wakeup that raced with timer_add may leave it queued
+    timer_del(&p->sleep_timer);
+}
+
+
+void
+sched_set_nice(struct proc* p, int nice)
+{
+    nice = MAX(NICE_MIN, MIN(NICE_MAX, nice));
+
+    struct rq* rq = task_rq_lock(p);
+    // the time run so far is charged at the old weight
+    if (p->on_cpu)
+        update_curr(p);
+    if (p->on_rq) {
+        dequeue(rq, p);
+        p->nice = nice;
+        enqueue(rq, p);
+    }
+    else
+        p->nice = nice;
+    spinlock_release(&rq->lock);
+}
+
+
+int
+sched_set_affinity(struct proc* p, uint64 mask)
+{
+    if ((mask & cpu_online_mask) == 0)
+        return -EINVAL;
+
+    struct rq* rq = task_rq_lock(p);
+    p->cpus_allowed = mask;
+    int src = p->cpu;
+    int stray = (p->on_rq && !cpu_allowed(p, src));
+    spinlock_release(&rq->lock);
+    if (!stray)
+        return 0;
+
+    // queued where it may no longer run, it moves now
+    int dst = select_cpu(p);
+    struct rq* srq = &runqueues[src];
+    struct rq* drq = &runqueues[dst];
+    double_rq_lock(srq, drq);
+    // it may have been picked or stolen meanwhile, and then it is not ours to move
+    int moved = (p->cpu == src && p->on_rq && srq != drq);
+    if (moved) {
+        dequeue(srq, p);
+        set_task_cpu(p, srq, dst);
+        enqueue(drq, p);
+    }
+    double_rq_unlock(srq, drq);
+
+    if (moved && dst != r_cpuid())
+        smp_send_ipi(dst, IPI_RESCHED);
+    return 0;
+}
+
+
+uint64
+sched_nr_queued()
+{
+    return runqueues[r_cpuid()].nr_running;
 }
@@ -0,0 +1,112 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <irq/interrupt.h>
+#include <proc/proc.h>
+#include <proc/smp.h>
+
+_Static_assert(NCPU <= 64, "one bit of a cpu mask per cpu");
+
+volatile uint64 cpu_online_mask;
+
+static volatile uint32 ipi_pending[NCPU];   // reasons not yet handled by each cpu
+static volatile uint64 tlb_gen[NCPU];       // flush requests sent to each cpu
+static volatile uint64 tlb_done[NCPU];      // requests each cpu has served
+
+
+// flush once for every request that arrived before we looked
+static void
+tlb_service(int cpu)
+{
+    uint64 gen = tlb_gen[cpu];
+    if (tlb_done[cpu] == gen)
+        return;
+    __sync_synchronize();
+    flush_tlb();
+    __sync_synchronize();
+    tlb_done[cpu] = gen;
+}
+
+
+void
+smp_online()
+{
+    __sync_fetch_and_or(&cpu_online_mask, 1UL << r_cpuid());
+}
+
+
+void
+smp_boot()
+{
+    irq_init_hart();
+    smp_online();
+
+    int self = r_cpuid();
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (cpu == self)
+            continue;
+        if (arch_cpu_start(cpu) < 0) {
+            log("cpu%d: failed to start", cpu);
+            continue;
+        }
+        uint64 deadline = r_time() + SMP_BOOT_TIMEOUT;
+        while (!cpu_online(cpu) && r_time() < deadline)
+            ;
+        if (!cpu_online(cpu))
+            log("cpu%d: not online in time", cpu);
+    }
+    out("%d cpus online", __builtin_popcountl(cpu_online_mask));
+}
+
+
+void
+smp_send_ipi(int cpu, int reason)
+{
+    __sync_fetch_and_or(&ipi_pending[cpu], reason);
+    arch_send_ipi(cpu);
+}
+
+
+void
+smp_ipi_handler()
+{
+    int cpu = r_cpuid();
+    uint32 reason = __sync_lock_test_and_set(&ipi_pending[cpu], 0);
+    if (reason & IPI_TLB)
+        tlb_service(cpu);
+    // IPI_RESCHED is done once cpu_idle returns, the scheduler looks at its queue again
+}
+
+
+void
+flush_tlb_others(uint64 mask)
+{
+    uint64 want[NCPU];
+
+    // stay on this cpu, and keep our own requests served only by the loop below
+    irq_pushoff();
+    int self = r_cpuid();
+    mask &= (cpu_online_mask & ~(1UL << self));
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (mask & (1UL << cpu)) {
+            want[cpu] = __sync_add_and_fetch(&tlb_gen[cpu], 1);
+            smp_send_ipi(cpu, IPI_TLB);
+        }
+    }
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        // the target may be waiting for us in the same way
+        while ((mask & (1UL << cpu)) && tlb_done[cpu] < want[cpu])
+            tlb_service(self);
+    }
+    irq_popoff();
+}
+
+
+void
+flush_tlb_all()
+{
+    flush_tlb();
+    flush_tlb_others(~0UL);
+}
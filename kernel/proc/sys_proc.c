@@ -7,10 +7,13 @@
 #include <proc/proc.h>
 #include <trap/trap.h>
 #include <proc/sched.h>
+#include <proc/smp.h>
 #include <mm/buddy.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
 #include <mm/vma.h>
+#include <mm/gfp.h>
+#include <mm/page_cache.h>
 #include <fs/file.h>
 #include <fs/fcntl.h>
 #include <fs/kernel.h>
@@ -20,32 +23,60 @@
 
 extern char trampoline[];
 
+// build child userspace as a COW copy of parent
+static int
+copy_user_vm(struct proc* child, struct proc* parent)
+{
+    pagetable_t cpgtbl = alloc_pagetable();
+    if (cpgtbl == NULL)
+        return -ENOMEM;
+    child->pagetable = upgtbl_init(cpgtbl);
+    if (child->pagetable == NULL) {
+        kfree(cpgtbl);
+        return -ENOMEM;
+    }
+    // map TRAPFRAME and TRAMPOLINE
+    // trapframe belongs to the kernel stack pool, the mapping only takes a reference
+    if (mappages(cpgtbl, TRAPFRAME, (uint64)child->trapframe, PGSIZE, PTE_U | PTE_RW) < 0)
+        return -ENOMEM;
+    if (mappages(cpgtbl, TRAMPOLINE, KERNEL_VA2PA(trampoline), PGSIZE, PTE_RX) < 0)
+        return -ENOMEM;
+    // share memory with parent, pages are copied on write
+    // reclaim may find child pages through rmap as soon as uvmcopy adds them
+    int err = 0;
+    sleeplock_acquire(&parent->pagetable->lock);
+    sleeplock_acquire(&child->pagetable->lock);
+    if (copy_vma_list(child, parent) < 0 || uvmcopy(cpgtbl, UPGTBL(parent->pagetable)) < 0)
+        err = -ENOMEM;
+    sleeplock_release(&child->pagetable->lock);
+    sleeplock_release(&parent->pagetable->lock);
+    if (err < 0)
+        return err;
+
+    child->mmap_base = parent->mmap_base;
+    child->mmap_brk = parent->mmap_brk;
+    return 0;
+}
+
 SYSCALL_DEFINE5(clone, int, unsigned long, flags, void*, stack, void*, ptid, void*, tls, void*, ctid)
 {
     struct proc* proc  = myproc();
     struct proc* child = alloc_proc();
-    assert(child);
+    if (child == NULL)
+        return -ENOMEM;
 
     // prepare userspace vm
     if (flags & CLONE_VM) {
         // share space with parent
         child->pagetable = upgtbl_clone(proc->pagetable);
-        // TODO: mmap area copy
-        for (struct vm_area *vma = proc->vma_list; vma; vma = vma->next) {
-            KALLOC(struct vm_area, new_vma);
-            *new_vma = *vma;
-            new_vma->next = child->vma_list;
-            if (child->vma_list) child->vma_list->prev = new_vma;
-            child->vma_list = new_vma;
-        }
+        if (copy_vma_list(child, proc) < 0)
+            goto clone_bad;
         child->mmap_base = proc->mmap_base;
         child->mmap_brk = proc->mmap_brk;
     } else {
-        // initialize child pagetable
-        pagetable_t cpgtbl = alloc_pagetable();
         // Copy memory from parent (COW)
-        // TODO: just ignore PTE_W
-        uvmcopy(cpgtbl, UPGTBL(proc->pagetable), proc->sz);
+        if (copy_user_vm(child, proc) < 0)
+            goto clone_bad;
     }
 
     child->sz = proc->sz;
@@ -66,7 +97,11 @@ SYSCALL_DEFINE5(clone, int, unsigned long, flags, void*, stack, void*, ptid, voi
         // child->umask = proc->umask;
     } else {
         // initialize child fs
-        child->cwd = strdup(proc->cwd);
+        char* cwd = strdup(proc->cwd);
+        if (cwd == NULL)
+            goto clone_bad;
+        kfree(child->cwd);
+        child->cwd = cwd;
         // child->root = strdup(proc->root);
         // child->fs = proc->fs; // share fs
         // child->umask = proc->umask;
@@ -76,7 +111,11 @@ SYSCALL_DEFINE5(clone, int, unsigned long, flags, void*, stack, void*, ptid, voi
         child->fdt = proc->fdt; // share file descriptor table
     }
     else {
-        child->fdt = fdt_dup(proc->fdt);
+        struct files_struct* fdt = fdt_dup(proc->fdt);
+        if (fdt == NULL)
+            goto clone_bad;
+        kfree(child->fdt);
+        child->fdt = fdt;
     }
 
     if (flags & CLONE_THREAD) {
@@ -100,19 +139,170 @@ SYSCALL_DEFINE5(clone, int, unsigned long, flags, void*, stack, void*, ptid, voi
     }
 
     child->parent = proc;
-    child->state = RUNNABLE;
+    child->nice = proc->nice;
 
     // add child to proc_list
+    spinlock_acquire(&proc_list_lock);
     child->next = proc_list;
     proc_list->prev = child;
     proc_list = child;
+    spinlock_release(&proc_list_lock);
+    sched_wakeup(child);
 
     return child->pid;
+
+clone_bad:
+    // child is not in proc_list yet, nobody else can see it
+    free_vma_list(child);
+    if (child->cwd != proc->cwd)
+        kfree(child->cwd);
+    if (child->fdt != proc->fdt)
+        kfree(child->fdt);
+    freeproc(child);
+    return -ENOMEM;
+}
+
+// prot of a segment from its p_flags
+static int
+elf_prot(uint32 flags)
+{
+    int prot = 0;
+    prot |= ((flags & PF_R) ? PROT_READ : 0);
+    prot |= ((flags & PF_W) ? PROT_WRITE : 0);
+    prot |= ((flags & PF_X) ? PROT_EXEC : 0);
+    return prot;
+}
+
+
+// push a private vma of the new image, a file vma takes a reference of file
+static struct vm_area*
+exec_vma(struct vm_area** vmas, uint64 start, uint64 end, int prot, struct file* file, off_t offset)
+{
+    KCALLOC(struct vm_area, vma, 1);
+    if (vma == NULL)
+        return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->flags = MAP_PRIVATE;
+    vma->file = file;
+    vma->offset = offset;
+    vma->refcnt = 1;
+    if (file)
+        file_get(file);
+    vma->next = *vmas;
+    *vmas = vma;
+    return vma;
+}
+
+
+// fill the page at va with its part of the segment, file data first and 0 after it
+// the page is private and made on first use, the part of prev sharing the page is copied from its file page,
+// these pages are not on anon LRU, so nothing is swapped out while the file is read into them
+static int
+load_private_page(pagetable_t pgtbl, struct file* file, Elf64_Phdr* phdr, uint64 base, struct vm_area* prev, uint64 va, int prot)
+{
+    if (prev && va >= prev->start && va < prev->end)
+        prot |= prev->prot;
+
+    char* page;
+    pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+    if (pte && (*pte & PTE_V)) {
+        // prev has loaded it already, the two segments share permissions of the page
+        page = (char*) KERNEL_PA2VA(PTE2PA(*pte));
+        *pte = PA2PTE(PTE2PA(*pte)) | prot_to_pte(prot) | PTE_V;
+    }
+    else {
+        page = kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+        if (page == NULL)
+            return -ENOMEM;
+        if (prev && prev->file && va >= prev->start && va < prev->end) {
+            char* src = page_cache_get(prev->file, (prev->offset + (va - prev->start)) >> PGSHIFT);
+            if (src == NULL) {
+                kfree(page);
+                return -ENOMEM;
+            }
+            copy_page(page, src);
+            page_cache_put(src);
+        }
+        if (mappages(pgtbl, va, KERNEL_VA2PA(page), PGSIZE, prot_to_pte(prot)) < 0) {
+            kfree(page);
+            return -ENOMEM;
+        }
+    }
+
+    uint64 seg = base + phdr->p_vaddr;
+    uint64 from = MAX(va, seg);
+    uint64 to = MIN(va + PGSIZE, seg + phdr->p_memsz);
+    uint64 file_to = MAX(from, MIN(to, seg + phdr->p_filesz));
+    if (file_to > from) {
+        kernel_lseek(file, phdr->p_offset + (from - seg), SEEK_SET);
+        if (kernel_read(file, page + (from - va), file_to - from) != file_to - from)
+            return -EIO;
+    }
+    memset(page + (file_to - va), 0, to - file_to);
+    return 0;
 }
 
+
+int
+load_elf_segment(pagetable_t pgtbl, struct file* file, Elf64_Phdr* phdr, uint64 base, struct vm_area** vmas)
+{
+    if (phdr->p_memsz < phdr->p_filesz || base + phdr->p_vaddr + phdr->p_memsz < base + phdr->p_vaddr)
+        return -ENOEXEC;
+    if (phdr->p_memsz == 0)
+        return 0;
+
+    int prot = elf_prot(phdr->p_flags);
+    uint64 start = PGROUNDDOWN(base + phdr->p_vaddr);
+    uint64 file_end = base + phdr->p_vaddr + phdr->p_filesz;
+    uint64 end = PGROUNDUP(base + phdr->p_vaddr + phdr->p_memsz);
+    // segments come in ascending order, but two of them may share a page, which stays in the vma of prev
+    struct vm_area* prev = *vmas;
+    uint64 first = start;
+    if (prev && prev->end > start) {
+        int err = load_private_page(pgtbl, file, phdr, base, prev, start, prot);
+        if (err < 0)
+            return err;
+        first = start + PGSIZE;
+    }
+    if (first >= end)
+        return 0;
+
+    // whole pages of file data are mapped from page cache on fault,
+    // which needs file offset and address to agree in the page
+    uint64 lazy_end = first;
+    if (page_cache_mappable(file) && ((phdr->p_offset - phdr->p_vaddr) & (PGSIZE - 1)) == 0) {
+        // without bss, the data of the file following the last page does no harm
+        lazy_end = (phdr->p_memsz > phdr->p_filesz ? PGROUNDDOWN(file_end) : PGROUNDUP(file_end));
+        lazy_end = MAX(lazy_end, first);
+    }
+    if (lazy_end > first) {
+        off_t offset = PGROUNDDOWN(phdr->p_offset) + (first - start);
+        if (exec_vma(vmas, first, lazy_end, prot, file, offset) == NULL)
+            return -ENOMEM;
+    }
+
+    // file data left over is copied now, bss after it is anonymous memory
+    if (lazy_end < end) {
+        if (exec_vma(vmas, lazy_end, end, prot, NULL, 0) == NULL)
+            return -ENOMEM;
+        for (uint64 va = lazy_end; va < PGROUNDUP(file_end); va += PGSIZE) {
+            int err = load_private_page(pgtbl, file, phdr, base, NULL, va, prot);
+            if (err < 0)
+                return err;
+        }
+    }
+    return 0;
+}
+
+
 #define LOADER_CHECK(cond) \
     if (!(cond)) goto execve_bad
 
+#define LOADER_CHECK_MEM(cond) \
+    if (!(cond)) { err = -ENOMEM; goto execve_bad; }
+
 SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char**, uenvp)
 {
     if (upath == NULL)
@@ -122,8 +312,12 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     pagetable_t pgtbl = NULL;
     pagetable_t old_pgtbl = UPGTBL(p->pagetable);
     struct file* file;
+    struct file* ld_file = NULL;
     // sz is a pointer, point at the current top of virtual user space
     uint64 sz = 0;
+    int err = -1;
+    // vmas of the new image, put into p only when nothing can fail any more
+    struct vm_area* new_vmas = NULL;
 
     const size_t max_size = MAX_ARGS * sizeof(char*);
     char* argv[max_size];
@@ -151,16 +345,12 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     
     Elf64_Phdr phdr = {};
     pgtbl = uvmmake((uint64) p->trapframe);
-
-    KALLOC(struct vm_area, vma);
-    int vma_pt = 0;
-    p->vma_list = vma;
-    p->vma_list->next = NULL;
+    LOADER_CHECK_MEM(pgtbl);
 
     for (int i = 0, off = elf.e_phoff; i < elf.e_phnum; i++, off += sizeof(Elf64_Phdr))
     {
         kernel_lseek(file, off, SEEK_SET);
-        kernel_read(file, &phdr, sizeof(Elf64_Ehdr));
+        kernel_read(file, &phdr, sizeof(Elf64_Phdr));
 
         log("Got phdr type=%u, flags=%u, off=%lx",  
             phdr.p_type, phdr.p_flags, phdr.p_offset);
@@ -168,8 +358,9 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
              phdr.p_vaddr, phdr.p_filesz, phdr.p_memsz);
 
         if (phdr.p_type == PT_INTERP) {
+            LOADER_CHECK(phdr.p_filesz < PATH_MAX);
             kernel_lseek(file, phdr.p_offset, SEEK_SET);
-            kernel_read(file, interp_path, phdr.p_filesz + 1);
+            kernel_read(file, interp_path, phdr.p_filesz);
             interp_path[phdr.p_filesz] = '\0';
             has_interp = 1;
             continue;
@@ -178,40 +369,18 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
         if (phdr.p_type != PT_LOAD)
             continue;
 
-        LOADER_CHECK(phdr.p_memsz >= phdr.p_filesz);
-        LOADER_CHECK(phdr.p_vaddr + phdr.p_memsz >= phdr.p_vaddr);
-        
-        // load to memory
-        // LOADER_CHECK(IS_PGALIGNED(phdr.p_vaddr));
-        
-        int perms = PTE_U | PTE_RWX;
-        // if (phdr.p_flags & (PF_R | PF_W)) perms |= PTE_RW;
-        // else if (phdr.p_flags & (PF_R | PF_X)) perms |= PTE_RX;
-        // else if (phdr.p_flags & (PF_R)) perms |= PTE_RONLY;
-        // else perms |= PTE_RWX;
-        
-        uint64 load_start = PGROUNDDOWN(phdr.p_vaddr);
-        uint64 load_end = PGROUNDUP(phdr.p_vaddr + phdr.p_memsz - 1);
-        uint64 load_off = phdr.p_vaddr - load_start;
-        char* mem = buddy_alloc(load_end - load_start);
-        mappages(pgtbl, phdr.p_vaddr, KERNEL_VA2PA(mem), phdr.p_memsz, perms);
-        sz = max_uint64(sz, load_end);
-
-        vma[vma_pt].start = load_start;
-        vma[vma_pt].end = load_end;
-        vma[vma_pt].prot = perms;
-
-        vma[vma_pt].next = p->vma_list;
-        p->vma_list = &vma[vma_pt];
-        vma_pt++;
-
-        // log("map vaddr %lx, load its start at %p", phdr.p_vaddr, mem + load_off);
-
-        kernel_lseek(file, phdr.p_offset, SEEK_SET);
-        kernel_read(file, mem + load_off, phdr.p_filesz);
+        // pages are faulted in from page cache later, text is shared by every process running the file
+        int ret = load_elf_segment(pgtbl, file, &phdr, 0, &new_vmas);
+        if (ret < 0) {
+            err = ret;
+            goto execve_bad;
+        }
+        sz = max_uint64(sz, PGROUNDUP(phdr.p_vaddr + phdr.p_memsz));
     }
 
+    // vmas of the image keep the file
     kernel_close(file);
+    file = NULL;
 
 
     // load dynamic linker
@@ -221,7 +390,7 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     if (has_interp) {
         Elf64_Ehdr ld_elf = {};
 
-        struct file* ld_file = kernel_open(interp_path);
+        ld_file = kernel_open(interp_path);
         if (!ld_file) {
             error("filad to open file: %s", interp_path);
             goto execve_bad;
@@ -237,18 +406,16 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
             if (phdr.p_type != PT_LOAD) 
                 continue;
             
-            uint64 load_addr = ld_base;
-            
-            char* mem = buddy_alloc(phdr.p_memsz);
-            mappages(pgtbl, load_addr + phdr.p_vaddr, KERNEL_VA2PA(mem), 
-                    phdr.p_memsz, PTE_U | PTE_RWX);
-            
-            kernel_lseek(ld_file, phdr.p_offset, SEEK_SET);
-            kernel_read(ld_file, mem, phdr.p_filesz);
+            int ret = load_elf_segment(pgtbl, ld_file, &phdr, ld_base, &new_vmas);
+            if (ret < 0) {
+                err = ret;
+                goto execve_bad;
+            }
         }
 
         ld_entry = ld_base + ld_elf.e_entry;
         kernel_close(ld_file);
+        ld_file = NULL;
     }
     
 
@@ -259,7 +426,8 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     log("stack range %lx - %lx", sz, sz + PGSIZE - 1);
     // next, alloc and map user stack
     char* ustack = kalloc(PGSIZE);
-    mappages(pgtbl, sz, KERNEL_VA2PA(ustack), PGSIZE, PTE_U | PTE_RW);
+    LOADER_CHECK_MEM(ustack);
+    LOADER_CHECK_MEM(mappages(pgtbl, sz, KERNEL_VA2PA(ustack), PGSIZE, PTE_U | PTE_RW) == 0);
     pte_t* pte = walk(pgtbl, sz, WALK_NOALLOC);
 
     sz += PGSIZE;
@@ -293,6 +461,7 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
         // caculate the real space they need
         // then copy to ustack
         char* envp_mem = kalloc(envc * MAX_ARG_STRLEN);
+        LOADER_CHECK_MEM(envp_mem);
         uint64 envp_nbytes = 0;
         for (int i = 0; i < envc; i++) {
             int size = copyinstr(old_pgtbl, &envp_mem[envp_nbytes], (uint64) envp[i], MAX_ARG_STRLEN);
@@ -324,6 +493,7 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
         // caculate the real space they need
         // then copy to ustack
         char* argv_mem = kalloc(argc * MAX_ARG_STRLEN);
+        LOADER_CHECK_MEM(argv_mem);
         uint64 argv_nbytes = 0;
         for (int i = 0; i < argc; i++) {
             int size = copyinstr(old_pgtbl, &argv_mem[argv_nbytes], (uint64) argv[i], MAX_ARG_STRLEN);
@@ -393,9 +563,28 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     p->trapframe->a1 = p_argv;
     p->trapframe->a2 = p_envp;
 
-    // free old pagetable
-    proc_free_pagetable(p);
-    p->pagetable = upgtbl_init(pgtbl);
+    // wrapped before the old image goes, nothing may fail after that
+    upagetable* upgtbl = upgtbl_init(pgtbl);
+    LOADER_CHECK_MEM(upgtbl);
+
+    // munmap all old vma, shared file pages are written back here
+    sleeplock_acquire(&p->pagetable->lock);
+    for (struct vm_area *vma = p->vma_list, *next; vma; vma = next) {
+        next = vma->next;
+        do_munmap((void*) vma->start, vma->end - vma->start);
+    }
+    sleeplock_release(&p->pagetable->lock);
+
+    // the old pagetable is freed here, unless other threads still share it
+    proc_set_pagetable(p, upgtbl);
+
+    while (new_vmas) {
+        struct vm_area* vma = new_vmas;
+        new_vmas = vma->next;
+        vma_insert(p, vma);
+    }
+    p->mmap_base = MMAP_BASE;
+    p->mmap_brk = MMAP_BASE + MMAP_INIT_SIZE;
     p->sz = sz;
     p->heap_start = sz;
     // syscall will add 4 later
@@ -407,12 +596,33 @@ SYSCALL_DEFINE3(execve, int, const char*, upath, const char**, uargv, const char
     return argc;
 
 execve_bad:
-    if (pgtbl) {
-        uvmfree(pgtbl, sz);
-        freewalk(pgtbl, 2);
+    while (new_vmas) {
+        struct vm_area* vma = new_vmas;
+        new_vmas = vma->next;
+        if (vma->file)
+            file_put(vma->file);
+        kfree(vma);
     }
+    if (file)
+        kernel_close(file);
+    if (ld_file)
+        kernel_close(ld_file);
+    // uvmfree also frees pagetable itself
+    if (pgtbl)
+        uvmfree(pgtbl, sz);
     
-    return -1;
+    return err;
+}
+
+static int
+has_zombie_child(struct proc* parent)
+{
+    int found = 0;
+    spinlock_acquire(&proc_list_lock);
+    for (struct proc* p = proc_list; p && !found; p = p->next)
+        found = (p->parent == parent && !p->waited && p->state == ZOMBIE);
+    spinlock_release(&proc_list_lock);
+    return found;
 }
 
 // Wait for a child process to exit and return its pid.
@@ -424,43 +634,46 @@ SYSCALL_DEFINE3(wait4, int, int, pid, int*, status, int, options)
     struct proc* curproc = myproc();
 
     for (;;) {
-        int found = 0;
+        struct proc* zombie = NULL;
         int has_child = 0;
         
+        spinlock_acquire(&proc_list_lock);
         for (struct proc* p = proc_list; p; p = p->next) {
             if (p->parent == curproc && !p->waited) {
                 has_child = 1;
 
                 if (p->state == ZOMBIE) {
-                    found = 1;
-
-                    if (status != NULL) {
-                        int child_status = p->status;
-                        if (copyout(UPGTBL(p->pagetable), (uint64)status, &child_status, sizeof(int)) < 0) {
-                            return -1;
-                        }
-                    }
-                    
-                    // its parent is waiting for it
+                    // its parent is waiting for it, another thread of the parent does not take it
                     p->waited = 1;
-                    int child_pid = p->pid;
-
-                    freeproc(p);
-
-                    return child_pid;
+                    zombie = p;
+                    break;
                 }
             }
         }
+        spinlock_release(&proc_list_lock);
 
-        if (!found) {
-            if (!has_child || curproc->killed)
+        if (zombie) {
+            int child_status = zombie->status;
+            int child_pid = zombie->pid;
+            if (status != NULL && copyout(UPGTBL(curproc->pagetable), (uint64)status, &child_status, sizeof(int)) < 0) {
+                zombie->waited = 0;
                 return -1;
+            }
 
-            if (options & WNOHANG)
-                return 0;
+            // copyout may sleep, so the zombie is freed without the lock
+            freeproc(zombie);
 
-            sleep(curproc);
+            return child_pid;
         }
+
+        if (!has_child || curproc->killed)
+            return -1;
+
+        if (options & WNOHANG)
+            return 0;
+
+        // rechecked once queued, a child exiting after the scan above is not missed
+        wait_event(&curproc->wait_child, has_zombie_child(curproc) || curproc->killed);
     }
 }
 
@@ -468,16 +681,12 @@ SYSCALL_DEFINE0(fork, int)
 {
     struct proc* parent = myproc();
     struct proc* child = alloc_proc();
-    assert(child);
+    if (child == NULL)
+        return -ENOMEM;
 
     // prepare userspace vm
-    pagetable_t cpgtbl = alloc_pagetable();
-    // Copy memory from parent
-    uvmcopy_alloc(cpgtbl, UPGTBL(parent->pagetable), parent->vma_list);
-    // map TRAPFRAME and TRAMPOLINE
-    mappages(cpgtbl, TRAPFRAME, (uint64)parent->trapframe, PGSIZE, PTE_U | PTE_RW);
-    mappages(cpgtbl, TRAMPOLINE, KERNEL_VA2PA(trampoline), PGSIZE, PTE_RX);
-    child->pagetable = upgtbl_init(cpgtbl);
+    if (copy_user_vm(child, parent) < 0)
+        goto fork_bad;
 
     child->sz = parent->sz;
     child->heap_start = parent->heap_start;
@@ -487,20 +696,40 @@ SYSCALL_DEFINE0(fork, int)
     child->trapframe->a0 = 0;
 
     // initialize child fs
-    child->cwd = strdup(parent->cwd);
-    child->fdt = fdt_dup(parent->fdt);
+    char* cwd = strdup(parent->cwd);
+    struct files_struct* fdt = fdt_dup(parent->fdt);
+    if (cwd == NULL || fdt == NULL) {
+        kfree(cwd);
+        kfree(fdt);
+        goto fork_bad;
+    }
+    kfree(child->cwd);
+    kfree(child->fdt);
+    child->cwd = cwd;
+    child->fdt = fdt;
 
     child->tgid = child->pid;
 
     child->parent = parent;
-    child->state = RUNNABLE;
+    child->nice = parent->nice;
 
     // add child to proc_list
+    spinlock_acquire(&proc_list_lock);
     child->next = proc_list;
     proc_list->prev = child;
     proc_list = child;
+    spinlock_release(&proc_list_lock);
+    sched_wakeup(child);
 
     return child->pid;
+
+fork_bad:
+    // child is not in proc_list yet, nobody else can see it
+    free_vma_list(child);
+    kfree(child->cwd);
+    kfree(child->fdt);
+    freeproc(child);
+    return -ENOMEM;
 }
 
 
@@ -522,6 +751,76 @@ SYSCALL_DEFINE0(sched_yield, int) {
     return 0;
 }
 
+// who == 0 means the caller
+// the caller holds proc_list_lock, so that the proc is not freed while in use
+static struct proc*
+prio_target(int who)
+{
+    if (who < 0)
+        return NULL;
+    if (who == 0)
+        return myproc();
+    for (struct proc* p = proc_list; p; p = p->next) {
+        if (p->pid == who && p->state != ZOMBIE)
+            return p;
+    }
+    return NULL;
+}
+
+SYSCALL_DEFINE3(setpriority, int, int, which, int, who, int, prio) {
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    spinlock_acquire(&proc_list_lock);
+    struct proc* p = prio_target(who);
+    if (p)
+        sched_set_nice(p, prio);
+    spinlock_release(&proc_list_lock);
+    return (p ? 0 : -ESRCH);
+}
+
+// as the raw syscall, 20 - nice so that the result is never negative
+SYSCALL_DEFINE2(getpriority, int, int, which, int, who) {
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+    spinlock_acquire(&proc_list_lock);
+    struct proc* p = prio_target(who);
+    int nice = (p ? p->nice : 0);
+    spinlock_release(&proc_list_lock);
+    if (p == NULL)
+        return -ESRCH;
+    return 20 - nice;
+}
+
+// a mask is one uint64, bits beyond it in a longer user mask are ignored
+SYSCALL_DEFINE3(sched_setaffinity, int, int, pid, size_t, len, const uint64*, umask) {
+    uint64 mask = 0;
+    if (copy_from_user(&mask, umask, MIN(len, sizeof(mask))) < 0)
+        return -EFAULT;
+    spinlock_acquire(&proc_list_lock);
+    struct proc* p = prio_target(pid);
+    int ret = (p ? sched_set_affinity(p, mask) : -ESRCH);
+    spinlock_release(&proc_list_lock);
+    // the caller moves once it leaves this cpu
+    if (ret == 0 && p == myproc() && !((mask >> r_cpuid()) & 1))
+        yield();
+    return ret;
+}
+
+// as the raw syscall, the number of bytes written
+SYSCALL_DEFINE3(sched_getaffinity, int, int, pid, size_t, len, uint64*, umask) {
+    if (len < sizeof(uint64))
+        return -EINVAL;
+    spinlock_acquire(&proc_list_lock);
+    struct proc* p = prio_target(pid);
+    uint64 mask = (p ? p->cpus_allowed & cpu_online_mask : 0);
+    spinlock_release(&proc_list_lock);
+    if (p == NULL)
+        return -ESRCH;
+    if (copy_to_user(umask, &mask, sizeof(mask)) < 0)
+        return -EFAULT;
+    return sizeof(mask);
+}
+
 SYSCALL_DEFINE0(geteuid, int) {
     return 0;
 }
@@ -0,0 +1,215 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <proc/proc.h>
+#include <proc/timer.h>
+#include <locking/spinlock.h>
+
+RB_HEAD(timer_tree, timer);
+
+// timers of one cpu ordered by expiry, and the state of its tick
+struct timer_base {
+    spinlock_t lock;
+    struct timer_tree tree;
+    uint64 next_tick;               // r_time() of the next scheduler tick
+    uint64 next_event;              // what the hardware timer is set to
+    int tick_stopped;               // idle, no scheduler tick
+    struct timer* volatile running; // the one whose fn is being called, without the lock
+    struct timer_stat stat;
+};
+
+static struct timer_base timer_bases[NCPU];
+
+
+static inline int
+timer_cmp(struct timer* a, struct timer* b)
+{
+    if (a->expires != b->expires)
+        return (a->expires < b->expires ? -1 : 1);
+    return (a < b ? -1 : (a > b));
+}
+
+RB_GENERATE_INTERNAL(timer_tree, timer, node, timer_cmp, static inline)
+
+
+// set the hardware timer to the earlier of the first timer and the next tick, base->lock held
+static void
+program_next_event(struct timer_base* base)
+{
+    uint64 next = (base->tick_stopped ? r_time() + TIMER_IDLE_MAX : base->next_tick);
+    struct timer* first = RB_MIN(timer_tree, &base->tree);
+    if (first && first->expires < next)
+        next = first->expires;
+    base->next_event = next;
+    timer_set_next_event(next);
+}
+
+
+void
+timers_init()
+{
+    for (int i = 0; i < NCPU; i++) {
+        spinlock_init(&timer_bases[i].lock, "timer_base");
+        RB_INIT(&timer_bases[i].tree);
+        // timer_init has set the first tick
+        timer_bases[i].next_tick = r_time() + INTERVAL;
+        timer_bases[i].next_event = timer_bases[i].next_tick;
+    }
+}
+
+
+void
+timer_init_hart()
+{
+    struct timer_base* base = &timer_bases[r_cpuid()];
+    spinlock_acquire(&base->lock);
+    base->next_tick = r_time() + INTERVAL;
+    program_next_event(base);
+    spinlock_release(&base->lock);
+}
+
+
+void
+timer_setup(struct timer* t, void (*fn)(struct timer*))
+{
+    assert(!timer_pending(t));
+    t->fn = fn;
+}
+
+
+void
+timer_add(struct timer* t, uint64 expires)
+{
+    timer_del(t);
+
+    struct timer_base* base = &timer_bases[r_cpuid()];
+    spinlock_acquire(&base->lock);
+    t->expires = expires;
+    t->base = base;
+    RB_INSERT(timer_tree, &base->tree, t);
+    // the hardware would fire too late for this one
+    if (expires < base->next_event)
+        program_next_event(base);
+    spinlock_release(&base->lock);
+}
+
+
+int
+timer_del(struct timer* t)
+{
+    for (;;) {
+        struct timer_base* base = t->base;
+        if (base == NULL)
+            return 0;
+        spinlock_acquire(&base->lock);
+        // it may have expired or moved before we got the lock
+        if (t->base == base) {
+            RB_REMOVE(timer_tree, &base->tree, t);
+            t->base = NULL;
+            spinlock_release(&base->lock);
+            return 1;
+        }
+        spinlock_release(&base->lock);
+    }
+}
+
+
+int
+timer_del_sync(struct timer* t)
+{
+    int ret = timer_del(t);
+    // an fn that has started on another cpu may still be using whatever t is part of
+    for (int i = 0; i < NCPU; i++) {
+        while (timer_bases[i].running == t)
+            ;
+    }
+    return ret;
+}
+
+
+int
+timer_interrupt()
+{
+    struct timer_base* base = &timer_bases[r_cpuid()];
+    uint64 now = r_time();
+    int ticked = 0;
+
+    tick_counter = now / INTERVAL;
+
+    // each one runs without the lock, so that it can add timers
+    for (;;) {
+        spinlock_acquire(&base->lock);
+        struct timer* t = RB_MIN(timer_tree, &base->tree);
+        if (t && t->expires <= now) {
+            RB_REMOVE(timer_tree, &base->tree, t);
+            t->base = NULL;
+            base->stat.nr_expired++;
+        }
+        else
+            t = NULL;
+        base->running = t;
+        spinlock_release(&base->lock);
+        if (t == NULL)
+            break;
+        t->fn(t);
+    }
+
+    spinlock_acquire(&base->lock);
+    base->stat.nr_interrupts++;
+    if (!base->tick_stopped && now >= base->next_tick) {
+        // ticks missed with interrupts off are dropped, not replayed
+        base->next_tick += ((now - base->next_tick) / INTERVAL + 1) * INTERVAL;
+        base->stat.nr_ticks++;
+        ticked = 1;
+    }
+    program_next_event(base);
+    spinlock_release(&base->lock);
+
+    return ticked;
+}
+
+
+void
+tick_nohz_idle_enter()
+{
+    struct timer_base* base = &timer_bases[r_cpuid()];
+    spinlock_acquire(&base->lock);
+    base->tick_stopped = 1;
+    base->stat.nr_idle++;
+    program_next_event(base);
+    spinlock_release(&base->lock);
+}
+
+
+void
+tick_nohz_idle_exit()
+{
+    struct timer_base* base = &timer_bases[r_cpuid()];
+    spinlock_acquire(&base->lock);
+    if (base->tick_stopped) {
+        uint64 now = r_time();
+        tick_counter = now / INTERVAL;
+        base->tick_stopped = 0;
+        base->next_tick = now + INTERVAL;
+        program_next_event(base);
+    }
+    spinlock_release(&base->lock);
+}
+
+
+void
+timer_get_stat(struct timer_stat* st)
+{
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < NCPU; i++) {
+        struct timer_base* base = &timer_bases[i];
+        spinlock_acquire(&base->lock);
+        st->nr_interrupts += base->stat.nr_interrupts;
+        st->nr_ticks += base->stat.nr_ticks;
+        st->nr_expired += base->stat.nr_expired;
+        st->nr_idle += base->stat.nr_idle;
+        spinlock_release(&base->lock);
+    }
+}
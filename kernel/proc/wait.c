@@ -0,0 +1,122 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <proc/wait.h>
+#include <locking/spinlock.h>
+
+// channel-style sleepers without a queue of their own share these by the hash of the chan
+static struct wait_queue_head chan_wait_table[CHAN_HASH_SIZE];
+
+
+void
+wait_queue_head_init(struct wait_queue_head* wq, const char* name)
+{
+    spinlock_init(&wq->lock, name);
+    INIT_LIST_HEAD(wq->head);
+}
+
+
+void
+wait_init()
+{
+    for (int i = 0; i < CHAN_HASH_SIZE; i++)
+        wait_queue_head_init(&chan_wait_table[i], "chan_wait");
+}
+
+
+struct wait_queue_head*
+chan_wait_queue(void* chan)
+{
+    // chans are mostly aligned addresses, multiply so that the low bits matter
+    uint64 hash = ((uint64) chan >> 3) * 0x9e3779b97f4a7c15UL;
+    return &chan_wait_table[hash >> (64 - CHAN_HASH_BITS)];
+}
+
+
+void
+init_wait_entry(struct wait_queue_entry* wait, void* key, int flags)
+{
+    wait->proc = myproc();
+    wait->key = key;
+    wait->flags = flags;
+    wait->queued = 0;
+}
+
+
+void
+prepare_to_wait(struct wait_queue_head* wq, struct wait_queue_entry* wait)
+{
+    spinlock_acquire(&wq->lock);
+    if (!wait->queued) {
+        // exclusive waiters go last, so a wake-one wakes every non-exclusive one before them
+        if (wait->flags & WQ_FLAG_EXCLUSIVE)
+            list_insert_end(&wq->head, &wait->list);
+        else
+            list_insert(&wq->head, &wait->list);
+        wait->queued = 1;
+    }
+    // set under the queue lock, a waker either sees us queued and SLEEPING or runs before we test the condition
+    spinlock_acquire(&wait->proc->lock);
+    wait->proc->state = SLEEPING;
+    spinlock_release(&wait->proc->lock);
+    spinlock_release(&wq->lock);
+}
+
+
+void
+finish_wait(struct wait_queue_head* wq, struct wait_queue_entry* wait)
+{
+    spinlock_acquire(&wq->lock);
+    spinlock_acquire(&wait->proc->lock);
+    wait->proc->state = RUNNING;
+    spinlock_release(&wait->proc->lock);
+    if (wait->queued) {
+        list_remove(&wait->list);
+        wait->queued = 0;
+    }
+    spinlock_release(&wq->lock);
+}
+
+
+void
+wait_schedule()
+{
+    int int_status = intr_get();
+    intr_off();
+    // if woken since prepare_to_wait we are RUNNABLE, and put back on the run queue at once
+    sched();
+    if (int_status)
+        intr_on();
+}
+
+
+int
+__wake_up(struct wait_queue_head* wq, void* key, int nr_exclusive)
+{
+    int nr_woken = 0;
+
+    spinlock_acquire(&wq->lock);
+    struct list_head* pos = wq->head.next;
+    while (pos != &wq->head) {
+        struct wait_queue_entry* wait = container_of(pos, struct wait_queue_entry, list);
+        pos = pos->next;
+        if (wait->key != key)
+            continue;
+
+        // the entry lives on the waiter's stack, done with it before the waiter can run
+        int exclusive = wait->flags & WQ_FLAG_EXCLUSIVE;
+        struct proc* p = wait->proc;
+        list_remove(&wait->list);
+        wait->queued = 0;
+        sched_wakeup(p);
+        nr_woken++;
+        if (exclusive && --nr_exclusive == 0)
+            break;
+    }
+    spinlock_release(&wq->lock);
+
+    return nr_woken;
+}
@@ -50,16 +50,18 @@ SYSCALL_DEFINE2(nanosleep, int, struct timespec*, dura, struct timespec*, rem) {
     struct proc* proc = myproc();
     if (proc == NULL)
         return -1;
-    long t_ms = dura->tv_sec * 1000 + dura->tv_nsec / 1000000;
-    if (dura->tv_nsec % 1000000 != 0)
-        t_ms += 1;
-    if (t_ms < 0)
-        return -1;
-    else if (t_ms == 0)
+    // rounded up to the clock, the sleep timer is not bound to the tick
+    uint64 ns_cycles = ((uint64) dura->tv_nsec * CLOCK_FREQUNCY + 999999999UL) / 1000000000UL;
+    uint64 cycles;
+    // a sleep too long for the clock saturates, sleep_until then arms no timer
+    if ((uint64) dura->tv_sec > (UINT64_MAX - ns_cycles) / CLOCK_FREQUNCY)
+        cycles = UINT64_MAX;
+    else
+        cycles = (uint64) dura->tv_sec * CLOCK_FREQUNCY + ns_cycles;
+    if (cycles == 0)
         return 0;
-    proc->state = SLEEPING;
-    proc->sleeping_due = tick_counter + (t_ms - 1) / MS_PER_TICK + 1;
-    sched();
+    uint64 now = r_time();
+    sleep_until(cycles > UINT64_MAX - now ? UINT64_MAX : now + cycles);
     return 0;
 }
 
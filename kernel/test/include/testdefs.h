@@ -40,4 +40,49 @@ void        test_net();
 /* test_execve.c */
 void        test_execve();
 
+/* test_page_cache.c */
+void        test_page_cache();
+
+/* test_vma.c */
+void        test_vma();
+
+/* test_megapage.c */
+void        test_megapage();
+
+/* test_uaccess.c */
+void        test_uaccess();
+
+/* test_asid.c */
+void        test_asid();
+
+/* test_swap.c */
+void        test_swap();
+
+/* test_meminfo.c */
+void        test_meminfo();
+
+/* test_zero_pool.c */
+void        test_zero_pool();
+
+/* test_mremap.c */
+void        test_mremap();
+
+/* test_shmem.c */
+void        test_shmem();
+
+/* test_kstack.c */
+void        test_kstack();
+
+/* test_sched.c */
+void        test_sched();
+
+/* test_wait.c */
+void        test_wait();
+
+/* test_timer.c */
+void        test_timer();
+
+/* test_smp.c */
+void        test_smp();
+
 #endif // __TESTDEFS_H__
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/asid.h>
+
+// upagetables here are never loaded, only asids are allocated for them
+void
+test_asid()
+{
+    upagetable a = { .pgtbl = NULL, .cnt = 1, .asid = 0 };
+    upagetable b = a, c = a;
+
+    if (asid_switch(&a) == 0) {
+        PASS("no asid, skip asid test");
+        return;
+    }
+
+    // distinct spaces get distinct asids, the same space keeps its own
+    uint64 asid_a = asid_switch(&a);
+    uint64 asid_b = asid_switch(&b);
+    assert(asid_a != 0 && asid_b != 0 && asid_a != asid_b);
+    assert(asid_switch(&a) == asid_a);
+    assert(asid_of(&a) == asid_a && asid_of(&b) == asid_b);
+    assert(asid_of(&c) == -1);
+    PASS("pass asid alloc test");
+
+    // use up every asid, the generation rolls over and old asids become invalid
+    int n = 0;
+    for (; asid_of(&a) >= 0; n++) {
+        assert(n <= (1 << ASID_MAX_BITS));
+        c.asid = 0;
+        assert(asid_switch(&c) != 0);
+    }
+    assert(asid_of(&b) == -1);
+    assert(asid_switch(&a) != 0 && asid_of(&a) >= 0);
+    assert(asid_switch(&b) != asid_of(&a));
+    log("asid rollover after %d allocations", n);
+    PASS("pass asid rollover test");
+}
@@ -3,23 +3,141 @@
 #include <mm/mm.h>
 #include <mm/buddy.h>
 #include <mm/memlayout.h>
+#include <proc/proc.h>
+#include <arch.h>
+#include <time.h>
 #include <debug.h>
 
+#define STRESS_ROUNDS 1024
+#define STRESS_DEPTH  64
+
 extern struct zone zone;
 extern char end[];
 
+static void
+test_pcp()
+{
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    pcp->high = PCP_HIGH;
+    pcp->batch = PCP_BATCH;
+    buddy_drain_local();
+    assert(pcp->count == 0);
+
+    // first allocation refills a whole batch, the rest are hits
+    uint64 hit = pcp->alloc_hit, miss = pcp->alloc_miss;
+    void* blocks[PCP_BATCH];
+    for (int i = 0; i < PCP_BATCH; i++)
+        blocks[i] = buddy_alloc(PGSIZE);
+    assert(pcp->alloc_miss == miss + 1);
+    assert(pcp->alloc_hit == hit + PCP_BATCH - 1);
+    assert(pcp->count == 0);
+
+    // freed page is hot, and is handed out again first
+    buddy_free(blocks[0], 0);
+    assert(pcp->count == 1);
+    assert(buddy_alloc(PGSIZE) == blocks[0]);
+
+    for (int i = 0; i < PCP_BATCH; i++)
+        buddy_free(blocks[i], 0);
+
+    // exceeding high drains a batch of cold pages back to zone
+    void* many[PCP_HIGH + 1];
+    for (int i = 0; i <= PCP_HIGH; i++)
+        many[i] = buddy_alloc(PGSIZE);
+    buddy_drain_local();
+    uint64 nr_drain = pcp->nr_drain;
+    for (int i = 0; i <= PCP_HIGH; i++)
+        buddy_free(many[i], 0);
+    assert(pcp->nr_drain == nr_drain + 1);
+    assert(pcp->count == PCP_HIGH + 1 - PCP_BATCH);
+
+    buddy_drain_local();
+    assert(pcp->count == 0);
+
+    PASS("pass pcp test");
+}
+
+static uint64
+nr_free_pages()
+{
+    uint64 n = 0;
+    for (int i = 0; i < MAX_ORDER; i++)
+        n += zone.free_area[i].nr_free << i;
+    return n;
+}
+
+
+// alloc/free cycles per second of order-0 pages and of mixed orders
+static uint64
+stress_rate(int mixed)
+{
+    static void* blocks[STRESS_DEPTH];
+    uint64 start = r_time();
+    for (int r = 0; r < STRESS_ROUNDS; r++) {
+        for (int i = 0; i < STRESS_DEPTH; i++)
+            blocks[i] = buddy_alloc(BLOCK_SIZE(mixed ? i % 4 : 0));
+        // free in a different order from alloc, so that merges happen at every level
+        for (int i = 0; i < STRESS_DEPTH; i += 2)
+            buddy_free(blocks[i], mixed ? i % 4 : 0);
+        for (int i = 1; i < STRESS_DEPTH; i += 2)
+            buddy_free(blocks[i], mixed ? i % 4 : 0);
+    }
+    uint64 ticks = MAX(r_time() - start, 1);
+    return (uint64) STRESS_ROUNDS * STRESS_DEPTH * CLOCK_FREQUNCY / ticks;
+}
+
+
+static void
+test_buddy_stress()
+{
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    buddy_drain_local();
+    uint64 nr_free = nr_free_pages();
+
+    uint64 pcp_rate = stress_rate(0);
+
+    // without pcp, every free of order-0 page goes through coalescing
+    buddy_drain_local();
+    pcp->high = 0;
+    pcp->batch = 1;
+    uint64 zone_rate = stress_rate(0);
+    uint64 mixed_rate = stress_rate(1);
+    pcp->high = PCP_HIGH;
+    pcp->batch = PCP_BATCH;
+
+    // every page comes back to zone
+    buddy_drain_local();
+    assert(nr_free_pages() == nr_free);
+
+    log("buddy stress: order-0 %lu cycles/s with pcp, %lu cycles/s without pcp, mixed order %lu cycles/s",
+        pcp_rate, zone_rate, mixed_rate);
+    PASS("pass buddy stress test");
+}
+
+
 void
 test_buddy()
 {
+    test_pcp();
+    test_buddy_stress();
+
+    // make per-cpu list pass-through, so that zone counters are exact
+    struct per_cpu_pages* pcp = &zone.pcp[CPUID(mycpu())];
+    buddy_drain_local();
+    pcp->high = 0;
+    pcp->batch = 1;
+
     // test for buddy_init
     for (int i = 0; i < MAX_ORDER; i++) {
-        struct block* ptr = zone.free_area[i].free_list.next;
+        struct list_head* ptr = zone.free_area[i].free_list.next;
         int turn = zone.free_area[i].nr_free;
         while (turn-- > 0) {
-            assert(ptr->next->prev = ptr);
+            struct page* page = container_of(ptr, struct page, list);
+            assert((page->flag & PG_BUDDY) && page->order == i);
+            assert(ptr->next->prev == ptr);
             ptr = ptr->next;
         }
-        assert(ptr = &zone.free_area[i].free_list);
+        assert(ptr == &zone.free_area[i].free_list);
     }
     PASS("pass budy_init test");
     
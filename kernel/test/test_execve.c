@@ -10,12 +10,101 @@
 #include <mm/buddy.h>
 #include <mm/mm.h>
 #include <mm/memlayout.h>
+#include <mm/vma.h>
+#include <mm/page_cache.h>
 #include <fs/file.h>
 #include <fs/fcntl.h>
 #include <fs/kernel.h>
 #include <syscall.h>
 #include <elf.h>
 
+// load every PT_LOAD segment of file into a fake proc, as execve does
+static struct proc*
+load_image(struct file* file, Elf64_Ehdr* elf)
+{
+    KCALLOC(struct proc, p, 1);
+    pagetable_t pgtbl = alloc_pagetable();
+    assert(p && pgtbl);
+    p->pagetable = upgtbl_init(pgtbl);
+    assert(p->pagetable);
+    RB_INIT(&p->vma_tree);
+
+    struct vm_area* vmas = NULL;
+    Elf64_Phdr phdr = {};
+    for (int i = 0, off = elf->e_phoff; i < elf->e_phnum; i++, off += sizeof(Elf64_Phdr)) {
+        kernel_lseek(file, off, SEEK_SET);
+        kernel_read(file, &phdr, sizeof(Elf64_Phdr));
+        if (phdr.p_type == PT_LOAD)
+            assert(load_elf_segment(pgtbl, file, &phdr, 0, &vmas) == 0);
+    }
+    while (vmas) {
+        struct vm_area* vma = vmas;
+        vmas = vma->next;
+        assert(vma_insert(p, vma) == 0);
+    }
+    return p;
+}
+
+
+static void
+free_image(struct proc* p)
+{
+    uvmfree(UPGTBL(p->pagetable), 0);
+    kfree(p->pagetable);
+    free_vma_list(p);
+    kfree(p);
+}
+
+
+// first page of the first file vma of a segment with the given flags, 0 if there is none
+static uint64
+segment_file_page(struct proc* p, uint32 prot)
+{
+    for (struct vm_area* vma = p->vma_list; vma; vma = vma->next) {
+        if (vma->file && vma->prot == prot)
+            return vma->start;
+    }
+    return 0;
+}
+
+
+// two processes running the same file share its text through page cache, data is copied on write
+static void
+test_execve_share(struct file* file, Elf64_Ehdr* elf)
+{
+    struct proc* p1 = load_image(file, elf);
+    struct proc* p2 = load_image(file, elf);
+    pagetable_t pgtbl1 = UPGTBL(p1->pagetable), pgtbl2 = UPGTBL(p2->pagetable);
+
+    uint64 text = segment_file_page(p1, PROT_READ | PROT_EXEC);
+    assert(text);
+    // nothing is read until the first fault
+    assert(walkaddr(pgtbl1, text) == 0);
+    assert(handle_mm_fault(p1, text, 0) == 0 && handle_mm_fault(p2, text, 0) == 0);
+    uint64 pa = walkaddr(pgtbl1, text);
+    assert(pa && pa == walkaddr(pgtbl2, text));
+    assert(GET_PAGE(KERNEL_PA2VA(pa))->flag & PG_CACHE);
+    // text is never writable
+    assert(handle_mm_fault(p1, text, 1) < 0);
+    PASS("pass execve shared text test");
+
+    uint64 data = segment_file_page(p1, PROT_READ | PROT_WRITE);
+    if (data) {
+        assert(handle_mm_fault(p1, data, 0) == 0 && handle_mm_fault(p2, data, 0) == 0);
+        pte_t* pte = walk(pgtbl1, data, WALK_NOALLOC);
+        assert(pte && (*pte & PTE_COW) && PTE2PA(*pte) == walkaddr(pgtbl2, data));
+        char* cached = (char*) KERNEL_PA2VA(PTE2PA(*pte));
+        assert(handle_mm_fault(p1, data, 1) == 0);
+        char* private = (char*) KERNEL_PA2VA(walkaddr(pgtbl1, data));
+        assert(private != cached && memcmp(private, cached, PGSIZE) == 0);
+        PASS("pass execve private data test");
+    }
+
+    free_image(p1);
+    free_image(p2);
+}
+
+
 void test_execve() {
     kernel_mount("/dev/sda", "/", "ext4", 0, NULL);
 
@@ -29,10 +118,12 @@ void test_execve() {
     kernel_lseek(file, elf.e_phoff, SEEK_SET);
     for (int i = 0, off = elf.e_phoff; i < elf.e_phnum; i++, off += sizeof(Elf64_Phdr)) {
         kernel_lseek(file, off, SEEK_SET);
-        kernel_read(file, &phdr, sizeof(Elf64_Ehdr));
+        kernel_read(file, &phdr, sizeof(Elf64_Phdr));
         log("InGot phdr type=%u, flags=%u, off=%lx, va=%lx, filesz=%lx, memsz=%lx", 
             phdr.p_type, phdr.p_flags, phdr.p_offset, phdr.p_vaddr, phdr.p_filesz, phdr.p_memsz);
     }
 
+    test_execve_share(file, &elf);
+
     kernel_close(file);
 }
\ No newline at end of file
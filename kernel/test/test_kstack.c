@@ -0,0 +1,133 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <mm/mm.h>
+#include <mm/memlayout.h>
+#include <proc/proc.h>
+#include <proc/kstack.h>
+
+#define KSTACK_TEST_NR      8
+#define KSTACK_BENCH_ROUNDS 256
+
+
+static int
+kstack_mapped(uint64 va)
+{
+    pte_t* pte = walk(kernel_pagetable, va, WALK_NOALLOC);
+    return (pte && (*pte & PTE_V));
+}
+
+
+// a freed stack comes back to the next process with a clean trapframe, the page below it stays unmapped
+static void
+test_kstack_recycle()
+{
+    KCALLOC(struct proc, p, 1);
+    assert(p);
+    struct kstack_stat st;
+
+    assert(kstack_alloc(p) == 0);
+    int slot = p->kstack;
+    uint64 stack = p->stack;
+    struct trapframe* trapframe = p->trapframe;
+    assert(slot > 0 && stack == KSTACK(slot));
+    memset((void*) stack, 0xa5, KSTACK_SIZE);
+    assert(!kstack_mapped(stack - PGSIZE));
+    trapframe->a0 = 42;
+
+    kstack_free(p);
+    assert(p->kstack == 0 && p->trapframe == NULL);
+    kstack_get_stat(&st);
+    uint64 nr_hit = st.nr_hit;
+
+    assert(kstack_alloc(p) == 0);
+    assert(p->kstack == slot && p->stack == stack && p->trapframe == trapframe);
+    assert(p->trapframe->a0 == 0);
+    kstack_get_stat(&st);
+    assert(st.nr_hit == nr_hit + 1);
+
+    // a pagetable still maps the trapframe, so neither is kept for reuse
+    page_ref_inc((uint64) trapframe);
+    kstack_free(p);
+    assert(!kstack_mapped(stack));
+    assert(page_ref_count((uint64) trapframe) == 1);
+    if (page_ref_dec((uint64) trapframe) == 1)
+        kfree(trapframe);
+
+    kfree(p);
+    PASS("pass kstack recycle test");
+}
+
+
+static void
+test_kstack_shrink()
+{
+    struct proc* procs[KSTACK_TEST_NR];
+    struct kstack_stat st;
+
+    for (int i = 0; i < KSTACK_TEST_NR; i++) {
+        procs[i] = kcalloc(1, sizeof(struct proc));
+        assert(procs[i] && kstack_alloc(procs[i]) == 0);
+    }
+    // neighbouring stacks are separated by a guard page
+    for (int i = 0; i < KSTACK_TEST_NR; i++) {
+        for (int j = 0; j < KSTACK_TEST_NR; j++) {
+            if (i != j)
+                assert(procs[j]->stack + KSTACK_SIZE < procs[i]->stack
+                       || procs[i]->stack + KSTACK_SIZE < procs[j]->stack);
+        }
+    }
+
+    uint64 stacks[KSTACK_TEST_NR];
+    for (int i = 0; i < KSTACK_TEST_NR; i++) {
+        stacks[i] = procs[i]->stack;
+        kstack_free(procs[i]);
+        kfree(procs[i]);
+    }
+    kstack_get_stat(&st);
+    assert(st.nr_cached >= MIN(KSTACK_TEST_NR, KSTACK_CACHE_MAX));
+
+    assert(kstack_shrink() >= MIN(KSTACK_TEST_NR, KSTACK_CACHE_MAX) * (KSTACK_SIZE / PGSIZE + 1));
+    kstack_get_stat(&st);
+    assert(st.nr_cached == 0);
+    for (int i = 0; i < KSTACK_TEST_NR; i++)
+        assert(!kstack_mapped(stacks[i]));
+
+    PASS("pass kstack shrink test");
+}
+
+
+// alloc and free as fork and wait4 do, with the cache and with every stack mapped again
+static uint64
+bench_kstack(int cached)
+{
+    KCALLOC(struct proc, p, 1);
+    assert(p);
+
+    uint64 start = r_time();
+    for (int i = 0; i < KSTACK_BENCH_ROUNDS; i++) {
+        assert(kstack_alloc(p) == 0);
+        kstack_free(p);
+        if (!cached)
+            kstack_shrink();
+    }
+    uint64 ticks = r_time() - start;
+
+    kfree(p);
+    return ticks * 1000000000UL / CLOCK_FREQUNCY / KSTACK_BENCH_ROUNDS;
+}
+
+
+void
+test_kstack()
+{
+    test_kstack_recycle();
+    test_kstack_shrink();
+
+    uint64 miss_ns = bench_kstack(0);
+    uint64 hit_ns = bench_kstack(1);
+    log("kstack alloc + free: %lu ns mapped each time, %lu ns from cache", miss_ns, hit_ns);
+    PASS("pass kstack test");
+}
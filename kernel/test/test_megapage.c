@@ -0,0 +1,72 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/memlayout.h>
+#include <syscall.h>
+
+#define TEST_MEGA_VA 0x40000000UL
+
+static char*
+alloc_megapage()
+{
+    char* mem = buddy_alloc(MEGAPGSIZE);
+    assert(mem && IS_MEGAPGALIGNED(KERNEL_VA2PA(mem)));
+    for (int i = 0; i < MEGAPG_NPAGES; i++)
+        GET_PAGE(mem + i * PGSIZE)->order = 0;
+    return mem;
+}
+
+
+// runs on a page table of its own, no process is involved
+void
+test_megapage()
+{
+    uint64 nr_free = buddy_nr_free_pages();
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+    pagetable_t pgtbl = alloc_pagetable();
+    assert(pgtbl);
+
+    uint64 va = TEST_MEGA_VA;
+    char* mem = alloc_megapage();
+    assert(mappages(pgtbl, va, KERNEL_VA2PA(mem), MEGAPGSIZE, perm | PTE_MEGA) == 0);
+
+    pte_t* pte = walk(pgtbl, va + 5 * PGSIZE, WALK_NOALLOC);
+    assert(pte && PTE_IS_MEGA(*pte));
+    assert(PTE_PAGE_PA(*pte, va + 5 * PGSIZE) == KERNEL_VA2PA(mem + 5 * PGSIZE));
+    assert(walkaddr(pgtbl, va + 5 * PGSIZE + 8) == KERNEL_VA2PA(mem + 5 * PGSIZE + 8));
+    for (int i = 0; i < MEGAPG_NPAGES; i++)
+        assert(page_ref_count((uint64) mem + i * PGSIZE) == 1);
+    PASS("pass megapage map test");
+
+    // unmapping a few pages in the middle splits it
+    assert(uvmunmap(pgtbl, va + 8 * PGSIZE, 4, UVMUNMAP_FREE) == 0);
+    pte = walk(pgtbl, va + 5 * PGSIZE, WALK_NOALLOC);
+    assert(pte && !PTE_IS_MEGA(*pte) && PTE2PA(*pte) == KERNEL_VA2PA(mem + 5 * PGSIZE));
+    for (int i = 8; i < 12; i++) {
+        pte = walk(pgtbl, va + i * PGSIZE, WALK_NOALLOC);
+        assert(pte && *pte == 0);
+        assert(page_ref_count((uint64) mem + i * PGSIZE) == 0);
+    }
+    assert(walkaddr(pgtbl, va + 12 * PGSIZE) == KERNEL_VA2PA(mem + 12 * PGSIZE));
+    PASS("pass megapage split test");
+
+    // a whole megapage goes back to buddy system as one block
+    char* mem2 = alloc_megapage();
+    assert(mappages(pgtbl, va + MEGAPGSIZE, KERNEL_VA2PA(mem2), MEGAPGSIZE, perm | PTE_MEGA) == 0);
+    uint64 nr_free_mapped = buddy_nr_free_pages();
+    assert(uvmunmap(pgtbl, va + MEGAPGSIZE, MEGAPG_NPAGES, UVMUNMAP_FREE) == 0);
+    assert(buddy_nr_free_pages() == nr_free_mapped + MEGAPG_NPAGES);
+    assert(walk(pgtbl, va + MEGAPGSIZE, WALK_NOALLOC) == NULL);
+
+    // the split one is released page by page, emptied L0 and L1 tables go as well
+    assert(uvmunmap(pgtbl, va, MEGAPG_NPAGES, UVMUNMAP_FREE) == 0);
+    assert(walk_megapage(pgtbl, va, WALK_NOALLOC) == NULL);
+    assert(buddy_nr_free_pages() == nr_free - 1);
+
+    uvmfree(pgtbl, 0);
+    assert(buddy_nr_free_pages() == nr_free);
+    PASS("pass megapage test");
+}
@@ -0,0 +1,79 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/meminfo.h>
+
+// the n-th number of the first record named key, -1 if there is none
+static int64
+field(const char* buf, const char* key, int n)
+{
+    int klen = strlen(key);
+    for (const char* line = buf; *line; ) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == ' ') {
+            const char* s = line + klen;
+            for (int i = 0; i <= n; i++) {
+                while (*s == ' ')
+                    s++;
+                if (*s < '0' || *s > '9')
+                    return -1;
+                int64 v = 0;
+                while (*s >= '0' && *s <= '9')
+                    v = v * 10 + (*s++ - '0');
+                if (i == n)
+                    return v;
+            }
+        }
+        while (*line && *line++ != '\n')
+            ;
+    }
+    return -1;
+}
+
+void
+test_meminfo()
+{
+    char* buf = kalloc(MEMINFO_BUF_SIZE);
+    assert(buf);
+
+    size_t len = meminfo_show(buf, MEMINFO_BUF_SIZE);
+    assert(len > 0 && len == strlen(buf) && buf[len - 1] == '\n');
+    log("meminfo: %lu bytes", len);
+
+    // free pages add up from the per-order counts and per-cpu lists
+    struct buddy_stat st;
+    buddy_get_stat(&st);
+    assert(field(buf, "mem_total_pages", 0) == st.nr_pages);
+    int64 nr_free = field(buf, "pcp_pages", 0);
+    for (int i = 0; i < MAX_ORDER; i++) {
+        char key[32];
+        sprintf(key, "buddy_free_blocks %d", i);
+        nr_free += field(buf, key, 0) << i;
+    }
+    assert(nr_free == field(buf, "mem_free_pages", 0));
+    assert(field(buf, "slab kmalloc-64", 0) == 64);
+    assert(field(buf, "page_cache_pages", 0) >= 0 && field(buf, "swap_pages", 0) >= 0);
+    PASS("pass meminfo format test");
+
+    // a page with two references counts as shared
+    int64 shared = field(buf, "shared_pages", 0);
+    void* page = kalloc(PGSIZE);
+    assert(page);
+    page_ref_inc((uint64) page);
+    page_ref_inc((uint64) page);
+    meminfo_show(buf, MEMINFO_BUF_SIZE);
+    assert(field(buf, "shared_pages", 0) == shared + 1);
+    page_ref_dec((uint64) page);
+    page_ref_dec((uint64) page);
+    kfree(page);
+    PASS("pass meminfo shared page test");
+
+    // lines that do not fit are dropped whole
+    len = meminfo_show(buf, 64);
+    assert(len < 64 && len > 0 && buf[len - 1] == '\n' && buf[len] == '\0');
+    PASS("pass meminfo truncate test");
+
+    kfree(buf);
+    PASS("pass meminfo test");
+}
@@ -0,0 +1,148 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/vma.h>
+#include <mm/swap.h>
+#include <mm/memlayout.h>
+#include <proc/proc.h>
+#include <syscall.h>
+
+#define MREMAP_TEST_VA    0x40000000UL
+#define MREMAP_TEST_PAGES 32
+
+static char*
+alloc_megapage()
+{
+    char* mem = buddy_alloc(MEGAPGSIZE);
+    assert(mem && IS_MEGAPGALIGNED(KERNEL_VA2PA(mem)));
+    for (int i = 0; i < MEGAPG_NPAGES; i++)
+        GET_PAGE(mem + i * PGSIZE)->order = 0;
+    return mem;
+}
+
+
+// anonymous pages, some of them swapped out, move to an address not congruent in 2 MiB
+static void
+test_uvmmove_pages(pagetable_t pgtbl)
+{
+    uint64 old = MREMAP_TEST_VA, new = MREMAP_TEST_VA + 3 * MEGAPGSIZE + 3 * PGSIZE;
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+
+    for (int i = 0; i < MREMAP_TEST_PAGES; i++) {
+        char* page = kalloc(PGSIZE);
+        assert(page);
+        memset(page, i + 1, PGSIZE);
+        assert(mappages(pgtbl, old + i * PGSIZE, KERNEL_VA2PA(page), PGSIZE, perm) == 0);
+        page_add_anon_rmap((uint64) page, pgtbl, old + i * PGSIZE);
+    }
+    // swap everything out, then bring even pages back
+    struct swap_stat st;
+    swap_get_stat(&st);
+    swap_out(2 * st.nr_anon);
+    for (int i = 0; i < MREMAP_TEST_PAGES; i += 2) {
+        pte_t* pte = walk(pgtbl, old + i * PGSIZE, WALK_NOALLOC);
+        if (PTE_IS_SWAP(*pte))
+            assert(do_swap_page(pgtbl, pte, old + i * PGSIZE) == 0);
+    }
+
+    assert(uvmmove(pgtbl, old, new, MREMAP_TEST_PAGES * PGSIZE) == 0);
+    // old range is empty, its tables are gone
+    assert(walk(pgtbl, old, WALK_NOALLOC) == NULL);
+    for (int i = 0; i < MREMAP_TEST_PAGES; i++) {
+        pte_t* pte = walk(pgtbl, new + i * PGSIZE, WALK_NOALLOC);
+        assert(pte && ((*pte & PTE_V) || PTE_IS_SWAP(*pte)));
+    }
+
+    // rmap follows, so swap out finds the new ptes
+    swap_get_stat(&st);
+    swap_out(2 * st.nr_anon);
+    for (int i = 0; i < MREMAP_TEST_PAGES; i++) {
+        uint64 va = new + i * PGSIZE;
+        pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+        assert(PTE_IS_SWAP(*pte));
+        assert(do_swap_page(pgtbl, pte, va) == 0);
+        char* page = (char*) KERNEL_PA2VA(walkaddr(pgtbl, va));
+        assert(page[0] == i + 1 && page[PGSIZE - 1] == i + 1);
+    }
+
+    assert(uvmunmap(pgtbl, new, MREMAP_TEST_PAGES, UVMUNMAP_FREE) == 0);
+    PASS("pass uvmmove page test");
+}
+
+
+// a megapage moves whole to a congruent address, and is split for any other one
+static void
+test_uvmmove_megapage(pagetable_t pgtbl)
+{
+    uint64 old = MREMAP_TEST_VA, new = MREMAP_TEST_VA + 4 * MEGAPGSIZE;
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+    char* mem = alloc_megapage();
+    assert(mappages(pgtbl, old, KERNEL_VA2PA(mem), MEGAPGSIZE, perm | PTE_MEGA) == 0);
+
+    assert(uvmmove(pgtbl, old, new, MEGAPGSIZE) == 0);
+    pte_t* pte = walk(pgtbl, new, WALK_NOALLOC);
+    assert(pte && PTE_IS_MEGA(*pte) && PTE2PA(*pte) == KERNEL_VA2PA(mem));
+    assert(walk(pgtbl, old, WALK_NOALLOC) == NULL);
+
+    old = new;
+    new = MREMAP_TEST_VA + PGSIZE;
+    assert(uvmmove(pgtbl, old, new, MEGAPGSIZE) == 0);
+    for (int i = 0; i < MEGAPG_NPAGES; i++) {
+        pte = walk(pgtbl, new + i * PGSIZE, WALK_NOALLOC);
+        assert(pte && !PTE_IS_MEGA(*pte) && PTE2PA(*pte) == KERNEL_VA2PA(mem + i * PGSIZE));
+        assert(page_ref_count((uint64) mem + i * PGSIZE) == 1);
+    }
+    assert(walk(pgtbl, old, WALK_NOALLOC) == NULL);
+
+    assert(uvmunmap(pgtbl, new, MEGAPG_NPAGES, UVMUNMAP_FREE) == 0);
+    PASS("pass uvmmove megapage test");
+}
+
+
+// runs on a fake proc, no page table is touched
+static void
+test_vma_split()
+{
+    KCALLOC(struct proc, p, 1);
+    KCALLOC(struct vm_area, vma, 1);
+    assert(p && vma);
+    RB_INIT(&p->vma_tree);
+    vma->start = MREMAP_TEST_VA;
+    vma->end = MREMAP_TEST_VA + 8 * PGSIZE;
+    vma->offset = PGSIZE;
+    vma->vm_flags = VMA_SEQ_READ;
+    assert(vma_insert(p, vma) == 0);
+
+    struct vm_area* hi = vma_split(p, vma, MREMAP_TEST_VA + 3 * PGSIZE);
+    assert(hi && hi->start == MREMAP_TEST_VA + 3 * PGSIZE && hi->end == MREMAP_TEST_VA + 8 * PGSIZE);
+    assert(vma->end == hi->start && vma->next == hi && hi->prev == vma);
+    assert(hi->offset == 4 * PGSIZE && hi->vm_flags == VMA_SEQ_READ);
+    assert(find_vma(p, MREMAP_TEST_VA + 2 * PGSIZE) == vma);
+    assert(find_vma(p, MREMAP_TEST_VA + 3 * PGSIZE) == hi);
+
+    free_vma_list(p);
+    kfree(p);
+    PASS("pass vma_split test");
+}
+
+
+void
+test_mremap()
+{
+    pagetable_t pgtbl = alloc_pagetable();
+    assert(pgtbl);
+    // swap out only takes pages of an address space it can lock
+    upagetable* mm = upgtbl_init(pgtbl);
+    assert(mm);
+
+    test_uvmmove_pages(pgtbl);
+    test_uvmmove_megapage(pgtbl);
+    uvmfree(pgtbl, 0);
+    kfree(mm);
+
+    test_vma_split();
+    PASS("pass mremap test");
+}
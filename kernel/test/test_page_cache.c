@@ -0,0 +1,62 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/page_cache.h>
+#include <fs/file.h>
+#include <fs/fcntl.h>
+#include <fs/kernel.h>
+
+// requires root file system mounted, and /init exists
+void
+test_page_cache()
+{
+    struct file* file = kernel_open("/init");
+    assert(file && page_cache_mappable(file));
+
+    // first access reads from file, content must match read()
+    char* page = page_cache_get(file, 0);
+    assert(page);
+    char* buf = kalloc(PGSIZE);
+    kernel_lseek(file, 0, SEEK_SET);
+    kernel_read(file, buf, PGSIZE);
+    assert(memcmp(page, buf, PGSIZE) == 0);
+    kfree(buf);
+
+    // second access hits the same page
+    char* again = page_cache_get(file, 0);
+    assert(again == page);
+    assert(GET_PAGE(page)->flag & PG_CACHE);
+    page_cache_put(again);
+    PASS("pass page_cache_get test");
+
+    // page in use can not be reclaimed
+    page_cache_shrink();
+    assert(page_cache_get(file, 0) == page);
+    page_cache_put(page);
+    page_cache_put(page);
+
+    // clean page without users is freed by shrinker
+    assert(page_cache_shrink() >= 1);
+    assert(!(GET_PAGE(page)->flag & PG_CACHE));
+    PASS("pass page_cache_shrink test");
+
+    // data written to the file goes into the cached page, only the cache is touched here
+    static const char data[8] = "written";
+    page = page_cache_get(file, 0);
+    assert(page);
+    page_cache_write(file, 16, data, sizeof(data));
+    assert(memcmp(page + 16, data, sizeof(data)) == 0);
+
+    // dropped pages stay with their users, next access reads the file again
+    page_cache_invalidate(file->f_inode->i_mp, file->f_inode->i_ino);
+    assert(!(GET_PAGE(page)->flag & PG_CACHE));
+    char* fresh = page_cache_get(file, 0);
+    assert(fresh && fresh != page && memcmp(fresh + 16, data, sizeof(data)) != 0);
+    page_cache_put(fresh);
+    page_cache_put(page);
+    PASS("pass page_cache_invalidate test");
+
+    kernel_close(file);
+    PASS("pass page cache test");
+}
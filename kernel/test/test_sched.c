@@ -0,0 +1,139 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+
+#define SCHED_FAIR_TICKS    100         // how long the two spinners compete
+#define SCHED_FAIR_NICE     5           // weight 335 against 1024, about a third of the CPU
+#define SCHED_BENCH_ROUNDS  20000       // yields of the benchmark thread per measurement
+
+static volatile int spin_stop;
+static volatile uint64 spin_count[2];
+static volatile int pingpong_on;
+static struct proc* partner;
+static int sleepers_chan, park_chan, partner_chan;
+
+
+// spin until told to stop, the timer preempts by vruntime; then park for good as kzerod does
+static void
+spinner(int i)
+{
+    intr_on();
+    while (!spin_stop)
+        spin_count[i]++;
+    intr_off();
+    for (;;)
+        sleep(&park_chan);
+}
+
+static void spinner0() { spinner(0); }
+static void spinner1() { spinner(1); }
+
+
+// two busy loops get the CPU in proportion to their weights
+static void
+test_sched_fair()
+{
+    intr_off();
+    struct proc* a = kthread_create("spin0", spinner0);
+    struct proc* b = kthread_create("spin1", spinner1);
+    assert(a && b);
+
+    sched_set_nice(b, 100);
+    assert(b->nice == NICE_MAX);
+    sched_set_nice(b, SCHED_FAIR_NICE);
+    assert(b->nice == SCHED_FAIR_NICE);
+
+    uint64 due = r_time() + SCHED_FAIR_TICKS * INTERVAL;
+    sleep_until(due);
+    assert(r_time() >= due && !timer_pending(&myproc()->sleep_timer));
+    spin_stop = 1;
+    // let both see the flag and park
+    sleep_until(r_time() + 2 * INTERVAL);
+
+    uint64 c0 = spin_count[0], c1 = spin_count[1];
+    log("nice 0: %lu, nice %d: %lu loops", c0, SCHED_FAIR_NICE, c1);
+    assert(c1 > 0 && c0 >= 2 * c1 && c0 <= 4 * c1);
+    assert(a->state == SLEEPING && b->state == SLEEPING && !a->on_rq && !b->on_rq);
+    PASS("pass sched fair test");
+}
+
+
+// bounce the CPU back to the benchmark thread, sleep between measurements
+static void
+pingpong_partner()
+{
+    intr_off();
+    for (;;) {
+        while (pingpong_on)
+            yield();
+        sleep(&partner_chan);
+    }
+}
+
+
+// context switches per second between two yielding threads with nr_sleepers idle processes around
+static uint64
+bench_switch(int nr_sleepers)
+{
+    struct proc** sleepers = kcalloc(nr_sleepers + 1, sizeof(struct proc*));
+    assert(sleepers);
+    for (int i = 0; i < nr_sleepers; i++) {
+        struct proc* p = alloc_proc();
+        assert(p);
+        // sleeping forever on a chan, and linked on proc_list as any other process
+        p->state = SLEEPING;
+        p->chan = &sleepers_chan;
+        spinlock_acquire(&proc_list_lock);
+        p->next = proc_list->next;
+        p->prev = proc_list;
+        if (proc_list->next)
+            proc_list->next->prev = p;
+        proc_list->next = p;
+        spinlock_release(&proc_list_lock);
+        sleepers[i] = p;
+    }
+
+    struct rq* rq = &runqueues[r_cpuid()];
+    pingpong_on = 1;
+    wakeup(&partner_chan);
+    uint64 nr_switches = rq->nr_switches;
+    uint64 start = r_time();
+    for (int i = 0; i < SCHED_BENCH_ROUNDS; i++)
+        yield();
+    uint64 ticks = r_time() - start;
+    nr_switches = rq->nr_switches - nr_switches;
+    // the partner sees the flag on its next turn and goes to sleep
+    pingpong_on = 0;
+    yield();
+    assert(partner->state == SLEEPING);
+
+    for (int i = 0; i < nr_sleepers; i++) {
+        kfree(sleepers[i]->cwd);
+        kfree(sleepers[i]->fdt);
+        freeproc(sleepers[i]);
+    }
+    kfree(sleepers);
+    return nr_switches * CLOCK_FREQUNCY / MAX(ticks, 1);
+}
+
+
+void
+test_sched()
+{
+    test_sched_fair();
+
+    intr_off();
+    partner = kthread_create("pingpong", pingpong_partner);
+    assert(partner);
+    // run the partner once so that it is parked before the first measurement
+    yield();
+
+    int nr_sleepers[] = { 0, 64, 512 };
+    for (int i = 0; i < sizeof(nr_sleepers) / sizeof(nr_sleepers[0]); i++)
+        log("%d sleepers: %lu context switches/s", nr_sleepers[i], bench_switch(nr_sleepers[i]));
+    PASS("pass sched test");
+}
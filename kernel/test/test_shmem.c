@@ -0,0 +1,184 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <mm/mm.h>
+#include <mm/shmem.h>
+#include <fs/file.h>
+#include <fs/fcntl.h>
+#include <fs/pipe.h>
+#include <syscall.h>
+
+#define SHMEM_TEST_VA       0x40000000UL
+#define SHMEM_BENCH_TOTAL   (8UL << 20)     // bytes moved by each benchmark
+#define SHMEM_BENCH_CHUNK   PGSIZE          // one kfifo worth of data per round
+#define SHMEM_BENCH_RING    16              // pages of the shared ring
+
+
+static uint64
+mib_per_sec(uint64 bytes, uint64 ticks)
+{
+    return bytes * CLOCK_FREQUNCY / MAX(ticks, 1) >> 20;
+}
+
+
+// the producer/consumer path through a pipe, each side copies through a bounce buffer as sys_write/sys_read do
+static uint64
+bench_pipe(char* src, char* dst)
+{
+    KCALLOC(struct file, rfile, 1);
+    KCALLOC(struct file, wfile, 1);
+    assert(rfile && wfile && pipe_init(rfile, wfile) == 0);
+
+    uint64 start = r_time();
+    for (uint64 done = 0; done < SHMEM_BENCH_TOTAL; done += SHMEM_BENCH_CHUNK) {
+        off_t off = 0;
+        char* wbuf = kcalloc(SHMEM_BENCH_CHUNK, 1);
+        assert(wbuf);
+        memcpy(wbuf, src + (done & (SHMEM_BENCH_RING * PGSIZE - 1)), SHMEM_BENCH_CHUNK);
+        assert(pipe_fileops.write(wfile, wbuf, SHMEM_BENCH_CHUNK, &off) == SHMEM_BENCH_CHUNK);
+        kfree(wbuf);
+
+        char* rbuf = kcalloc(SHMEM_BENCH_CHUNK, 1);
+        assert(rbuf);
+        assert(pipe_fileops.read(rfile, rbuf, SHMEM_BENCH_CHUNK, &off) == SHMEM_BENCH_CHUNK);
+        memcpy(dst + (done & (SHMEM_BENCH_RING * PGSIZE - 1)), rbuf, SHMEM_BENCH_CHUNK);
+        kfree(rbuf);
+    }
+    uint64 ticks = r_time() - start;
+
+    pipe_fileops.close(rfile);
+    pipe_fileops.close(wfile);
+    kfree(rfile);
+    kfree(wfile);
+    return ticks;
+}
+
+
+// the same path through a ring in shared memory, the producer writes into it and the consumer reads from it
+static uint64
+bench_shmem(char* src, char* dst)
+{
+    struct file* file = shmem_file_create("/memfd:bench", SHMEM_BENCH_RING * PGSIZE);
+    assert(file);
+    file_get(file);
+    // as mapped by both processes, the pages are looked up once
+    char* ring[SHMEM_BENCH_RING];
+    for (int i = 0; i < SHMEM_BENCH_RING; i++)
+        assert((ring[i] = shmem_get_page(file, i)));
+
+    uint64 start = r_time();
+    for (uint64 done = 0; done < SHMEM_BENCH_TOTAL; done += SHMEM_BENCH_CHUNK) {
+        uint64 slot = (done >> PGSHIFT) % SHMEM_BENCH_RING;
+        memcpy(ring[slot], src + slot * PGSIZE, SHMEM_BENCH_CHUNK);
+        memcpy(dst + slot * PGSIZE, ring[slot], SHMEM_BENCH_CHUNK);
+    }
+    uint64 ticks = r_time() - start;
+
+    for (int i = 0; i < SHMEM_BENCH_RING; i++)
+        shmem_put_page(ring[i]);
+    file_put(file);
+    return ticks;
+}
+
+
+static void
+test_shmem_file()
+{
+    uint64 nr_pages = shmem_nr_pages();
+    struct file* file = shmem_file_create("/memfd:test", 0);
+    assert(file && shmem_file(file));
+    file_get(file);
+
+    // write past a hole, the hole reads as 0
+    char buf[64];
+    off_t off = 3 * PGSIZE + 10;
+    assert(file->f_op->write(file, "hello shmem", 12, &off) == 12);
+    assert(file->f_op->llseek(file, 0, SEEK_END) == 3 * PGSIZE + 22);
+    assert(shmem_nr_pages() == nr_pages + 1);
+    off = PGSIZE;
+    assert(file->f_op->read(file, buf, sizeof(buf), &off) == sizeof(buf));
+    for (int i = 0; i < sizeof(buf); i++)
+        assert(buf[i] == 0);
+    off = 3 * PGSIZE + 10;
+    assert(file->f_op->read(file, buf, sizeof(buf), &off) == 12 && strcmp(buf, "hello shmem") == 0);
+
+    // mapping beyond the end of file has no page
+    assert(shmem_get_page(file, 4) == NULL);
+    char* page = shmem_get_page(file, 3);
+    assert(page && strcmp(page + 10, "hello shmem") == 0);
+    assert(GET_PAGE(page)->flag & PG_SHMEM);
+
+    // truncation drops the page from the object, the holder keeps it
+    assert(file->f_op->truncate(file, PGSIZE) == 0);
+    assert(shmem_nr_pages() == nr_pages);
+    assert(!(GET_PAGE(page)->flag & PG_SHMEM) && page_ref_count((uint64) page) == 1);
+    shmem_put_page(page);
+    off = 0;
+    assert(file->f_op->read(file, buf, sizeof(buf), &off) == sizeof(buf));
+    assert(file->f_op->read(file, buf, sizeof(buf), &off) == sizeof(buf));
+    off = PGSIZE;
+    assert(file->f_op->read(file, buf, sizeof(buf), &off) == 0);
+
+    file_put(file);
+    PASS("pass shmem file test");
+}
+
+
+// a writable shared page stays writable and shared in both page tables after fork
+static void
+test_shmem_fork()
+{
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+    pagetable_t pgtbl = alloc_pagetable(), child = alloc_pagetable();
+    struct file* file = shmem_file_create("/dev/zero", PGSIZE);
+    assert(pgtbl && child && file);
+    file_get(file);
+
+    char* page = shmem_get_page(file, 0);
+    assert(page);
+    assert(mappages(pgtbl, SHMEM_TEST_VA, KERNEL_VA2PA(page), PGSIZE, perm) == 0);
+    shmem_put_page(page);
+    assert(uvmcopy(child, pgtbl) == 0);
+
+    pte_t* ppte = walk(pgtbl, SHMEM_TEST_VA, WALK_NOALLOC);
+    pte_t* cpte = walk(child, SHMEM_TEST_VA, WALK_NOALLOC);
+    assert(cpte && PTE2PA(*cpte) == PTE2PA(*ppte));
+    assert((*ppte & PTE_W) && (*cpte & PTE_W) && !(*ppte & PTE_COW) && !(*cpte & PTE_COW));
+    // the object and two mappings
+    assert(page_ref_count((uint64) page) == 3);
+
+    uvmfree(child, 0);
+    uvmfree(pgtbl, 0);
+    assert(page_ref_count((uint64) page) == 1);
+    file_put(file);
+    PASS("pass shmem fork test");
+}
+
+
+void
+test_shmem()
+{
+    test_shmem_file();
+    test_shmem_fork();
+
+    char* src = kalloc(SHMEM_BENCH_RING * PGSIZE);
+    char* dst = kalloc(SHMEM_BENCH_RING * PGSIZE);
+    assert(src && dst);
+    for (int i = 0; i < SHMEM_BENCH_RING * PGSIZE; i++)
+        src[i] = i * 7 + (i >> 12);
+
+    uint64 pipe_ticks = bench_pipe(src, dst);
+    assert(memcmp(src, dst, SHMEM_BENCH_RING * PGSIZE) == 0);
+    memset(dst, 0, SHMEM_BENCH_RING * PGSIZE);
+    uint64 shmem_ticks = bench_shmem(src, dst);
+    assert(memcmp(src, dst, SHMEM_BENCH_RING * PGSIZE) == 0);
+    log("pipe: %lu MiB/s, shmem: %lu MiB/s, %lu MiB moved",
+        mib_per_sec(SHMEM_BENCH_TOTAL, pipe_ticks), mib_per_sec(SHMEM_BENCH_TOTAL, shmem_ticks),
+        SHMEM_BENCH_TOTAL >> 20);
+
+    kfree(src);
+    kfree(dst);
+    PASS("pass shmem test");
+}
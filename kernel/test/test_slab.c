@@ -0,0 +1,75 @@
+#include <common.h>
+#include <klib.h>
+#include <mm/mm.h>
+#include <mm/buddy.h>
+#include <mm/slab.h>
+#include <debug.h>
+
+struct test_obj {
+    uint64 a;
+    uint64 b;
+    char buf[32];
+};
+
+void
+test_slab()
+{
+    // test for kmem_cache_create
+    struct kmem_cache* cache = kmem_cache_create("test_obj", sizeof(struct test_obj), 0);
+    assert(cache);
+    assert(cache->obj_size >= sizeof(struct test_obj));
+    assert(cache->objs_per_slab * cache->obj_size + cache->offset <= PGSIZE);
+    PASS("pass kmem_cache_create test");
+
+    // test for kmem_cache_alloc, objects of one slab share one page
+    int n = cache->objs_per_slab;
+    struct test_obj* objs[n + 1];
+    for (int i = 0; i < n; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        assert(objs[i] && !IS_PGALIGNED(objs[i]));
+        assert(SLAB(objs[i]) == SLAB(objs[0]));
+        objs[i]->a = i;
+    }
+    assert(cache->nr_slabs == 1 && cache->nr_active == n);
+
+    // a full slab forces cache to grow
+    objs[n] = kmem_cache_alloc(cache);
+    assert(SLAB(objs[n]) != SLAB(objs[0]));
+    assert(cache->nr_slabs == 2);
+    for (int i = 0; i < n; i++)
+        assert(objs[i]->a == i);
+    PASS("pass kmem_cache_alloc test");
+
+    // test for kmem_cache_free, a freed object is reused first
+    void* freed = objs[n / 2];
+    kmem_cache_free(cache, freed);
+    assert(kmem_cache_alloc(cache) == freed);
+
+    for (int i = 0; i <= n; i++)
+        kmem_cache_free(cache, objs[i]);
+    assert(cache->nr_active == 0);
+    kmem_cache_shrink(cache);
+    assert(cache->nr_slabs == 0);
+    kmem_cache_destroy(cache);
+    PASS("pass kmem_cache_free test");
+
+    // test for kmalloc size classes through kalloc
+    for (uint64 sz = 1; sz <= KMALLOC_MAX_SIZE; sz <<= 1) {
+        char* p1 = kalloc(sz);
+        char* p2 = kalloc(sz);
+        assert(p1 && p2 && p1 != p2);
+        assert(!IS_PGALIGNED(p1) && !IS_PGALIGNED(p2));
+        memset(p1, 0x5a, sz);
+        memset(p2, 0xa5, sz);
+        assert((uchar) p1[sz - 1] == 0x5a);
+        kfree(p1);
+        kfree(p2);
+    }
+
+    // large allocations still come from buddy system
+    void* page = kalloc(KMALLOC_MAX_SIZE + 1);
+    assert(IS_PGALIGNED(page));
+    kfree(page);
+
+    PASS("pass slab test");
+}
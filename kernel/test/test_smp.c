@@ -0,0 +1,270 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <proc/wait.h>
+#include <proc/smp.h>
+#include <errno.h>
+
+#define SMP_PID_ROUNDS      1000        // pids each worker allocates
+#define SMP_PINGPONG_ROUNDS 1000        // round trips between two cpus
+#define SMP_FLUSH_ROUNDS    100         // shootdowns measured
+#define SMP_STEAL_LOOPS     2000000     // busy loop of one worker in a burst
+#define SMP_STEAL_PER_CPU   2           // workers in a burst for each online cpu
+
+static int pids[NCPU][SMP_PID_ROUNDS];
+static volatile int nr_started, nr_done;
+static SPINLOCK_DEFINE(count_lock);
+static uint64 locked_count;
+static int park_chan;
+
+static WAIT_QUEUE_HEAD_DEFINE(ping_wq);
+static WAIT_QUEUE_HEAD_DEFINE(pong_wq);
+static volatile int ping, pong;
+
+static volatile uint64 ran_on;
+static volatile int affinity_stop;
+static volatile int nr_burst_done;
+
+
+// a kthread pinned to cpu instead of ours, it is not on any queue until sched_wakeup
+static struct proc*
+kthread_on(int cpu, const char* name, void (*fn)())
+{
+    struct proc* p = alloc_proc();
+    assert(p);
+    context_set_init_func(p, (uint64) fn);
+    strncpy(p->name, name, sizeof(p->name) - 1);
+    p->cpus_allowed = 1UL << cpu;
+
+    spinlock_acquire(&proc_list_lock);
+    p->next = proc_list->next;
+    p->prev = proc_list;
+    if (proc_list->next)
+        proc_list->next->prev = p;
+    proc_list->next = p;
+    spinlock_release(&proc_list_lock);
+
+    sched_wakeup(p);
+    return p;
+}
+
+
+static void
+pid_worker()
+{
+    int w = __sync_fetch_and_add(&nr_started, 1);
+    for (int i = 0; i < SMP_PID_ROUNDS; i++) {
+        pids[w][i] = alloc_pid();
+        spinlock_acquire(&count_lock);
+        locked_count++;
+        spinlock_release(&count_lock);
+    }
+    __sync_fetch_and_add(&nr_done, 1);
+
+    intr_off();
+    for (;;)
+        sleep(&park_chan);
+}
+
+
+// one worker on every cpu, each pid is handed out once and no increment is lost
+static void
+test_smp_pid(int nr_cpus)
+{
+    int first = alloc_pid();
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (cpu_online(cpu))
+            kthread_on(cpu, "pid", pid_worker);
+    }
+    while (nr_done < nr_cpus)
+        yield();
+    int last = alloc_pid();
+
+    char* seen = kcalloc(last - first, 1);
+    assert(seen);
+    for (int w = 0; w < nr_cpus; w++) {
+        for (int i = 0; i < SMP_PID_ROUNDS; i++) {
+            int pid = pids[w][i];
+            assert(pid > first && pid < last && !seen[pid - first]);
+            seen[pid - first] = 1;
+        }
+    }
+    kfree(seen);
+    assert(locked_count == (uint64) nr_cpus * SMP_PID_ROUNDS);
+    PASS("pass smp pid test");
+}
+
+
+static void
+pong_worker()
+{
+    intr_off();
+    for (;;) {
+        wait_event(&ping_wq, ping != pong);
+        pong = ping;
+        wake_up(&pong_wq);
+    }
+}
+
+
+// each round trip is two wakeups of a proc queued on the other cpu, which is idle in between
+static void
+test_smp_pingpong(int other)
+{
+    kthread_on(other, "pong", pong_worker);
+
+    uint64 start = r_time();
+    for (int i = 0; i < SMP_PINGPONG_ROUNDS; i++) {
+        ping++;
+        wake_up(&ping_wq);
+        wait_event(&pong_wq, pong == ping);
+    }
+    uint64 ticks = r_time() - start;
+
+    log("cpu%d <-> cpu%d: %lu ns per round trip", (int) r_cpuid(), other,
+        ticks * 1000000000UL / CLOCK_FREQUNCY / SMP_PINGPONG_ROUNDS);
+    PASS("pass smp pingpong test");
+}
+
+
+static void
+affinity_worker()
+{
+    intr_on();
+    while (!affinity_stop)
+        __sync_fetch_and_or(&ran_on, 1UL << r_cpuid());
+    intr_off();
+    for (;;)
+        sleep(&park_chan);
+}
+
+
+// a pinned busy loop runs only where it may, and moves when its affinity does
+static void
+test_smp_affinity(int other)
+{
+    int self = r_cpuid();
+    struct proc* p = kthread_on(other, "affinity", affinity_worker);
+
+    sleep_until(r_time() + 4 * INTERVAL);
+    assert(ran_on == 1UL << other);
+
+    assert(sched_set_affinity(p, 0) == -EINVAL);
+    if (~cpu_online_mask)
+        assert(sched_set_affinity(p, ~cpu_online_mask) == -EINVAL);
+    assert(p->cpus_allowed == 1UL << other);
+
+    // it leaves the other cpu on its next tick, and shares ours with us sleeping
+    assert(sched_set_affinity(p, 1UL << self) == 0);
+    sleep_until(r_time() + 2 * INTERVAL);
+    ran_on = 0;
+    sleep_until(r_time() + 4 * INTERVAL);
+    assert(ran_on == 1UL << self && p->cpu == self);
+
+    affinity_stop = 1;
+    sleep_until(r_time() + 2 * INTERVAL);
+    PASS("pass smp affinity test");
+}
+
+
+static void
+burst_worker()
+{
+    uint64 seen = 0;
+
+    intr_on();
+    for (volatile uint64 i = 0; i < SMP_STEAL_LOOPS; i++)
+        seen |= 1UL << r_cpuid();
+    intr_off();
+    __sync_fetch_and_or(&ran_on, seen);
+    __sync_fetch_and_add(&nr_burst_done, 1);
+    for (;;)
+        sleep(&park_chan);
+}
+
+
+// a burst of workers all queued on our cpu, where our affinity puts them
+// pinned they stay here, otherwise idle cpus are woken by the balancer and steal them
+static uint64
+run_burst(int nr, int spread)
+{
+    struct proc* workers[NCPU * SMP_STEAL_PER_CPU];
+
+    ran_on = 0;
+    nr_burst_done = 0;
+    uint64 start = r_time();
+    for (int i = 0; i < nr; i++) {
+        workers[i] = kthread_create("burst", burst_worker);
+        assert(workers[i] && workers[i]->cpu == r_cpuid());
+    }
+    if (spread) {
+        for (int i = 0; i < nr; i++)
+            assert(sched_set_affinity(workers[i], ~0UL) == 0);
+    }
+    while (nr_burst_done < nr)
+        sleep_until(r_time() + INTERVAL);
+    return r_time() - start;
+}
+
+
+static void
+test_smp_steal(int nr_cpus)
+{
+    int nr = nr_cpus * SMP_STEAL_PER_CPU;
+    uint64 nr_migrations = 0;
+
+    uint64 pinned = run_burst(nr, 0);
+    assert(ran_on == 1UL << r_cpuid());
+
+    for (int cpu = 0; cpu < NCPU; cpu++)
+        nr_migrations -= runqueues[cpu].nr_migrations;
+    uint64 spread = run_burst(nr, 1);
+    for (int cpu = 0; cpu < NCPU; cpu++)
+        nr_migrations += runqueues[cpu].nr_migrations;
+    assert(__builtin_popcountl(ran_on) > 1 && nr_migrations > 0);
+
+    log("burst of %d on %d cpus: %lu ms pinned, %lu ms spread, %lu migrations", nr, __builtin_popcountl(ran_on),
+        pinned * 1000 / CLOCK_FREQUNCY, spread * 1000 / CLOCK_FREQUNCY, nr_migrations);
+    PASS("pass smp steal test");
+}
+
+
+static void
+bench_smp_flush()
+{
+    uint64 start = r_time();
+    for (int i = 0; i < SMP_FLUSH_ROUNDS; i++)
+        flush_tlb_others(cpu_online_mask);
+    uint64 ticks = r_time() - start;
+
+    log("tlb shootdown of %d cpus: %lu ns", __builtin_popcountl(cpu_online_mask) - 1,
+        ticks * 1000000000UL / CLOCK_FREQUNCY / SMP_FLUSH_ROUNDS);
+}
+
+
+void
+test_smp()
+{
+    intr_off();
+    int nr_cpus = __builtin_popcountl(cpu_online_mask);
+    log("%d of %d cpus online", nr_cpus, NCPU);
+
+    test_smp_pid(nr_cpus);
+    if (nr_cpus == 1) {
+        PASS("pass smp test, single cpu");
+        return;
+    }
+
+    int other = 0;
+    while (other == r_cpuid() || !cpu_online(other))
+        other++;
+    test_smp_pingpong(other);
+    test_smp_affinity(other);
+    test_smp_steal(nr_cpus);
+    bench_smp_flush();
+    PASS("pass smp test");
+}
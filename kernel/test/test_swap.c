@@ -0,0 +1,123 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/swap.h>
+#include <mm/zram.h>
+#include <syscall.h>
+
+#define SWAP_TEST_VA    0x40000000UL
+#define SWAP_TEST_PAGES 64
+
+// page i: text-like for most, page 0 all zero, the last one random
+static void
+fill_page(char* page, int i)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    uint64 seed = i * 2654435761UL + 1;
+    for (int k = 0; k < PGSIZE; k++) {
+        if (i == 0)
+            page[k] = 0;
+        else if (i == SWAP_TEST_PAGES - 1) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            page[k] = (seed >> 56);
+        }
+        else
+            page[k] = words[(k + i) % (sizeof(words) - 1)];
+    }
+}
+
+
+static int
+check_page(pagetable_t pgtbl, int i)
+{
+    char* page = (char*) KERNEL_PA2VA(walkaddr(pgtbl, SWAP_TEST_VA + i * PGSIZE));
+    char* expect = kalloc(PGSIZE);
+    assert(expect);
+    fill_page(expect, i);
+    int ok = (memcmp(page, expect, PGSIZE) == 0);
+    kfree(expect);
+    return ok;
+}
+
+
+// anonymous pages are mapped by hand on two page tables of its own, as a fork would share them
+// both are wrapped in upagetable, swap out skips pages whose address space it can not lock
+void
+test_swap()
+{
+    pagetable_t pgtbl = alloc_pagetable(), child = alloc_pagetable();
+    assert(pgtbl && child);
+    upagetable* mm = upgtbl_init(pgtbl);
+    upagetable* cmm = upgtbl_init(child);
+    assert(mm && cmm);
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+
+    for (int i = 0; i < SWAP_TEST_PAGES; i++) {
+        char* page = kalloc(PGSIZE);
+        uint64 va = SWAP_TEST_VA + i * PGSIZE;
+        assert(page);
+        fill_page(page, i);
+        assert(mappages(pgtbl, va, KERNEL_VA2PA(page), PGSIZE, perm) == 0);
+        page_add_anon_rmap((uint64) page, pgtbl, va);
+    }
+    // page 1 is shared with child
+    char* shared = (char*) KERNEL_PA2VA(walkaddr(pgtbl, SWAP_TEST_VA + PGSIZE));
+    assert(mappages(child, SWAP_TEST_VA + PGSIZE, KERNEL_VA2PA(shared), PGSIZE, perm) == 0);
+    page_add_anon_rmap((uint64) shared, child, SWAP_TEST_VA + PGSIZE);
+
+    struct swap_stat st;
+    struct zram_stat zst;
+    swap_get_stat(&st);
+    uint64 nr_swapout = st.nr_swapout;
+    swap_out(2 * st.nr_anon);
+
+    // all but the random page are swapped out, the shared one in both tables
+    for (int i = 0; i < SWAP_TEST_PAGES; i++) {
+        pte_t* pte = walk(pgtbl, SWAP_TEST_VA + i * PGSIZE, WALK_NOALLOC);
+        assert(pte && PTE_IS_SWAP(*pte) == (i != SWAP_TEST_PAGES - 1));
+    }
+    pte_t* cpte = walk(child, SWAP_TEST_VA + PGSIZE, WALK_NOALLOC);
+    pte_t* ppte = walk(pgtbl, SWAP_TEST_VA + PGSIZE, WALK_NOALLOC);
+    assert(PTE_IS_SWAP(*cpte) && SWAP_PTE_SLOT(*cpte) == SWAP_PTE_SLOT(*ppte));
+    swap_get_stat(&st);
+    zram_get_stat(&zst);
+    assert(st.nr_swapout - nr_swapout >= SWAP_TEST_PAGES - 1);
+    assert(zst.nr_same_filled >= 1 && zst.nr_rejected >= 1);
+    log("zram: %lu pages in %lu pool pages, %lu compressed bytes, %lu same-filled",
+        zst.nr_slots, zst.pool_pages, zst.compr_bytes, zst.nr_same_filled);
+    PASS("pass swap out test");
+
+    // faults bring them back with the same content and permission
+    for (int i = 0; i < SWAP_TEST_PAGES; i++) {
+        uint64 va = SWAP_TEST_VA + i * PGSIZE;
+        pte_t* pte = walk(pgtbl, va, WALK_NOALLOC);
+        if (PTE_IS_SWAP(*pte))
+            assert(do_swap_page(pgtbl, pte, va) == 0);
+        assert((*pte & PTE_V) && (PTE_FLAGS(*pte) & perm) == perm);
+        assert(check_page(pgtbl, i));
+    }
+    // child still has its own swap pte, which keeps the slot alive
+    assert(PTE_IS_SWAP(*cpte));
+    assert(do_swap_page(child, cpte, SWAP_TEST_VA + PGSIZE) == 0);
+    assert(check_page(child, 1));
+    swap_get_stat(&st);
+    log("swap in: %lu pages, %lu ns on average, %lu ns at most",
+        st.nr_swapin, st.swapin_ns / MAX(st.nr_swapin, 1), st.swapin_ns_max);
+    PASS("pass swap in test");
+
+    // swapped out pages are released on unmap as well
+    swap_out(2 * st.nr_anon);
+    zram_get_stat(&zst);
+    uint64 nr_slots = zst.nr_slots;
+    assert(uvmunmap(child, SWAP_TEST_VA, SWAP_TEST_PAGES, UVMUNMAP_FREE) == 0);
+    assert(uvmunmap(pgtbl, SWAP_TEST_VA, SWAP_TEST_PAGES, UVMUNMAP_FREE) == 0);
+    zram_get_stat(&zst);
+    assert(zst.nr_slots <= nr_slots - (SWAP_TEST_PAGES - 1));
+    uvmfree(pgtbl, 0);
+    uvmfree(child, 0);
+    kfree(mm);
+    kfree(cmm);
+    PASS("pass swap test");
+}
@@ -0,0 +1,103 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <proc/timer.h>
+
+#define TIMER_TEST_NR       8
+#define TIMER_IDLE_TICKS    50          // how long the idle test sleeps
+#define TIMER_LATENCY_NR    16          // sleeps measured for the wakeup latency
+
+static struct timer timers[TIMER_TEST_NR];
+static volatile int fired[TIMER_TEST_NR];
+static volatile int nr_fired;
+
+
+static void
+record_fn(struct timer* t)
+{
+    fired[nr_fired++] = t - timers;
+}
+
+
+// timers fire in the order of their expiry, not of timer_add, and a deleted one never fires
+static void
+test_timer_order()
+{
+    uint64 now = r_time();
+    nr_fired = 0;
+    for (int i = 0; i < TIMER_TEST_NR; i++) {
+        timer_setup(&timers[i], record_fn);
+        // in reverse order of i a quarter tick apart, then the last two share an expiry
+        timer_add(&timers[i], now + INTERVAL + (TIMER_TEST_NR - 1 - i) * INTERVAL / 4);
+    }
+    timer_add(&timers[TIMER_TEST_NR - 1], timers[TIMER_TEST_NR - 2].expires);
+    assert(timer_del(&timers[3]) == 1 && !timer_pending(&timers[3]));
+    assert(timer_del(&timers[3]) == 0);
+
+    intr_on();
+    while (nr_fired < TIMER_TEST_NR - 1)
+        ;
+    intr_off();
+
+    for (int i = 1; i < TIMER_TEST_NR - 1; i++)
+        assert(timers[fired[i - 1]].expires <= timers[fired[i]].expires);
+    for (int i = 0; i < TIMER_TEST_NR - 1; i++)
+        assert(fired[i] != 3);
+    for (int i = 0; i < TIMER_TEST_NR; i++)
+        assert(!timer_pending(&timers[i]));
+    PASS("pass timer order test");
+}
+
+
+// nobody runnable: the tick stops, the only interrupt is the sleeper's timer
+static void
+test_timer_idle()
+{
+    struct timer_stat before, after;
+
+    // let kzerod fill its pool first, it would keep the tick going
+    sleep_until(r_time() + TIMER_IDLE_TICKS * INTERVAL);
+    timer_get_stat(&before);
+    sleep_until(r_time() + TIMER_IDLE_TICKS * INTERVAL);
+    timer_get_stat(&after);
+
+    uint64 nr_interrupts = after.nr_interrupts - before.nr_interrupts;
+    log("%d ticks asleep: %lu timer interrupts, %lu scheduler ticks",
+        TIMER_IDLE_TICKS, nr_interrupts, after.nr_ticks - before.nr_ticks);
+    assert(after.nr_idle > before.nr_idle);
+    assert(nr_interrupts < TIMER_IDLE_TICKS / 2);
+    PASS("pass timer idle test");
+}
+
+
+// how late a sleeper wakes, independent of the tick and the number of processes
+static void
+bench_timer_latency()
+{
+    uint64 total = 0, worst = 0;
+    for (int i = 0; i < TIMER_LATENCY_NR; i++) {
+        // not aligned to the tick
+        uint64 due = r_time() + INTERVAL / 3 + i * 997;
+        sleep_until(due);
+        uint64 late = r_time() - due;
+        total += late;
+        worst = MAX(worst, late);
+    }
+    log("sleep wakeup latency: %lu us average, %lu us worst",
+        total * 1000000 / CLOCK_FREQUNCY / TIMER_LATENCY_NR, worst * 1000000 / CLOCK_FREQUNCY);
+}
+
+
+void
+test_timer()
+{
+    intr_off();
+    test_timer_order();
+    test_timer_idle();
+    bench_timer_latency();
+    PASS("pass timer test");
+}
@@ -0,0 +1,77 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <time.h>
+#include <mm/mm.h>
+#include <mm/memlayout.h>
+#include <syscall.h>
+
+#define UACCESS_VA          0x40000000UL
+#define UACCESS_SIZE        (1UL << 20)
+#define UACCESS_NPAGES      (UACCESS_SIZE >> PGSHIFT)
+#define UACCESS_BENCH_BYTES (16UL << 20)    // bytes copied for each size
+
+
+// MB/s of copying len bytes between kernel and user again and again
+static uint64
+copy_rate(pagetable_t pgtbl, char* kbuf, size_t len, int out)
+{
+    uint64 rounds = MAX(UACCESS_BENCH_BYTES / len, 1);
+    uint64 start = r_time();
+    for (uint64 r = 0; r < rounds; r++) {
+        int err = (out ? copyout(pgtbl, UACCESS_VA, kbuf, len) : copyin(pgtbl, kbuf, UACCESS_VA, len));
+        assert(err == 0);
+    }
+    uint64 ticks = MAX(r_time() - start, 1);
+    return ((rounds * len * CLOCK_FREQUNCY / ticks) >> 20);
+}
+
+
+// user pages are mapped by hand on a page table of its own, nothing faults
+void
+test_uaccess()
+{
+    pagetable_t pgtbl = alloc_pagetable();
+    char* kbuf = kalloc(UACCESS_SIZE);
+    assert(pgtbl && kbuf);
+    uint64 perm = prot_to_pte(PROT_READ | PROT_WRITE);
+    for (int i = 0; i < UACCESS_NPAGES; i++) {
+        char* page = kalloc(PGSIZE);
+        assert(page);
+        assert(mappages(pgtbl, UACCESS_VA + i * PGSIZE, KERNEL_VA2PA(page), PGSIZE, perm) == 0);
+    }
+
+    // unaligned copies across pages come back unchanged
+    size_t len = 3 * PGSIZE + 123;
+    for (int i = 0; i < len; i++)
+        kbuf[i] = (char) (i * 7 + 1);
+    assert(copyout(pgtbl, UACCESS_VA + 4093, kbuf + 5, len) == 0);
+    assert(copyin(pgtbl, kbuf + len + 3, UACCESS_VA + 4093, len) == 0);
+    assert(memcmp(kbuf + 5, kbuf + len + 3, len) == 0);
+    // nothing is mapped right after the range
+    assert(copyin(pgtbl, kbuf, UACCESS_VA + UACCESS_SIZE - 8, 16) == 8);
+    assert(copyout(pgtbl, UACCESS_VA + UACCESS_SIZE, kbuf, 1) < 0);
+    PASS("pass copyin & copyout test");
+
+    // string crossing a page, and one without '\0' in reach
+    memset(kbuf, 'x', 2 * PGSIZE);
+    kbuf[PGSIZE + 10] = '\0';
+    assert(copyout(pgtbl, UACCESS_VA, kbuf, 2 * PGSIZE) == 0);
+    assert(copyinstr(pgtbl, kbuf + 2 * PGSIZE + 1, UACCESS_VA + 3, 2 * PGSIZE) == PGSIZE + 8);
+    assert(kbuf[2 * PGSIZE + 1 + PGSIZE + 7] == '\0' && kbuf[2 * PGSIZE + 1 + PGSIZE + 6] == 'x');
+    assert(copyinstr(pgtbl, kbuf + 2 * PGSIZE, UACCESS_VA, PGSIZE) == (size_t) -1);
+    PASS("pass copyinstr test");
+
+    size_t sizes[] = { 64, PGSIZE, UACCESS_SIZE };
+    for (int i = 0; i < 3; i++) {
+        uint64 in = copy_rate(pgtbl, kbuf, sizes[i], 0);
+        uint64 out = copy_rate(pgtbl, kbuf, sizes[i], 1);
+        log("uaccess %lu bytes: copyin %lu MB/s, copyout %lu MB/s", sizes[i], in, out);
+    }
+
+    assert(uvmunmap(pgtbl, UACCESS_VA, UACCESS_NPAGES, UVMUNMAP_FREE) == 0);
+    uvmfree(pgtbl, 0);
+    kfree(kbuf);
+    PASS("pass uaccess test");
+}
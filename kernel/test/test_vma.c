@@ -0,0 +1,112 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <errno.h>
+#include <mm/mm.h>
+#include <mm/vma.h>
+#include <proc/proc.h>
+
+#define NR_TEST_VMA 256
+
+// check that max_gap of every node matches its subtree, return the max_gap
+static uint64
+check_gap(struct vm_area* node)
+{
+    if (node == NULL)
+        return 0;
+    uint64 max_gap = node->gap;
+    uint64 l = check_gap(RB_LEFT(node, rb));
+    uint64 r = check_gap(RB_RIGHT(node, rb));
+    max_gap = MAX(max_gap, MAX(l, r));
+    assert(node->max_gap == max_gap);
+    assert(node->gap == node->start - (node->prev ? node->prev->end : 0));
+    return max_gap;
+}
+
+static struct vm_area*
+new_vma(uint64 start, uint64 end)
+{
+    KCALLOC(struct vm_area, vma, 1);
+    assert(vma);
+    vma->start = start;
+    vma->end = end;
+    return vma;
+}
+
+// runs on a fake proc, no page table is touched
+void
+test_vma()
+{
+    KCALLOC(struct proc, p, 1);
+    assert(p);
+    RB_INIT(&p->vma_tree);
+    p->mmap_base = 0x10000000;
+    p->mmap_brk = p->mmap_base + NR_TEST_VMA * 4 * PGSIZE;
+
+    // one page mapped, then three pages of hole, inserted in a scattered order
+    for (int i = 0; i < NR_TEST_VMA; i++) {
+        int k = (i * 97) % NR_TEST_VMA;
+        uint64 start = p->mmap_base + k * 4 * PGSIZE;
+        assert(vma_insert(p, new_vma(start, start + PGSIZE)) == 0);
+    }
+    check_gap(RB_ROOT(&p->vma_tree));
+
+    // list is sorted by address
+    int n = 0;
+    for (struct vm_area* vma = p->vma_list; vma; vma = vma->next, n++) {
+        assert(vma->start == p->mmap_base + n * 4 * PGSIZE);
+        assert(vma->next == NULL || vma->next->prev == vma);
+    }
+    assert(n == NR_TEST_VMA);
+
+    // overlapping vma is refused
+    struct vm_area* bad = new_vma(p->mmap_base + PGSIZE / 2, p->mmap_base + 2 * PGSIZE);
+    assert(vma_insert(p, bad) == -EINVAL);
+    kfree(bad);
+    PASS("pass vma_insert test");
+
+    for (int k = 0; k < NR_TEST_VMA; k++) {
+        uint64 va = p->mmap_base + k * 4 * PGSIZE;
+        assert(find_vma(p, va) && find_vma(p, va)->start == va);
+        assert(p->vma_cache == find_vma(p, va + PGSIZE - 1));
+        assert(find_vma(p, va + PGSIZE) == NULL);
+        assert(k == NR_TEST_VMA - 1 || find_vma_after(p, va + PGSIZE)->start == va + 4 * PGSIZE);
+    }
+    PASS("pass find_vma test");
+
+    // highest hole of three pages lies right below mmap_brk
+    uint64 top = p->mmap_brk;
+    assert(find_free_vma_range(p, 3 * PGSIZE) == top - 3 * PGSIZE);
+
+    // fill the top hole, the next one is found below the last vma
+    struct vm_area* last = new_vma(p->vma_list->start + (NR_TEST_VMA - 1) * 4 * PGSIZE + PGSIZE, top);
+    assert(vma_insert(p, last) == 0);
+    check_gap(RB_ROOT(&p->vma_tree));
+    uint64 last_vma_start = p->mmap_base + (NR_TEST_VMA - 1) * 4 * PGSIZE;
+    assert(find_free_vma_range(p, 3 * PGSIZE) == last_vma_start - 3 * PGSIZE);
+
+    // removing a vma joins two holes and itself into one of seven pages
+    struct vm_area* mid = find_vma(p, p->mmap_base + 100 * 4 * PGSIZE);
+    vma_remove(p, mid);
+    kfree(mid);
+    check_gap(RB_ROOT(&p->vma_tree));
+    assert(find_vma(p, p->mmap_base + 100 * 4 * PGSIZE) == NULL);
+    assert(find_free_vma_range(p, 7 * PGSIZE) == p->mmap_base + 101 * 4 * PGSIZE - 7 * PGSIZE);
+
+    // nothing fits, mmap area grows
+    assert(find_free_vma_range(p, 8 * PGSIZE) >= top && p->mmap_brk > top);
+    PASS("pass find_free_vma_range test");
+
+    // shrink and grow keep the gaps right
+    struct vm_area* vma = find_vma(p, p->mmap_base + 10 * 4 * PGSIZE);
+    vma_adjust(p, vma, vma->start, vma->start + 3 * PGSIZE);
+    check_gap(RB_ROOT(&p->vma_tree));
+    vma_adjust(p, vma, vma->start + PGSIZE, vma->start + 2 * PGSIZE);
+    check_gap(RB_ROOT(&p->vma_tree));
+    PASS("pass vma_adjust test");
+
+    free_vma_list(p);
+    assert(p->vma_list == NULL && RB_EMPTY(&p->vma_tree));
+    kfree(p);
+    PASS("pass vma test");
+}
@@ -0,0 +1,135 @@
+#include <common.h>
+#include <arch.h>
+#include <klib.h>
+#include <debug.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <proc/wait.h>
+
+#define WAIT_TEST_NR        4
+
+static WAIT_QUEUE_HEAD_DEFINE(test_wq);
+static volatile int tokens;
+static volatile int nr_served;
+static volatile int chan_flag;
+static int chan_a, chan_b;
+
+
+static int
+nr_queued(struct wait_queue_head* wq)
+{
+    int n = 0;
+    spinlock_acquire(&wq->lock);
+    for (struct list_head* pos = wq->head.next; pos != &wq->head; pos = pos->next)
+        n++;
+    spinlock_release(&wq->lock);
+    return n;
+}
+
+
+// take one token per wakeup, forever
+static void
+token_waiter()
+{
+    intr_off();
+    for (;;) {
+        wait_event_exclusive(&test_wq, tokens > 0);
+        tokens--;
+        nr_served++;
+    }
+}
+
+
+static void
+chan_waiter()
+{
+    intr_off();
+    wait_event_chan(&chan_a, chan_flag);
+    chan_flag = 2;
+    for (;;)
+        sleep(&chan_b);
+}
+
+
+// give every runnable kthread a turn
+static void
+run_others()
+{
+    while (sched_nr_queued() > 0)
+        yield();
+}
+
+
+// wake_up wakes one exclusive waiter, wake_up_all wakes all of them
+static void
+test_wait_exclusive()
+{
+    for (int i = 0; i < WAIT_TEST_NR; i++)
+        assert(kthread_create("waiter", token_waiter));
+    run_others();
+    assert(nr_queued(&test_wq) == WAIT_TEST_NR);
+
+    tokens = 1;
+    assert(wake_up(&test_wq) == 1);
+    run_others();
+    assert(nr_served == 1 && tokens == 0);
+    assert(nr_queued(&test_wq) == WAIT_TEST_NR);
+
+    // one of them finds nothing left and goes back to sleep
+    tokens = WAIT_TEST_NR - 1;
+    assert(wake_up_all(&test_wq) == WAIT_TEST_NR);
+    run_others();
+    assert(nr_served == WAIT_TEST_NR && tokens == 0);
+    assert(nr_queued(&test_wq) == WAIT_TEST_NR);
+    PASS("pass wait exclusive test");
+}
+
+
+// a wakeup on another chan is ignored, even if the two hash to the same queue
+static void
+test_wait_chan()
+{
+    struct proc* p = kthread_create("chan_waiter", chan_waiter);
+    assert(p);
+    run_others();
+    assert(p->state == SLEEPING);
+
+    wakeup(&chan_b);
+    assert(p->state == SLEEPING);
+
+    // woken without the condition, it sleeps again
+    wakeup(&chan_a);
+    run_others();
+    assert(p->state == SLEEPING && chan_flag == 0);
+
+    chan_flag = 1;
+    wakeup(&chan_a);
+    run_others();
+    assert(chan_flag == 2);
+    PASS("pass wait chan test");
+}
+
+
+// a condition that already holds never sleeps, so a wakeup before the wait is not lost
+static void
+test_wait_no_lost_wakeup()
+{
+    struct wait_queue_head wq;
+    wait_queue_head_init(&wq, "test");
+    int done = 1;
+    assert(wake_up_all(&wq) == 0);
+    wait_event(&wq, done);
+    assert(myproc()->state == RUNNING && nr_queued(&wq) == 0);
+    PASS("pass wait no lost wakeup test");
+}
+
+
+void
+test_wait()
+{
+    intr_off();
+    test_wait_exclusive();
+    test_wait_chan();
+    test_wait_no_lost_wakeup();
+    PASS("pass wait test");
+}
@@ -0,0 +1,69 @@
+#include <common.h>
+#include <klib.h>
+#include <debug.h>
+#include <mm/mm.h>
+#include <mm/zero_pool.h>
+
+#define NR_TEST_PAGES 8
+
+static int
+page_is_zero(const void* page)
+{
+    const uint64* p = page;
+    for (int i = 0; i < PGSIZE / sizeof(uint64); i++) {
+        if (p[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+void
+test_zero_pool()
+{
+    struct zero_pool_stat before, after;
+    void* mem[NR_TEST_PAGES];
+
+    // empty the pool, so that pages below come from refill
+    for (void* p; (p = zero_pool_get()) != NULL; )
+        kfree(p);
+
+    assert(zero_pool_refill(NR_TEST_PAGES) == NR_TEST_PAGES);
+    zero_pool_get_stat(&before);
+    assert(before.nr_pages == NR_TEST_PAGES);
+
+    for (int i = 0; i < NR_TEST_PAGES; i++) {
+        mem[i] = kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+        assert(mem[i] && IS_PGALIGNED(mem[i]) && page_is_zero(mem[i]));
+        memset(mem[i], 0xa5, PGSIZE);
+    }
+    zero_pool_get_stat(&after);
+    assert(after.nr_pages == 0 && after.nr_hit == before.nr_hit + NR_TEST_PAGES);
+    PASS("pass zero pool hit test");
+
+    // dirty pages freed just now are handed out again, and cleared on the spot
+    for (int i = 0; i < NR_TEST_PAGES; i++)
+        kfree(mem[i]);
+    for (int i = 0; i < NR_TEST_PAGES; i++) {
+        mem[i] = kalloc_gfp(PGSIZE, GFP_KERNEL | __GFP_ZERO);
+        assert(mem[i] && page_is_zero(mem[i]));
+    }
+    zero_pool_get_stat(&before);
+    assert(before.nr_miss == after.nr_miss + NR_TEST_PAGES);
+    for (int i = 0; i < NR_TEST_PAGES; i++)
+        kfree(mem[i]);
+
+    // small and multi-page allocations are cleared as well
+    char* small = kalloc(100);
+    memset(small, 0xa5, 100);
+    kfree(small);
+    small = kcalloc(1, 100);
+    for (int i = 0; i < 100; i++)
+        assert(small[i] == 0);
+    kfree(small);
+    char* big = kalloc_gfp(3 * PGSIZE, GFP_KERNEL | __GFP_ZERO);
+    assert(big && page_is_zero(big) && page_is_zero(big + 2 * PGSIZE));
+    kfree(big);
+    PASS("pass zero pool miss test");
+
+    PASS("pass zero pool test");
+}